@@ -6,151 +6,10828 @@
 #include <chrono>     // For timestamp (optional, but good for real Git)
 #include <iomanip>    // For string formatting (optional)
 #include <sstream>    // For string streams
+#include <array>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <deque>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <regex>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <cerrno>
+#include <cctype>
+#include <charconv>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <unistd.h>
+#if defined(MINIGIT_WITH_ZSTD)
+#include <zstd.h>      // optional: build with -DMINIGIT_WITH_ZSTD -lzstd for 'archive --format=tar.zst'
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h> // SSE2 intrinsics for hex encode/decode
+#endif
 
 namespace fs = std::filesystem;
 
-// A simple placeholder for a hashing function.
-// In a real Git system, you would use a robust cryptographic hash like SHA-1.
-// For this simplified version, we'll create a "hash" based on content and timestamp.
-std::string generate_simple_hash(const std::string& content) {
-    // Generate a timestamp string
+// Minimal SHA-1 implementation used to name objects by their content.
+// Objects are hashed the same way real Git does it: "<type> <size>\0<content>",
+// so identical content always maps to the same object id.
+class Sha1 {
+public:
+    Sha1() { reset(); }
+
+    void reset() {
+        state_[0] = 0x67452301u;
+        state_[1] = 0xEFCDAB89u;
+        state_[2] = 0x98BADCFEu;
+        state_[3] = 0x10325476u;
+        state_[4] = 0xC3D2E1F0u;
+        total_len_ = 0;
+        buffer_len_ = 0;
+    }
+
+    void update(const void* data, std::size_t len) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        total_len_ += len;
+        if (buffer_len_ > 0) {
+            std::size_t take = std::min(len, sizeof(buffer_) - buffer_len_);
+            std::memcpy(buffer_ + buffer_len_, p, take);
+            buffer_len_ += take;
+            p += take;
+            len -= take;
+            if (buffer_len_ < sizeof(buffer_)) {
+                return;
+            }
+            process_block(buffer_);
+            buffer_len_ = 0;
+        }
+        while (len >= sizeof(buffer_)) {
+            process_block(p);
+            p += sizeof(buffer_);
+            len -= sizeof(buffer_);
+        }
+        std::memcpy(buffer_, p, len);
+        buffer_len_ = len;
+    }
+
+    void update(const std::string& data) { update(data.data(), data.size()); }
+
+    // Writes the 20-byte digest to 'out'. The object must be reset() before reuse.
+    void finish(unsigned char* out) {
+        std::uint64_t bit_len = total_len_ * 8;
+        unsigned char pad = 0x80;
+        update(&pad, 1);
+        unsigned char zero = 0;
+        while (buffer_len_ != 56) {
+            update(&zero, 1);
+        }
+        unsigned char len_be[8];
+        for (int i = 0; i < 8; ++i) {
+            len_be[i] = static_cast<unsigned char>(bit_len >> (56 - 8 * i));
+        }
+        update(len_be, 8);
+        for (int i = 0; i < 5; ++i) {
+            out[4 * i] = static_cast<unsigned char>(state_[i] >> 24);
+            out[4 * i + 1] = static_cast<unsigned char>(state_[i] >> 16);
+            out[4 * i + 2] = static_cast<unsigned char>(state_[i] >> 8);
+            out[4 * i + 3] = static_cast<unsigned char>(state_[i]);
+        }
+    }
+
+private:
+    static std::uint32_t rotl(std::uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+    void process_block(const unsigned char* block) {
+        std::uint32_t w[80];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (std::uint32_t(block[4 * i]) << 24) | (std::uint32_t(block[4 * i + 1]) << 16) |
+                   (std::uint32_t(block[4 * i + 2]) << 8) | std::uint32_t(block[4 * i + 3]);
+        }
+        for (int i = 16; i < 80; ++i) {
+            w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        std::uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3], e = state_[4];
+        for (int i = 0; i < 80; ++i) {
+            std::uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999u;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1u;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDCu;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6u;
+            }
+            std::uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotl(b, 30);
+            b = a;
+            a = temp;
+        }
+        state_[0] += a;
+        state_[1] += b;
+        state_[2] += c;
+        state_[3] += d;
+        state_[4] += e;
+    }
+
+    std::uint32_t state_[5];
+    std::uint64_t total_len_;
+    unsigned char buffer_[64];
+    std::size_t buffer_len_;
+};
+
+// Minimal SHA-256 implementation with the same interface as Sha1. It names
+// objects in the compatibility object format (see OidTranslation).
+class Sha256 {
+public:
+    Sha256() { reset(); }
+
+    void reset() {
+        static const std::uint32_t kInit[8] = {0x6a09e667u, 0xbb67ae85u, 0x3c6ef372u, 0xa54ff53au,
+                                               0x510e527fu, 0x9b05688cu, 0x1f83d9abu, 0x5be0cd19u};
+        std::memcpy(state_, kInit, sizeof(state_));
+        total_len_ = 0;
+        buffer_len_ = 0;
+    }
+
+    void update(const void* data, std::size_t len) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        total_len_ += len;
+        if (buffer_len_ > 0) {
+            std::size_t take = std::min(len, sizeof(buffer_) - buffer_len_);
+            std::memcpy(buffer_ + buffer_len_, p, take);
+            buffer_len_ += take;
+            p += take;
+            len -= take;
+            if (buffer_len_ < sizeof(buffer_)) {
+                return;
+            }
+            process_block(buffer_);
+            buffer_len_ = 0;
+        }
+        while (len >= sizeof(buffer_)) {
+            process_block(p);
+            p += sizeof(buffer_);
+            len -= sizeof(buffer_);
+        }
+        std::memcpy(buffer_, p, len);
+        buffer_len_ = len;
+    }
+
+    void update(const std::string& data) { update(data.data(), data.size()); }
+
+    // Writes the 32-byte digest to 'out'. The object must be reset() before reuse.
+    void finish(unsigned char* out) {
+        std::uint64_t bit_len = total_len_ * 8;
+        unsigned char pad = 0x80;
+        update(&pad, 1);
+        unsigned char zero = 0;
+        while (buffer_len_ != 56) {
+            update(&zero, 1);
+        }
+        unsigned char len_be[8];
+        for (int i = 0; i < 8; ++i) {
+            len_be[i] = static_cast<unsigned char>(bit_len >> (56 - 8 * i));
+        }
+        update(len_be, 8);
+        for (int i = 0; i < 8; ++i) {
+            out[4 * i] = static_cast<unsigned char>(state_[i] >> 24);
+            out[4 * i + 1] = static_cast<unsigned char>(state_[i] >> 16);
+            out[4 * i + 2] = static_cast<unsigned char>(state_[i] >> 8);
+            out[4 * i + 3] = static_cast<unsigned char>(state_[i]);
+        }
+    }
+
+private:
+    static std::uint32_t rotr(std::uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void process_block(const unsigned char* block) {
+        static const std::uint32_t k[64] = {
+            0x428a2f98u, 0x71374491u, 0xb5c0fbcfu, 0xe9b5dba5u, 0x3956c25bu, 0x59f111f1u, 0x923f82a4u, 0xab1c5ed5u,
+            0xd807aa98u, 0x12835b01u, 0x243185beu, 0x550c7dc3u, 0x72be5d74u, 0x80deb1feu, 0x9bdc06a7u, 0xc19bf174u,
+            0xe49b69c1u, 0xefbe4786u, 0x0fc19dc6u, 0x240ca1ccu, 0x2de92c6fu, 0x4a7484aau, 0x5cb0a9dcu, 0x76f988dau,
+            0x983e5152u, 0xa831c66du, 0xb00327c8u, 0xbf597fc7u, 0xc6e00bf3u, 0xd5a79147u, 0x06ca6351u, 0x14292967u,
+            0x27b70a85u, 0x2e1b2138u, 0x4d2c6dfcu, 0x53380d13u, 0x650a7354u, 0x766a0abbu, 0x81c2c92eu, 0x92722c85u,
+            0xa2bfe8a1u, 0xa81a664bu, 0xc24b8b70u, 0xc76c51a3u, 0xd192e819u, 0xd6990624u, 0xf40e3585u, 0x106aa070u,
+            0x19a4c116u, 0x1e376c08u, 0x2748774cu, 0x34b0bcb5u, 0x391c0cb3u, 0x4ed8aa4au, 0x5b9cca4fu, 0x682e6ff3u,
+            0x748f82eeu, 0x78a5636fu, 0x84c87814u, 0x8cc70208u, 0x90befffau, 0xa4506cebu, 0xbef9a3f7u, 0xc67178f2u};
+        std::uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (std::uint32_t(block[4 * i]) << 24) | (std::uint32_t(block[4 * i + 1]) << 16) |
+                   (std::uint32_t(block[4 * i + 2]) << 8) | std::uint32_t(block[4 * i + 3]);
+        }
+        for (int i = 16; i < 64; ++i) {
+            std::uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            std::uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        std::uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+        std::uint32_t e = state_[4], f = state_[5], g = state_[6], h = state_[7];
+        for (int i = 0; i < 64; ++i) {
+            std::uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            std::uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state_[0] += a;
+        state_[1] += b;
+        state_[2] += c;
+        state_[3] += d;
+        state_[4] += e;
+        state_[5] += f;
+        state_[6] += g;
+        state_[7] += h;
+    }
+
+    std::uint32_t state_[8];
+    std::uint64_t total_len_;
+    unsigned char buffer_[64];
+    std::size_t buffer_len_;
+};
+
+// Hex encoding/decoding of raw hash bytes. The SSE2 paths handle 16 raw bytes
+// (32 hex characters) per iteration; the scalar loops finish any remaining tail.
+inline void hex_encode(const unsigned char* in, std::size_t len, char* out) {
+    static const char digits[] = "0123456789abcdef";
+    std::size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i low_nibble = _mm_set1_epi8(0x0f);
+    const __m128i ascii_zero = _mm_set1_epi8('0');
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i letter_gap = _mm_set1_epi8('a' - '0' - 10);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), low_nibble);
+        __m128i lo = _mm_and_si128(v, low_nibble);
+        __m128i first = _mm_unpacklo_epi8(hi, lo);
+        __m128i second = _mm_unpackhi_epi8(hi, lo);
+        first = _mm_add_epi8(_mm_add_epi8(first, ascii_zero),
+                             _mm_and_si128(_mm_cmpgt_epi8(first, nine), letter_gap));
+        second = _mm_add_epi8(_mm_add_epi8(second, ascii_zero),
+                              _mm_and_si128(_mm_cmpgt_epi8(second, nine), letter_gap));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * i), first);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 2 * i + 16), second);
+    }
+#endif
+    for (; i < len; ++i) {
+        out[2 * i] = digits[in[i] >> 4];
+        out[2 * i + 1] = digits[in[i] & 0x0f];
+    }
+}
+
+inline int hex_digit_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+#if defined(__SSE2__)
+// Converts 16 hex characters to their nibble values (one per byte).
+// Returns false if any character is not a hex digit.
+inline bool hex_nibbles_sse2(const char* in, __m128i& nibbles) {
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+    __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                     _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i is_letter = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                      _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+    if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_letter)) != 0xffff) {
+        return false;
+    }
+    __m128i digit_value = _mm_and_si128(_mm_sub_epi8(c, _mm_set1_epi8('0')), is_digit);
+    __m128i letter_value = _mm_and_si128(_mm_sub_epi8(lower, _mm_set1_epi8('a' - 10)), is_letter);
+    nibbles = _mm_or_si128(digit_value, letter_value);
+    return true;
+}
+#endif
+
+// Decodes 2*len hex characters into 'len' raw bytes. Returns false on a non-hex character.
+inline bool hex_decode(const char* in, std::size_t len, unsigned char* out) {
+    std::size_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        __m128i a, b;
+        if (!hex_nibbles_sse2(in + 2 * i, a) || !hex_nibbles_sse2(in + 2 * i + 16, b)) {
+            return false;
+        }
+        // Each 16-bit lane holds (high nibble, low nibble); fold them into one byte.
+        __m128i byte_mask = _mm_set1_epi16(0x00ff);
+        __m128i a_bytes = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, byte_mask), 4), _mm_srli_epi16(a, 8));
+        __m128i b_bytes = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b, byte_mask), 4), _mm_srli_epi16(b, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(a_bytes, b_bytes));
+    }
+#endif
+    for (; i < len; ++i) {
+        int hi = hex_digit_value(in[2 * i]);
+        int lo = hex_digit_value(in[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        out[i] = static_cast<unsigned char>((hi << 4) | lo);
+    }
+    return true;
+}
+
+// Fixed-size binary object id. The storage is large enough for a SHA-256 digest;
+// SHA-1 ids use the first 20 bytes and leave the rest zeroed.
+struct ObjectId {
+    static constexpr std::size_t kMaxRawSize = 32;
+    static constexpr std::size_t kSha1RawSize = 20;
+    static constexpr std::size_t kSha256RawSize = 32;
+
+    std::array<unsigned char, kMaxRawSize> bytes{};
+    unsigned char raw_size = kSha1RawSize;
+
+    constexpr std::size_t hex_size() const { return 2 * std::size_t(raw_size); }
+
+    constexpr bool is_null() const {
+        for (std::size_t i = 0; i < raw_size; ++i) {
+            if (bytes[i] != 0) return false;
+        }
+        return true;
+    }
+
+    std::string to_hex() const {
+        std::string hex(hex_size(), '0');
+        hex_encode(bytes.data(), raw_size, &hex[0]);
+        return hex;
+    }
+
+    // Parses a full-length hex id. Returns false if 'hex' is not a valid SHA-1
+    // or SHA-256 id.
+    static bool from_hex(std::string_view hex, ObjectId& out) {
+        if (hex.size() != 2 * kSha1RawSize && hex.size() != 2 * kSha256RawSize) {
+            return false;
+        }
+        ObjectId oid;
+        oid.raw_size = static_cast<unsigned char>(hex.size() / 2);
+        if (!hex_decode(hex.data(), oid.raw_size, oid.bytes.data())) {
+            return false;
+        }
+        out = oid;
+        return true;
+    }
+
+    friend constexpr int compare(const ObjectId& a, const ObjectId& b) {
+        for (std::size_t i = 0; i < kMaxRawSize; ++i) {
+            if (a.bytes[i] != b.bytes[i]) return a.bytes[i] < b.bytes[i] ? -1 : 1;
+        }
+        return int(a.raw_size) - int(b.raw_size);
+    }
+    friend constexpr bool operator==(const ObjectId& a, const ObjectId& b) { return compare(a, b) == 0; }
+    friend constexpr bool operator!=(const ObjectId& a, const ObjectId& b) { return compare(a, b) != 0; }
+    friend constexpr bool operator<(const ObjectId& a, const ObjectId& b) { return compare(a, b) < 0; }
+};
+
+inline std::ostream& operator<<(std::ostream& os, const ObjectId& oid) { return os << oid.to_hex(); }
+
+// Object ids are already uniformly distributed, so the first machine word is a good hash.
+namespace std {
+template <>
+struct hash<ObjectId> {
+    std::size_t operator()(const ObjectId& oid) const noexcept {
+        std::size_t h;
+        std::memcpy(&h, oid.bytes.data(), sizeof(h));
+        return h;
+    }
+};
+}  // namespace std
+
+// Computes the id of an object the way Git does: SHA-1 over "<type> <size>\0<content>".
+ObjectId hash_object(const std::string& type, const std::string& content) {
+    Sha1 sha;
+    std::string header = type + " " + std::to_string(content.size());
+    sha.update(header.data(), header.size() + 1);  // include the terminating '\0'
+    sha.update(content);
+    ObjectId oid;
+    sha.finish(oid.bytes.data());
+    return oid;
+}
+
+// Like hash_object(), but with SHA-256: the id of an object in the
+// compatibility object format, given its content in that format.
+ObjectId hash_object_sha256(const std::string& type, const std::string& content) {
+    Sha256 sha;
+    std::string header = type + " " + std::to_string(content.size());
+    sha.update(header.data(), header.size() + 1);
+    sha.update(content);
+    ObjectId oid;
+    oid.raw_size = ObjectId::kSha256RawSize;
+    sha.finish(oid.bytes.data());
+    return oid;
+}
+
+// Open-addressing hash map keyed by ObjectId, laid out like a SwissTable:
+// one control byte per slot (empty, deleted, or the low 7 bits of the hash)
+// scanned 16 at a time, and keys/values stored inline in one flat array.
+// Object ids are uniformly random, so the hash is simply a prefix of the id.
+template <typename V>
+class OidMap {
+public:
+    using value_type = std::pair<ObjectId, V>;
+
+    class iterator {
+    public:
+        iterator(OidMap* map, std::size_t index) : map_(map), index_(index) { skip_empty(); }
+        value_type& operator*() const { return map_->slots_[index_]; }
+        value_type* operator->() const { return &map_->slots_[index_]; }
+        iterator& operator++() {
+            ++index_;
+            skip_empty();
+            return *this;
+        }
+        bool operator==(const iterator& other) const { return index_ == other.index_; }
+        bool operator!=(const iterator& other) const { return index_ != other.index_; }
+
+    private:
+        void skip_empty() {
+            while (index_ < map_->ctrl_.size() && map_->ctrl_[index_] < 0) {
+                ++index_;
+            }
+        }
+        OidMap* map_;
+        std::size_t index_;
+    };
+
+    OidMap() = default;
+
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, ctrl_.size()); }
+
+    void clear() {
+        ctrl_.clear();
+        slots_.clear();
+        size_ = 0;
+        used_ = 0;
+    }
+
+    // Makes room for 'count' entries without further rehashing.
+    void reserve(std::size_t count) {
+        std::size_t needed = kGroupSize;
+        while (needed * 7 / 8 < count) {
+            needed *= 2;
+        }
+        if (needed > ctrl_.size()) {
+            rehash(needed);
+        }
+    }
+
+    V* find(const ObjectId& key) {
+        std::size_t index = find_index(key);
+        return index == kNotFound ? nullptr : &slots_[index].second;
+    }
+
+    const V* find(const ObjectId& key) const { return const_cast<OidMap*>(this)->find(key); }
+
+    bool contains(const ObjectId& key) const { return find(key) != nullptr; }
+
+    // Inserts 'value' unless 'key' is already present. Returns the stored value and
+    // whether an insertion took place.
+    std::pair<V*, bool> insert(const ObjectId& key, V value) {
+        if (V* existing = find(key)) {
+            return {existing, false};
+        }
+        if ((used_ + 1) * 8 > ctrl_.size() * 7) {
+            // Grow when live entries dominate; otherwise just sweep out tombstones.
+            std::size_t capacity = size_ * 2 >= ctrl_.size() * 7 / 8 ? ctrl_.size() * 2 : ctrl_.size();
+            rehash(std::max(capacity, kGroupSize));
+        }
+        std::size_t index = place(key);
+        if (ctrl_[index] == kEmpty) {
+            ++used_;
+        }
+        ctrl_[index] = static_cast<std::int8_t>(std::hash<ObjectId>()(key) & 0x7f);
+        slots_[index].first = key;
+        slots_[index].second = std::move(value);
+        ++size_;
+        return {&slots_[index].second, true};
+    }
+
+    V& operator[](const ObjectId& key) { return *insert(key, V{}).first; }
+
+    bool erase(const ObjectId& key) {
+        std::size_t index = find_index(key);
+        if (index == kNotFound) {
+            return false;
+        }
+        ctrl_[index] = kDeleted;
+        slots_[index].second = V{};
+        --size_;
+        return true;
+    }
+
+private:
+    static constexpr std::size_t kGroupSize = 16;
+    static constexpr std::int8_t kEmpty = -128;
+    static constexpr std::int8_t kDeleted = -2;
+
+    static constexpr std::size_t kNotFound = static_cast<std::size_t>(-1);
+
+    static unsigned count_trailing_zeros(std::uint32_t bits) {
+        unsigned n = 0;
+        while ((bits & 1u) == 0) {
+            bits >>= 1;
+            ++n;
+        }
+        return n;
+    }
+
+    // Bitmask of the control bytes in a group equal to 'tag'.
+    static std::uint32_t match(const std::int8_t* ctrl, std::int8_t tag) {
+#if defined(__SSE2__)
+        __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+        return static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag))));
+#else
+        std::uint32_t bits = 0;
+        for (std::size_t i = 0; i < kGroupSize; ++i) {
+            if (ctrl[i] == tag) bits |= 1u << i;
+        }
+        return bits;
+#endif
+    }
+
+    // Bitmask of the empty or deleted control bytes in a group (their sign bit is set).
+    static std::uint32_t match_free(const std::int8_t* ctrl) {
+#if defined(__SSE2__)
+        __m128i group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ctrl));
+        return static_cast<std::uint32_t>(_mm_movemask_epi8(group));
+#else
+        std::uint32_t bits = 0;
+        for (std::size_t i = 0; i < kGroupSize; ++i) {
+            if (ctrl[i] < 0) bits |= 1u << i;
+        }
+        return bits;
+#endif
+    }
+
+    std::size_t find_index(const ObjectId& key) const {
+        if (ctrl_.empty()) {
+            return kNotFound;
+        }
+        std::size_t h = std::hash<ObjectId>()(key);
+        std::int8_t tag = static_cast<std::int8_t>(h & 0x7f);
+        std::size_t group_mask = ctrl_.size() / kGroupSize - 1;
+        std::size_t group = (h >> 7) & group_mask;
+        for (std::size_t step = 1;; ++step) {
+            const std::int8_t* ctrl = &ctrl_[group * kGroupSize];
+            for (std::uint32_t bits = match(ctrl, tag); bits != 0; bits &= bits - 1) {
+                std::size_t index = group * kGroupSize + count_trailing_zeros(bits);
+                if (slots_[index].first == key) {
+                    return index;
+                }
+            }
+            if (match(ctrl, kEmpty) != 0) {
+                return kNotFound;
+            }
+            group = (group + step) & group_mask;
+        }
+    }
+
+    // Finds the first free slot on the probe sequence of 'key'.
+    std::size_t place(const ObjectId& key) const {
+        std::size_t h = std::hash<ObjectId>()(key);
+        std::size_t group_mask = ctrl_.size() / kGroupSize - 1;
+        std::size_t group = (h >> 7) & group_mask;
+        for (std::size_t step = 1;; ++step) {
+            std::uint32_t bits = match_free(&ctrl_[group * kGroupSize]);
+            if (bits != 0) {
+                return group * kGroupSize + count_trailing_zeros(bits);
+            }
+            group = (group + step) & group_mask;
+        }
+    }
+
+    void rehash(std::size_t capacity) {
+        std::vector<std::int8_t> old_ctrl(capacity, kEmpty);
+        std::vector<value_type> old_slots(capacity);
+        old_ctrl.swap(ctrl_);
+        old_slots.swap(slots_);
+        used_ = size_;
+        for (std::size_t i = 0; i < old_ctrl.size(); ++i) {
+            if (old_ctrl[i] >= 0) {
+                std::size_t index = place(old_slots[i].first);
+                ctrl_[index] = old_ctrl[i];
+                slots_[index] = std::move(old_slots[i]);
+            }
+        }
+    }
+
+    std::vector<std::int8_t> ctrl_;
+    std::vector<value_type> slots_;
+    std::size_t size_ = 0;
+    std::size_t used_ = 0;  // live entries plus tombstones
+};
+
+// Set of object ids built on OidMap; used for visited/seen bookkeeping in walks.
+class OidSet {
+public:
+    class iterator {
+    public:
+        explicit iterator(OidMap<bool>::iterator it) : it_(it) {}
+        const ObjectId& operator*() const { return it_->first; }
+        iterator& operator++() {
+            ++it_;
+            return *this;
+        }
+        bool operator!=(const iterator& other) const { return it_ != other.it_; }
+
+    private:
+        OidMap<bool>::iterator it_;
+    };
+
+    std::size_t size() const { return map_.size(); }
+    bool empty() const { return map_.empty(); }
+    void clear() { map_.clear(); }
+    void reserve(std::size_t count) { map_.reserve(count); }
+
+    // Returns true if 'oid' was not yet in the set.
+    bool insert(const ObjectId& oid) { return map_.insert(oid, true).second; }
+    bool contains(const ObjectId& oid) const { return map_.contains(oid); }
+    bool erase(const ObjectId& oid) { return map_.erase(oid); }
+
+    iterator begin() { return iterator(map_.begin()); }
+    iterator end() { return iterator(map_.end()); }
+
+private:
+    OidMap<bool> map_;
+};
+
+// Fixed-size pool of worker threads. submit() queues a task and returns a future
+// for its result; the destructor finishes queued tasks and joins the workers.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned threads = 0) {
+        if (threads == 0) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (unsigned i = 0; i < threads; ++i) {
+            workers_.emplace_back([this] { run(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        for (std::thread& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    std::size_t size() const { return workers_.size(); }
+
+    template <typename F>
+    auto submit(F&& fn) -> std::future<decltype(fn())> {
+        using Result = decltype(fn());
+        auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(fn));
+        std::future<Result> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.emplace_back([task] { (*task)(); });
+        }
+        cv_.notify_one();
+        return result;
+    }
+
+private:
+    void run() {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+                if (tasks_.empty()) {
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+};
+
+// Bounded lock-free queue for exactly one producer and one consumer thread.
+// The capacity is rounded up to a power of two. try_push()/try_pop() never
+// block; callers back off while the queue is full or empty, which is what
+// keeps a fast stage from running ahead of a slow one. close() is called by
+// the producer after its last push.
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(std::size_t capacity) : slots_(round_up(capacity)), mask_(slots_.size() - 1) {}
+
+    bool try_push(T& value) {
+        std::size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == slots_.size()) {
+            return false;
+        }
+        slots_[tail & mask_] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& value) {
+        std::size_t head = head_.load(std::memory_order_relaxed);
+        if (head == tail_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = std::move(slots_[head & mask_]);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    void close() { closed_.store(true, std::memory_order_release); }
+    bool closed() const { return closed_.load(std::memory_order_acquire); }
+
+private:
+    static std::size_t round_up(std::size_t n) {
+        std::size_t size = 2;
+        while (size < n) size <<= 1;
+        return size;
+    }
+
+    std::vector<T> slots_;
+    std::size_t mask_;
+    alignas(64) std::atomic<std::size_t> head_{0};
+    alignas(64) std::atomic<std::size_t> tail_{0};
+    std::atomic<bool> closed_{false};
+};
+
+// Bounded lock-free queue for any number of producers and consumers: each
+// slot carries a sequence number saying whether it is free for the producer
+// of a given round or holds a value for its consumer, so claiming a slot is
+// one compare-and-swap. close() is called once every producer is done.
+template <typename T>
+class MpmcQueue {
+public:
+    explicit MpmcQueue(std::size_t capacity) : slots_(round_up(capacity)), mask_(slots_.size() - 1) {
+        for (std::size_t i = 0; i < slots_.size(); ++i) slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    bool try_push(T& value) {
+        std::size_t pos = tail_.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot& slot = slots_[pos & mask_];
+            std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence == pos) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.value = std::move(value);
+                    slot.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (sequence < pos) {
+                return false;  // full
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(T& value) {
+        std::size_t pos = head_.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot& slot = slots_[pos & mask_];
+            std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            if (sequence == pos + 1) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    value = std::move(slot.value);
+                    slot.sequence.store(pos + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (sequence < pos + 1) {
+                return false;  // empty
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void close() { closed_.store(true, std::memory_order_release); }
+    bool closed() const { return closed_.load(std::memory_order_acquire); }
+
+private:
+    struct Slot {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    static std::size_t round_up(std::size_t n) {
+        std::size_t size = 2;
+        while (size < n) size <<= 1;
+        return size;
+    }
+
+    std::vector<Slot> slots_;
+    std::size_t mask_;
+    alignas(64) std::atomic<std::size_t> head_{0};
+    alignas(64) std::atomic<std::size_t> tail_{0};
+    std::atomic<bool> closed_{false};
+};
+
+// Computes the id of raw, already-framed object bytes ("<type> <size>\0<content>").
+ObjectId hash_raw(const std::string& data) {
+    Sha1 sha;
+    sha.update(data);
+    ObjectId oid;
+    sha.finish(oid.bytes.data());
+    return oid;
+}
+
+// Little-endian helpers for the binary metadata files under .minigit/.
+inline void put_u32(std::string& out, std::uint32_t v) {
+    for (int i = 0; i < 4; ++i) out.push_back(static_cast<char>(v >> (8 * i)));
+}
+
+inline void put_u64(std::string& out, std::uint64_t v) {
+    for (int i = 0; i < 8; ++i) out.push_back(static_cast<char>(v >> (8 * i)));
+}
+
+inline std::uint32_t get_u32(const char* p) {
+    std::uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) v |= std::uint32_t(static_cast<unsigned char>(p[i])) << (8 * i);
+    return v;
+}
+
+inline std::uint64_t get_u64(const char* p) {
+    std::uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) v |= std::uint64_t(static_cast<unsigned char>(p[i])) << (8 * i);
+    return v;
+}
+
+// LEB128 varints: 7 bits per byte, least significant first, high bit set on
+// all but the last byte.
+inline void put_varint(std::string& out, std::uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+inline bool get_varint(std::string_view data, std::size_t& pos, std::uint64_t& value) {
+    value = 0;
+    for (unsigned shift = 0; pos < data.size() && shift < 64; shift += 7) {
+        unsigned char byte = static_cast<unsigned char>(data[pos++]);
+        value |= std::uint64_t(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+// Reads a whole file into 'out'. Returns false if it cannot be opened.
+bool read_file(const std::string& path, std::string& out) {
+    std::ifstream infile(path, std::ios::binary);
+    if (!infile.is_open()) {
+        return false;
+    }
+    out.assign((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
+    return true;
+}
+
+// Writes 'data' to a temporary file next to 'path' and renames it into place,
+// so readers never observe a partially written file. The temporary file gets
+// a fresh hidden name (".<name>.tmp-<pid>-<n>") and is created exclusively,
+// so it never replaces another file, and concurrent writers of the same path
+// do not share it.
+bool write_file_atomic(const std::string& path, const std::string& data) {
+    static std::atomic<std::uint64_t> counter{0};
+    std::size_t slash = path.rfind('/');
+    std::size_t name = slash == std::string::npos ? 0 : slash + 1;
+    std::string tmp_path;
+    int fd = -1;
+    for (int attempt = 0; fd < 0 && attempt < 100; ++attempt) {
+        tmp_path = path.substr(0, name) + "." + path.substr(name) + ".tmp-" + std::to_string(::getpid()) + "-" +
+                   std::to_string(counter++);
+        fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (fd < 0 && errno != EEXIST) {
+            return false;
+        }
+    }
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = true;
+    for (std::size_t written = 0; ok && written < data.size();) {
+        ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+        if (n < 0 && errno == EINTR) continue;
+        ok = n > 0;
+        if (ok) written += static_cast<std::size_t>(n);
+    }
+    ok = ::close(fd) == 0 && ok;
+    std::error_code ec;
+    if (ok) {
+        fs::rename(tmp_path, path, ec);
+        ok = !ec;
+    }
+    if (!ok) {
+        fs::remove(tmp_path, ec);
+    }
+    return ok;
+}
+
+// A read-only memory mapping of a whole file; empty files map to an empty view.
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile(MappedFile&& other) noexcept { *this = std::move(other); }
+    MappedFile& operator=(MappedFile&& other) noexcept {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        return *this;
+    }
+    ~MappedFile() { close(); }
+
+    // With 'populate' the pages are read in now, by the calling thread, rather
+    // than faulted in by whoever first touches them.
+    bool open(const std::string& path, bool populate = false) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        bool ok = ::fstat(fd, &st) == 0;
+        if (ok && st.st_size > 0) {
+            int flags = MAP_PRIVATE;
+#if defined(MAP_POPULATE)
+            if (populate) flags |= MAP_POPULATE;
+#else
+            (void)populate;
+#endif
+            void* data = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, flags, fd, 0);
+            ok = data != MAP_FAILED;
+            if (ok) {
+                data_ = static_cast<const char*>(data);
+                size_ = static_cast<std::size_t>(st.st_size);
+            }
+        }
+        ::close(fd);
+        return ok;
+    }
+
+    void close() {
+        if (data_ != nullptr) {
+            ::munmap(const_cast<char*>(data_), size_);
+        }
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    std::string_view data() const { return std::string_view(data_, size_); }
+
+private:
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+// Current time in seconds, overridable through MINIGIT_COMMITTER_DATE so that
+// scripted histories get reproducible object ids.
+std::int64_t current_time() {
+    if (const char* date = std::getenv("MINIGIT_COMMITTER_DATE")) {
+        return std::strtoll(date, nullptr, 10);
+    }
     auto now = std::chrono::system_clock::now();
-    auto timestamp = std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count();
+    return std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count();
+}
 
-    // Combine content length and timestamp for a simple, pseudo-unique identifier
-    std::hash<std::string> hasher;
-    std::string data_to_hash = content + std::to_string(timestamp) + std::to_string(hasher(content));
-    size_t content_hash = hasher(data_to_hash);
+// Parses a date for --since/--until style options. Accepts a Unix timestamp
+// (optionally prefixed with '@'), "YYYY-MM-DD[ HH:MM[:SS]]" in UTC, or
+// "<n> <unit>[s] ago" / "<n>.<unit>s.ago" with units from seconds to years.
+bool parse_date(std::string text, std::int64_t& out) {
+    if (!text.empty() && text[0] == '@') {
+        text.erase(0, 1);
+    }
+    std::replace(text.begin(), text.end(), '.', ' ');
+    char* end = nullptr;
+    long long number = std::strtoll(text.c_str(), &end, 10);
+    if (end != text.c_str() && *end == '\0') {
+        out = number;
+        return true;
+    }
+
+    int year, month, day, hour = 0, minute = 0, second = 0;
+    if (std::sscanf(text.c_str(), "%d-%d-%d %d:%d:%d", &year, &month, &day, &hour, &minute, &second) >= 3) {
+        std::tm tm{};
+        tm.tm_year = year - 1900;
+        tm.tm_mon = month - 1;
+        tm.tm_mday = day;
+        tm.tm_hour = hour;
+        tm.tm_min = minute;
+        tm.tm_sec = second;
+        out = static_cast<std::int64_t>(timegm(&tm));
+        return true;
+    }
+
+    std::istringstream words(text);
+    long long amount = 0;
+    std::string unit, ago;
+    if (words >> amount >> unit >> ago && ago == "ago") {
+        if (unit.size() > 1 && unit.back() == 's') {
+            unit.pop_back();
+        }
+        static const std::pair<const char*, std::int64_t> units[] = {
+            {"second", 1}, {"minute", 60}, {"hour", 3600}, {"day", 86400},
+            {"week", 7 * 86400}, {"month", 30 * 86400}, {"year", 365 * 86400}};
+        for (const auto& u : units) {
+            if (unit == u.first) {
+                out = current_time() - amount * u.second;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Tree entry modes, as in Git.
+constexpr unsigned kModeTree = 040000;
+constexpr unsigned kModeFile = 0100644;
+constexpr unsigned kModeExecutable = 0100755;
+
+// One entry of a tree object: a file (blob) or a subdirectory (tree).
+struct TreeEntry {
+    unsigned mode = kModeFile;
+    ObjectId oid;
+    std::string name;
+
+    bool is_tree() const { return mode == kModeTree; }
+};
+
+// Trees are stored as text, one "<mode> <type> <id>\t<name>" line per entry,
+// sorted by name.
+std::string serialize_tree(const std::vector<TreeEntry>& entries) {
+    std::string out;
+    char mode[16];
+    for (const TreeEntry& entry : entries) {
+        std::snprintf(mode, sizeof(mode), "%06o", entry.mode);
+        out += mode;
+        out += entry.is_tree() ? " tree " : " blob ";
+        out += entry.oid.to_hex();
+        out += '\t';
+        out += entry.name;
+        out += '\n';
+    }
+    return out;
+}
+
+bool parse_tree(const std::string& content, std::vector<TreeEntry>& entries) {
+    entries.clear();
+    std::size_t pos = 0;
+    while (pos < content.size()) {
+        std::size_t eol = content.find('\n', pos);
+        if (eol == std::string::npos) {
+            eol = content.size();
+        }
+        std::size_t tab = content.find('\t', pos);
+        // "<6-digit mode> <4-char type> <hex>\t<name>"
+        if (tab == std::string::npos || tab > eol || tab < pos + 12) {
+            return false;
+        }
+        TreeEntry entry;
+        entry.mode = static_cast<unsigned>(std::strtoul(content.c_str() + pos, nullptr, 8));
+        std::size_t hex_start = content.find(' ', pos + 7);
+        if (hex_start == std::string::npos || hex_start >= tab ||
+            !ObjectId::from_hex(content.substr(hex_start + 1, tab - hex_start - 1), entry.oid)) {
+            return false;
+        }
+        entry.name = content.substr(tab + 1, eol - tab - 1);
+        entries.push_back(std::move(entry));
+        pos = eol + 1;
+    }
+    return true;
+}
+
+// A parsed commit object.
+struct Commit {
+    ObjectId tree;
+    std::vector<ObjectId> parents;
+    std::string author;     // "Name <email>"
+    std::string committer;  // "Name <email>"
+    std::int64_t author_time = 0;
+    std::int64_t commit_time = 0;
+    std::string message;
+};
+
+std::string serialize_commit(const Commit& commit) {
+    std::string out = "tree " + commit.tree.to_hex() + "\n";
+    for (const ObjectId& parent : commit.parents) {
+        out += "parent " + parent.to_hex() + "\n";
+    }
+    out += "author " + commit.author + " " + std::to_string(commit.author_time) + " +0000\n";
+    out += "committer " + commit.committer + " " + std::to_string(commit.commit_time) + " +0000\n";
+    out += "\n";
+    out += commit.message;
+    return out;
+}
+
+// Splits "Name <email> <time> <tz>" into identity and time.
+bool parse_ident(const std::string& line, std::string& ident, std::int64_t& time) {
+    std::size_t tz = line.rfind(' ');
+    if (tz == std::string::npos || tz == 0) {
+        return false;
+    }
+    std::size_t ts = line.rfind(' ', tz - 1);
+    if (ts == std::string::npos) {
+        return false;
+    }
+    ident = line.substr(0, ts);
+    time = std::strtoll(line.c_str() + ts + 1, nullptr, 10);
+    return true;
+}
+
+bool parse_commit(const std::string& content, Commit& commit) {
+    commit = Commit{};
+    std::size_t pos = 0;
+    bool has_tree = false;
+    while (pos < content.size()) {
+        std::size_t eol = content.find('\n', pos);
+        if (eol == std::string::npos) {
+            return false;
+        }
+        if (eol == pos) {
+            commit.message = content.substr(eol + 1);
+            return has_tree;
+        }
+        std::string line = content.substr(pos, eol - pos);
+        if (line.compare(0, 5, "tree ") == 0) {
+            has_tree = ObjectId::from_hex(line.substr(5), commit.tree);
+        } else if (line.compare(0, 7, "parent ") == 0) {
+            ObjectId parent;
+            if (!ObjectId::from_hex(line.substr(7), parent)) {
+                return false;
+            }
+            commit.parents.push_back(parent);
+        } else if (line.compare(0, 7, "author ") == 0) {
+            parse_ident(line.substr(7), commit.author, commit.author_time);
+        } else if (line.compare(0, 10, "committer ") == 0) {
+            parse_ident(line.substr(10), commit.committer, commit.commit_time);
+        }
+        pos = eol + 1;
+    }
+    return has_tree;
+}
+
+// One staged file in .minigit/index.
+struct IndexEntry {
+    std::string path;  // relative to the repository root, '/'-separated
+    ObjectId oid;
+    unsigned mode = kModeFile;
+    std::int64_t mtime_ns = 0;
+    std::uint64_t size = 0;
+    unsigned stage = 0;  // 1-3 for the base, our and their version of an unmerged path
+};
+
+// What 'status' found in one working-tree directory the last time it read
+// it; the index keeps these as its untracked cache. The directory is read
+// again only when its mtime or the tracked names directly in it (summed up
+// by 'tracked_hash') change. A negative mtime marks a directory that
+// changed too recently to be trusted.
+struct UntrackedDir {
+    std::int64_t mtime_ns = -1;
+    std::uint64_t tracked_hash = 0;
+    std::vector<std::string> subdirs;    // names of the subdirectories
+    std::vector<std::string> untracked;  // names of the untracked files
+};
+
+// Remembers which blob a working-tree file held, keyed by its device and
+// inode (.minigit/blob-cache), so that a file that was rewritten with the
+// same bytes is recognised without computing its SHA-1 again. A file
+// matches an entry only if its size, the hash of its first and last 4KB
+// and a 64-bit checksum of its whole content all agree; a differing
+// partial hash alone already proves that the content changed. The checksum
+// is not cryptographic, so the cache only confirms that a file still holds
+// the blob the index already names for it; it never names new content.
+//
+// Layout (integers little-endian):
+//   "MGBC" | version u32 | entry count u32
+//   per entry: dev u64 | inode u64 | size u64 | partial hash u64 | checksum u64 | blob id (20 bytes)
+//
+// Lookups may run on many threads at once; record() only queues an entry
+// (under a mutex) until save().
+class BlobCache {
+public:
+    struct Entry {
+        std::uint64_t size = 0;
+        std::uint64_t partial = 0;
+        std::uint64_t checksum = 0;
+        ObjectId oid;
+    };
+
+    static constexpr std::size_t kEdgeSize = 4096;
+
+    void load(const std::string& path) {
+        entries_.clear();
+        std::string data;
+        if (!read_file(path, data) || data.size() < 12 || data.compare(0, 4, "MGBC") != 0 ||
+            get_u32(&data[4]) != 1 || data.size() != 12 + std::size_t(get_u32(&data[8])) * kRecordSize) {
+            return;
+        }
+        for (const char* p = data.data() + 12; p < data.data() + data.size(); p += kRecordSize) {
+            Entry entry;
+            entry.size = get_u64(p + 16);
+            entry.partial = get_u64(p + 24);
+            entry.checksum = get_u64(p + 32);
+            std::memcpy(entry.oid.bytes.data(), p + 40, ObjectId::kSha1RawSize);
+            entries_[{get_u64(p), get_u64(p + 8)}] = entry;
+        }
+    }
+
+    // Writes the cache if anything was recorded since it was loaded. Entries
+    // of inodes not seen in this run are dropped once the cache outgrows
+    // kMaxEntries.
+    bool save(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (pending_.empty()) {
+            return true;
+        }
+        if (entries_.size() + pending_.size() > kMaxEntries) {
+            entries_.clear();
+        }
+        for (auto& [key, entry] : pending_) entries_[key] = entry;
+        pending_.clear();
+        std::string out = "MGBC";
+        put_u32(out, 1);
+        put_u32(out, static_cast<std::uint32_t>(entries_.size()));
+        for (const auto& [key, entry] : entries_) {
+            put_u64(out, key.dev);
+            put_u64(out, key.ino);
+            put_u64(out, entry.size);
+            put_u64(out, entry.partial);
+            put_u64(out, entry.checksum);
+            out.append(reinterpret_cast<const char*>(entry.oid.bytes.data()), ObjectId::kSha1RawSize);
+        }
+        return write_file_atomic(path, out);
+    }
+
+    // The entry for the file with stat data 'st', if its size still matches.
+    const Entry* find(const struct stat& st) const {
+        auto it = entries_.find({std::uint64_t(st.st_dev), std::uint64_t(st.st_ino)});
+        return it != entries_.end() && it->second.size == std::uint64_t(st.st_size) ? &it->second : nullptr;
+    }
+
+    // True if 'content', the bytes of the file with stat data 'st', is what
+    // the cache holds for it and that is the blob 'oid'.
+    bool confirms(const struct stat& st, std::string_view content, const ObjectId& oid) const {
+        const Entry* entry = find(st);
+        return entry != nullptr && entry->oid == oid && entry->partial == partial_hash(content) &&
+               entry->checksum == checksum(content);
+    }
+
+    void record(const struct stat& st, std::string_view content, const ObjectId& oid) {
+        Entry entry;
+        entry.size = content.size();
+        entry.partial = partial_hash(content);
+        entry.checksum = checksum(content);
+        entry.oid = oid;
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.emplace_back(Key{std::uint64_t(st.st_dev), std::uint64_t(st.st_ino)}, entry);
+    }
+
+    // Hash of the first and last kEdgeSize bytes of 'content' (all of it if
+    // it is that short).
+    static std::uint64_t partial_hash(std::string_view content) {
+        if (content.size() <= 2 * kEdgeSize) {
+            return checksum(content);
+        }
+        return checksum(content.substr(0, kEdgeSize)) * 31 + checksum(content.substr(content.size() - kEdgeSize));
+    }
+
+    // partial_hash() of a file of 'size' bytes, reading only the edges it covers.
+    static bool read_partial_hash(const std::string& path, std::uint64_t size, std::uint64_t& hash) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        char head[kEdgeSize], tail[kEdgeSize];
+        bool ok;
+        if (size <= 2 * kEdgeSize) {
+            std::string content(size, '\0');
+            ok = ::pread(fd, &content[0], size, 0) == ssize_t(size);
+            hash = checksum(content);
+        } else {
+            ok = ::pread(fd, head, kEdgeSize, 0) == ssize_t(kEdgeSize) &&
+                 ::pread(fd, tail, kEdgeSize, off_t(size - kEdgeSize)) == ssize_t(kEdgeSize);
+            hash = checksum(std::string_view(head, kEdgeSize)) * 31 + checksum(std::string_view(tail, kEdgeSize));
+        }
+        ::close(fd);
+        return ok;
+    }
+
+    // A fast non-cryptographic 64-bit checksum: four independent
+    // multiply-rotate lanes over 8-byte words, then a final mix.
+    static std::uint64_t checksum(std::string_view data) {
+        const std::uint64_t k1 = 0x9e3779b97f4a7c15ull, k2 = 0xc2b2ae3d27d4eb4full;
+        std::uint64_t lanes[4] = {k1, k2, k1 ^ k2, k1 + k2};
+        const char* p = data.data();
+        std::size_t n = data.size(), i = 0;
+        auto rotl = [](std::uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+        for (; i + 32 <= n; i += 32) {
+            for (int j = 0; j < 4; ++j) {
+                std::uint64_t word;
+                std::memcpy(&word, p + i + 8 * j, 8);
+                lanes[j] = rotl(lanes[j] + word * k2, 31) * k1;
+            }
+        }
+        std::uint64_t h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18) + n;
+        for (; i < n; ++i) {
+            h = rotl(h ^ (static_cast<unsigned char>(p[i]) * k1), 11) * k2;
+        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        return h ^ (h >> 33);
+    }
+
+private:
+    struct Key {
+        std::uint64_t dev;
+        std::uint64_t ino;
+        bool operator==(const Key& other) const { return dev == other.dev && ino == other.ino; }
+    };
+    struct KeyHash {
+        std::size_t operator()(const Key& key) const { return std::size_t(key.ino * 0x9e3779b97f4a7c15ull ^ key.dev); }
+    };
+
+    static constexpr std::size_t kRecordSize = 40 + ObjectId::kSha1RawSize;
+    static constexpr std::size_t kMaxEntries = 1 << 21;
+
+    std::unordered_map<Key, Entry, KeyHash> entries_;
+    std::vector<std::pair<Key, Entry>> pending_;
+    std::mutex mutex_;
+};
+
+// A region that differs between two line sequences: 'old_count' lines at
+// 'old_start' were replaced by 'new_count' lines at 'new_start' (0-based).
+struct DiffHunk {
+    std::size_t old_start = 0;
+    std::size_t old_count = 0;
+    std::size_t new_start = 0;
+    std::size_t new_count = 0;
+};
+
+// True for content that diffs should not show line by line: a NUL byte in
+// its first 8000 bytes, the same test 'grep' uses.
+bool is_binary_content(std::string_view content) {
+    return std::memchr(content.data(), '\0', std::min<std::size_t>(content.size(), 8000)) != nullptr;
+}
+
+// Splits text into lines; every line keeps its trailing '\n' (the last one may
+// lack it).
+std::vector<std::string_view> split_lines(std::string_view text) {
+    std::vector<std::string_view> lines;
+    std::size_t pos = 0;
+    while (pos < text.size()) {
+        std::size_t eol = text.find('\n', pos);
+        std::size_t end = eol == std::string_view::npos ? text.size() : eol + 1;
+        lines.push_back(text.substr(pos, end - pos));
+        pos = end;
+    }
+    return lines;
+}
+
+// Maps every distinct line to a small integer, so that diffs compare integers
+// instead of strings. Both sides of a diff must be interned in the same table,
+// and the table must not outlive the text its views point into.
+class LineTable {
+public:
+    std::vector<std::uint32_t> intern(const std::vector<std::string_view>& lines) {
+        std::vector<std::uint32_t> ids;
+        ids.reserve(lines.size());
+        for (std::string_view line : lines) {
+            ids.push_back(ids_.emplace(line, static_cast<std::uint32_t>(ids_.size())).first->second);
+        }
+        return ids;
+    }
+
+private:
+    std::unordered_map<std::string_view, std::uint32_t> ids_;
+};
+
+// Finds the middle snake of Myers' O(ND) algorithm, running the forward and
+// reverse searches towards each other in linear space. Returns false when the
+// sequences have nothing in common.
+bool myers_bisect(const std::uint32_t* a, long n, const std::uint32_t* b, long m, long& split_a, long& split_b) {
+    long max_d = (n + m + 1) / 2;
+    long offset = max_d;
+    long length = 2 * max_d + 2;
+    std::vector<long> v1(length, -1), v2(length, -1);
+    v1[offset + 1] = 0;
+    v2[offset + 1] = 0;
+    long delta = n - m;
+    bool front = (delta % 2) != 0;
+    long k1_start = 0, k1_end = 0, k2_start = 0, k2_end = 0;
+    for (long d = 0; d < max_d; ++d) {
+        for (long k1 = -d + k1_start; k1 <= d - k1_end; k1 += 2) {
+            long k1_offset = offset + k1;
+            long x1 = (k1 == -d || (k1 != d && v1[k1_offset - 1] < v1[k1_offset + 1])) ? v1[k1_offset + 1]
+                                                                                      : v1[k1_offset - 1] + 1;
+            long y1 = x1 - k1;
+            while (x1 < n && y1 < m && a[x1] == b[y1]) {
+                ++x1;
+                ++y1;
+            }
+            v1[k1_offset] = x1;
+            if (x1 > n) {
+                k1_end += 2;
+            } else if (y1 > m) {
+                k1_start += 2;
+            } else if (front) {
+                long k2_offset = offset + delta - k1;
+                if (k2_offset >= 0 && k2_offset < length && v2[k2_offset] != -1 && x1 >= n - v2[k2_offset]) {
+                    split_a = x1;
+                    split_b = y1;
+                    return true;
+                }
+            }
+        }
+        for (long k2 = -d + k2_start; k2 <= d - k2_end; k2 += 2) {
+            long k2_offset = offset + k2;
+            long x2 = (k2 == -d || (k2 != d && v2[k2_offset - 1] < v2[k2_offset + 1])) ? v2[k2_offset + 1]
+                                                                                      : v2[k2_offset - 1] + 1;
+            long y2 = x2 - k2;
+            while (x2 < n && y2 < m && a[n - x2 - 1] == b[m - y2 - 1]) {
+                ++x2;
+                ++y2;
+            }
+            v2[k2_offset] = x2;
+            if (x2 > n) {
+                k2_end += 2;
+            } else if (y2 > m) {
+                k2_start += 2;
+            } else if (!front) {
+                long k1_offset = offset + delta - k2;
+                if (k1_offset >= 0 && k1_offset < length && v1[k1_offset] != -1) {
+                    long x1 = v1[k1_offset];
+                    long y1 = offset + x1 - k1_offset;
+                    if (x1 >= n - x2) {
+                        split_a = x1;
+                        split_b = y1;
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// Marks the lines of a[a_lo, a_hi) and b[b_lo, b_hi) that are not part of a
+// longest common subsequence.
+void myers_compare(const std::uint32_t* a, long a_lo, long a_hi, const std::uint32_t* b, long b_lo, long b_hi,
+                   std::vector<char>& a_changed, std::vector<char>& b_changed) {
+    while (a_lo < a_hi && b_lo < b_hi && a[a_lo] == b[b_lo]) {
+        ++a_lo;
+        ++b_lo;
+    }
+    while (a_lo < a_hi && b_lo < b_hi && a[a_hi - 1] == b[b_hi - 1]) {
+        --a_hi;
+        --b_hi;
+    }
+    long split_a, split_b;
+    if (a_lo == a_hi || b_lo == b_hi ||
+        !myers_bisect(a + a_lo, a_hi - a_lo, b + b_lo, b_hi - b_lo, split_a, split_b) ||
+        (split_a == 0 && split_b == 0) || (split_a == a_hi - a_lo && split_b == b_hi - b_lo)) {
+        std::fill(a_changed.begin() + a_lo, a_changed.begin() + a_hi, 1);
+        std::fill(b_changed.begin() + b_lo, b_changed.begin() + b_hi, 1);
+        return;
+    }
+    myers_compare(a, a_lo, a_lo + split_a, b, b_lo, b_lo + split_b, a_changed, b_changed);
+    myers_compare(a, a_lo + split_a, a_hi, b, b_lo + split_b, b_hi, a_changed, b_changed);
+}
+
+// Diffs two interned line sequences and returns the changed regions in order.
+std::vector<DiffHunk> diff_lines(const std::vector<std::uint32_t>& a, const std::vector<std::uint32_t>& b) {
+    std::vector<char> a_changed(a.size(), 0), b_changed(b.size(), 0);
+    myers_compare(a.data(), 0, static_cast<long>(a.size()), b.data(), 0, static_cast<long>(b.size()), a_changed,
+                  b_changed);
+    std::vector<DiffHunk> hunks;
+    std::size_t i = 0, j = 0;
+    while (i < a.size() || j < b.size()) {
+        if (i < a.size() && j < b.size() && !a_changed[i] && !b_changed[j]) {
+            ++i;
+            ++j;
+            continue;
+        }
+        DiffHunk hunk;
+        hunk.old_start = i;
+        hunk.new_start = j;
+        while (i < a.size() && a_changed[i]) ++i;
+        while (j < b.size() && b_changed[j]) ++j;
+        hunk.old_count = i - hunk.old_start;
+        hunk.new_count = j - hunk.new_start;
+        hunks.push_back(hunk);
+    }
+    return hunks;
+}
+
+// Line diff of two texts. The common prefix and suffix are skipped by comparing
+// the lines directly, so only the differing middle is interned and diffed; for
+// the typical small edit to a large file this avoids hashing every line.
+std::vector<DiffHunk> diff_text(std::string_view old_text, std::string_view new_text) {
+    std::vector<std::string_view> a = split_lines(old_text);
+    std::vector<std::string_view> b = split_lines(new_text);
+    std::size_t prefix = 0;
+    while (prefix < a.size() && prefix < b.size() && a[prefix] == b[prefix]) ++prefix;
+    std::size_t suffix = 0;
+    while (suffix < a.size() - prefix && suffix < b.size() - prefix &&
+           a[a.size() - 1 - suffix] == b[b.size() - 1 - suffix]) {
+        ++suffix;
+    }
+    LineTable table;
+    std::vector<std::uint32_t> a_ids =
+        table.intern(std::vector<std::string_view>(a.begin() + prefix, a.end() - suffix));
+    std::vector<std::uint32_t> b_ids =
+        table.intern(std::vector<std::string_view>(b.begin() + prefix, b.end() - suffix));
+    std::vector<DiffHunk> hunks = diff_lines(a_ids, b_ids);
+    for (DiffHunk& hunk : hunks) {
+        hunk.old_start += prefix;
+        hunk.new_start += prefix;
+    }
+    return hunks;
+}
+
+// Three-way merge of text files. The changes from 'base' to each side are
+// found with diff_text(); changes that overlap or touch in the base are a
+// conflict unless both sides made the same edit, and are written between
+// conflict markers labelled 'our_label' and 'their_label'. Returns true if
+// the merge is clean.
+bool merge_file(std::string_view base, std::string_view ours, std::string_view theirs, const std::string& our_label,
+                const std::string& their_label, std::string& out) {
+    out.clear();
+    if (ours == theirs || base == theirs) {
+        out.assign(ours.data(), ours.size());
+        return true;
+    }
+    if (base == ours) {
+        out.assign(theirs.data(), theirs.size());
+        return true;
+    }
+    std::vector<std::string_view> a = split_lines(base), o = split_lines(ours), t = split_lines(theirs);
+    std::vector<DiffHunk> our_hunks = diff_text(base, ours), their_hunks = diff_text(base, theirs);
+    auto append = [&out](const std::vector<std::string_view>& lines, std::size_t begin, std::size_t end) {
+        for (std::size_t k = begin; k < end; ++k) out.append(lines[k].data(), lines[k].size());
+    };
+    auto append_marker = [&out](const std::string& marker) {
+        if (!out.empty() && out.back() != '\n') out.push_back('\n');
+        out += marker;
+    };
+    bool clean = true;
+    std::size_t copied = 0, io = 0, it = 0;
+    long our_shift = 0, their_shift = 0;  // line offset of each side against the base before the region
+    while (io < our_hunks.size() || it < their_hunks.size()) {
+        // Grow a region of the base from the earliest hunk until no hunk of
+        // either side starts inside or right at its end.
+        bool take_ours = it == their_hunks.size() ||
+                         (io < our_hunks.size() && our_hunks[io].old_start <= their_hunks[it].old_start);
+        std::size_t start = take_ours ? our_hunks[io].old_start : their_hunks[it].old_start;
+        std::size_t end = start;
+        std::size_t our_first = io, their_first = it;
+        long our_end_shift = our_shift, their_end_shift = their_shift;
+        for (bool grew = true; grew;) {
+            grew = false;
+            if (io < our_hunks.size() && our_hunks[io].old_start <= end) {
+                end = std::max(end, our_hunks[io].old_start + our_hunks[io].old_count);
+                our_end_shift += long(our_hunks[io].new_count) - long(our_hunks[io].old_count);
+                ++io;
+                grew = true;
+            }
+            if (it < their_hunks.size() && their_hunks[it].old_start <= end) {
+                end = std::max(end, their_hunks[it].old_start + their_hunks[it].old_count);
+                their_end_shift += long(their_hunks[it].new_count) - long(their_hunks[it].old_count);
+                ++it;
+                grew = true;
+            }
+        }
+        append(a, copied, start);
+        std::size_t our_begin = std::size_t(long(start) + our_shift), our_end = std::size_t(long(end) + our_end_shift);
+        std::size_t their_begin = std::size_t(long(start) + their_shift),
+                    their_end = std::size_t(long(end) + their_end_shift);
+        if (their_first == it) {
+            append(o, our_begin, our_end);
+        } else if (our_first == io ||
+                   std::equal(o.begin() + our_begin, o.begin() + our_end, t.begin() + their_begin, t.begin() + their_end)) {
+            append(t, their_begin, their_end);
+        } else {
+            clean = false;
+            append_marker("<<<<<<< " + our_label + "\n");
+            append(o, our_begin, our_end);
+            append_marker("=======\n");
+            append(t, their_begin, their_end);
+            append_marker(">>>>>>> " + their_label + "\n");
+        }
+        copied = end;
+        our_shift = our_end_shift;
+        their_shift = their_end_shift;
+    }
+    append(a, copied, a.size());
+    return clean;
+}
+
+// Changed-path Bloom filter of one commit, as in Git's commit-graph. Every path
+// that differs from the first parent, plus each of its leading directories, is
+// added with 7 hash functions at 10 bits per entry. A lookup answers either
+// "maybe changed" or "definitely unchanged". A commit that changes nothing gets
+// a one-byte empty filter; one that changes too many paths gets a one-byte full
+// filter, which answers "maybe" for everything.
+class BloomFilter {
+public:
+    static constexpr std::size_t kMaxChangedPaths = 512;
+    static constexpr unsigned kHashes = 7;
+    static constexpr unsigned kBitsPerEntry = 10;
+
+    static std::string build(const std::vector<std::string>& paths) {
+        std::vector<std::string> keys;
+        for (const std::string& path : paths) {
+            keys.push_back(path);
+            for (std::size_t slash = path.rfind('/'); slash != std::string::npos && slash > 0;
+                 slash = path.rfind('/', slash - 1)) {
+                keys.push_back(path.substr(0, slash));
+            }
+        }
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+        if (keys.empty()) {
+            return std::string(1, '\0');
+        }
+        if (keys.size() > kMaxChangedPaths) {
+            return std::string(1, '\xff');
+        }
+        std::string filter((keys.size() * kBitsPerEntry + 7) / 8, '\0');
+        std::uint64_t bits = filter.size() * 8;
+        for (const std::string& key : keys) {
+            std::uint64_t h1, h2;
+            hash(key, h1, h2);
+            for (unsigned i = 0; i < kHashes; ++i) {
+                std::uint64_t bit = (h1 + i * h2) % bits;
+                filter[bit / 8] = static_cast<char>(filter[bit / 8] | (1 << (bit % 8)));
+            }
+        }
+        return filter;
+    }
+
+    static bool maybe_contains(std::string_view filter, const std::string& path) {
+        if (filter.empty()) {
+            return true;  // no filter: nothing is known
+        }
+        std::uint64_t bits = filter.size() * 8;
+        std::uint64_t h1, h2;
+        hash(path, h1, h2);
+        for (unsigned i = 0; i < kHashes; ++i) {
+            std::uint64_t bit = (h1 + i * h2) % bits;
+            if (!(static_cast<unsigned char>(filter[bit / 8]) & (1 << (bit % 8)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    // Two independent 64-bit hashes for double hashing (FNV-1a and a mix of it).
+    static void hash(const std::string& key, std::uint64_t& h1, std::uint64_t& h2) {
+        h1 = 14695981039346656037ull;
+        for (unsigned char c : key) {
+            h1 = (h1 ^ c) * 1099511628211ull;
+        }
+        h2 = h1 ^ (h1 >> 33);
+        h2 *= 0xff51afd7ed558ccdull;
+        h2 ^= h2 >> 33;
+        h2 |= 1;
+    }
+};
+
+// One path that differs between two trees. A null id (and zero mode) on one
+// side means the path was added or deleted.
+struct TreeChange {
+    std::string path;
+    ObjectId old_oid;
+    ObjectId new_oid;
+    unsigned old_mode = 0;
+    unsigned new_mode = 0;
+};
+
+// A path that a three-way tree merge could not resolve, with its version on
+// each side (a null id where the side has no file). The merged tree holds
+// the file with conflict markers, or the surviving side's version.
+struct MergeConflict {
+    std::string path;
+    std::string reason;  // "content", "add/add", "modify/delete", "mode" or "file/directory"
+    ObjectId base_oid, our_oid, their_oid;
+    unsigned base_mode = 0, our_mode = 0, their_mode = 0;
+};
+
+// Generation number of commits that are not in the commit-graph.
+constexpr std::uint32_t kGenerationInfinity = 0xffffffff;
+
+// The parts of a commit that history walks need.
+struct CommitInfo {
+    ObjectId tree;
+    std::vector<ObjectId> parents;
+    std::int64_t commit_time = 0;
+    std::uint32_t generation = kGenerationInfinity;
+};
+
+// On-disk cache of commit metadata (.minigit/commit-graph) so that history walks
+// can order and cut off commits by date and generation number without opening
+// every commit object.
+//
+// Layout (integers little-endian):
+//   "MGCG" | version u32 | commit count u32 | edge count u32
+//   commit ids, sorted by id (20 bytes each)
+//   per commit: tree id (20) | generation u32 | commit time u64 | first edge u32 | parent count u32
+//   edges: parent positions (u32 each)
+//   version 2 only: per commit the end offset (u32) of its changed-path Bloom
+//   filter, followed by the concatenated filters
+class CommitGraph {
+public:
+    // Input record for write(); parents are given as ids. An empty 'bloom'
+    // means no filter is known for the commit.
+    struct Entry {
+        ObjectId oid;
+        ObjectId tree;
+        std::vector<ObjectId> parents;
+        std::int64_t commit_time = 0;
+        std::string bloom;
+    };
+
+    bool load(const std::string& path) {
+        count_ = 0;
+        bloom_index_ = 0;
+        std::uint32_t version = 0;
+        if (!read_file(path, data_) || data_.size() < kHeaderSize || data_.compare(0, 4, "MGCG") != 0 ||
+            ((version = get_u32(&data_[4])) != 1 && version != 2)) {
+            data_.clear();
+            return false;
+        }
+        std::uint32_t count = get_u32(&data_[8]);
+        std::uint32_t edges = get_u32(&data_[12]);
+        std::size_t expected = kHeaderSize + std::size_t(count) * (kIdSize + kRecordSize) + std::size_t(edges) * 4;
+        if (version == 2) {
+            std::size_t index = expected;
+            expected += std::size_t(count) * 4;
+            if (data_.size() < expected) {
+                data_.clear();
+                return false;
+            }
+            expected += count ? get_u32(&data_[index + (std::size_t(count) - 1) * 4]) : 0;
+            bloom_index_ = index;
+        }
+        if (data_.size() != expected) {
+            data_.clear();
+            bloom_index_ = 0;
+            return false;
+        }
+        // Every parent edge and Bloom filter must lie inside the file, so that
+        // parent() and bloom() need no checks of their own. A graph that fails
+        // is not used, and commits are read from their objects instead.
+        count_ = count;
+        bool valid = true;
+        for (std::uint32_t pos = 0; valid && pos < count; ++pos) {
+            valid = std::uint64_t(get_u32(record_ptr(pos) + 32)) + parent_count(pos) <= edges;
+        }
+        for (std::uint32_t edge = 0; valid && edge < edges; ++edge) {
+            valid = get_u32(&data_[edges_offset() + std::size_t(edge) * 4]) < count;
+        }
+        for (std::uint32_t pos = 1; valid && bloom_index_ != 0 && pos < count; ++pos) {
+            valid = get_u32(&data_[bloom_index_ + (std::size_t(pos) - 1) * 4]) <=
+                    get_u32(&data_[bloom_index_ + std::size_t(pos) * 4]);
+        }
+        if (!valid) {
+            data_.clear();
+            bloom_index_ = 0;
+            count_ = 0;
+            return false;
+        }
+        return true;
+    }
+
+    bool has_bloom_filters() const { return bloom_index_ != 0; }
+
+    // The changed-path Bloom filter of the commit at 'pos' (empty if unknown).
+    std::string_view bloom(std::uint32_t pos) const {
+        if (bloom_index_ == 0) {
+            return std::string_view();
+        }
+        std::uint32_t begin = pos ? get_u32(&data_[bloom_index_ + (std::size_t(pos) - 1) * 4]) : 0;
+        std::uint32_t end = get_u32(&data_[bloom_index_ + std::size_t(pos) * 4]);
+        return std::string_view(data_).substr(bloom_index_ + std::size_t(count_) * 4 + begin, end - begin);
+    }
+
+    // False only if the commit certainly did not change 'path' relative to its
+    // first parent.
+    bool maybe_changed(std::uint32_t pos, const std::string& path) const {
+        return BloomFilter::maybe_contains(bloom(pos), path);
+    }
+
+    std::uint32_t size() const { return count_; }
+
+    // Binary search over the sorted id table.
+    bool find(const ObjectId& oid, std::uint32_t& pos) const {
+        std::uint32_t lo = 0, hi = count_;
+        while (lo < hi) {
+            std::uint32_t mid = lo + (hi - lo) / 2;
+            int cmp = std::memcmp(id_ptr(mid), oid.bytes.data(), kIdSize);
+            if (cmp == 0) {
+                pos = mid;
+                return true;
+            }
+            if (cmp < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return false;
+    }
+
+    ObjectId oid_at(std::uint32_t pos) const {
+        ObjectId oid;
+        std::memcpy(oid.bytes.data(), id_ptr(pos), kIdSize);
+        return oid;
+    }
+
+    ObjectId tree_at(std::uint32_t pos) const {
+        ObjectId oid;
+        std::memcpy(oid.bytes.data(), record_ptr(pos), kIdSize);
+        return oid;
+    }
+
+    std::uint32_t generation(std::uint32_t pos) const { return get_u32(record_ptr(pos) + 20); }
+    std::int64_t commit_time(std::uint32_t pos) const {
+        return static_cast<std::int64_t>(get_u64(record_ptr(pos) + 24));
+    }
+    std::uint32_t parent_count(std::uint32_t pos) const { return get_u32(record_ptr(pos) + 36); }
+    std::uint32_t parent(std::uint32_t pos, std::uint32_t i) const {
+        std::uint32_t edge = get_u32(record_ptr(pos) + 32) + i;
+        return get_u32(&data_[edges_offset() + std::size_t(edge) * 4]);
+    }
+
+    // Writes a graph for 'entries', which must be closed under parents.
+    // Generation numbers are computed here: roots are 1, every other commit is
+    // one more than its highest parent.
+    static bool write(const std::string& path, std::vector<Entry> entries) {
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.oid < b.oid; });
+        OidMap<std::uint32_t> positions;
+        positions.reserve(entries.size());
+        for (std::uint32_t i = 0; i < entries.size(); ++i) {
+            positions.insert(entries[i].oid, i);
+        }
+
+        std::vector<std::vector<std::uint32_t>> parents(entries.size());
+        for (std::size_t i = 0; i < entries.size(); ++i) {
+            for (const ObjectId& parent : entries[i].parents) {
+                const std::uint32_t* pos = positions.find(parent);
+                if (pos == nullptr) {
+                    std::cerr << "Error: commit-graph is missing parent " << parent << " of " << entries[i].oid
+                              << std::endl;
+                    return false;
+                }
+                parents[i].push_back(*pos);
+            }
+        }
+
+        // Iterative post-order so long linear histories do not overflow the stack.
+        std::vector<std::uint32_t> generation(entries.size(), 0);
+        std::vector<std::uint32_t> stack;
+        for (std::uint32_t start = 0; start < entries.size(); ++start) {
+            if (generation[start] != 0) continue;
+            stack.push_back(start);
+            while (!stack.empty()) {
+                std::uint32_t cur = stack.back();
+                if (generation[cur] != 0) {
+                    stack.pop_back();
+                    continue;
+                }
+                std::uint32_t max_parent = 0;
+                bool ready = true;
+                for (std::uint32_t p : parents[cur]) {
+                    if (generation[p] == 0) {
+                        stack.push_back(p);
+                        ready = false;
+                    } else {
+                        max_parent = std::max(max_parent, generation[p]);
+                    }
+                }
+                if (ready) {
+                    generation[cur] = max_parent + 1;
+                    stack.pop_back();
+                }
+            }
+        }
+
+        std::string out = "MGCG";
+        std::uint32_t edge_count = 0;
+        for (const auto& p : parents) edge_count += static_cast<std::uint32_t>(p.size());
+        put_u32(out, 2);
+        put_u32(out, static_cast<std::uint32_t>(entries.size()));
+        put_u32(out, edge_count);
+        for (const Entry& entry : entries) {
+            out.append(reinterpret_cast<const char*>(entry.oid.bytes.data()), kIdSize);
+        }
+        std::uint32_t next_edge = 0;
+        for (std::size_t i = 0; i < entries.size(); ++i) {
+            out.append(reinterpret_cast<const char*>(entries[i].tree.bytes.data()), kIdSize);
+            put_u32(out, generation[i]);
+            put_u64(out, static_cast<std::uint64_t>(entries[i].commit_time));
+            put_u32(out, next_edge);
+            put_u32(out, static_cast<std::uint32_t>(parents[i].size()));
+            next_edge += static_cast<std::uint32_t>(parents[i].size());
+        }
+        for (const auto& p : parents) {
+            for (std::uint32_t pos : p) put_u32(out, pos);
+        }
+        std::uint32_t bloom_end = 0;
+        for (const Entry& entry : entries) {
+            bloom_end += static_cast<std::uint32_t>(entry.bloom.size());
+            put_u32(out, bloom_end);
+        }
+        for (const Entry& entry : entries) {
+            out += entry.bloom;
+        }
+        return write_file_atomic(path, out);
+    }
+
+private:
+    static constexpr std::size_t kHeaderSize = 16;
+    static constexpr std::size_t kIdSize = ObjectId::kSha1RawSize;
+    static constexpr std::size_t kRecordSize = 40;
+
+    const char* id_ptr(std::uint32_t pos) const { return &data_[kHeaderSize + std::size_t(pos) * kIdSize]; }
+    const char* record_ptr(std::uint32_t pos) const {
+        return &data_[kHeaderSize + std::size_t(count_) * kIdSize + std::size_t(pos) * kRecordSize];
+    }
+    std::size_t edges_offset() const { return kHeaderSize + std::size_t(count_) * (kIdSize + kRecordSize); }
+
+    std::string data_;
+    std::uint32_t count_ = 0;
+    std::size_t bloom_index_ = 0;  // offset of the Bloom filter offsets, 0 if none
+};
+
+// Bidirectional map between the ids objects have in the repository's object
+// format (SHA-1) and in its compatibility format (SHA-256), so that objects
+// can be named by either. The file (.minigit/oid-map) is mapped and both
+// directions are binary searches; no object is read or re-hashed to answer.
+//
+// Layout (integers little-endian):
+//   "MGOT" | version u32 | entry count u32
+//   SHA-1 ids, sorted (20 bytes each)
+//   SHA-256 ids, in the same order as the SHA-1 ids (32 bytes each)
+//   positions (u32) of the entries, ordered by SHA-256 id
+class OidTranslation {
+public:
+    bool load(const std::string& path) {
+        count_ = 0;
+        if (!file_.open(path)) {
+            return false;
+        }
+        std::string_view data = file_.data();
+        if (data.size() < kHeaderSize || data.compare(0, 4, "MGOT") != 0 || get_u32(data.data() + 4) != 1 ||
+            data.size() != kHeaderSize + std::size_t(get_u32(data.data() + 8)) * kRecordSize) {
+            file_.close();
+            return false;
+        }
+        count_ = get_u32(data.data() + 8);
+        return true;
+    }
+
+    std::uint32_t size() const { return count_; }
+
+    // Looks up the SHA-256 id of a SHA-1 id, or the other way round.
+    bool translate(const ObjectId& oid, ObjectId& out) const {
+        std::uint32_t lo = 0, hi = count_;
+        bool to_compat = oid.raw_size == ObjectId::kSha1RawSize;
+        while (lo < hi) {
+            std::uint32_t mid = lo + (hi - lo) / 2;
+            std::uint32_t pos = to_compat ? mid : get_u32(order_ptr(mid));
+            const char* id = to_compat ? sha1_ptr(pos) : sha256_ptr(pos);
+            int cmp = std::memcmp(id, oid.bytes.data(), oid.raw_size);
+            if (cmp == 0) {
+                out = ObjectId{};
+                out.raw_size = static_cast<unsigned char>(to_compat ? ObjectId::kSha256RawSize : ObjectId::kSha1RawSize);
+                std::memcpy(out.bytes.data(), to_compat ? sha256_ptr(pos) : sha1_ptr(pos), out.raw_size);
+                return true;
+            }
+            if (cmp < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return false;
+    }
+
+    // All (SHA-1, SHA-256) pairs, in SHA-1 order.
+    void entries(std::vector<std::pair<ObjectId, ObjectId>>& out) const {
+        for (std::uint32_t i = 0; i < count_; ++i) {
+            std::pair<ObjectId, ObjectId> entry;
+            entry.second.raw_size = ObjectId::kSha256RawSize;
+            std::memcpy(entry.first.bytes.data(), sha1_ptr(i), ObjectId::kSha1RawSize);
+            std::memcpy(entry.second.bytes.data(), sha256_ptr(i), ObjectId::kSha256RawSize);
+            out.push_back(entry);
+        }
+    }
+
+    // Writes a table; 'entries' must be sorted by SHA-1 id without duplicates.
+    static bool write(const std::string& path, const std::vector<std::pair<ObjectId, ObjectId>>& entries) {
+        std::string out = "MGOT";
+        put_u32(out, 1);
+        put_u32(out, static_cast<std::uint32_t>(entries.size()));
+        for (const auto& entry : entries) {
+            out.append(reinterpret_cast<const char*>(entry.first.bytes.data()), ObjectId::kSha1RawSize);
+        }
+        for (const auto& entry : entries) {
+            out.append(reinterpret_cast<const char*>(entry.second.bytes.data()), ObjectId::kSha256RawSize);
+        }
+        std::vector<std::uint32_t> order(entries.size());
+        for (std::uint32_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b) {
+            return std::memcmp(entries[a].second.bytes.data(), entries[b].second.bytes.data(),
+                               ObjectId::kSha256RawSize) < 0;
+        });
+        for (std::uint32_t pos : order) put_u32(out, pos);
+        return write_file_atomic(path, out);
+    }
+
+private:
+    static constexpr std::size_t kHeaderSize = 12;
+    static constexpr std::size_t kRecordSize = ObjectId::kSha1RawSize + ObjectId::kSha256RawSize + 4;
+
+    const char* sha1_ptr(std::uint32_t pos) const {
+        return file_.data().data() + kHeaderSize + std::size_t(pos) * ObjectId::kSha1RawSize;
+    }
+    const char* sha256_ptr(std::uint32_t pos) const {
+        return file_.data().data() + kHeaderSize + std::size_t(count_) * ObjectId::kSha1RawSize +
+               std::size_t(pos) * ObjectId::kSha256RawSize;
+    }
+    const char* order_ptr(std::uint32_t i) const {
+        return file_.data().data() + kHeaderSize +
+               std::size_t(count_) * (ObjectId::kSha1RawSize + ObjectId::kSha256RawSize) + std::size_t(i) * 4;
+    }
+
+    MappedFile file_;
+    std::uint32_t count_ = 0;
+};
+
+// Persistent trigram index over blob contents, used by 'minigit grep' to skip
+// blobs that cannot contain the literals a pattern requires. The base file is
+//   "MGTI" | version u32 | blob count u32 | trigram count u32
+//   blob ids, sorted (20 bytes each)
+//   per trigram, sorted: trigram u32 | end of its posting list u64
+//   posting lists: ascending blob numbers, delta + varint encoded
+// New commits append the blobs they introduce to a delta file of records
+//   blob id (20 bytes) | length u32 | sorted trigrams, delta + varint encoded
+// which is folded into a fresh base once it grows large. Trigrams are taken over
+// ASCII-lowercased text and never span a newline, so one index serves both
+// case-sensitive and case-insensitive line searches.
+class TrigramIndex {
+public:
+    // (blob id, sorted distinct trigrams) as fed to write().
+    using Blob = std::pair<ObjectId, std::vector<std::uint32_t>>;
+
+    // Blobs larger than this, and binary blobs, are not indexed; grep always
+    // searches blobs the index does not know.
+    static constexpr std::size_t kMaxBlobSize = 8 << 20;
+
+    // Fills 'out' with the sorted, distinct trigrams of 'content'. Returns false
+    // if the blob is not indexable.
+    static bool blob_trigrams(std::string_view content, std::vector<std::uint32_t>& out) {
+        out.clear();
+        if (content.size() > kMaxBlobSize ||
+            std::memchr(content.data(), '\0', std::min<std::size_t>(content.size(), 8000)) != nullptr) {
+            return false;
+        }
+        append_trigrams(content, out);
+        std::sort(out.begin(), out.end());
+        out.erase(std::unique(out.begin(), out.end()), out.end());
+        return true;
+    }
+
+    // Appends the trigrams of 'text', lowercased and not spanning newlines; also
+    // used for the literals a pattern requires.
+    static void append_trigrams(std::string_view text, std::vector<std::uint32_t>& out) {
+        std::uint32_t window = 0;
+        std::size_t run = 0;
+        for (char c : text) {
+            if (c == '\n') {
+                run = 0;
+                continue;
+            }
+            window = ((window << 8) | static_cast<unsigned char>(std::tolower(static_cast<unsigned char>(c)))) & 0xffffff;
+            if (++run >= 3) out.push_back(window);
+        }
+    }
+
+    // Loads the base file and the delta file next to it. Returns false if there
+    // is no usable base file.
+    bool load(const std::string& path) {
+        base_count_ = trigram_count_ = 0;
+        delta_.clear();
+        delta_positions_.clear();
+        restricted_ = false;
+        if (!read_file(path, data_) || data_.size() < kHeaderSize || data_.compare(0, 4, "MGTI") != 0 ||
+            get_u32(&data_[4]) != 1) {
+            data_.clear();
+            return false;
+        }
+        std::uint32_t blobs = get_u32(&data_[8]);
+        std::uint32_t trigrams = get_u32(&data_[12]);
+        std::size_t postings = kHeaderSize + std::size_t(blobs) * kIdSize + std::size_t(trigrams) * kTrigramSize;
+        if (data_.size() < postings || (trigrams && data_.size() - postings != get_u64(&data_[postings - 8]))) {
+            data_.clear();
+            return false;
+        }
+        base_count_ = blobs;
+        trigram_count_ = trigrams;
+        // Posting lists end where the next one begins, so posting_list_at()
+        // relies on the end offsets never decreasing.
+        std::uint64_t previous = 0;
+        for (std::uint32_t t = 0; t < trigrams; ++t) {
+            std::uint64_t end = get_u64(trigram_ptr(t) + 4);
+            if (end < previous || end > data_.size() - postings) {
+                data_.clear();
+                base_count_ = trigram_count_ = 0;
+                return false;
+            }
+            previous = end;
+        }
+
+        std::string delta;
+        if (read_file(path + ".delta", delta)) {
+            std::size_t pos = 0;
+            while (pos + kIdSize + 4 <= delta.size()) {
+                Blob blob;
+                std::memcpy(blob.first.bytes.data(), &delta[pos], kIdSize);
+                std::uint32_t length = get_u32(&delta[pos + kIdSize]);
+                pos += kIdSize + 4;
+                if (length > delta.size() - pos) break;  // torn final record
+                std::string_view list = std::string_view(delta).substr(pos, length);
+                pos += length;
+                std::size_t at = 0;
+                std::uint64_t value = 0, previous = 0;
+                while (at < list.size() && get_varint(list, at, value)) {
+                    previous += value;
+                    blob.second.push_back(static_cast<std::uint32_t>(previous));
+                }
+                std::uint32_t base_pos;
+                if (find_base(blob.first, base_pos) || delta_positions_.contains(blob.first)) continue;
+                delta_positions_.insert(blob.first, static_cast<std::uint32_t>(delta_.size()));
+                delta_.push_back(std::move(blob));
+            }
+            delta_bytes_ = delta.size();
+        }
+        return true;
+    }
+
+    std::size_t base_bytes() const { return data_.size(); }
+    std::size_t delta_bytes() const { return delta_bytes_; }
+    std::size_t blob_count() const { return base_count_ + delta_.size(); }
+
+    // True if the blob is in the index, whether or not it matches.
+    bool contains(const ObjectId& blob) const {
+        std::uint32_t pos;
+        return find_base(blob, pos) || delta_positions_.contains(blob);
+    }
+
+    // Narrows the candidates to the indexed blobs that contain every trigram in
+    // 'trigrams' by intersecting their posting lists, shortest first.
+    void restrict(std::vector<std::uint32_t> trigrams) {
+        std::sort(trigrams.begin(), trigrams.end());
+        trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+        if (trigrams.empty()) {
+            return;
+        }
+        std::vector<std::string_view> lists;
+        for (std::uint32_t trigram : trigrams) {
+            lists.push_back(posting_list(trigram));
+        }
+        std::sort(lists.begin(), lists.end(),
+                  [](std::string_view a, std::string_view b) { return a.size() < b.size(); });
+        std::vector<std::uint32_t> result = decode_postings(lists[0]);
+        for (std::size_t i = 1; i < lists.size() && !result.empty(); ++i) {
+            std::vector<std::uint32_t> next = decode_postings(lists[i]), both;
+            std::set_intersection(result.begin(), result.end(), next.begin(), next.end(), std::back_inserter(both));
+            result.swap(both);
+        }
+        candidates_ = std::move(result);
+
+        delta_matches_.assign(delta_.size(), true);
+        for (std::size_t i = 0; i < delta_.size(); ++i) {
+            const std::vector<std::uint32_t>& own = delta_[i].second;
+            delta_matches_[i] = std::includes(own.begin(), own.end(), trigrams.begin(), trigrams.end());
+        }
+        restricted_ = true;
+    }
+
+    // False only if 'blob' is indexed and lacks one of the trigrams passed to
+    // restrict(); unindexed blobs may always match.
+    bool may_contain(const ObjectId& blob) const {
+        if (!restricted_) {
+            return true;
+        }
+        std::uint32_t pos;
+        if (find_base(blob, pos)) {
+            return std::binary_search(candidates_.begin(), candidates_.end(), pos);
+        }
+        const std::uint32_t* delta_pos = delta_positions_.find(blob);
+        return delta_pos == nullptr || delta_matches_[*delta_pos];
+    }
+
+    // Decodes the whole index (base and delta) back into per-blob trigram lists.
+    std::vector<Blob> blobs() const {
+        std::vector<Blob> out(base_count_);
+        for (std::uint32_t i = 0; i < base_count_; ++i) {
+            std::memcpy(out[i].first.bytes.data(), id_ptr(i), kIdSize);
+        }
+        for (std::uint32_t t = 0; t < trigram_count_; ++t) {
+            std::uint32_t trigram = get_u32(trigram_ptr(t));
+            for (std::uint32_t blob : decode_postings(posting_list_at(t))) {
+                if (blob < base_count_) out[blob].second.push_back(trigram);
+            }
+        }
+        out.insert(out.end(), delta_.begin(), delta_.end());
+        return out;
+    }
+
+    // Writes a base file for 'blobs' (in any order, duplicates ignored).
+    static bool write(const std::string& path, std::vector<Blob> blobs) {
+        std::sort(blobs.begin(), blobs.end(), [](const Blob& a, const Blob& b) { return a.first < b.first; });
+        blobs.erase(std::unique(blobs.begin(), blobs.end(),
+                                [](const Blob& a, const Blob& b) { return a.first == b.first; }),
+                    blobs.end());
+
+        // Blobs are visited in number order, so each posting list is built
+        // already sorted and can be delta encoded as it grows.
+        struct Posting {
+            std::string bytes;
+            std::uint32_t last = 0;
+        };
+        std::unordered_map<std::uint32_t, Posting> postings;
+        for (std::uint32_t i = 0; i < blobs.size(); ++i) {
+            for (std::uint32_t trigram : blobs[i].second) {
+                Posting& posting = postings[trigram];
+                put_varint(posting.bytes, posting.bytes.empty() ? i : i - posting.last);
+                posting.last = i;
+            }
+        }
+        std::vector<std::uint32_t> trigrams;
+        trigrams.reserve(postings.size());
+        for (const auto& entry : postings) trigrams.push_back(entry.first);
+        std::sort(trigrams.begin(), trigrams.end());
+
+        std::string out = "MGTI";
+        put_u32(out, 1);
+        put_u32(out, static_cast<std::uint32_t>(blobs.size()));
+        put_u32(out, static_cast<std::uint32_t>(trigrams.size()));
+        for (const Blob& blob : blobs) {
+            out.append(reinterpret_cast<const char*>(blob.first.bytes.data()), kIdSize);
+        }
+        std::uint64_t end = 0;
+        for (std::uint32_t trigram : trigrams) {
+            end += postings[trigram].bytes.size();
+            put_u32(out, trigram);
+            put_u64(out, end);
+        }
+        for (std::uint32_t trigram : trigrams) {
+            out += postings[trigram].bytes;
+        }
+        return write_file_atomic(path, out);
+    }
+
+    // Appends blobs to the delta file of the index at 'path'.
+    static bool append_delta(const std::string& path, const std::vector<Blob>& blobs) {
+        std::string out;
+        for (const Blob& blob : blobs) {
+            std::string list;
+            std::uint32_t previous = 0;
+            for (std::uint32_t trigram : blob.second) {
+                put_varint(list, trigram - previous);
+                previous = trigram;
+            }
+            out.append(reinterpret_cast<const char*>(blob.first.bytes.data()), kIdSize);
+            put_u32(out, static_cast<std::uint32_t>(list.size()));
+            out += list;
+        }
+        std::ofstream file(path + ".delta", std::ios::binary | std::ios::app);
+        return file.write(out.data(), static_cast<std::streamsize>(out.size())) && file.flush();
+    }
+
+private:
+    static constexpr std::size_t kHeaderSize = 16;
+    static constexpr std::size_t kIdSize = ObjectId::kSha1RawSize;
+    static constexpr std::size_t kTrigramSize = 12;
+
+    const char* id_ptr(std::uint32_t pos) const { return &data_[kHeaderSize + std::size_t(pos) * kIdSize]; }
+    const char* trigram_ptr(std::uint32_t t) const {
+        return &data_[kHeaderSize + std::size_t(base_count_) * kIdSize + std::size_t(t) * kTrigramSize];
+    }
+    std::size_t postings_offset() const {
+        return kHeaderSize + std::size_t(base_count_) * kIdSize + std::size_t(trigram_count_) * kTrigramSize;
+    }
+
+    bool find_base(const ObjectId& oid, std::uint32_t& pos) const {
+        std::uint32_t lo = 0, hi = base_count_;
+        while (lo < hi) {
+            std::uint32_t mid = lo + (hi - lo) / 2;
+            int cmp = std::memcmp(id_ptr(mid), oid.bytes.data(), kIdSize);
+            if (cmp == 0) {
+                pos = mid;
+                return true;
+            }
+            if (cmp < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return false;
+    }
+
+    std::string_view posting_list_at(std::uint32_t t) const {
+        std::uint64_t begin = t ? get_u64(trigram_ptr(t - 1) + 4) : 0;
+        std::uint64_t end = get_u64(trigram_ptr(t) + 4);
+        return std::string_view(data_).substr(postings_offset() + begin, end - begin);
+    }
+
+    // The posting list of 'trigram' in the base file; empty if no blob has it.
+    std::string_view posting_list(std::uint32_t trigram) const {
+        std::uint32_t lo = 0, hi = trigram_count_;
+        while (lo < hi) {
+            std::uint32_t mid = lo + (hi - lo) / 2;
+            std::uint32_t value = get_u32(trigram_ptr(mid));
+            if (value == trigram) return posting_list_at(mid);
+            if (value < trigram) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return std::string_view();
+    }
+
+    static std::vector<std::uint32_t> decode_postings(std::string_view list) {
+        std::vector<std::uint32_t> out;
+        std::size_t pos = 0;
+        std::uint64_t value = 0, current = 0;
+        while (pos < list.size() && get_varint(list, pos, value)) {
+            current = out.empty() ? value : current + value;
+            out.push_back(static_cast<std::uint32_t>(current));
+        }
+        return out;
+    }
+
+    std::string data_;
+    std::uint32_t base_count_ = 0;
+    std::uint32_t trigram_count_ = 0;
+    std::vector<Blob> delta_;
+    OidMap<std::uint32_t> delta_positions_;
+    std::size_t delta_bytes_ = 0;
+    bool restricted_ = false;
+    std::vector<std::uint32_t> candidates_;  // matching base blob numbers, sorted
+    std::vector<bool> delta_matches_;
+};
+
+// Sorts the suffixes of 's' by prefix doubling, with two stable counting sorts
+// per round: O(n log n).
+std::vector<std::uint32_t> build_suffix_array(std::string_view s) {
+    std::size_t n = s.size();
+    std::vector<std::uint32_t> sa(n), rank(n), tmp(n);
+    std::vector<std::uint32_t> count(std::max<std::size_t>(n, 256) + 1);
+    for (std::size_t i = 0; i < n; ++i) ++count[static_cast<unsigned char>(s[i]) + 1];
+    for (std::size_t c = 1; c < count.size(); ++c) count[c] += count[c - 1];
+    for (std::size_t i = 0; i < n; ++i) sa[count[static_cast<unsigned char>(s[i])]++] = static_cast<std::uint32_t>(i);
+    std::uint32_t classes = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        if (i > 0 && s[sa[i]] != s[sa[i - 1]]) ++classes;
+        rank[sa[i]] = classes;
+    }
+    for (std::size_t k = 1; n > 0 && classes + 1 < n; k <<= 1) {
+        // Order by the rank of the second half: suffixes without one first.
+        std::size_t pos = 0;
+        for (std::size_t i = n - std::min(n, k); i < n; ++i) tmp[pos++] = static_cast<std::uint32_t>(i);
+        for (std::size_t i = 0; i < n; ++i) {
+            if (sa[i] >= k) tmp[pos++] = static_cast<std::uint32_t>(sa[i] - k);
+        }
+        // Then stably by the rank of the first half.
+        std::fill(count.begin(), count.begin() + classes + 2, 0);
+        for (std::size_t i = 0; i < n; ++i) ++count[rank[i] + 1];
+        for (std::size_t c = 1; c < classes + 2; ++c) count[c] += count[c - 1];
+        for (std::size_t i = 0; i < n; ++i) sa[count[rank[tmp[i]]]++] = tmp[i];
+        auto second = [&](std::uint32_t i) { return i + k < n ? std::int64_t(rank[i + k]) : -1; };
+        tmp[sa[0]] = classes = 0;
+        for (std::size_t i = 1; i < n; ++i) {
+            if (rank[sa[i]] != rank[sa[i - 1]] || second(sa[i]) != second(sa[i - 1])) ++classes;
+            tmp[sa[i]] = classes;
+        }
+        rank.swap(tmp);
+    }
+    return sa;
+}
+
+// Binary deltas in Git's format: the base and result sizes as varints, then
+// instructions that either copy a range of the base (a byte 0x80 | flags,
+// followed by the offset bytes named by flag bits 0-3 and the size bytes named
+// by bits 4-6; size 0 means 0x10000) or insert literal bytes (a count of 1-127,
+// then the bytes).
+//
+// create_delta() indexes every 16-byte block of the base by a polynomial hash,
+// rolls the same hash over the result, extends each verified block match in
+// both directions and copies the longest one. With DeltaSearch::Best it instead
+// looks up the longest match at every position of the result in a suffix array
+// of the base: slower, but it also finds matches shorter than a block or not
+// aligned to one, which matters for the small edits of binary files. It gives
+// up and returns false once the delta would exceed 'max_size'.
+enum class DeltaSearch { Fast, Best };
+
+bool create_delta(std::string_view base, std::string_view target, std::size_t max_size, std::string& out,
+                  DeltaSearch search = DeltaSearch::Fast) {
+    constexpr std::size_t kBlock = 16;
+    constexpr std::size_t kMinBestCopy = 8;  // shorter copies cost as much as the literal bytes
+    constexpr std::uint32_t kMul = 0x01000193u;
+    constexpr std::uint32_t kNone = 0xffffffffu;
+    constexpr int kMaxProbes = 32;
+    std::uint32_t pow_block = 1;
+    for (std::size_t i = 0; i < kBlock; ++i) pow_block *= kMul;
+    auto block_hash = [&](const char* p) {
+        std::uint32_t h = 0;
+        for (std::size_t i = 0; i < kBlock; ++i) h = h * kMul + static_cast<unsigned char>(p[i]);
+        return h;
+    };
+
+    std::size_t blocks = search == DeltaSearch::Fast ? base.size() / kBlock : 0;
+    std::uint64_t buckets = 1;
+    while (buckets < blocks) buckets <<= 1;
+    auto slot = [&](std::uint32_t h) { return ((h * 0x9e3779b1u) * buckets) >> 32; };
+    std::vector<std::uint32_t> head(buckets, kNone), next(blocks);
+    for (std::size_t b = 0; b < blocks; ++b) {
+        std::uint64_t s = slot(block_hash(base.data() + b * kBlock));
+        next[b] = head[s];
+        head[s] = static_cast<std::uint32_t>(b);
+    }
+    std::vector<std::uint32_t> suffixes;
+    if (search == DeltaSearch::Best) suffixes = build_suffix_array(base);
+
+    // Longest match for target[i..] among the indexed blocks. The hash of the
+    // previous position is rolled forward instead of being recomputed.
+    std::uint32_t h = 0;
+    std::size_t hashed = std::string_view::npos;
+    auto find_block_match = [&](std::size_t i, std::size_t& best_offset, std::size_t& best_len) {
+        if (blocks == 0 || i + kBlock > target.size()) return;
+        if (hashed != std::string_view::npos && hashed + 1 == i) {
+            h = h * kMul + static_cast<unsigned char>(target[i + kBlock - 1]) -
+                static_cast<unsigned char>(target[i - 1]) * pow_block;
+        } else {
+            h = block_hash(target.data() + i);
+        }
+        hashed = i;
+        int probes = 0;
+        for (std::uint32_t b = head[slot(h)]; b != kNone && probes < kMaxProbes; b = next[b], ++probes) {
+            std::size_t offset = std::size_t(b) * kBlock;
+            if (std::memcmp(base.data() + offset, target.data() + i, kBlock) != 0) continue;
+            std::size_t len = kBlock;
+            while (offset + len < base.size() && i + len < target.size() && base[offset + len] == target[i + len]) {
+                ++len;
+            }
+            if (len > best_len) {
+                best_len = len;
+                best_offset = offset;
+            }
+        }
+    };
+    // Longest match for target[i..] anywhere in the base: binary search for its
+    // place among the sorted suffixes, whose neighbours share the longest
+    // prefix with it. Both bounds' common prefixes are tracked, so characters
+    // known to match are not compared again.
+    auto find_suffix_match = [&](std::size_t i, std::size_t& best_offset, std::size_t& best_len) {
+        std::size_t lo = 0, hi = suffixes.size(), lcp_lo = 0, lcp_hi = 0;
+        std::size_t remaining = target.size() - i;
+        while (lo < hi) {
+            std::size_t mid = lo + (hi - lo) / 2;
+            std::size_t offset = suffixes[mid];
+            std::size_t len = std::min(lcp_lo, lcp_hi);
+            while (offset + len < base.size() && len < remaining && base[offset + len] == target[i + len]) ++len;
+            bool less = len < remaining && (offset + len == base.size() ||
+                                            static_cast<unsigned char>(base[offset + len]) <
+                                                static_cast<unsigned char>(target[i + len]));
+            if (less) {
+                lo = mid + 1;
+                lcp_lo = len;
+            } else {
+                hi = mid;
+                lcp_hi = len;
+            }
+        }
+        if (lo > 0 && lcp_lo > best_len) {
+            best_len = lcp_lo;
+            best_offset = suffixes[lo - 1];
+        }
+        if (lo < suffixes.size() && lcp_hi > best_len) {
+            best_len = lcp_hi;
+            best_offset = suffixes[lo];
+        }
+        if (best_len < kMinBestCopy) best_len = 0;
+    };
+
+    out.clear();
+    put_varint(out, base.size());
+    put_varint(out, target.size());
+    auto emit_literals = [&](std::size_t begin, std::size_t end) {
+        while (begin < end) {
+            std::size_t n = std::min<std::size_t>(127, end - begin);
+            out.push_back(static_cast<char>(n));
+            out.append(target.data() + begin, n);
+            begin += n;
+        }
+    };
+    auto emit_copy = [&](std::size_t offset, std::size_t size) {
+        while (size > 0) {
+            std::size_t n = std::min<std::size_t>(size, 0x10000);
+            unsigned char cmd = 0x80;
+            char args[7];
+            int count = 0;
+            for (int k = 0; k < 4; ++k) {
+                if ((offset >> (8 * k)) & 0xff) {
+                    cmd |= static_cast<unsigned char>(1 << k);
+                    args[count++] = static_cast<char>(offset >> (8 * k));
+                }
+            }
+            for (int k = 0; k < 3; ++k) {
+                if ((n >> (8 * k)) & 0xff) {
+                    cmd |= static_cast<unsigned char>(0x10 << k);
+                    args[count++] = static_cast<char>(n >> (8 * k));
+                }
+            }
+            out.push_back(static_cast<char>(cmd));
+            out.append(args, count);
+            offset += n;
+            size -= n;
+        }
+    };
+
+    std::size_t i = 0, literal_start = 0;
+    std::size_t end = 0;
+    if (search == DeltaSearch::Best && !base.empty()) {
+        end = target.size();
+    } else if (blocks > 0 && target.size() >= kBlock) {
+        end = target.size() - kBlock + 1;
+    }
+    while (i < end) {
+        std::size_t best_len = 0, best_offset = 0;
+        if (search == DeltaSearch::Best) {
+            find_suffix_match(i, best_offset, best_len);
+        } else {
+            find_block_match(i, best_offset, best_len);
+        }
+        if (best_len == 0) {
+            ++i;
+            continue;
+        }
+        while (best_offset > 0 && i > literal_start && base[best_offset - 1] == target[i - 1]) {
+            --best_offset;
+            --i;
+            ++best_len;
+        }
+        emit_literals(literal_start, i);
+        emit_copy(best_offset, best_len);
+        i += best_len;
+        literal_start = i;
+        if (out.size() > max_size) {
+            return false;
+        }
+    }
+    emit_literals(literal_start, target.size());
+    return out.size() <= max_size;
+}
+
+// Applies a delta made by create_delta() (or Git) to 'base'. Returns false if
+// the delta is malformed or does not belong to this base.
+bool apply_delta(std::string_view base, std::string_view delta, std::string& out) {
+    std::size_t pos = 0;
+    std::uint64_t base_size = 0, result_size = 0;
+    if (!get_varint(delta, pos, base_size) || !get_varint(delta, pos, result_size) || base_size != base.size()) {
+        return false;
+    }
+    out.clear();
+    out.reserve(result_size);
+    while (pos < delta.size()) {
+        unsigned char cmd = static_cast<unsigned char>(delta[pos++]);
+        if (cmd & 0x80) {
+            std::uint64_t offset = 0, size = 0;
+            for (int k = 0; k < 4; ++k) {
+                if (cmd & (1 << k)) {
+                    if (pos == delta.size()) return false;
+                    offset |= std::uint64_t(static_cast<unsigned char>(delta[pos++])) << (8 * k);
+                }
+            }
+            for (int k = 0; k < 3; ++k) {
+                if (cmd & (0x10 << k)) {
+                    if (pos == delta.size()) return false;
+                    size |= std::uint64_t(static_cast<unsigned char>(delta[pos++])) << (8 * k);
+                }
+            }
+            if (size == 0) size = 0x10000;
+            if (offset + size > base.size() || out.size() + size > result_size) return false;
+            out.append(base.data() + offset, size);
+        } else if (cmd != 0) {
+            if (cmd > delta.size() - pos || out.size() + cmd > result_size) return false;
+            out.append(delta.data() + pos, cmd);
+            pos += cmd;
+        } else {
+            return false;
+        }
+    }
+    return out.size() == result_size;
+}
+
+// Pack files hold many objects in one file, objects/pack/pack-<checksum>.pack:
+//   "MGPK" | version u32 | object count u32 | entries | SHA-1 of all preceding bytes
+// Every entry starts with Git's type-and-size header: the type in bits 4-6 of
+// the first byte, the size in its low 4 bits and 7 more bits per following
+// byte, the high bit meaning "more bytes follow". A REF_DELTA entry continues
+// with the 20-byte id of its base and holds a delta against it; other entries
+// hold the object content. Like loose objects, entries are not compressed.
+// A delta's base may live outside the pack (a "thin" pack, as carried by
+// bundles); it is then looked up in the rest of the object store.
+//
+// The index next to it, pack-<checksum>.idx, maps ids to entry offsets:
+//   "MGIX" | version u32 | count u32 | fanout[256] u32 | sorted ids | offsets u64 | pack checksum
+constexpr int kPackCommit = 1;
+constexpr int kPackTree = 2;
+constexpr int kPackBlob = 3;
+constexpr int kPackRefDelta = 7;
+
+inline int pack_type_code(const std::string& type) {
+    return type == "commit" ? kPackCommit : type == "tree" ? kPackTree : type == "blob" ? kPackBlob : 0;
+}
+
+inline const char* pack_type_name(int code) {
+    return code == kPackCommit ? "commit" : code == kPackTree ? "tree" : code == kPackBlob ? "blob" : "";
+}
+
+// Builds a pack in memory.
+class PackWriter {
+public:
+    PackWriter() {
+        data_ = "MGPK";
+        put_u32(data_, 1);
+        put_u32(data_, 0);
+    }
+
+    void add(const std::string& type, std::string_view content) { add_entry(pack_type_code(type), content, nullptr); }
+
+    void add_delta(const ObjectId& base, std::string_view delta) { add_entry(kPackRefDelta, delta, &base); }
+
+    std::uint32_t count() const { return count_; }
+
+    // Fills in the object count and appends the checksum; returns the pack.
+    std::string finish(ObjectId& checksum) {
+        std::string count;
+        put_u32(count, count_);
+        data_.replace(8, 4, count);
+        checksum = hash_raw(data_);
+        data_.append(reinterpret_cast<const char*>(checksum.bytes.data()), ObjectId::kSha1RawSize);
+        return std::move(data_);
+    }
+
+private:
+    void add_entry(int type, std::string_view content, const ObjectId* base) {
+        std::uint64_t size = content.size();
+        unsigned char byte = static_cast<unsigned char>((type << 4) | (size & 0x0f));
+        size >>= 4;
+        while (size != 0) {
+            data_.push_back(static_cast<char>(byte | 0x80));
+            byte = static_cast<unsigned char>(size & 0x7f);
+            size >>= 7;
+        }
+        data_.push_back(static_cast<char>(byte));
+        if (base != nullptr) {
+            data_.append(reinterpret_cast<const char*>(base->bytes.data()), ObjectId::kSha1RawSize);
+        }
+        data_.append(content.data(), content.size());
+        ++count_;
+    }
+
+    std::string data_;
+    std::uint32_t count_ = 0;
+};
+
+// A pack file and its index, both memory-mapped.
+class PackFile {
+public:
+    // One parsed entry: 'data' is the content, or the delta for a REF_DELTA.
+    struct Entry {
+        int type = 0;
+        ObjectId base;
+        std::string_view data;
+    };
+
+    // Parses the entry at 'offset' of a whole pack; 'next' receives the offset
+    // of the following entry.
+    static bool parse_entry(std::string_view pack, std::uint64_t offset, Entry& out, std::uint64_t& next) {
+        if (offset >= pack.size()) {
+            return false;
+        }
+        std::size_t pos = static_cast<std::size_t>(offset);
+        unsigned char byte = static_cast<unsigned char>(pack[pos++]);
+        out.type = (byte >> 4) & 7;
+        std::uint64_t size = byte & 0x0f;
+        for (unsigned shift = 4; byte & 0x80; shift += 7) {
+            if (pos == pack.size() || shift > 57) return false;
+            byte = static_cast<unsigned char>(pack[pos++]);
+            size |= std::uint64_t(byte & 0x7f) << shift;
+        }
+        if (out.type == kPackRefDelta) {
+            if (pack.size() - pos < kIdSize) return false;
+            std::memcpy(out.base.bytes.data(), pack.data() + pos, kIdSize);
+            pos += kIdSize;
+        } else if (pack_type_name(out.type)[0] == '\0') {
+            return false;
+        }
+        if (size > pack.size() - pos) {
+            return false;
+        }
+        out.data = pack.substr(pos, static_cast<std::size_t>(size));
+        next = pos + size;
+        return true;
+    }
+
+    // Writes the index for 'entries' (id, offset) of the pack with 'checksum'.
+    static bool write_index(const std::string& path, std::vector<std::pair<ObjectId, std::uint64_t>> entries,
+                            const ObjectId& checksum) {
+        std::sort(entries.begin(), entries.end());
+        std::string out = "MGIX";
+        put_u32(out, 1);
+        put_u32(out, static_cast<std::uint32_t>(entries.size()));
+        std::uint32_t fanout[256] = {};
+        for (const auto& entry : entries) ++fanout[entry.first.bytes[0]];
+        for (int i = 1; i < 256; ++i) fanout[i] += fanout[i - 1];
+        for (std::uint32_t count : fanout) put_u32(out, count);
+        for (const auto& entry : entries) {
+            out.append(reinterpret_cast<const char*>(entry.first.bytes.data()), kIdSize);
+        }
+        for (const auto& entry : entries) put_u64(out, entry.second);
+        out.append(reinterpret_cast<const char*>(checksum.bytes.data()), kIdSize);
+        return write_file_atomic(path, out);
+    }
+
+    // Opens "<base>.pack" and "<base>.idx".
+    bool open(const std::string& base) {
+        count_ = 0;
+        base_ = base;
+        if (!pack_.open(base + ".pack") || !index_.open(base + ".idx")) {
+            return false;
+        }
+        std::string_view pack = pack_.data(), index = index_.data();
+        if (pack.size() < 12 + kIdSize || pack.compare(0, 4, "MGPK") != 0 || get_u32(pack.data() + 4) != 1 ||
+            index.size() < kIndexHeader || index.compare(0, 4, "MGIX") != 0 || get_u32(index.data() + 4) != 1) {
+            return false;
+        }
+        std::uint32_t count = get_u32(index.data() + 8);
+        if (index.size() != kIndexHeader + std::size_t(count) * (kIdSize + 8) + kIdSize ||
+            get_u32(pack.data() + 8) != count ||
+            std::memcmp(index.data() + index.size() - kIdSize, pack.data() + pack.size() - kIdSize, kIdSize) != 0) {
+            return false;
+        }
+        count_ = count;
+        return true;
+    }
+
+    std::uint32_t size() const { return count_; }
+    std::string_view pack_data() const { return pack_.data(); }
+    std::string pack_path() const { return base_ + ".pack"; }
+
+    ObjectId oid_at(std::uint32_t i) const {
+        ObjectId oid;
+        std::memcpy(oid.bytes.data(), id_ptr(i), kIdSize);
+        return oid;
+    }
+
+    std::uint64_t offset_at(std::uint32_t i) const {
+        return get_u64(index_.data().data() + kIndexHeader + std::size_t(count_) * kIdSize + std::size_t(i) * 8);
+    }
+
+    // Position of the first id not less than 'oid', narrowed by the fanout table.
+    std::uint32_t lower_bound(const ObjectId& oid) const {
+        const char* fanout = index_.data().data() + 12;
+        std::uint32_t lo = oid.bytes[0] ? get_u32(fanout + 4 * (oid.bytes[0] - 1)) : 0;
+        std::uint32_t hi = get_u32(fanout + 4 * oid.bytes[0]);
+        while (lo < hi) {
+            std::uint32_t mid = lo + (hi - lo) / 2;
+            if (std::memcmp(id_ptr(mid), oid.bytes.data(), kIdSize) < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    bool find(const ObjectId& oid, std::uint64_t& offset) const {
+        std::uint32_t pos = lower_bound(oid);
+        if (pos == count_ || std::memcmp(id_ptr(pos), oid.bytes.data(), kIdSize) != 0) {
+            return false;
+        }
+        offset = offset_at(pos);
+        return true;
+    }
+
+    bool entry(std::uint64_t offset, Entry& out) const {
+        std::uint64_t next;
+        return parse_entry(pack_.data().substr(0, pack_.data().size() - kIdSize), offset, out, next);
+    }
+
+private:
+    static constexpr std::size_t kIdSize = ObjectId::kSha1RawSize;
+    static constexpr std::size_t kIndexHeader = 12 + 256 * 4;
+
+    const char* id_ptr(std::uint32_t i) const { return index_.data().data() + kIndexHeader + std::size_t(i) * kIdSize; }
+
+    std::string base_;
+    MappedFile pack_;
+    MappedFile index_;
+    std::uint32_t count_ = 0;
+};
+
+// Reachability bitmaps. ObjectNumbering hands out dense numbers to objects as
+// walks meet them, and an ObjectBitmap is a set of those numbers. "Reachable
+// from A but not from B" is a walk from A that prunes at every object set in
+// B's bitmap, so shared trees are neither re-read nor re-sent.
+class ObjectNumbering {
+public:
+    // The number of 'oid', assigning the next free one if it has none yet.
+    std::uint32_t number(const ObjectId& oid) {
+        auto inserted = ids_.insert(oid, static_cast<std::uint32_t>(oids_.size()));
+        if (inserted.second) {
+            oids_.push_back(oid);
+        }
+        return *inserted.first;
+    }
+
+    const ObjectId& oid(std::uint32_t number) const { return oids_[number]; }
+    std::size_t size() const { return oids_.size(); }
+
+private:
+    OidMap<std::uint32_t> ids_;
+    std::vector<ObjectId> oids_;
+};
+
+class ObjectBitmap {
+public:
+    void set(std::uint32_t i) {
+        if (i / 64 >= words_.size()) words_.resize(i / 64 + 1, 0);
+        words_[i / 64] |= std::uint64_t(1) << (i % 64);
+    }
+
+    bool test(std::uint32_t i) const {
+        return i / 64 < words_.size() && (words_[i / 64] >> (i % 64)) & 1;
+    }
+
+    std::size_t count() const {
+        std::size_t n = 0;
+        for (std::uint64_t word : words_) n += static_cast<std::size_t>(__builtin_popcountll(word));
+        return n;
+    }
+
+private:
+    std::vector<std::uint64_t> words_;
+};
+
+class MiniGit {
+public:
+    // Constructor initializes the base directory name
+    MiniGit() : minigit_dir_name_(".minigit") {}
+
+    // Implements the 'minigit init [--object-format=sha1] [--compat-object-format=sha256]' command.
+    // Objects are always stored under their SHA-1 ids; a compatibility format
+    // of sha256 makes the repository keep a SHA-256 name for every object as
+    // well (see OidTranslation), so that either id can be used.
+    bool init(const std::vector<std::string>& args) {
+        std::string format = "sha1", compat;
+        for (const std::string& arg : args) {
+            if (arg.compare(0, 16, "--object-format=") == 0) {
+                format = arg.substr(16);
+            } else if (arg.compare(0, 23, "--compat-object-format=") == 0) {
+                compat = arg.substr(23);
+            } else {
+                std::cerr << "Usage: minigit init [--object-format=sha1] [--compat-object-format=sha256]" << std::endl;
+                return false;
+            }
+        }
+        if (format != "sha1") {
+            std::cerr << "Error: Unsupported object format '" << format
+                      << "' (objects are stored as sha1; use --compat-object-format=sha256 to also name them by "
+                         "SHA-256)"
+                      << std::endl;
+            return false;
+        }
+        if (!compat.empty() && compat != "sha256") {
+            std::cerr << "Error: Unsupported compatibility object format '" << compat << "'" << std::endl;
+            return false;
+        }
+        std::cout << "Initializing MiniGit repository..." << std::endl;
+
+        // Check if .minigit directory already exists
+        if (fs::exists(minigit_dir_name_) && fs::is_directory(minigit_dir_name_)) {
+            std::cout << "Reinitializing existing MiniGit repository in " << fs::current_path() << std::endl;
+            // In a real Git, re-init might reset HEAD or just confirm.
+            // For simplicity, we'll just confirm existence here.
+        } else {
+            // Create the .minigit directory
+            if (!fs::create_directory(minigit_dir_name_)) {
+                std::cerr << "Error: Could not create directory " << minigit_dir_name_ << std::endl;
+                return false;
+            }
+            std::cout << "Created directory: " << minigit_dir_name_ << std::endl;
+        }
+
+        // Create .minigit/objects directory for storing blob contents
+        std::string objects_path = minigit_dir_name_ + "/objects";
+        if (!fs::exists(objects_path)) {
+            if (!fs::create_directory(objects_path)) {
+                std::cerr << "Error: Could not create directory " << objects_path << std::endl;
+                return false;
+            }
+            std::cout << "Created directory: " << objects_path << std::endl;
+        }
+
+        // Create .minigit/refs directory for storing references (branches, tags)
+        std::string refs_path = minigit_dir_name_ + "/refs";
+        if (!fs::exists(refs_path)) {
+            if (!fs::create_directory(refs_path)) {
+                std::cerr << "Error: Could not create directory " << refs_path << std::endl;
+                return false;
+            }
+            std::cout << "Created directory: " << refs_path << std::endl;
+        }
+
+        // Create .minigit/refs/heads directory for storing branch pointers
+        std::string heads_path = refs_path + "/heads";
+        if (!fs::exists(heads_path)) {
+            if (!fs::create_directory(heads_path)) {
+                std::cerr << "Error: Could not create directory " << heads_path << std::endl;
+                return false;
+            }
+            std::cout << "Created directory: " << heads_path << std::endl;
+        }
+
+        // Initialize HEAD file to point to the 'main' branch
+        // In real Git, HEAD initially points to 'ref: refs/heads/master' or 'ref: refs/heads/main'
+        std::string head_path = minigit_dir_name_ + "/HEAD";
+        std::ofstream head_file(head_path);
+        if (head_file.is_open()) {
+            head_file << "ref: refs/heads/main" << std::endl;
+            head_file.close();
+            std::cout << "Initialized HEAD to point to refs/heads/main" << std::endl;
+        } else {
+            std::cerr << "Error: Could not create HEAD file." << std::endl;
+        }
+
+        // Create the initial 'main' branch file (it will be empty until the first commit)
+        std::string main_branch_path = heads_path + "/main";
+        std::ofstream main_branch_file(main_branch_path);
+        if (main_branch_file.is_open()) {
+            main_branch_file.close(); // File is created but empty, will hold commit hash later
+            std::cout << "Created initial 'main' branch reference file." << std::endl;
+        } else {
+            std::cerr << "Error: Could not create main branch file." << std::endl;
+        }
+
+        if (!config_set("extensions.objectformat", format) ||
+            (!compat.empty() && !config_set("extensions.compatobjectformat", compat))) {
+            std::cerr << "Error: Could not write " << minigit_dir_name_ << "/config" << std::endl;
+            return false;
+        }
+
+        std::cout << "MiniGit repository initialized successfully!" << std::endl;
+        return true;
+    }
+
+    // Stores an object of the given type in the .minigit/objects directory.
+    // The file holds "<type> <size>\0<content>", exactly the bytes that are hashed.
+    // Returns the id of the object, or a null id on error.
+    ObjectId write_object(const std::string& type, const std::string& content) {
+        std::string data = type + " " + std::to_string(content.size());
+        data.push_back('\0');
+        data += content;
+        ObjectId oid = hash_raw(data);
+        std::string path = object_path(oid);
+
+        // Objects are content-addressed: if we have the object it already holds these bytes.
+        if (has_object(oid)) {
+            return oid;
+        }
+        if (!write_file_atomic(path, data)) {
+            std::cerr << "Error: Could not save object to " << path << std::endl;
+            return ObjectId{}; // Return null id on error
+        }
+        return oid;
+    }
+
+    // Reads an object, splitting off its header. Loose objects are tried first
+    // (ours, then those of the alternates), then the packs. Returns false if the
+    // object is missing or malformed.
+    bool read_object(const ObjectId& oid, std::string& type, std::string& content) {
+        std::string data;
+        bool loose = read_file(object_path(oid), data);
+        for (std::size_t i = 0; !loose && i < alternates().size(); ++i) {
+            loose = read_file(alternates()[i] + "/" + oid.to_hex(), data);
+        }
+        if (!loose) {
+            // A partial clone fetches what it lacks from its promisor remote.
+            return read_packed_object(oid, type, content) ||
+                   (fetch_promised({oid}) && read_packed_object(oid, type, content));
+        }
+        std::size_t space = data.find(' ');
+        std::size_t nul = data.find('\0');
+        if (space == std::string::npos || nul == std::string::npos || space > nul) {
+            return false;
+        }
+        type = data.substr(0, space);
+        content = data.substr(nul + 1);
+        return true;
+    }
+
+    // Like read_object(), but maps the object file and points 'content' into
+    // 'file' instead of copying it.
+    bool map_object(const ObjectId& oid, MappedFile& file, std::string& type, std::string_view& content,
+                    bool populate = false) const {
+        bool mapped = file.open(object_path(oid), populate);
+        for (std::size_t i = 0; !mapped && i < alternates().size(); ++i) {
+            mapped = file.open(alternates()[i] + "/" + oid.to_hex(), populate);
+        }
+        if (!mapped) {
+            return false;
+        }
+        std::string_view data = file.data();
+        std::size_t space = data.find(' ');
+        std::size_t nul = data.find('\0');
+        if (space == std::string_view::npos || nul == std::string_view::npos || space > nul) {
+            return false;
+        }
+        type = std::string(data.substr(0, space));
+        content = data.substr(nul + 1);
+        return true;
+    }
+
+    bool has_object(const ObjectId& oid) const {
+        if (fs::exists(object_path(oid))) {
+            return true;
+        }
+        for (const std::string& dir : alternates()) {
+            if (fs::exists(dir + "/" + oid.to_hex())) return true;
+        }
+        std::uint64_t offset;
+        for (const auto& pack : packs()) {
+            if (pack->find(oid, offset)) return true;
+        }
+        return false;
+    }
+
+    // The packs under objects/pack of this repository and its alternates,
+    // opened on first use. Returns a snapshot, so it is safe to call from
+    // several threads while store_pack() adds a pack.
+    std::vector<std::shared_ptr<PackFile>> packs() const {
+        std::lock_guard<std::mutex> lock(packs_mutex_);
+        load_object_stores();
+        return packs_;
+    }
+
+    // Object directories of other repositories listed in
+    // objects/info/alternates, whose objects this one may use without copying.
+    const std::vector<std::string>& alternates() const {
+        std::lock_guard<std::mutex> lock(packs_mutex_);
+        load_object_stores();
+        return alternates_;
+    }
+
+    // Points 'content' at an object stored whole (not as a delta) in a pack,
+    // inside the pack's mapping. Returns false otherwise.
+    bool packed_view(const ObjectId& oid, std::string& type, std::string_view& content) const {
+        for (const auto& pack : packs()) {
+            std::uint64_t offset;
+            PackFile::Entry entry;
+            if (pack->find(oid, offset)) {
+                if (!pack->entry(offset, entry) || entry.type == kPackRefDelta) return false;
+                type = pack_type_name(entry.type);
+                content = entry.data;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The remote a partial clone fetches its missing objects from
+    // (extensions.partialclone), or "" in a complete repository.
+    std::string promisor_remote() {
+        std::lock_guard<std::mutex> lock(promisor_mutex_);
+        if (!promisor_loaded_) {
+            promisor_ = config_get("extensions.partialclone");
+            promisor_loaded_ = true;
+        }
+        return promisor_;
+    }
+
+    // Fetches those of 'oids' that are missing from the promisor remote in one
+    // request. Threads that miss objects while a fetch runs queue them for the
+    // next one, so misses from a thread pool are batched as well. Objects the
+    // remote failed to send are not asked for again. True if all of 'oids' are
+    // present afterwards.
+    bool fetch_promised(const std::vector<ObjectId>& oids) {
+        std::string remote = promisor_remote();
+        if (remote.empty()) {
+            return false;
+        }
+        std::unique_lock<std::mutex> lock(promisor_mutex_);
+        promisor_queue_.insert(promisor_queue_.end(), oids.begin(), oids.end());
+        auto settled = [&] {
+            return std::all_of(oids.begin(), oids.end(), [this](const ObjectId& oid) {
+                return promisor_missing_.contains(oid) || has_object(oid);
+            });
+        };
+        while (promisor_busy_ && !settled()) promisor_done_.wait(lock);
+        if (!settled()) {
+            std::vector<ObjectId> batch;
+            OidSet queued;
+            for (const ObjectId& oid : promisor_queue_) {
+                if (queued.insert(oid) && !promisor_missing_.contains(oid) && !has_object(oid)) batch.push_back(oid);
+            }
+            promisor_queue_.clear();
+            promisor_busy_ = true;
+            lock.unlock();
+            fetch_objects(remote, batch);
+            lock.lock();
+            promisor_busy_ = false;
+            for (const ObjectId& oid : batch) {
+                if (!has_object(oid)) promisor_missing_.insert(oid);
+            }
+            promisor_done_.notify_all();
+        }
+        return std::all_of(oids.begin(), oids.end(), [this](const ObjectId& oid) { return has_object(oid); });
+    }
+
+    // Reads an object from the packs, applying its chain of deltas. A base
+    // that is not in the same pack is read through read_object().
+    bool read_packed_object(const ObjectId& oid, std::string& type, std::string& content) {
+        for (const auto& pack : packs()) {
+            std::uint64_t offset;
+            if (!pack->find(oid, offset)) {
+                continue;
+            }
+            std::vector<std::string_view> deltas;
+            PackFile::Entry entry;
+            for (;;) {
+                if (!pack->entry(offset, entry) || deltas.size() > kMaxDeltaChain) {
+                    return false;
+                }
+                if (entry.type != kPackRefDelta) {
+                    type = pack_type_name(entry.type);
+                    content.assign(entry.data.data(), entry.data.size());
+                    break;
+                }
+                deltas.push_back(entry.data);
+                if (!pack->find(entry.base, offset)) {
+                    if (!read_object(entry.base, type, content)) return false;
+                    break;
+                }
+            }
+            std::string result;
+            for (auto it = deltas.rbegin(); it != deltas.rend(); ++it) {
+                if (!apply_delta(content, *it, result)) return false;
+                content.swap(result);
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // Checks a received pack, computes the id of every object in it (hashing
+    // plain entries in parallel, then resolving deltas in waves: each wave
+    // applies, in parallel, the deltas whose base the previous waves produced)
+    // and installs it with its index under objects/pack.
+    bool store_pack(const std::string& pack) {
+        const std::size_t kId = ObjectId::kSha1RawSize;
+        if (pack.size() < 12 + kId || pack.compare(0, 4, "MGPK") != 0 || get_u32(&pack[4]) != 1) {
+            std::cerr << "Error: Not a MiniGit pack" << std::endl;
+            return false;
+        }
+        std::string_view body = std::string_view(pack).substr(0, pack.size() - kId);
+        ObjectId checksum;
+        std::memcpy(checksum.bytes.data(), pack.data() + body.size(), kId);
+        if (hash_raw(std::string(body)) != checksum) {
+            std::cerr << "Error: Pack checksum mismatch" << std::endl;
+            return false;
+        }
+
+        struct Item {
+            std::uint64_t offset;
+            PackFile::Entry entry;
+            ObjectId oid;
+            std::string type;
+            std::string content;  // resolved content of a delta, while still needed as a base
+        };
+        std::uint32_t count = get_u32(&pack[8]);
+        std::vector<Item> items(count);
+        std::uint64_t offset = 12;
+        for (Item& item : items) {
+            item.offset = offset;
+            if (!PackFile::parse_entry(body, offset, item.entry, offset)) {
+                std::cerr << "Error: Corrupt pack entry at offset " << item.offset << std::endl;
+                return false;
+            }
+        }
+        if (offset != body.size()) {
+            std::cerr << "Error: Trailing garbage in pack" << std::endl;
+            return false;
+        }
+
+        ThreadPool pool;
+        const std::size_t kChunk = 64;
+        std::vector<std::future<void>> done;
+        for (std::size_t begin = 0; begin < items.size(); begin += kChunk) {
+            std::size_t end = std::min(items.size(), begin + kChunk);
+            done.push_back(pool.submit([&items, begin, end] {
+                for (std::size_t i = begin; i < end; ++i) {
+                    Item& item = items[i];
+                    if (item.entry.type == kPackRefDelta) continue;
+                    item.type = pack_type_name(item.entry.type);
+                    item.oid = hash_object(item.type, std::string(item.entry.data));
+                }
+            }));
+        }
+        for (auto& d : done) d.get();
+
+        OidMap<std::uint32_t> resolved;
+        std::vector<std::uint32_t> pending, kept;
+        for (std::uint32_t i = 0; i < count; ++i) {
+            if (items[i].entry.type == kPackRefDelta) {
+                pending.push_back(i);
+            } else {
+                resolved.insert(items[i].oid, i);
+            }
+        }
+        while (!pending.empty()) {
+            std::vector<std::uint32_t> wave, rest;
+            for (std::uint32_t i : pending) {
+                const ObjectId& base = items[i].entry.base;
+                (resolved.contains(base) || has_object(base) ? wave : rest).push_back(i);
+            }
+            if (wave.empty()) {
+                std::cerr << "Error: Pack is missing delta base " << items[rest[0]].entry.base << std::endl;
+                return false;
+            }
+            std::vector<std::future<bool>> results;
+            for (std::uint32_t i : wave) {
+                results.push_back(pool.submit([this, &items, &resolved, i] {
+                    Item& item = items[i];
+                    std::string base_type, base_content;
+                    std::string_view base;
+                    if (const std::uint32_t* pos = resolved.find(item.entry.base)) {
+                        const Item& base_item = items[*pos];
+                        base_type = base_item.type;
+                        base = base_item.entry.type == kPackRefDelta ? std::string_view(base_item.content)
+                                                                      : base_item.entry.data;
+                    } else if (read_object(item.entry.base, base_type, base_content)) {
+                        base = base_content;
+                    } else {
+                        return false;
+                    }
+                    if (!apply_delta(base, item.entry.data, item.content)) {
+                        return false;
+                    }
+                    item.type = base_type;
+                    item.oid = hash_object(item.type, item.content);
+                    return true;
+                }));
+            }
+            bool ok = true;
+            for (auto& result : results) ok = result.get() && ok;
+            if (!ok) {
+                std::cerr << "Error: Could not resolve deltas in pack" << std::endl;
+                return false;
+            }
+            // Later waves look bases up by id; resolved contents that no pending
+            // delta uses as its base are dropped.
+            OidSet needed;
+            for (std::uint32_t i : rest) needed.insert(items[i].entry.base);
+            for (std::uint32_t i : wave) {
+                resolved.insert(items[i].oid, i);
+                kept.push_back(i);
+            }
+            kept.erase(std::remove_if(kept.begin(), kept.end(),
+                                      [&](std::uint32_t i) {
+                                          if (needed.contains(items[i].oid)) return false;
+                                          std::string().swap(items[i].content);
+                                          return true;
+                                      }),
+                       kept.end());
+            pending.swap(rest);
+        }
+
+        std::vector<std::pair<ObjectId, std::uint64_t>> entries;
+        entries.reserve(count);
+        for (const Item& item : items) entries.emplace_back(item.oid, item.offset);
+        std::string dir = minigit_dir_name_ + "/objects/pack";
+        std::string base = dir + "/pack-" + checksum.to_hex();
+        std::error_code ec;
+        fs::create_directories(dir, ec);
+        if (!write_file_atomic(base + ".pack", pack) || !PackFile::write_index(base + ".idx", std::move(entries), checksum)) {
+            std::cerr << "Error: Could not write " << base << ".pack" << std::endl;
+            return false;
+        }
+        auto stored = std::make_shared<PackFile>();
+        std::lock_guard<std::mutex> lock(packs_mutex_);
+        if (packs_loaded_) {
+            if (!stored->open(base)) {
+                std::cerr << "Error: Could not open " << base << ".pack" << std::endl;
+                return false;
+            }
+            packs_.push_back(std::move(stored));
+        }
+        return true;
+    }
+
+    // Stores file content as a 'blob' in the .minigit/objects directory.
+    // Returns the id of the blob, or a null id on error.
+    ObjectId save_blob(const std::string& file_content) {
+        return write_object("blob", file_content);
+    }
+
+    // Reads the content of a blob given its id.
+    // Returns the content as a string.
+    std::string read_blob(const ObjectId& oid) {
+        std::string type, content;
+        if (!read_object(oid, type, content) || type != "blob") {
+            std::cerr << "Error: Could not read blob " << oid << std::endl;
+            return ""; // Return empty string on error
+        }
+        return content;
+    }
+
+    ObjectId write_tree(const std::vector<TreeEntry>& entries) {
+        return write_object("tree", serialize_tree(entries));
+    }
+
+    bool read_tree(const ObjectId& oid, std::vector<TreeEntry>& entries) {
+        if (merge_cache_) {
+            std::lock_guard<std::mutex> lock(merge_cache_->mutex);
+            if (const std::vector<TreeEntry>* cached = merge_cache_->trees.find(oid)) {
+                entries = *cached;
+                return true;
+            }
+        }
+        std::string type, content;
+        if (!read_object(oid, type, content) || type != "tree" || !parse_tree(content, entries)) {
+            return false;
+        }
+        if (merge_cache_) {
+            std::lock_guard<std::mutex> lock(merge_cache_->mutex);
+            if (merge_cache_->tree_entries > MergeCache::kMaxTreeEntries) {
+                merge_cache_->trees.clear();
+                merge_cache_->tree_entries = 0;
+            }
+            merge_cache_->tree_entries += entries.size();
+            merge_cache_->trees.insert(oid, entries);
+        }
+        return true;
+    }
+
+    ObjectId write_commit(const Commit& commit) {
+        return write_object("commit", serialize_commit(commit));
+    }
+
+    // Reads a commit. A shallow commit comes without parents.
+    bool read_commit(const ObjectId& oid, Commit& commit) {
+        std::string type, content;
+        if (!read_object(oid, type, content) || type != "commit" || !parse_commit(content, commit)) {
+            return false;
+        }
+        if (!shallow_commits().empty() && shallow_commits().contains(oid)) commit.parents.clear();
+        return true;
+    }
+
+    // The commits of a shallow repository whose parents were not fetched
+    // (.minigit/shallow, one id per line), loaded on first use. History walks
+    // see them as root commits.
+    const OidSet& shallow_commits() {
+        if (!shallow_loaded_.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(shallow_mutex_);
+            if (!shallow_loaded_.load(std::memory_order_relaxed)) {
+                shallow_.clear();
+                for (const ObjectId& oid : read_shallow_file()) shallow_.insert(oid);
+                shallow_loaded_.store(true, std::memory_order_release);
+            }
+        }
+        return shallow_;
+    }
+
+    // The ids listed in .minigit/shallow, in file order.
+    std::vector<ObjectId> read_shallow_file() {
+        std::vector<ObjectId> out;
+        std::ifstream file(minigit_dir_name_ + "/shallow");
+        std::string line;
+        ObjectId oid;
+        while (std::getline(file, line)) {
+            if (ObjectId::from_hex(trim(line), oid)) out.push_back(oid);
+        }
+        return out;
+    }
+
+    // Moves the shallow boundary: 'added' commits become shallow, 'removed'
+    // ones were deepened (the file goes away once empty). A commit-graph that
+    // recorded a deepened commit as a root is dropped; 'commit-graph write'
+    // rebuilds it.
+    bool update_shallow(const std::vector<ObjectId>& added, const std::vector<ObjectId>& removed) {
+        std::vector<std::string> lines;
+        for (const ObjectId& oid : added) lines.push_back(oid.to_hex());
+        for (const ObjectId& oid : read_shallow_file()) {
+            if (std::find(removed.begin(), removed.end(), oid) == removed.end()) lines.push_back(oid.to_hex());
+        }
+        std::sort(lines.begin(), lines.end());
+        lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+        std::string out;
+        for (const std::string& l : lines) out += l + "\n";
+        std::string path = minigit_dir_name_ + "/shallow";
+        std::error_code ec;
+        if (out.empty()) {
+            fs::remove(path, ec);
+        } else if (!write_file_atomic(path, out)) {
+            ec = std::make_error_code(std::errc::io_error);
+        }
+        if (ec) {
+            std::cerr << "Error: Could not write " << path << std::endl;
+            return false;
+        }
+        const CommitGraph& graph = commit_graph();
+        std::uint32_t pos;
+        for (const ObjectId& deepened : removed) {
+            if (graph.find(deepened, pos)) {
+                fs::remove(minigit_dir_name_ + "/commit-graph", ec);
+                commit_graph_loaded_ = false;
+                break;
+            }
+        }
+        shallow_loaded_.store(false, std::memory_order_release);
+        return true;
+    }
+
+    // Loads .minigit/index. A missing index is an empty one. A split index
+    // (see write_index()) is merged with its shared base here.
+    bool read_index(std::vector<IndexEntry>& entries) {
+        entries.clear();
+        untracked_cache_.clear();
+        split_base_.clear();
+        split_base_id_.clear();
+        std::string content;
+        if (!read_file(minigit_dir_name_ + "/index", content)) {
+            return true;
+        }
+        std::string_view data = content;
+        if (data.compare(0, 16, "MINIGIT-INDEX 1\n") != 0) {
+            std::cerr << "Error: Unrecognized index format" << std::endl;
+            return false;
+        }
+        // "<mode> <id> <mtime_ns> <size>[ <stage>]\t<path>" lines, sorted by
+        // path and stage (only unmerged paths have a stage), possibly preceded by
+        // an OFFSETS table (see parse_index_entries()), then optional extensions:
+        //   UNTRACKED <directory count>
+        //   <mtime_ns> <tracked hash, hex> <subdir count> <untracked count>\t<directory>
+        //   \t<subdir name>...  \t<untracked file name>...
+        // A split index starts with "LINK <shared index id>"; its entries then
+        // replace or add to those of the base, and "-\t<path>" removes one.
+        std::size_t pos = 16;
+        bool linked = data.compare(pos, 5, "LINK ") == 0;
+        if (linked) {
+            std::size_t eol = data.find('\n', pos);
+            if (eol == std::string_view::npos) {
+                std::cerr << "Error: Corrupt index" << std::endl;
+                return false;
+            }
+            split_base_id_ = std::string(data.substr(pos + 5, eol - pos - 5));
+            pos = eol + 1;
+            if (!read_shared_index(split_base_id_, split_base_)) {
+                return false;
+            }
+        }
+        if (!parse_index_entries(data, pos, entries, linked)) {
+            return false;
+        }
+        if (data.compare(pos, 10, "UNTRACKED ") == 0) {
+            std::istringstream rest(std::string(data.substr(pos)));
+            std::string line;
+            std::getline(rest, line);
+            if (!read_untracked_cache(rest, std::strtoull(line.c_str() + 10, nullptr, 10))) {
+                std::cerr << "warning: ignoring corrupt untracked cache" << std::endl;
+                untracked_cache_.clear();
+            }
+        } else if (pos < data.size()) {
+            std::cerr << "Error: Corrupt index entry: " << data.substr(pos, data.find('\n', pos) - pos) << std::endl;
+            return false;
+        }
+        if (linked) {
+            std::vector<IndexEntry> delta = std::move(entries);
+            entries.clear();
+            entries.reserve(split_base_.size() + delta.size());
+            std::size_t i = 0, j = 0;
+            while (i < split_base_.size() || j < delta.size()) {
+                if (j == delta.size() || (i < split_base_.size() && split_base_[i].path < delta[j].path)) {
+                    entries.push_back(split_base_[i++]);
+                } else {
+                    if (i < split_base_.size() && split_base_[i].path == delta[j].path) ++i;
+                    if (delta[j].mode != 0) entries.push_back(std::move(delta[j]));
+                    ++j;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Index entries are decoded in blocks of this many, one block per task,
+    // when the index carries an OFFSETS table.
+    static constexpr std::size_t kIndexBlockEntries = 4096;
+
+    // Parses the index entry lines starting at 'pos' and leaves 'pos' at the
+    // first line that is not one. The lines may be preceded by
+    //   OFFSETS <entry count> <offset of entry 0> <offset of entry N> ...
+    // (all fixed-width hex, N = kIndexBlockEntries), which lets the blocks be
+    // decoded in parallel instead of one line after another. With
+    // 'removals', "-\t<path>" lines are accepted and returned with mode 0.
+    static bool parse_index_entries(std::string_view data, std::size_t& pos, std::vector<IndexEntry>& entries,
+                                    bool removals = false) {
+        auto parse_line = [&](std::size_t& at, IndexEntry& entry) {
+            std::size_t eol = data.find('\n', at);
+            std::string_view line = data.substr(at, eol == std::string_view::npos ? eol : eol - at);
+            at = eol == std::string_view::npos ? data.size() : eol + 1;
+            if (removals && line.compare(0, 2, "-\t") == 0) {
+                entry.path = std::string(line.substr(2));
+                entry.mode = 0;
+                return true;
+            }
+            return parse_index_entry(line, entry);
+        };
+        if (data.compare(pos, 8, "OFFSETS ") != 0) {
+            while (pos < data.size() && (std::isdigit(static_cast<unsigned char>(data[pos])) ||
+                                         (removals && data[pos] == '-'))) {
+                entries.emplace_back();
+                if (!parse_line(pos, entries.back())) return false;
+            }
+            return true;
+        }
+        auto hex_field = [&](std::size_t at, std::uint64_t& value) {
+            return at + 16 <= data.size() &&
+                   std::from_chars(data.data() + at, data.data() + at + 16, value, 16).ptr == data.data() + at + 16;
+        };
+        // The shortest entry line, "0 <40 hex> 0 0\t\n", bounds the count by
+        // the bytes left, before anything is allocated for it.
+        constexpr std::size_t kMinEntryLine = 48;
+        std::uint64_t count = 0;
+        if (!hex_field(pos + 8, count) || count > (data.size() - pos) / kMinEntryLine) {
+            std::cerr << "Error: Corrupt index offset table" << std::endl;
+            return false;
+        }
+        std::size_t blocks = (count + kIndexBlockEntries - 1) / kIndexBlockEntries;
+        std::vector<std::size_t> offsets(blocks);
+        std::size_t table_end = pos + 24 + 17 * blocks;
+        for (std::size_t k = 0; k < blocks; ++k) {
+            std::uint64_t offset = 0;
+            if (data.compare(pos + 24 + 17 * k, 1, " ") != 0 || !hex_field(pos + 25 + 17 * k, offset) ||
+                offset <= table_end || offset >= data.size() || (k == 0 && offset != table_end + 1) ||
+                (k > 0 && offset <= offsets[k - 1])) {
+                std::cerr << "Error: Corrupt index offset table" << std::endl;
+                return false;
+            }
+            offsets[k] = offset;
+        }
+        if (data.compare(table_end, 1, "\n") != 0) {
+            std::cerr << "Error: Corrupt index offset table" << std::endl;
+            return false;
+        }
+        std::size_t first = entries.size();
+        entries.resize(first + count);
+        // Each block returns where it stopped, or npos on a parse error; a
+        // block must end exactly where the next one starts.
+        auto decode = [&](std::size_t k) {
+            std::size_t at = offsets[k];
+            std::size_t end = std::min<std::size_t>(count, (k + 1) * kIndexBlockEntries);
+            for (std::size_t i = k * kIndexBlockEntries; i < end; ++i) {
+                if (at >= data.size() || !parse_line(at, entries[first + i])) return std::string_view::npos;
+            }
+            return at;
+        };
+        std::vector<std::size_t> ends(blocks);
+        if (blocks > 1) {
+            ThreadPool pool;
+            std::vector<std::future<std::size_t>> results;
+            for (std::size_t k = 0; k < blocks; ++k) results.push_back(pool.submit([&decode, k] { return decode(k); }));
+            for (std::size_t k = 0; k < blocks; ++k) ends[k] = results[k].get();
+        } else if (blocks == 1) {
+            ends[0] = decode(0);
+        }
+        for (std::size_t k = 0; k < blocks; ++k) {
+            if (ends[k] == std::string_view::npos || (k + 1 < blocks && ends[k] != offsets[k + 1])) {
+                std::cerr << "Error: Corrupt index offset table" << std::endl;
+                return false;
+            }
+        }
+        pos = blocks > 0 ? ends.back() : table_end + 1;
+        return true;
+    }
+
+    // Parses one "<mode> <id> <mtime_ns> <size>\t<path>" index line.
+    static bool parse_index_entry(std::string_view line, IndexEntry& entry) {
+        const char* p = line.data();
+        const char* end = p + line.size();
+        std::size_t tab = line.find('\t');
+        auto field = [&](auto& value, int base, char sep) {
+            auto result = std::from_chars(p, end, value, base);
+            if (result.ec != std::errc() || result.ptr == end || *result.ptr != sep) return false;
+            p = result.ptr + 1;
+            return true;
+        };
+        if (tab != std::string_view::npos && field(entry.mode, 8, ' ') &&
+            p + 41 <= end && p[40] == ' ' && ObjectId::from_hex(std::string_view(p, 40), entry.oid) &&
+            (p += 41, field(entry.mtime_ns, 10, ' ')) &&
+            (field(entry.size, 10, '\t') || (field(entry.size, 10, ' ') && field(entry.stage, 10, '\t') &&
+                                             entry.stage >= 1 && entry.stage <= 3)) &&
+            p == line.data() + tab + 1) {
+            entry.path = std::string(line.substr(tab + 1));
+            return true;
+        }
+        std::cerr << "Error: Corrupt index entry: " << line << std::endl;
+        return false;
+    }
+
+    // Appends 'entries' in the index format, preceded by an OFFSETS table
+    // when there is more than one block of them.
+    static void format_index_entries(const std::vector<IndexEntry>& entries, std::string& out) {
+        std::size_t blocks = (entries.size() + kIndexBlockEntries - 1) / kIndexBlockEntries;
+        std::size_t table_at = out.size();
+        if (blocks > 1) {
+            out.append(24 + 17 * blocks + 1, ' ');
+        }
+        char field[17];
+        auto put = [&](std::size_t at, std::uint64_t value) {
+            std::snprintf(field, sizeof(field), "%016llx", static_cast<unsigned long long>(value));
+            out.replace(at, 16, field);
+        };
+        for (std::size_t i = 0; i < entries.size(); ++i) {
+            if (blocks > 1 && i % kIndexBlockEntries == 0) {
+                put(table_at + 25 + 17 * (i / kIndexBlockEntries), out.size());
+            }
+            format_index_entry(entries[i], out);
+        }
+        if (blocks > 1) {
+            out.replace(table_at, 8, "OFFSETS ");
+            put(table_at + 8, entries.size());
+            out[table_at + 24 + 17 * blocks] = '\n';
+        }
+    }
+
+    static void format_index_entry(const IndexEntry& entry, std::string& out) {
+        char mode[16];
+        std::snprintf(mode, sizeof(mode), "%06o", entry.mode);
+        out += mode;
+        out += ' ' + entry.oid.to_hex() + ' ' + std::to_string(entry.mtime_ns) + ' ' + std::to_string(entry.size);
+        if (entry.stage != 0) out += ' ' + std::to_string(entry.stage);
+        out += '\t' + entry.path + '\n';
+    }
+
+    // Loads .minigit/sharedindex.<id>, the base of a split index.
+    bool read_shared_index(const std::string& id, std::vector<IndexEntry>& entries) {
+        std::string content;
+        std::size_t pos = 16;
+        if (!read_file(minigit_dir_name_ + "/sharedindex." + id, content) ||
+            content.compare(0, 16, "MINIGIT-INDEX 1\n") != 0) {
+            std::cerr << "Error: Missing or corrupt shared index " << id << std::endl;
+            return false;
+        }
+        if (!parse_index_entries(content, pos, entries)) {
+            return false;
+        }
+        if (pos < content.size()) {
+            std::cerr << "Error: Corrupt shared index " << id << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Writes .minigit/index; 'entries' must be sorted by path.
+    // With core.splitIndex set, the bulk of the entries lives in a shared
+    // base (.minigit/sharedindex.<id>) that is left alone, and the index
+    // itself only lists the entries that differ from it, so updating a few
+    // files in a huge index writes a few lines. Once more than
+    // splitIndex.maxPercentChange percent (default 20) of the entries differ
+    // from the base, a new base is written and the old one is removed.
+    bool write_index(const std::vector<IndexEntry>& entries) {
+        std::string out = "MINIGIT-INDEX 1\n";
+        std::string old_base = split_base_id_;
+        // The split delta is keyed by path, so an index with unmerged paths
+        // (several entries for one path) is written whole.
+        bool unmerged = std::any_of(entries.begin(), entries.end(), [](const IndexEntry& e) { return e.stage != 0; });
+        if (!unmerged && config_get("core.splitIndex") == "true") {
+            std::string delta;
+            std::size_t changed = 0;
+            if (!split_base_id_.empty()) {
+                auto same = [](const IndexEntry& a, const IndexEntry& b) {
+                    return a.oid == b.oid && a.mode == b.mode && a.mtime_ns == b.mtime_ns && a.size == b.size;
+                };
+                std::size_t i = 0, j = 0;
+                while (i < split_base_.size() || j < entries.size()) {
+                    if (j == entries.size() || (i < split_base_.size() && split_base_[i].path < entries[j].path)) {
+                        delta += "-\t" + split_base_[i++].path + '\n';
+                        ++changed;
+                    } else if (i == split_base_.size() || entries[j].path < split_base_[i].path) {
+                        format_index_entry(entries[j++], delta);
+                        ++changed;
+                    } else {
+                        if (!same(split_base_[i], entries[j])) {
+                            format_index_entry(entries[j], delta);
+                            ++changed;
+                        }
+                        ++i, ++j;
+                    }
+                }
+            }
+            long max_percent = std::strtol(config_get("splitIndex.maxPercentChange", "20").c_str(), nullptr, 10);
+            if (split_base_id_.empty() || changed * 100 > std::size_t(std::max(0L, max_percent)) * split_base_.size()) {
+                std::string base = "MINIGIT-INDEX 1\n";
+                format_index_entries(entries, base);
+                std::string id = hash_raw(base).to_hex();
+                if (!write_file_atomic(minigit_dir_name_ + "/sharedindex." + id, base)) {
+                    std::cerr << "Error: Could not write shared index" << std::endl;
+                    return false;
+                }
+                split_base_ = entries;
+                split_base_id_ = id;
+                delta.clear();
+            }
+            out += "LINK " + split_base_id_ + '\n' + delta;
+        } else {
+            format_index_entries(entries, out);
+            split_base_.clear();
+            split_base_id_.clear();
+        }
+        // The untracked cache stays valid across index changes: a directory
+        // whose tracked files changed no longer matches its tracked hash.
+        if (!untracked_cache_.empty()) {
+            std::vector<const std::pair<const std::string, UntrackedDir>*> dirs;
+            for (const auto& dir : untracked_cache_) dirs.push_back(&dir);
+            std::sort(dirs.begin(), dirs.end(), [](const auto* a, const auto* b) { return a->first < b->first; });
+            out += "UNTRACKED " + std::to_string(dirs.size()) + "\n";
+            char hash[17];
+            for (const auto* dir : dirs) {
+                const UntrackedDir& d = dir->second;
+                std::snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(d.tracked_hash));
+                out += std::to_string(d.mtime_ns) + ' ' + hash + ' ' + std::to_string(d.subdirs.size()) + ' ' +
+                       std::to_string(d.untracked.size()) + '\t' + dir->first + '\n';
+                for (const std::string& name : d.subdirs) out += '\t' + name + '\n';
+                for (const std::string& name : d.untracked) out += '\t' + name + '\n';
+            }
+        }
+        if (!write_file_atomic(minigit_dir_name_ + "/index", out)) {
+            std::cerr << "Error: Could not write index" << std::endl;
+            return false;
+        }
+        // Drop bases that no index links to any more, including those left
+        // behind by an index written without being read first.
+        if (old_base != split_base_id_) {
+            std::error_code ec;
+            for (fs::directory_iterator it(minigit_dir_name_, ec), end; !ec && it != end; it.increment(ec)) {
+                std::string name = it->path().filename().string();
+                if (name.compare(0, 12, "sharedindex.") == 0 && name.substr(12) != split_base_id_) {
+                    std::error_code remove_ec;
+                    fs::remove(it->path(), remove_ec);
+                }
+            }
+        }
+        return true;
+    }
+
+    // Reads the UNTRACKED extension of the index (see read_index()).
+    bool read_untracked_cache(std::istream& in, std::size_t count) {
+        std::string line;
+        for (std::size_t i = 0; i < count; ++i) {
+            std::size_t tab;
+            if (!std::getline(in, line) || (tab = line.find('\t')) == std::string::npos) {
+                return false;
+            }
+            std::string name = line.substr(tab + 1);
+            UntrackedDir dir;
+            std::istringstream fields(line.substr(0, tab));
+            std::string hash;
+            std::size_t subdirs = 0, untracked = 0;
+            fields >> dir.mtime_ns >> hash >> subdirs >> untracked;
+            if (!fields) {
+                return false;
+            }
+            dir.tracked_hash = std::strtoull(hash.c_str(), nullptr, 16);
+            for (std::size_t j = 0; j < subdirs + untracked; ++j) {
+                if (!std::getline(in, line) || line.empty() || line[0] != '\t') {
+                    return false;
+                }
+                (j < subdirs ? dir.subdirs : dir.untracked).push_back(line.substr(1));
+            }
+            untracked_cache_[name] = std::move(dir);
+        }
+        return true;
+    }
+
+    // Reads HEAD. 'symref' receives the branch ref ("refs/heads/main") or is left
+    // empty when HEAD is detached; 'oid' receives the commit HEAD points at, or a
+    // null id on an unborn branch.
+    bool read_head(std::string& symref, ObjectId& oid) {
+        std::string content;
+        if (!read_file(minigit_dir_name_ + "/HEAD", content)) {
+            std::cerr << "Error: Not a MiniGit repository (missing HEAD)" << std::endl;
+            return false;
+        }
+        content = trim(content);
+        symref.clear();
+        if (content.compare(0, 5, "ref: ") == 0) {
+            symref = content.substr(5);
+            oid = resolve_ref(symref);
+            return true;
+        }
+        return ObjectId::from_hex(content, oid);
+    }
+
+    // Returns the commit a ref points to, or a null id if the ref is missing or unborn.
+    ObjectId resolve_ref(const std::string& refname) {
+        std::string content;
+        ObjectId oid;
+        if (!read_file(minigit_dir_name_ + "/" + refname, content) || !ObjectId::from_hex(trim(content), oid)) {
+            return ObjectId{};
+        }
+        return oid;
+    }
+
+    bool update_ref(const std::string& refname, const ObjectId& oid) {
+        std::string path = minigit_dir_name_ + "/" + refname;
+        std::error_code ec;
+        fs::create_directories(fs::path(path).parent_path(), ec);
+        if (!write_file_atomic(path, oid.to_hex() + "\n")) {
+            std::cerr << "Error: Could not update " << refname << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Moves HEAD (or the branch it points to) to 'oid'.
+    bool update_head(const ObjectId& oid) {
+        std::string symref;
+        ObjectId current;
+        if (!read_head(symref, current)) {
+            return false;
+        }
+        if (!symref.empty()) {
+            return update_ref(symref, oid);
+        }
+        return write_file_atomic(minigit_dir_name_ + "/HEAD", oid.to_hex() + "\n");
+    }
+
+    // Resolves a revision: "HEAD", a branch, tag or remote-tracking branch name
+    // ("origin/main"), a full ref name, a full or abbreviated (4+ characters)
+    // object id, optionally followed by any number of "~<n>" or "^" first-parent
+    // steps.
+    bool resolve_revision(const std::string& rev, ObjectId& out) {
+        std::size_t suffix = rev.find_first_of("~^");
+        std::string base = rev.substr(0, suffix);
+        ObjectId oid;
+        if (base == "HEAD") {
+            std::string symref;
+            if (!read_head(symref, oid)) return false;
+        } else if (!(oid = resolve_ref(base)).is_null()) {
+        } else if (!(oid = resolve_ref("refs/heads/" + base)).is_null()) {
+        } else if (!(oid = resolve_ref("refs/tags/" + base)).is_null()) {
+        } else if (!(oid = resolve_ref("refs/remotes/" + base)).is_null()) {
+        } else if (!ObjectId::from_hex(base, oid) && !resolve_abbreviated(base, oid)) {
+            return false;
+        }
+        if (oid.raw_size == ObjectId::kSha256RawSize && !lookup_translation(oid, oid)) {
+            return false;
+        }
+        if (oid.is_null()) {
+            return false;
+        }
+
+        std::size_t pos = suffix;
+        while (pos != std::string::npos && pos < rev.size()) {
+            int steps = 1;
+            std::size_t next = pos + 1;
+            if (rev[pos] == '~' && next < rev.size() && std::isdigit(static_cast<unsigned char>(rev[next]))) {
+                steps = std::atoi(rev.c_str() + next);
+                while (next < rev.size() && std::isdigit(static_cast<unsigned char>(rev[next]))) ++next;
+            } else if (rev[pos] != '~' && rev[pos] != '^') {
+                return false;
+            }
+            for (int i = 0; i < steps; ++i) {
+                Commit commit;
+                if (!read_commit(oid, commit) || commit.parents.empty()) {
+                    return false;
+                }
+                oid = commit.parents[0];
+            }
+            pos = next;
+        }
+        out = oid;
+        return true;
+    }
+
+    // Commit metadata cache, loaded on first use. Empty if no graph was written.
+    const CommitGraph& commit_graph() {
+        if (!commit_graph_loaded_) {
+            commit_graph_.load(minigit_dir_name_ + "/commit-graph");
+            commit_graph_loaded_ = true;
+        }
+        return commit_graph_;
+    }
+
+    // Fills 'info' from the commit-graph when the commit is in it, and from the
+    // commit object otherwise (with an infinite generation number).
+    bool read_commit_info(const ObjectId& oid, CommitInfo& info) {
+        const CommitGraph& graph = commit_graph();
+        std::uint32_t pos;
+        info.parents.clear();
+        if (graph.find(oid, pos)) {
+            info.tree = graph.tree_at(pos);
+            info.commit_time = graph.commit_time(pos);
+            info.generation = graph.generation(pos);
+            for (std::uint32_t i = 0; i < graph.parent_count(pos); ++i) {
+                info.parents.push_back(graph.oid_at(graph.parent(pos, i)));
+            }
+            if (!shallow_commits().empty() && shallow_commits().contains(oid)) info.parents.clear();
+            return true;
+        }
+        if (merge_cache_) {
+            std::lock_guard<std::mutex> lock(merge_cache_->mutex);
+            if (const CommitInfo* cached = merge_cache_->commits.find(oid)) {
+                info = *cached;
+                return true;
+            }
+        }
+        Commit commit;
+        if (!read_commit(oid, commit)) {
+            return false;
+        }
+        info.tree = commit.tree;
+        info.commit_time = commit.commit_time;
+        info.generation = kGenerationInfinity;
+        info.parents = std::move(commit.parents);
+        if (merge_cache_) {
+            std::lock_guard<std::mutex> lock(merge_cache_->mutex);
+            merge_cache_->commits.insert(oid, info);
+        }
+        return true;
+    }
+
+    // Finds the best common ancestors of 'a' and 'b' (see find_merge_bases()),
+    // remembering the answer while a merge cache is installed.
+    bool merge_bases(const ObjectId& a, const ObjectId& b, std::vector<ObjectId>& out) {
+        if (!merge_cache_) {
+            return find_merge_bases(a, b, out);
+        }
+        std::string key = b < a ? MergeCache::key({&b, &a}) : MergeCache::key({&a, &b});
+        auto cached = merge_cache_->bases.find(key);
+        if (cached != merge_cache_->bases.end()) {
+            out = cached->second;
+            return true;
+        }
+        if (!find_merge_bases(a, b, out)) {
+            return false;
+        }
+        merge_cache_->bases.emplace(std::move(key), out);
+        return true;
+    }
+
+    // Both histories are walked together, highest generation (then newest) first, and each commit is
+    // painted with the side(s) it is reachable from. A commit painted from both
+    // sides is a candidate, and everything below it goes stale. The walk stops
+    // once only stale commits are queued. Candidates that are ancestors of
+    // other candidates (criss-cross histories) are then dropped.
+    bool find_merge_bases(const ObjectId& a, const ObjectId& b, std::vector<ObjectId>& out) {
+        out.clear();
+        if (a == b) {
+            out.push_back(a);
+            return true;
+        }
+        enum : unsigned { kSideA = 1, kSideB = 2, kStale = 4, kResult = 8 };
+        struct State {
+            unsigned flags = 0;
+            int queued = 0;
+        };
+        struct Item {
+            ObjectId oid;
+            std::uint32_t generation;
+            std::int64_t time;
+        };
+        auto lower = [](const Item& x, const Item& y) {
+            return x.generation != y.generation ? x.generation < y.generation : x.time < y.time;
+        };
+        std::priority_queue<Item, std::vector<Item>, decltype(lower)> queue(lower);
+        OidMap<State> states;
+        std::size_t nonstale = 0;
+        auto push = [&](const ObjectId& oid, State& state) {
+            CommitInfo info;
+            if (!read_commit_info(oid, info)) {
+                std::cerr << "Error: Could not read commit " << oid << std::endl;
+                return false;
+            }
+            ++state.queued;
+            if (!(state.flags & kStale)) ++nonstale;
+            queue.push({oid, info.generation, info.commit_time});
+            return true;
+        };
+        State* state = states.insert(a, State{kSideA, 0}).first;
+        if (!push(a, *state)) return false;
+        state = states.insert(b, State{kSideB, 0}).first;
+        if (!push(b, *state)) return false;
+
+        std::vector<ObjectId> candidates;
+        while (nonstale > 0) {
+            Item item = queue.top();
+            queue.pop();
+            state = states.find(item.oid);
+            --state->queued;
+            if (!(state->flags & kStale)) --nonstale;
+            unsigned paint = state->flags & (kSideA | kSideB | kStale);
+            if (paint == (kSideA | kSideB)) {
+                if (!(state->flags & kResult)) {
+                    state->flags |= kResult;
+                    candidates.push_back(item.oid);
+                }
+                paint |= kStale;
+            }
+            CommitInfo info;
+            if (!read_commit_info(item.oid, info)) {
+                std::cerr << "Error: Could not read commit " << item.oid << std::endl;
+                return false;
+            }
+            for (const ObjectId& parent : info.parents) {
+                State* parent_state = states.insert(parent, State{}).first;
+                if ((parent_state->flags & paint) == paint) continue;
+                if ((paint & kStale) && !(parent_state->flags & kStale)) nonstale -= parent_state->queued;
+                parent_state->flags |= paint;
+                if (!push(parent, *parent_state)) return false;
+            }
+        }
+
+        for (std::size_t i = 0; i < candidates.size(); ++i) {
+            bool redundant = false;
+            for (std::size_t j = 0; j < candidates.size() && !redundant; ++j) {
+                if (i == j || candidates[j].is_null()) continue;
+                redundant = is_ancestor(candidates[i], candidates[j]);
+            }
+            if (redundant) {
+                candidates[i] = ObjectId{};
+            } else {
+                out.push_back(candidates[i]);
+            }
+        }
+        return true;
+    }
+
+    // Counts, for each of 'tips', the commits it has that 'base' lacks (ahead)
+    // and the commits 'base' has that it lacks (behind), in one walk of their
+    // combined history instead of one walk per tip (see walk_ahead_behind()).
+    bool count_ahead_behind(const ObjectId& base, const std::vector<ObjectId>& tips,
+                            std::vector<std::pair<std::uint64_t, std::uint64_t>>& counts) {
+        counts.assign(tips.size(), {0, 0});
+        return walk_ahead_behind(base, tips, [&](const ObjectId&, const std::uint64_t* mask) {
+            bool in_base = (mask[tips.size() / 64] >> (tips.size() % 64)) & 1;
+            for (std::size_t i = 0; i < tips.size(); ++i) {
+                bool in_tip = (mask[i / 64] >> (i % 64)) & 1;
+                if (in_tip && !in_base) {
+                    ++counts[i].first;
+                } else if (in_base && !in_tip) {
+                    ++counts[i].second;
+                }
+            }
+        });
+    }
+
+    // Walks the combined history of 'tips' and 'base' once and calls
+    // visit(oid, mask) for every commit not reached from all of them. Every
+    // visited commit carries a bitmask with bit i set when tips[i] reaches it
+    // and the last bit set when the base does; masks flow from children to
+    // parents, highest generation (then newest) first, so a commit's mask is
+    // complete when it is popped. The walk stops once every queued commit is reached from all
+    // sides, since nothing below those is ahead or behind. Graph commits find
+    // their mask through their commit-graph position; others through a map.
+    // Dates do not order commits outside the graph reliably, so those are all
+    // walked (a commit reached again after it was popped is queued again)
+    // before the stopping rule applies; the commit-graph keeps that short.
+    template <typename Visit>
+    bool walk_ahead_behind(const ObjectId& base, const std::vector<ObjectId>& tips, Visit visit) {
+        constexpr std::uint32_t kNone = 0xffffffff;
+        const CommitGraph& graph = commit_graph();
+        const std::size_t bits = tips.size() + 1, words = (bits + 63) / 64;
+        std::vector<std::uint64_t> full(words, ~std::uint64_t(0));
+        if (bits % 64) full.back() = (std::uint64_t(1) << (bits % 64)) - 1;
+
+        struct Node {
+            std::uint32_t pos = kNone;  // in the commit-graph, if there
+            // Only commits outside the graph keep their id and parents here.
+            ObjectId oid;
+            std::vector<ObjectId> parents;
+            std::uint32_t generation = kGenerationInfinity;
+            std::int64_t time = 0;
+            int queued = 0;
+        };
+        struct Item {
+            std::uint32_t node;
+            std::uint32_t generation;
+            std::int64_t time;
+        };
+        auto lower = [](const Item& x, const Item& y) {
+            return x.generation != y.generation ? x.generation < y.generation : x.time < y.time;
+        };
+        std::priority_queue<Item, std::vector<Item>, decltype(lower)> queue(lower);
+        std::vector<Node> nodes;
+        std::vector<std::uint64_t> masks;  // 'words' per node
+        std::vector<std::uint32_t> graph_nodes(graph.size(), kNone);
+        OidMap<std::uint32_t> other_nodes;
+        std::size_t partial = 0;  // queued commits not yet reached from every side
+
+        auto is_full = [&](std::uint32_t node) {
+            return std::equal(full.begin(), full.end(), masks.begin() + std::size_t(node) * words);
+        };
+        auto new_node = [&](Node node) {
+            nodes.push_back(std::move(node));
+            masks.resize(masks.size() + words, 0);
+            return static_cast<std::uint32_t>(nodes.size() - 1);
+        };
+        auto graph_node = [&](std::uint32_t pos) {
+            if (graph_nodes[pos] == kNone) {
+                Node node;
+                node.pos = pos;
+                node.generation = graph.generation(pos);
+                node.time = graph.commit_time(pos);
+                graph_nodes[pos] = new_node(std::move(node));
+            }
+            return graph_nodes[pos];
+        };
+        auto node_of = [&](const ObjectId& oid, std::uint32_t& out) {
+            std::uint32_t pos;
+            if (graph.find(oid, pos)) {
+                out = graph_node(pos);
+                return true;
+            }
+            if (const std::uint32_t* known = other_nodes.find(oid)) {
+                out = *known;
+                return true;
+            }
+            CommitInfo info;
+            if (!read_commit_info(oid, info)) {
+                std::cerr << "Error: Could not read commit " << oid << std::endl;
+                return false;
+            }
+            Node node;
+            node.oid = oid;
+            node.parents = std::move(info.parents);
+            node.time = info.commit_time;
+            out = new_node(std::move(node));
+            other_nodes.insert(oid, out);
+            return true;
+        };
+        // ORs 'mask' into the node's mask, queueing the node if that added bits.
+        auto paint = [&](std::uint32_t node, const std::uint64_t* mask) {
+            std::uint64_t* target = &masks[std::size_t(node) * words];
+            bool was_full = is_full(node), changed = false;
+            for (std::size_t w = 0; w < words; ++w) {
+                changed |= (mask[w] & ~target[w]) != 0;
+                target[w] |= mask[w];
+            }
+            if (!changed) return;
+            if (!was_full && is_full(node)) partial -= nodes[node].queued;
+            if (nodes[node].queued == 0) {
+                ++nodes[node].queued;
+                if (!is_full(node)) ++partial;
+                queue.push({node, nodes[node].generation, nodes[node].time});
+            }
+        };
+
+        std::vector<std::uint64_t> mask(words);
+        for (std::size_t i = 0; i < bits; ++i) {
+            std::uint32_t node;
+            if (!node_of(i < tips.size() ? tips[i] : base, node)) {
+                return false;
+            }
+            std::fill(mask.begin(), mask.end(), 0);
+            mask[i / 64] = std::uint64_t(1) << (i % 64);
+            paint(node, mask.data());
+        }
+        std::vector<std::uint32_t> parents;
+        while (!queue.empty() && (partial > 0 || queue.top().generation == kGenerationInfinity)) {
+            std::uint32_t node = queue.top().node;
+            queue.pop();
+            --nodes[node].queued;
+            if (!is_full(node)) --partial;
+            std::copy(masks.begin() + std::size_t(node) * words, masks.begin() + std::size_t(node + 1) * words,
+                      mask.begin());
+            parents.clear();
+            if (nodes[node].pos != kNone) {
+                std::uint32_t pos = nodes[node].pos;
+                if (shallow_commits().empty() || !shallow_commits().contains(graph.oid_at(pos))) {
+                    for (std::uint32_t i = 0; i < graph.parent_count(pos); ++i) {
+                        parents.push_back(graph_node(graph.parent(pos, i)));
+                    }
+                }
+            } else {
+                std::vector<ObjectId> parent_oids = nodes[node].parents;  // node_of() may move 'nodes'
+                for (const ObjectId& oid : parent_oids) {
+                    std::uint32_t parent;
+                    if (!node_of(oid, parent)) return false;
+                    parents.push_back(parent);
+                }
+            }
+            for (std::uint32_t parent : parents) paint(parent, mask.data());
+        }
+
+        for (std::uint32_t node = 0; node < nodes.size(); ++node) {
+            if (is_full(node)) continue;
+            visit(nodes[node].pos != kNone ? graph.oid_at(nodes[node].pos) : nodes[node].oid,
+                  &masks[std::size_t(node) * words]);
+        }
+        return true;
+    }
+
+    // Whether 'ancestor' is reachable from 'descendant' (or is it). Commits in
+    // the commit-graph whose generation is not above the ancestor's cannot reach
+    // it and are not walked; neither is any graph commit when the ancestor is
+    // not in the graph.
+    bool is_ancestor(const ObjectId& ancestor, const ObjectId& descendant) {
+        if (ancestor == descendant) {
+            return true;
+        }
+        CommitInfo target;
+        if (!read_commit_info(ancestor, target)) {
+            return false;
+        }
+        OidSet seen;
+        std::vector<ObjectId> stack{descendant};
+        seen.insert(descendant);
+        while (!stack.empty()) {
+            ObjectId oid = stack.back();
+            stack.pop_back();
+            CommitInfo info;
+            if (!read_commit_info(oid, info)) {
+                return false;
+            }
+            for (const ObjectId& parent : info.parents) {
+                if (parent == ancestor) {
+                    return true;
+                }
+                if (!seen.insert(parent)) continue;
+                std::uint32_t position;
+                if (commit_graph().find(parent, position)) {
+                    std::uint32_t generation = commit_graph().generation(position);
+                    if (target.generation == kGenerationInfinity || generation <= target.generation) continue;
+                }
+                stack.push_back(parent);
+            }
+        }
+        return false;
+    }
+
+    // Implements the 'minigit add <path>...' command.
+    // Stores each file as a blob and records it in the index. Directories are added
+    // recursively; paths that no longer exist are removed from the index.
+    bool add(const std::vector<std::string>& paths) {
+        if (paths.empty()) {
+            std::cerr << "Usage: minigit add <path>..." << std::endl;
+            return false;
+        }
+        std::vector<IndexEntry> index;
+        if (!read_index(index)) {
+            return false;
+        }
+
+        // Index entries under a 'scope' that are not re-added below are dropped, so
+        // deleted files disappear from the index when their path or directory is added.
+        std::vector<std::string> files, scopes;
+        for (const std::string& arg : paths) {
+            std::string path = normalize_path(arg);
+            std::string fs_path = path.empty() ? "." : path;
+            scopes.push_back(path);
+            if (!fs::exists(fs_path)) {
+                continue;
+            }
+            if (fs::is_directory(fs_path)) {
+                collect_files(path, files);
+            } else {
+                files.push_back(path);
+            }
+        }
+        std::vector<IndexEntry> updates;
+        if (!stage_files(files, index, updates)) {
+            return false;
+        }
+        return write_index(
+            merge_index_updates(index, updates, [&scopes](const std::string& path) { return in_scope(path, scopes); }));
+    }
+
+    // Merges 'updates' into the sorted index in one pass. Index entries that
+    // are not updated are dropped when 'drop' returns true for their path.
+    template <typename Drop>
+    static std::vector<IndexEntry> merge_index_updates(std::vector<IndexEntry>& index, std::vector<IndexEntry>& updates,
+                                                       Drop drop) {
+        std::sort(updates.begin(), updates.end(),
+                  [](const IndexEntry& a, const IndexEntry& b) { return a.path < b.path; });
+        std::vector<IndexEntry> merged;
+        merged.reserve(index.size() + updates.size());
+        std::size_t i = 0, j = 0;
+        while (i < index.size() || j < updates.size()) {
+            if (j == updates.size() || (i < index.size() && index[i].path < updates[j].path)) {
+                if (!drop(index[i].path)) merged.push_back(std::move(index[i]));
+                ++i;
+            } else {
+                while (i < index.size() && index[i].path == updates[j].path) ++i;  // including unmerged stages
+                if (merged.empty() || merged.back().path != updates[j].path) merged.push_back(std::move(updates[j]));
+                ++j;
+            }
+        }
+        return merged;
+    }
+
+    // Implements the 'minigit commit -m "<message>"' command.
+    bool commit(const std::vector<std::string>& args) {
+        std::string message;
+        for (std::size_t i = 0; i < args.size(); ++i) {
+            if (args[i] == "-m" && i + 1 < args.size()) {
+                message = args[++i];
+            }
+        }
+        // Concluding a merge that stopped on conflicts: MERGE_HEAD is the
+        // second parent and MERGE_MSG, without its '#' comment lines, the
+        // default message.
+        std::string merge_head_path = minigit_dir_name_ + "/MERGE_HEAD", merge_msg_path = minigit_dir_name_ + "/MERGE_MSG";
+        std::string merge_head_hex;
+        ObjectId merge_head;
+        if (read_file(merge_head_path, merge_head_hex) && !ObjectId::from_hex(trim(merge_head_hex), merge_head)) {
+            std::cerr << "Error: Corrupt MERGE_HEAD" << std::endl;
+            return false;
+        }
+        std::string merge_msg;
+        if (message.empty() && !merge_head.is_null() && read_file(merge_msg_path, merge_msg)) {
+            for (std::string_view line : split_lines(merge_msg)) {
+                if (line[0] != '#') message += line;
+            }
+            while (message.size() > 1 && message.compare(message.size() - 2, 2, "\n\n") == 0) message.pop_back();
+            if (trim(message).empty()) message.clear();
+        }
+        if (message.empty()) {
+            std::cerr << "Usage: minigit commit -m \"<message>\"" << std::endl;
+            return false;
+        }
+
+        std::vector<IndexEntry> index;
+        if (!read_index(index)) {
+            return false;
+        }
+        if (std::any_of(index.begin(), index.end(), [](const IndexEntry& e) { return e.stage != 0; })) {
+            std::cerr << "error: Committing is not possible because you have unmerged files." << std::endl;
+            return false;
+        }
+        ObjectId tree = write_index_tree(index, 0, index.size(), 0);
+        if (tree.is_null()) {
+            return false;
+        }
+
+        std::string symref;
+        ObjectId parent;
+        if (!read_head(symref, parent)) {
+            return false;
+        }
+        Commit commit;
+        ObjectId parent_tree;
+        if (!parent.is_null()) {
+            Commit parent_commit;
+            if (!read_commit(parent, parent_commit)) {
+                std::cerr << "Error: Could not read HEAD commit " << parent << std::endl;
+                return false;
+            }
+            if (parent_commit.tree == tree && merge_head.is_null()) {
+                std::cout << "nothing to commit, working tree clean" << std::endl;
+                return false;
+            }
+            commit.parents.push_back(parent);
+            parent_tree = parent_commit.tree;
+        }
+        if (!merge_head.is_null()) commit.parents.push_back(merge_head);
+        commit.tree = tree;
+        commit.author = commit.committer = identity();
+        commit.author_time = commit.commit_time = current_time();
+        commit.message = message.back() == '\n' ? message : message + "\n";
+
+        ObjectId oid = write_commit(commit);
+        if (oid.is_null() || !update_head(oid)) {
+            return false;
+        }
+        if (!merge_head.is_null()) {
+            std::error_code ec;
+            fs::remove(merge_head_path, ec);
+            fs::remove(merge_msg_path, ec);
+        }
+        update_trigram_index(parent_tree, tree);
+        if (compat_object_format() && !record_translations({oid})) {
+            std::cerr << "warning: could not record the SHA-256 id of " << oid << std::endl;
+        }
+        std::string branch = symref.compare(0, 11, "refs/heads/") == 0 ? symref.substr(11) : "detached HEAD";
+        std::cout << "[" << branch << " " << oid.to_hex().substr(0, 7) << "] " << first_line(commit.message)
+                  << std::endl;
+        return true;
+    }
+
+    // Checks that neither the index nor the working tree differs from
+    // 'head_tree', since 'action' will overwrite both. A file whose stat data
+    // matches its index entry (and that was not modified in the same tick as
+    // the index was written) is not read.
+    bool require_clean_tree(const ObjectId& head_tree, const std::vector<IndexEntry>& index, const std::string& action) {
+        if (std::any_of(index.begin(), index.end(), [](const IndexEntry& e) { return e.stage != 0; })) {
+            std::cerr << "error: cannot " << action << ": you need to resolve your current index first" << std::endl;
+            return false;
+        }
+        std::vector<IndexEntry> head_entries;
+        if (!head_tree.is_null() && !list_tree_entries(head_tree, "", head_entries)) {
+            return false;
+        }
+        bool staged = head_entries.size() != index.size();
+        for (std::size_t i = 0; !staged && i < index.size(); ++i) {
+            staged = head_entries[i].path != index[i].path || head_entries[i].oid != index[i].oid ||
+                     head_entries[i].mode != index[i].mode;
+        }
+        if (staged) {
+            std::cerr << "error: cannot " << action << ": Your index contains uncommitted changes." << std::endl;
+            return false;
+        }
+        std::int64_t index_mtime_ns = 0;
+        struct stat index_st;
+        if (::stat((minigit_dir_name_ + "/index").c_str(), &index_st) == 0) {
+            index_mtime_ns = std::int64_t(index_st.st_mtim.tv_sec) * 1000000000 + index_st.st_mtim.tv_nsec;
+        }
+        for (const IndexEntry& entry : index) {
+            struct stat st;
+            std::string content;
+            bool clean = ::lstat(entry.path.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+                         ((st.st_mode & S_IXUSR) ? kModeExecutable : kModeFile) == entry.mode;
+            std::int64_t mtime_ns = std::int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+            if (clean && (mtime_ns != entry.mtime_ns || std::uint64_t(st.st_size) != entry.size ||
+                          mtime_ns >= index_mtime_ns)) {
+                clean = read_file(entry.path, content) && hash_object("blob", content) == entry.oid;
+            }
+            if (!clean) {
+                std::cerr << "error: cannot " << action << ": You have unstaged changes." << std::endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Moves a clean index and working tree from 'old_tree' to 'new_tree':
+    // only the files that differ are removed or written (in parallel), and the
+    // index is written once. The paths of 'conflicts' are recorded in the
+    // index as unmerged, one entry per side that has them.
+    bool switch_tree(const ObjectId& old_tree, const ObjectId& new_tree, std::vector<IndexEntry>& index,
+                     const std::vector<MergeConflict>& conflicts = {}) {
+        std::vector<TreeChange> changes;
+        if (!diff_trees(old_tree, new_tree, changes)) {
+            return false;
+        }
+        std::vector<IndexEntry> updates;
+        std::unordered_set<std::string> removed;
+        for (const TreeChange& change : changes) {
+            if (!change.new_oid.is_null()) {
+                IndexEntry entry;
+                entry.path = change.path;
+                entry.oid = change.new_oid;
+                entry.mode = change.new_mode;
+                updates.push_back(std::move(entry));
+                continue;
+            }
+            // Removals go first: a file may be replaced by a directory.
+            std::error_code ec;
+            fs::remove(change.path, ec);
+            for (fs::path dir = fs::path(change.path).parent_path(); !dir.empty(); dir = dir.parent_path()) {
+                if (!fs::remove(dir, ec)) break;  // stops at the first directory that is not empty
+            }
+            removed.insert(change.path);
+        }
+        if (!checkout_entries(updates)) {
+            return false;
+        }
+        std::vector<IndexEntry> merged =
+            merge_index_updates(index, updates, [&removed](const std::string& path) { return removed.count(path) != 0; });
+        if (!conflicts.empty()) {
+            std::unordered_set<std::string> unmerged;
+            for (const MergeConflict& conflict : conflicts) unmerged.insert(conflict.path);
+            merged.erase(std::remove_if(merged.begin(), merged.end(),
+                                        [&unmerged](const IndexEntry& e) { return unmerged.count(e.path) != 0; }),
+                         merged.end());
+            for (const MergeConflict& conflict : conflicts) {
+                const ObjectId* oids[3] = {&conflict.base_oid, &conflict.our_oid, &conflict.their_oid};
+                const unsigned modes[3] = {conflict.base_mode, conflict.our_mode, conflict.their_mode};
+                for (unsigned stage = 1; stage <= 3; ++stage) {
+                    if (oids[stage - 1]->is_null()) continue;
+                    IndexEntry entry;
+                    entry.path = conflict.path;
+                    entry.oid = *oids[stage - 1];
+                    entry.mode = modes[stage - 1];
+                    entry.stage = stage;
+                    merged.push_back(std::move(entry));
+                }
+            }
+            std::stable_sort(merged.begin(), merged.end(),
+                             [](const IndexEntry& a, const IndexEntry& b) { return a.path < b.path; });
+        }
+        return write_index(merged);
+    }
+
+    // Replays 'commits' (oldest first) on top of 'onto' by merging the change
+    // each made against its parent into the current tip, writing new trees and
+    // commits directly to the object store. The index and working tree are not
+    // touched. Commits whose change is already present are dropped. On a
+    // conflict the conflicting commit and paths are reported and false is
+    // returned, with 'tip' at the last commit that applied.
+    bool replay_commits(const ObjectId& onto, const std::vector<ObjectId>& commits, ObjectId& tip) {
+        tip = onto;
+        Commit tip_commit;
+        if (!onto.is_null() && !read_commit(onto, tip_commit)) {
+            std::cerr << "Error: Could not read commit " << onto << std::endl;
+            return false;
+        }
+        for (const ObjectId& oid : commits) {
+            Commit commit, parent;
+            if (!read_commit(oid, commit)) {
+                std::cerr << "Error: Could not read commit " << oid << std::endl;
+                return false;
+            }
+            if (commit.parents.size() > 1) {
+                std::cerr << "Error: commit " << oid << " is a merge; it cannot be replayed" << std::endl;
+                return false;
+            }
+            if (!commit.parents.empty() && !read_commit(commit.parents[0], parent)) {
+                std::cerr << "Error: Could not read commit " << commit.parents[0] << std::endl;
+                return false;
+            }
+            std::string subject = first_line(commit.message);
+            std::string label = oid.to_hex().substr(0, 7) + " (" + subject + ")";
+            ObjectId tree;
+            std::vector<MergeConflict> conflicts;
+            if (!merge_trees(parent.tree, tip_commit.tree, commit.tree, "HEAD", label, tree, conflicts)) {
+                return false;
+            }
+            if (!conflicts.empty()) {
+                for (const MergeConflict& conflict : conflicts) {
+                    std::cerr << "CONFLICT (" << conflict.reason << "): Merge conflict in " << conflict.path
+                              << std::endl;
+                }
+                std::cerr << "error: could not apply " << label << std::endl;
+                return false;
+            }
+            if (tree.is_null()) tree = write_tree({});
+            if (!tip.is_null() && tree == tip_commit.tree) {
+                std::cout << "dropping " << oid.to_hex().substr(0, 7) << " " << subject
+                          << " -- patch contents already upstream" << std::endl;
+                continue;
+            }
+            Commit replayed = commit;
+            replayed.tree = tree;
+            replayed.parents.clear();
+            if (!tip.is_null()) replayed.parents.push_back(tip);
+            replayed.committer = identity();
+            replayed.commit_time = current_time();
+            ObjectId replayed_oid = write_commit(replayed);
+            if (replayed_oid.is_null()) {
+                return false;
+            }
+            tip = replayed_oid;
+            tip_commit = std::move(replayed);
+        }
+        return true;
+    }
+
+    // Moves the current branch (or detached HEAD) from 'head' to 'tip' after a
+    // replay, saving the old position in ORIG_HEAD, and brings the index and
+    // working tree along in one step.
+    bool finish_replay(const ObjectId& head, const ObjectId& tip, std::vector<IndexEntry>& index) {
+        Commit old_commit, new_commit;
+        if ((!head.is_null() && !read_commit(head, old_commit)) || (!tip.is_null() && !read_commit(tip, new_commit))) {
+            return false;
+        }
+        if (!write_file_atomic(minigit_dir_name_ + "/ORIG_HEAD", head.to_hex() + "\n") || !update_head(tip) ||
+            !switch_tree(old_commit.tree, new_commit.tree, index)) {
+            return false;
+        }
+        update_trigram_index(old_commit.tree, new_commit.tree);
+        if (compat_object_format() && !record_translations({tip})) {
+            std::cerr << "warning: could not record the SHA-256 id of " << tip << std::endl;
+        }
+        return true;
+    }
+
+    // Implements the 'minigit cherry-pick <commit>...' command.
+    // Applies the changes the given commits introduced, in order, as new
+    // commits on HEAD. All of them are replayed in memory first; HEAD, the
+    // index and the working tree move only if every one applies.
+    bool cherry_pick(const std::vector<std::string>& args) {
+        if (args.empty()) {
+            std::cerr << "Usage: minigit cherry-pick <commit>..." << std::endl;
+            return false;
+        }
+        std::vector<ObjectId> commits;
+        for (const std::string& arg : args) {
+            ObjectId oid;
+            if (!resolve_revision(arg, oid)) {
+                std::cerr << "Error: Not a valid commit: " << arg << std::endl;
+                return false;
+            }
+            commits.push_back(oid);
+        }
+        std::string symref;
+        ObjectId head, tip;
+        std::vector<IndexEntry> index;
+        Commit head_commit;
+        if (!read_head(symref, head) || !read_index(index) ||
+            (!head.is_null() && !read_commit(head, head_commit)) ||
+            !require_clean_tree(head_commit.tree, index, "cherry-pick") || !replay_commits(head, commits, tip)) {
+            return false;
+        }
+        if (tip == head) {
+            return true;
+        }
+        if (!finish_replay(head, tip, index)) {
+            return false;
+        }
+        std::string branch = symref.compare(0, 11, "refs/heads/") == 0 ? symref.substr(11) : "detached HEAD";
+        std::vector<std::string> lines;
+        Commit commit;
+        for (ObjectId oid = tip; oid != head && read_commit(oid, commit);) {
+            lines.push_back("[" + branch + " " + oid.to_hex().substr(0, 7) + "] " + first_line(commit.message));
+            oid = commit.parents.empty() ? head : commit.parents[0];
+        }
+        for (auto it = lines.rbegin(); it != lines.rend(); ++it) std::cout << *it << std::endl;
+        return true;
+    }
+
+    // Implements the 'minigit rebase [--onto <newbase>] <upstream>' command.
+    // Replays the commits of the current branch that 'upstream' cannot reach
+    // (upstream..HEAD), parents before children, on top of it (or of
+    // 'newbase') in memory, then moves the branch and updates the index and
+    // working tree once. Merge commits themselves are dropped, as in Git, but
+    // the commits of the branches they merged are replayed.
+    bool rebase(const std::vector<std::string>& args) {
+        std::string upstream_rev, onto_rev;
+        for (std::size_t i = 0; i < args.size(); ++i) {
+            if (args[i] == "--onto" && i + 1 < args.size()) {
+                onto_rev = args[++i];
+            } else if (upstream_rev.empty() && args[i][0] != '-') {
+                upstream_rev = args[i];
+            } else {
+                upstream_rev.clear();
+                break;
+            }
+        }
+        if (upstream_rev.empty()) {
+            std::cerr << "Usage: minigit rebase [--onto <newbase>] <upstream>" << std::endl;
+            return false;
+        }
+        ObjectId upstream, onto;
+        if (!resolve_revision(upstream_rev, upstream) || (!onto_rev.empty() && !resolve_revision(onto_rev, onto))) {
+            std::cerr << "Error: Not a valid commit: " << (onto_rev.empty() ? upstream_rev : onto_rev) << std::endl;
+            return false;
+        }
+        if (onto_rev.empty()) onto = upstream;
+        std::string symref;
+        ObjectId head;
+        std::vector<IndexEntry> index;
+        Commit head_commit;
+        if (!read_head(symref, head) || !read_index(index)) {
+            return false;
+        }
+        if (head.is_null()) {
+            std::cerr << "Error: HEAD does not point to a commit" << std::endl;
+            return false;
+        }
+        std::vector<ObjectId> bases;
+        if (!read_commit(head, head_commit) || !require_clean_tree(head_commit.tree, index, "rebase") ||
+            !merge_bases(head, upstream, bases)) {
+            return false;
+        }
+        if (onto_rev.empty() && std::find(bases.begin(), bases.end(), upstream) != bases.end()) {
+            std::cout << "Current branch is up to date." << std::endl;
+            return true;
+        }
+
+        // The commits to replay: upstream..HEAD, found in one walk of both
+        // histories, then ordered by a depth-first walk from HEAD that emits
+        // every commit after its parents (first parents first).
+        OidMap<CommitInfo> range;
+        bool ok = walk_ahead_behind(upstream, {head}, [&](const ObjectId& oid, const std::uint64_t* mask) {
+            if (mask[0] == 1) range.insert(oid, CommitInfo{});
+        });
+        for (auto& entry : range) {
+            if (!read_commit_info(entry.first, entry.second)) {
+                std::cerr << "Error: Could not read commit " << entry.first << std::endl;
+                ok = false;
+            }
+        }
+        if (!ok) {
+            return false;
+        }
+        std::vector<ObjectId> commits;
+        OidSet emitted;
+        std::vector<std::pair<ObjectId, std::size_t>> stack;  // (commit, next parent)
+        if (range.contains(head)) stack.emplace_back(head, 0);
+        while (!stack.empty()) {
+            auto& [oid, next] = stack.back();
+            const CommitInfo& info = *range.find(oid);
+            if (next < info.parents.size()) {
+                const ObjectId& parent = info.parents[next++];
+                if (range.contains(parent) && !emitted.contains(parent)) stack.emplace_back(parent, 0);
+                continue;
+            }
+            if (emitted.insert(oid) && info.parents.size() <= 1) commits.push_back(oid);
+            stack.pop_back();
+        }
+        ObjectId tip;
+        if (!replay_commits(onto, commits, tip)) {
+            std::cerr << "Rebase stopped; " << symref << " was not changed." << std::endl;
+            return false;
+        }
+        if (!finish_replay(head, tip, index)) {
+            return false;
+        }
+        std::cout << "Successfully rebased and updated " << (symref.empty() ? "detached HEAD" : symref) << "."
+                  << std::endl;
+        return true;
+    }
+
+    // Implements the 'minigit ahead-behind <base> [<rev>...]' command.
+    // Prints "<rev> <ahead> <behind>" for each revision (by default every
+    // branch), all counted in one walk by count_ahead_behind().
+    bool ahead_behind(const std::vector<std::string>& args) {
+        if (args.empty() || args[0][0] == '-') {
+            std::cerr << "Usage: minigit ahead-behind <base> [<rev>...]" << std::endl;
+            return false;
+        }
+        ObjectId base;
+        if (!resolve_revision(args[0], base)) {
+            std::cerr << "Error: Not a valid commit: " << args[0] << std::endl;
+            return false;
+        }
+        std::vector<std::string> names(args.begin() + 1, args.end());
+        std::vector<ObjectId> tips;
+        if (names.empty()) {
+            for (const auto& ref : list_refs("refs/heads")) {
+                names.push_back(ref.first.substr(std::strlen("refs/heads/")));
+                tips.push_back(ref.second);
+            }
+        }
+        for (std::size_t i = tips.size(); i < names.size(); ++i) {
+            tips.emplace_back();
+            if (!resolve_revision(names[i], tips.back())) {
+                std::cerr << "Error: Not a valid commit: " << names[i] << std::endl;
+                return false;
+            }
+        }
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> counts;
+        if (!count_ahead_behind(base, tips, counts)) {
+            return false;
+        }
+        for (std::size_t i = 0; i < names.size(); ++i) {
+            std::cout << names[i] << ' ' << counts[i].first << ' ' << counts[i].second << '\n';
+        }
+        return true;
+    }
+
+    // What one 'merge-tree' run learns about the repository, shared by all the
+    // merges it answers: parsed trees and commits, merge bases by commit pair,
+    // and merge results by their three trees and two labels. Everything is
+    // keyed by object ids, so nothing goes stale when refs move. Installed in
+    // merge_cache_ only while merge-tree runs.
+    struct MergeCache {
+        static constexpr std::size_t kMaxTreeEntries = std::size_t(1) << 22;
+        static constexpr std::size_t kMaxMerges = std::size_t(1) << 16;
+        struct Result {
+            ObjectId tree;
+            std::vector<MergeConflict> conflicts;
+        };
+
+        static std::string key(std::initializer_list<const ObjectId*> oids) {
+            std::string key;
+            for (const ObjectId* oid : oids) key.append(reinterpret_cast<const char*>(oid->bytes.data()), oid->raw_size);
+            return key;
+        }
+
+        std::mutex mutex;  // guards 'trees' and 'commits'
+        OidMap<std::vector<TreeEntry>> trees;
+        std::size_t tree_entries = 0;
+        OidMap<CommitInfo> commits;
+        std::unordered_map<std::string, std::vector<ObjectId>> bases;
+        std::unordered_map<std::string, Result> merges;
+    };
+
+    // Implements the 'minigit merge-tree' command (defined below Blame).
+    bool merge_tree(const std::vector<std::string>& args);
+
+    // The tree that a merge compares both sides against: the merge base's,
+    // or, when criss-cross history gives several, a virtual base made by
+    // merging them in turn, conflict markers and all, as Git's "ort" strategy
+    // does. The inner merges use the bases of the first base and each other.
+    bool merge_base_tree(const std::vector<ObjectId>& bases, ObjectId& tree, int depth = 0) {
+        tree = ObjectId{};
+        Commit commit;
+        if (bases.empty()) {
+            return true;
+        }
+        if (!read_commit(bases[0], commit)) {
+            std::cerr << "Error: Could not read commit " << bases[0] << std::endl;
+            return false;
+        }
+        tree = commit.tree;
+        for (std::size_t k = 1; k < bases.size() && depth < 8; ++k) {
+            std::vector<ObjectId> inner;
+            std::vector<MergeConflict> ignored;
+            ObjectId inner_tree;
+            if (!read_commit(bases[k], commit) || !merge_bases(bases[0], bases[k], inner) ||
+                !merge_base_tree(inner, inner_tree, depth + 1) ||
+                !merge_trees(inner_tree, tree, commit.tree, "Temporary merge branch 1", "Temporary merge branch 2",
+                             tree, ignored)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Implements the 'minigit merge [--no-ff] [-m <message>] <commit>' command.
+    // The result tree is computed entirely in memory with merge_trees(); only
+    // then are HEAD, the index and the working tree updated, each once. On
+    // conflicts the working tree gets the merged files with conflict markers,
+    // the index records the conflicting paths as unmerged stages, and
+    // MERGE_HEAD/MERGE_MSG wait for the 'commit' that concludes the merge.
+    bool merge(const std::vector<std::string>& args) {
+        std::string rev, message;
+        bool no_ff = false;
+        for (std::size_t i = 0; i < args.size(); ++i) {
+            if (args[i] == "--no-ff") {
+                no_ff = true;
+            } else if (args[i] == "-m" && i + 1 < args.size()) {
+                message = args[++i];
+            } else if (rev.empty() && args[i][0] != '-') {
+                rev = args[i];
+            } else {
+                rev.clear();
+                break;
+            }
+        }
+        if (rev.empty()) {
+            std::cerr << "Usage: minigit merge [--no-ff] [-m <message>] <commit>" << std::endl;
+            return false;
+        }
+        if (fs::exists(minigit_dir_name_ + "/MERGE_HEAD")) {
+            std::cerr << "error: You have not concluded your merge (MERGE_HEAD exists)." << std::endl;
+            return false;
+        }
+        ObjectId other, head;
+        std::string symref;
+        std::vector<IndexEntry> index;
+        Commit head_commit, other_commit;
+        if (!resolve_revision(rev, other) || !read_commit(other, other_commit)) {
+            std::cerr << "Error: Not a valid commit: " << rev << std::endl;
+            return false;
+        }
+        if (!read_head(symref, head) || !read_index(index) || (!head.is_null() && !read_commit(head, head_commit)) ||
+            !require_clean_tree(head_commit.tree, index, "merge")) {
+            return false;
+        }
+        std::vector<ObjectId> bases;
+        if (!head.is_null() && !merge_bases(head, other, bases)) {
+            return false;
+        }
+        if (std::find(bases.begin(), bases.end(), other) != bases.end()) {
+            std::cout << "Already up to date." << std::endl;
+            return true;
+        }
+        if (head.is_null() || (!no_ff && std::find(bases.begin(), bases.end(), head) != bases.end())) {
+            std::cout << "Updating " << (head.is_null() ? std::string("0000000") : head.to_hex().substr(0, 7))
+                      << ".." << other.to_hex().substr(0, 7) << "\nFast-forward" << std::endl;
+            return finish_replay(head, other, index);
+        }
+
+        ObjectId base_tree, tree;
+        std::vector<MergeConflict> conflicts;
+        if (!merge_base_tree(bases, base_tree) ||
+            !merge_trees(base_tree, head_commit.tree, other_commit.tree, "HEAD", rev, tree, conflicts)) {
+            return false;
+        }
+        if (tree.is_null()) tree = write_tree({});
+        if (message.empty()) {
+            bool branch = !resolve_ref("refs/heads/" + rev).is_null();
+            message = std::string(branch ? "Merge branch '" : "Merge commit '") + rev + "'";
+        }
+        if (message.back() != '\n') message += '\n';
+
+        if (!conflicts.empty()) {
+            std::string merge_msg = message + "\n# Conflicts:\n";
+            for (const MergeConflict& conflict : conflicts) merge_msg += "#\t" + conflict.path + "\n";
+            if (!write_file_atomic(minigit_dir_name_ + "/ORIG_HEAD", head.to_hex() + "\n") ||
+                !write_file_atomic(minigit_dir_name_ + "/MERGE_HEAD", other.to_hex() + "\n") ||
+                !write_file_atomic(minigit_dir_name_ + "/MERGE_MSG", merge_msg) ||
+                !switch_tree(head_commit.tree, tree, index, conflicts)) {
+                return false;
+            }
+            for (const MergeConflict& conflict : conflicts) {
+                std::cout << "CONFLICT (" << conflict.reason << "): Merge conflict in " << conflict.path << std::endl;
+            }
+            std::cout << "Automatic merge failed; fix conflicts and then commit the result." << std::endl;
+            return false;
+        }
+        Commit commit;
+        commit.tree = tree;
+        commit.parents = {head, other};
+        commit.author = commit.committer = identity();
+        commit.author_time = commit.commit_time = current_time();
+        commit.message = message;
+        ObjectId oid = write_commit(commit);
+        if (oid.is_null() || !finish_replay(head, oid, index)) {
+            return false;
+        }
+        std::cout << "Merge made by the 'ort' strategy." << std::endl;
+        return true;
+    }
+
+    // True if the repository keeps SHA-256 names for its objects.
+    bool compat_object_format() { return config_get("extensions.compatobjectformat") == "sha256"; }
+
+    // Translates between SHA-1 and SHA-256 ids using .minigit/oid-map and the
+    // translations recorded since it was written (.minigit/oid-map.loose,
+    // "<sha1> <sha256>" lines).
+    bool lookup_translation(const ObjectId& oid, ObjectId& out) {
+        load_translations();
+        if (oid_translation_.translate(oid, out)) {
+            return true;
+        }
+        auto it = loose_translations_.find(oid);
+        if (it == loose_translations_.end()) {
+            return false;
+        }
+        out = it->second;
+        return true;
+    }
+
+    void load_translations() {
+        if (!translations_loaded_) {
+            translations_loaded_ = true;
+            oid_translation_.load(minigit_dir_name_ + "/oid-map");
+            std::ifstream loose(minigit_dir_name_ + "/oid-map.loose");
+            std::string sha1, sha256;
+            ObjectId a, b;
+            while (loose >> sha1 >> sha256) {
+                if (ObjectId::from_hex(sha1, a) && ObjectId::from_hex(sha256, b)) {
+                    loose_translations_[a] = b;
+                    loose_translations_[b] = a;
+                }
+            }
+        }
+    }
+
+    // The content of an object in the compatibility format: the same bytes
+    // with every object id replaced by its SHA-256 id, which 'ids' supplies.
+    // Ids it cannot supply are appended to 'missing' and no content is made.
+    static bool convert_object(const std::string& type, const std::string& content,
+                               const std::function<bool(const ObjectId&, ObjectId&)>& ids, std::string& out,
+                               std::vector<ObjectId>& missing) {
+        out.clear();
+        if (type == "tree") {
+            std::vector<TreeEntry> entries;
+            if (!parse_tree(content, entries)) return false;
+            for (TreeEntry& entry : entries) {
+                ObjectId compat;
+                if (ids(entry.oid, compat)) {
+                    entry.oid = compat;
+                } else {
+                    missing.push_back(entry.oid);
+                }
+            }
+            out = serialize_tree(entries);
+        } else if (type == "commit") {
+            // Only the "tree" and "parent" header lines name objects.
+            std::size_t pos = 0;
+            while (pos < content.size()) {
+                std::size_t eol = content.find('\n', pos);
+                if (eol == std::string::npos || eol == pos) break;
+                std::string_view line(content.data() + pos, eol - pos);
+                std::size_t space = line.find(' ');
+                ObjectId oid, compat;
+                if ((line.compare(0, 5, "tree ") == 0 || line.compare(0, 7, "parent ") == 0) &&
+                    ObjectId::from_hex(line.substr(space + 1), oid)) {
+                    if (ids(oid, compat)) {
+                        out.append(line.substr(0, space + 1)).append(compat.to_hex()).push_back('\n');
+                    } else {
+                        missing.push_back(oid);
+                    }
+                } else {
+                    out.append(line).push_back('\n');
+                }
+                pos = eol + 1;
+            }
+            out.append(content, std::min(pos, content.size()), std::string::npos);
+        } else {
+            out = content;
+        }
+        return true;
+    }
+
+    // Computes the SHA-256 ids of 'roots' and everything they reference that
+    // has none yet, children before the objects that name them, without
+    // recursion. New pairs are appended to 'added'. Returns false if an
+    // object cannot be read, e.g. beyond a shallow boundary or a blob a
+    // partial clone never fetched.
+    bool translate_objects(const std::vector<ObjectId>& roots, OidMap<ObjectId>& known,
+                           std::vector<std::pair<ObjectId, ObjectId>>& added) {
+        auto ids = [&](const ObjectId& oid, ObjectId& compat) {
+            if (const ObjectId* found = known.find(oid)) {
+                compat = *found;
+                return true;
+            }
+            return lookup_translation(oid, compat);
+        };
+        std::vector<ObjectId> stack(roots.rbegin(), roots.rend());
+        std::string type, content, converted;
+        while (!stack.empty()) {
+            ObjectId oid = stack.back(), compat;
+            if (ids(oid, compat)) {
+                stack.pop_back();
+                continue;
+            }
+            std::vector<ObjectId> missing;
+            if (!read_object(oid, type, content) || !convert_object(type, content, ids, converted, missing)) {
+                std::cerr << "Error: Could not read object " << oid << std::endl;
+                return false;
+            }
+            if (!missing.empty()) {
+                stack.insert(stack.end(), missing.begin(), missing.end());
+                continue;
+            }
+            compat = hash_object_sha256(type, converted);
+            known.insert(oid, compat);
+            added.emplace_back(oid, compat);
+            stack.pop_back();
+        }
+        return true;
+    }
+
+    // Records the SHA-256 ids of 'roots' and their new dependencies in
+    // .minigit/oid-map.loose, folding the loose file into the table once it
+    // holds kMaxLooseTranslations entries.
+    bool record_translations(const std::vector<ObjectId>& roots) {
+        static constexpr std::size_t kMaxLooseTranslations = 4096;
+        OidMap<ObjectId> known;
+        std::vector<std::pair<ObjectId, ObjectId>> added;
+        if (!translate_objects(roots, known, added)) {
+            return false;
+        }
+        std::string lines;
+        for (const auto& [sha1, sha256] : added) {
+            lines += sha1.to_hex() + ' ' + sha256.to_hex() + '\n';
+            loose_translations_[sha1] = sha256;
+            loose_translations_[sha256] = sha1;
+        }
+        std::ofstream loose(minigit_dir_name_ + "/oid-map.loose", std::ios::app | std::ios::binary);
+        if (!(loose << lines)) {
+            return false;
+        }
+        loose.close();
+        return loose_translations_.size() / 2 < kMaxLooseTranslations || write_translation_table({});
+    }
+
+    // Writes .minigit/oid-map from its current entries, the loose ones and
+    // 'added', then removes the loose file.
+    bool write_translation_table(const std::vector<std::pair<ObjectId, ObjectId>>& added) {
+        std::vector<std::pair<ObjectId, ObjectId>> entries = added;
+        load_translations();
+        oid_translation_.entries(entries);
+        for (const auto& [from, to] : loose_translations_) {
+            if (from.raw_size == ObjectId::kSha1RawSize) entries.emplace_back(from, to);
+        }
+        std::sort(entries.begin(), entries.end(),
+                  [](const auto& a, const auto& b) { return a.first < b.first; });
+        entries.erase(std::unique(entries.begin(), entries.end(),
+                                  [](const auto& a, const auto& b) { return a.first == b.first; }),
+                      entries.end());
+        std::string path = minigit_dir_name_ + "/oid-map";
+        if (!OidTranslation::write(path, entries)) {
+            std::cerr << "Error: Could not write " << path << std::endl;
+            return false;
+        }
+        std::error_code ec;
+        fs::remove(path + ".loose", ec);
+        loose_translations_.clear();
+        oid_translation_.load(path);
+        return true;
+    }
+
+    // Implements the 'minigit oid-map write' and 'minigit oid-map lookup <id>...'
+    // commands. 'write' gives every stored object that has none a SHA-256 id;
+    // 'lookup' prints the SHA-256 id of a SHA-1 id and vice versa.
+    bool oid_map(const std::vector<std::string>& args) {
+        if (args.empty() || (args[0] != "write" && args[0] != "lookup") || (args[0] == "write") != (args.size() == 1)) {
+            std::cerr << "Usage: minigit oid-map write | minigit oid-map lookup <id>..." << std::endl;
+            return false;
+        }
+        if (!compat_object_format()) {
+            std::cerr << "Error: No compatibility object format configured (extensions.compatobjectformat)"
+                      << std::endl;
+            return false;
+        }
+        if (args[0] == "lookup") {
+            bool ok = true;
+            for (std::size_t i = 1; i < args.size(); ++i) {
+                ObjectId oid, other;
+                if (!ObjectId::from_hex(args[i], oid) || !lookup_translation(oid, other)) {
+                    std::cerr << "Error: No translation for " << args[i] << std::endl;
+                    ok = false;
+                    continue;
+                }
+                std::cout << other << std::endl;
+            }
+            return ok;
+        }
+
+        std::vector<ObjectId> all;
+        std::error_code ec;
+        for (fs::directory_iterator it(minigit_dir_name_ + "/objects", ec), end; !ec && it != end; it.increment(ec)) {
+            ObjectId oid;
+            if (it->is_regular_file() && ObjectId::from_hex(it->path().filename().string(), oid)) all.push_back(oid);
+        }
+        for (const auto& pack : packs()) {
+            for (std::uint32_t i = 0; i < pack->size(); ++i) all.push_back(pack->oid_at(i));
+        }
+        OidMap<ObjectId> known;
+        std::vector<std::pair<ObjectId, ObjectId>> added;
+        std::size_t failed = 0;
+        for (const ObjectId& oid : all) {
+            if (!translate_objects({oid}, known, added)) ++failed;
+        }
+        if (!write_translation_table(added)) {
+            return false;
+        }
+        std::cout << "Translated " << added.size() << " new objects, " << oid_translation_.size() << " in total."
+                  << std::endl;
+        if (failed > 0) {
+            std::cerr << "warning: " << failed << " objects reference objects that are not available" << std::endl;
+        }
+        return true;
+    }
+
+    // Implements the 'minigit commit-graph write' command.
+    // Collects every commit reachable from the branches and HEAD. Commits already
+    // in the existing graph are copied from it instead of being parsed again.
+    bool commit_graph_write() {
+        std::vector<ObjectId> tips;
+        std::string symref;
+        ObjectId head;
+        if (read_head(symref, head) && !head.is_null()) {
+            tips.push_back(head);
+        }
+        for (const auto& ref : list_refs("refs/heads")) {
+            tips.push_back(ref.second);
+        }
+
+        const CommitGraph& old_graph = commit_graph();
+        std::vector<CommitGraph::Entry> entries;
+        OidSet seen;
+        std::vector<ObjectId> stack;
+        for (const ObjectId& tip : tips) {
+            if (seen.insert(tip)) stack.push_back(tip);
+        }
+        while (!stack.empty()) {
+            CommitGraph::Entry entry;
+            entry.oid = stack.back();
+            stack.pop_back();
+            std::uint32_t pos;
+            if (old_graph.find(entry.oid, pos)) {
+                entry.tree = old_graph.tree_at(pos);
+                entry.commit_time = old_graph.commit_time(pos);
+                entry.bloom = std::string(old_graph.bloom(pos));
+                for (std::uint32_t i = 0; i < old_graph.parent_count(pos); ++i) {
+                    entry.parents.push_back(old_graph.oid_at(old_graph.parent(pos, i)));
+                }
+            } else {
+                Commit commit;
+                if (!read_commit(entry.oid, commit)) {
+                    std::cerr << "Error: Could not read commit " << entry.oid << std::endl;
+                    return false;
+                }
+                entry.tree = commit.tree;
+                entry.commit_time = commit.commit_time;
+                entry.parents = commit.parents;
+            }
+            for (const ObjectId& parent : entry.parents) {
+                if (seen.insert(parent)) stack.push_back(parent);
+            }
+            entries.push_back(std::move(entry));
+        }
+
+        if (!compute_bloom_filters(entries)) {
+            return false;
+        }
+        std::size_t count = entries.size();
+        if (!CommitGraph::write(minigit_dir_name_ + "/commit-graph", std::move(entries))) {
+            return false;
+        }
+        commit_graph_loaded_ = false;
+        std::cout << "Wrote commit-graph with " << count << " commits." << std::endl;
+        return true;
+    }
+
+    // Fills in the changed-path Bloom filter of every entry that lacks one by
+    // diffing its tree against its first parent's tree. Commits are split into
+    // chunks that are diffed on a thread pool.
+    bool compute_bloom_filters(std::vector<CommitGraph::Entry>& entries) {
+        OidMap<ObjectId> trees;
+        trees.reserve(entries.size());
+        for (const CommitGraph::Entry& entry : entries) {
+            trees.insert(entry.oid, entry.tree);
+        }
+        const std::size_t kChunk = 256;
+        ThreadPool pool;
+        std::vector<std::future<bool>> results;
+        for (std::size_t begin = 0; begin < entries.size(); begin += kChunk) {
+            std::size_t end = std::min(entries.size(), begin + kChunk);
+            results.push_back(pool.submit([this, &entries, &trees, begin, end] {
+                for (std::size_t i = begin; i < end; ++i) {
+                    CommitGraph::Entry& entry = entries[i];
+                    if (!entry.bloom.empty()) continue;
+                    ObjectId parent_tree = entry.parents.empty() ? ObjectId{} : *trees.find(entry.parents[0]);
+                    std::vector<TreeChange> changes;
+                    if (!diff_trees(parent_tree, entry.tree, changes)) {
+                        std::cerr << "Error: Could not diff trees of commit " << entry.oid << std::endl;
+                        return false;
+                    }
+                    std::vector<std::string> paths;
+                    for (const TreeChange& change : changes) paths.push_back(change.path);
+                    entry.bloom = BloomFilter::build(paths);
+                }
+                return true;
+            }));
+        }
+        bool ok = true;
+        for (auto& result : results) ok = result.get() && ok;
+        return ok;
+    }
+
+    // Compares two trees (a null id is the empty tree) and appends every file
+    // path that differs, recursing only into subtrees whose ids differ.
+    bool diff_trees(const ObjectId& old_tree, const ObjectId& new_tree, std::vector<TreeChange>& changes,
+                    const std::string& prefix = "") {
+        if (old_tree == new_tree) {
+            return true;
+        }
+        std::vector<TreeEntry> old_entries, new_entries;
+        if ((!old_tree.is_null() && !read_tree(old_tree, old_entries)) ||
+            (!new_tree.is_null() && !read_tree(new_tree, new_entries))) {
+            return false;
+        }
+        std::size_t i = 0, j = 0;
+        while (i < old_entries.size() || j < new_entries.size()) {
+            int cmp = i == old_entries.size()   ? 1
+                      : j == new_entries.size() ? -1
+                                                : old_entries[i].name.compare(new_entries[j].name);
+            const TreeEntry* old_entry = cmp <= 0 ? &old_entries[i] : nullptr;
+            const TreeEntry* new_entry = cmp >= 0 ? &new_entries[j] : nullptr;
+            std::string path = prefix + (old_entry ? old_entry->name : new_entry->name);
+            if (old_entry && new_entry && old_entry->oid == new_entry->oid && old_entry->mode == new_entry->mode) {
+                // unchanged
+            } else if ((old_entry && old_entry->is_tree()) || (new_entry && new_entry->is_tree())) {
+                // A file replaced by a directory (or vice versa) is a deletion plus additions.
+                ObjectId old_sub = old_entry && old_entry->is_tree() ? old_entry->oid : ObjectId{};
+                ObjectId new_sub = new_entry && new_entry->is_tree() ? new_entry->oid : ObjectId{};
+                if (old_entry && !old_entry->is_tree()) changes.push_back({path, old_entry->oid, {}, old_entry->mode, 0});
+                if (new_entry && !new_entry->is_tree()) changes.push_back({path, {}, new_entry->oid, 0, new_entry->mode});
+                if (!diff_trees(old_sub, new_sub, changes, path + "/")) return false;
+            } else {
+                changes.push_back({path, old_entry ? old_entry->oid : ObjectId{}, new_entry ? new_entry->oid : ObjectId{},
+                                   old_entry ? old_entry->mode : 0, new_entry ? new_entry->mode : 0});
+            }
+            if (cmp <= 0) ++i;
+            if (cmp >= 0) ++j;
+        }
+        return true;
+    }
+
+    // Three-way merge of trees (a null id is the empty tree) into new objects
+    // in the object store, without touching the index or working tree, in the
+    // manner of Git's "ort" strategy:
+    //  1. The three trees are walked together. Subtrees that only one side
+    //     changed are taken whole, so the walk is in proportion to the paths
+    //     both sides changed; files changed on both sides are queued.
+    //  2. The queued files are merged with merge_file() on all cores.
+    //  3. The merged trees are written bottom-up.
+    // What cannot be resolved is appended to 'conflicts', sorted by path, and
+    // the result keeps the conflict markers (or, for binary files and
+    // modify/delete conflicts, the surviving or our side). 'out' is null if the
+    // merged tree is empty.
+    bool merge_trees(const ObjectId& base, const ObjectId& ours, const ObjectId& theirs, const std::string& our_label,
+                     const std::string& their_label, ObjectId& out, std::vector<MergeConflict>& conflicts) {
+        std::string key;
+        if (merge_cache_) {
+            key = MergeCache::key({&base, &ours, &theirs});
+            key += our_label + '\0' + their_label;
+            auto cached = merge_cache_->merges.find(key);
+            if (cached != merge_cache_->merges.end()) {
+                out = cached->second.tree;
+                conflicts.insert(conflicts.end(), cached->second.conflicts.begin(), cached->second.conflicts.end());
+                return true;
+            }
+        }
+        MergePlan plan;
+        plan.dirs.emplace_back();
+        std::size_t first_conflict = conflicts.size();
+        if (!plan_tree_merge(base, ours, theirs, "", 0, plan, conflicts)) {
+            return false;
+        }
+
+        // A partial clone fetches the blobs to merge in one request.
+        if (!promisor_remote().empty()) {
+            std::vector<ObjectId> missing;
+            for (const FileMerge& file : plan.files) {
+                for (const ObjectId* oid : {&file.conflict.base_oid, &file.conflict.our_oid, &file.conflict.their_oid}) {
+                    if (!oid->is_null() && !has_object(*oid)) missing.push_back(*oid);
+                }
+            }
+            if (!missing.empty() && !fetch_promised(missing)) {
+                return false;
+            }
+        }
+
+        std::vector<char> clean(plan.files.size(), 1);
+        std::mutex claimed_mutex;
+        OidSet claimed;  // blobs being written, so that equal results are written once
+        // An unreadable side fails the merge rather than being merged as empty.
+        auto read_side = [this](const ObjectId& oid, std::string& content) {
+            std::string type;
+            if (oid.is_null()) {
+                content.clear();
+                return true;
+            }
+            if (!read_object(oid, type, content) || type != "blob") {
+                std::cerr << "Error: Could not read blob " << oid << std::endl;
+                return false;
+            }
+            return true;
+        };
+        auto merge_files = [&](std::size_t begin, std::size_t end) {
+            for (std::size_t i = begin; i < end; ++i) {
+                FileMerge& file = plan.files[i];
+                MergeConflict& conflict = file.conflict;
+                std::string base_content, our_content, their_content;
+                if (!read_side(conflict.base_oid, base_content) || !read_side(conflict.our_oid, our_content) ||
+                    !read_side(conflict.their_oid, their_content)) {
+                    return false;
+                }
+                std::string content;
+                if (is_binary_content(our_content) || is_binary_content(their_content) ||
+                    is_binary_content(base_content)) {
+                    clean[i] = 0;  // binary: keep ours
+                    file.oid = conflict.our_oid;
+                    continue;
+                }
+                clean[i] = merge_file(base_content, our_content, their_content, our_label, their_label, content);
+                file.oid = hash_object("blob", content);
+                bool first;
+                {
+                    std::lock_guard<std::mutex> lock(claimed_mutex);
+                    first = claimed.insert(file.oid);
+                }
+                if (first && write_object("blob", content) != file.oid) return false;
+            }
+            return true;
+        };
+        bool ok = true;
+        const std::size_t kChunk = 8;
+        if (plan.files.size() <= kChunk) {
+            ok = merge_files(0, plan.files.size());
+        } else {
+            ThreadPool pool;
+            std::vector<std::future<bool>> results;
+            for (std::size_t begin = 0; begin < plan.files.size(); begin += kChunk) {
+                std::size_t end = std::min(plan.files.size(), begin + kChunk);
+                results.push_back(pool.submit([&merge_files, begin, end] { return merge_files(begin, end); }));
+            }
+            for (auto& result : results) ok = result.get() && ok;
+        }
+        if (!ok) {
+            return false;
+        }
+        for (std::size_t i = 0; i < plan.files.size(); ++i) {
+            FileMerge& file = plan.files[i];
+            plan.dirs[file.dir].entries[file.entry].oid = file.oid;
+            if (!clean[i]) {
+                file.conflict.reason = file.conflict.base_oid.is_null() ? "add/add" : "content";
+                conflicts.push_back(std::move(file.conflict));
+            } else if (!file.conflict.reason.empty()) {
+                conflicts.push_back(std::move(file.conflict));  // a clean content merge with a mode conflict
+            }
+        }
+        std::sort(conflicts.begin() + first_conflict, conflicts.end(),
+                  [](const MergeConflict& a, const MergeConflict& b) { return a.path < b.path; });
+
+        // Directories are planned parent first, so writing them in reverse
+        // order writes every subtree before the tree that holds it.
+        for (std::size_t d = plan.dirs.size(); d-- > 0;) {
+            MergeDir& dir = plan.dirs[d];
+            for (const auto& subdir : dir.subdirs) dir.entries[subdir.first].oid = plan.dirs[subdir.second].oid;
+            dir.entries.erase(std::remove_if(dir.entries.begin(), dir.entries.end(),
+                                             [](const TreeEntry& entry) { return entry.oid.is_null(); }),
+                              dir.entries.end());
+            if (dir.entries.empty() && d > 0) {
+                continue;
+            }
+            dir.oid = write_tree(dir.entries);
+            if (dir.oid.is_null()) {
+                return false;
+            }
+        }
+        out = plan.dirs[0].entries.empty() ? ObjectId{} : plan.dirs[0].oid;
+        if (merge_cache_) {
+            if (merge_cache_->merges.size() >= MergeCache::kMaxMerges) merge_cache_->merges.clear();
+            merge_cache_->merges.emplace(std::move(key),
+                                         MergeCache::Result{out, {conflicts.begin() + first_conflict, conflicts.end()}});
+        }
+        return true;
+    }
+
+    // The pending result of merge_trees(): one MergeDir per merged directory,
+    // whose entries for merged subdirectories and files are filled in once
+    // those are done.
+    struct MergeDir {
+        std::vector<TreeEntry> entries;
+        std::vector<std::pair<std::size_t, std::size_t>> subdirs;  // (entry, directory) pairs
+        ObjectId oid;
+    };
+    struct FileMerge {
+        std::size_t dir = 0;
+        std::size_t entry = 0;
+        MergeConflict conflict;  // the three sides, and a mode conflict if any
+        ObjectId oid;            // the merged blob
+    };
+    struct MergePlan {
+        std::vector<MergeDir> dirs;
+        std::vector<FileMerge> files;
+    };
+
+    // Step 1 of merge_trees() for the directory 'prefix', planned as plan.dirs[dir].
+    bool plan_tree_merge(const ObjectId& base, const ObjectId& ours, const ObjectId& theirs, const std::string& prefix,
+                         std::size_t dir, MergePlan& plan, std::vector<MergeConflict>& conflicts) {
+        std::vector<TreeEntry> sides[3];
+        const ObjectId* trees[3] = {&base, &ours, &theirs};
+        for (int s = 0; s < 3; ++s) {
+            if (!trees[s]->is_null() && !read_tree(*trees[s], sides[s])) {
+                std::cerr << "Error: Could not read tree " << *trees[s] << std::endl;
+                return false;
+            }
+        }
+        std::size_t pos[3] = {0, 0, 0};
+        while (pos[0] < sides[0].size() || pos[1] < sides[1].size() || pos[2] < sides[2].size()) {
+            const std::string* name = nullptr;
+            for (int s = 0; s < 3; ++s) {
+                if (pos[s] < sides[s].size() && (!name || sides[s][pos[s]].name < *name)) name = &sides[s][pos[s]].name;
+            }
+            const TreeEntry* entry[3] = {nullptr, nullptr, nullptr};
+            for (int s = 0; s < 3; ++s) {
+                if (pos[s] < sides[s].size() && sides[s][pos[s]].name == *name) entry[s] = &sides[s][pos[s]];
+            }
+            auto same = [](const TreeEntry* x, const TreeEntry* y) {
+                return x == y || (x && y && x->oid == y->oid && x->mode == y->mode);
+            };
+            const TreeEntry *b = entry[0], *o = entry[1], *t = entry[2];
+            std::string path = prefix + *name;
+            TreeEntry result;
+            result.name = *name;
+            if (same(o, t) || same(b, t)) {
+                if (o) result = *o;
+            } else if (same(b, o)) {
+                if (t) result = *t;
+            } else if ((!o || o->is_tree()) && (!t || t->is_tree()) && (!b || b->is_tree())) {
+                // Trees on both sides, or a tree changed on one side and deleted on the other.
+                std::size_t subdir = plan.dirs.size();
+                plan.dirs.emplace_back();
+                plan.dirs[dir].subdirs.emplace_back(plan.dirs[dir].entries.size(), subdir);
+                result.mode = kModeTree;
+                result.oid = ObjectId{};
+                plan.dirs[dir].entries.push_back(result);
+                if (!plan_tree_merge(b ? b->oid : ObjectId{}, o ? o->oid : ObjectId{}, t ? t->oid : ObjectId{},
+                                     path + "/", subdir, plan, conflicts)) {
+                    return false;
+                }
+                for (int s = 0; s < 3; ++s) {
+                    if (entry[s]) ++pos[s];
+                }
+                continue;
+            } else {
+                MergeConflict conflict;
+                conflict.path = path;
+                if (b && !b->is_tree()) conflict.base_oid = b->oid, conflict.base_mode = b->mode;
+                if (o && !o->is_tree()) conflict.our_oid = o->oid, conflict.our_mode = o->mode;
+                if (t && !t->is_tree()) conflict.their_oid = t->oid, conflict.their_mode = t->mode;
+                if ((o && o->is_tree()) || (t && t->is_tree()) || (b && b->is_tree())) {
+                    conflict.reason = "file/directory";  // keep our side
+                    if (o) result = *o;
+                } else if (!o || !t) {
+                    conflict.reason = "modify/delete";  // keep the modification
+                    result = o ? *o : *t;
+                } else {
+                    result.mode = o->mode;
+                    if (o->mode != t->mode) {
+                        if (b && b->mode == o->mode) {
+                            result.mode = t->mode;
+                        } else if (!b || b->mode != t->mode) {
+                            conflict.reason = "mode";
+                        }
+                    }
+                    result.oid = o->oid;
+                    if (o->oid != t->oid) {
+                        // Merged in step 2, which also reports a mode conflict.
+                        plan.files.push_back({dir, plan.dirs[dir].entries.size(), conflict, ObjectId{}});
+                        conflict.reason.clear();
+                    }
+                }
+                if (!conflict.reason.empty()) conflicts.push_back(std::move(conflict));
+            }
+            if (!result.oid.is_null()) plan.dirs[dir].entries.push_back(std::move(result));
+            for (int s = 0; s < 3; ++s) {
+                if (entry[s]) ++pos[s];
+            }
+        }
+        return true;
+    }
+
+    // Finds the entry for a '/'-separated path inside a tree. Returns false if
+    // the path does not exist.
+    bool lookup_path(const ObjectId& tree, const std::string& path, TreeEntry& out) {
+        ObjectId current = tree;
+        std::size_t pos = 0;
+        while (!current.is_null()) {
+            std::size_t slash = path.find('/', pos);
+            std::string name = path.substr(pos, slash == std::string::npos ? std::string::npos : slash - pos);
+            std::vector<TreeEntry> entries;
+            if (!read_tree(current, entries)) {
+                return false;
+            }
+            auto it = std::lower_bound(entries.begin(), entries.end(), name,
+                                       [](const TreeEntry& e, const std::string& n) { return e.name < n; });
+            if (it == entries.end() || it->name != name) {
+                return false;
+            }
+            if (slash == std::string::npos) {
+                out = *it;
+                return true;
+            }
+            if (!it->is_tree()) {
+                return false;
+            }
+            current = it->oid;
+            pos = slash + 1;
+        }
+        return false;
+    }
+
+    // Lists the files of a tree recursively as (path, blob id) pairs.
+    bool list_tree_files(const ObjectId& tree, const std::string& prefix,
+                         std::vector<std::pair<std::string, ObjectId>>& files) {
+        std::vector<TreeEntry> entries;
+        if (!read_tree(tree, entries)) {
+            std::cerr << "Error: Could not read tree " << tree << std::endl;
+            return false;
+        }
+        for (const TreeEntry& entry : entries) {
+            if (entry.is_tree()) {
+                if (!list_tree_files(entry.oid, prefix + entry.name + "/", files)) return false;
+            } else {
+                files.emplace_back(prefix + entry.name, entry.oid);
+            }
+        }
+        return true;
+    }
+
+    // Lists the files of a tree recursively as index entries (path, mode and
+    // blob id; no stat data), sorted by path like the index.
+    bool list_tree_entries(const ObjectId& tree, const std::string& prefix, std::vector<IndexEntry>& out) {
+        std::vector<TreeEntry> entries;
+        if (!read_tree(tree, entries)) {
+            std::cerr << "Error: Could not read tree " << tree << std::endl;
+            return false;
+        }
+        for (const TreeEntry& entry : entries) {
+            if (entry.is_tree()) {
+                if (!list_tree_entries(entry.oid, prefix + entry.name + "/", out)) return false;
+            } else {
+                IndexEntry file;
+                file.path = prefix + entry.name;
+                file.mode = entry.mode;
+                file.oid = entry.oid;
+                out.push_back(std::move(file));
+            }
+        }
+        if (prefix.empty()) {
+            std::sort(out.begin(), out.end(), [](const IndexEntry& a, const IndexEntry& b) { return a.path < b.path; });
+        }
+        return true;
+    }
+
+    // Writes the blobs of 'entries' into the working tree and fills in their
+    // stat data. A partial clone first fetches the blobs it lacks in one
+    // request. Directories are created first; the files are then written on a
+    // thread pool in chunks.
+    bool checkout_entries(std::vector<IndexEntry>& entries) {
+        if (!promisor_remote().empty()) {
+            std::vector<ObjectId> missing;
+            for (const IndexEntry& entry : entries) {
+                if (!has_object(entry.oid)) missing.push_back(entry.oid);
+            }
+            if (!missing.empty() && !fetch_promised(missing)) {
+                return false;
+            }
+        }
+        std::vector<std::string> dirs;
+        for (const IndexEntry& entry : entries) {
+            std::size_t slash = entry.path.rfind('/');
+            if (slash != std::string::npos) dirs.push_back(entry.path.substr(0, slash));
+        }
+        std::sort(dirs.begin(), dirs.end());
+        dirs.erase(std::unique(dirs.begin(), dirs.end()), dirs.end());
+        for (const std::string& dir : dirs) {
+            std::error_code ec;
+            fs::create_directories(dir, ec);
+            if (ec) {
+                std::cerr << "Error: Could not create directory " << dir << ": " << ec.message() << std::endl;
+                return false;
+            }
+        }
+
+        const std::size_t kChunk = 32;
+        ThreadPool pool;
+        std::vector<std::future<bool>> results;
+        for (std::size_t begin = 0; begin < entries.size(); begin += kChunk) {
+            std::size_t end = std::min(entries.size(), begin + kChunk);
+            results.push_back(pool.submit([this, &entries, begin, end] {
+                for (std::size_t i = begin; i < end; ++i) {
+                    IndexEntry& entry = entries[i];
+                    std::string type, content;
+                    struct stat st;
+                    if (!read_object(entry.oid, type, content) || type != "blob") {
+                        std::cerr << "Error: Could not read blob " << entry.oid << " (" << entry.path << ")" << std::endl;
+                        return false;
+                    }
+                    if (!write_file_atomic(entry.path, content) ||
+                        ::chmod(entry.path.c_str(), entry.mode == kModeExecutable ? 0755 : 0644) != 0 ||
+                        ::stat(entry.path.c_str(), &st) != 0) {
+                        std::cerr << "Error: Could not write " << entry.path << std::endl;
+                        return false;
+                    }
+                    entry.mtime_ns = std::int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+                    entry.size = static_cast<std::uint64_t>(st.st_size);
+                }
+                return true;
+            }));
+        }
+        bool ok = true;
+        for (auto& result : results) ok = result.get() && ok;
+        return ok;
+    }
+
+    // Reads a setting from .minigit/config, a list of "<key> = <value>" lines.
+    // Returns 'fallback' if the key is not set.
+    std::string config_get(const std::string& key, const std::string& fallback = "") {
+        std::ifstream config(minigit_dir_name_ + "/config");
+        std::string line;
+        while (std::getline(config, line)) {
+            std::size_t eq = line.find('=');
+            if (eq != std::string::npos && trim(line.substr(0, eq)) == key) {
+                return trim(line.substr(eq + 1));
+            }
+        }
+        return fallback;
+    }
+
+    // Sets (or with an empty value, removes) a setting in .minigit/config.
+    bool config_set(const std::string& key, const std::string& value) {
+        std::string content, out;
+        read_file(minigit_dir_name_ + "/config", content);
+        std::istringstream lines(content);
+        std::string line;
+        bool replaced = false;
+        while (std::getline(lines, line)) {
+            std::size_t eq = line.find('=');
+            if (eq != std::string::npos && trim(line.substr(0, eq)) == key) {
+                if (!replaced && !value.empty()) out += key + " = " + value + "\n";
+                replaced = true;
+            } else {
+                out += line + "\n";
+            }
+        }
+        if (!replaced && !value.empty()) {
+            out += key + " = " + value + "\n";
+        }
+        if (!write_file_atomic(minigit_dir_name_ + "/config", out)) {
+            std::cerr << "Error: Could not write " << minigit_dir_name_ << "/config" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Implements the 'minigit config <key> [<value>]' command.
+    bool config(const std::vector<std::string>& args) {
+        if (args.empty() || args.size() > 2) {
+            std::cerr << "Usage: minigit config <key> [<value>]" << std::endl;
+            return false;
+        }
+        if (args.size() == 2) {
+            return config_set(args[0], args[1]);
+        }
+        std::string value = config_get(args[0]);
+        if (value.empty()) {
+            return false;
+        }
+        std::cout << value << std::endl;
+        return true;
+    }
+
+    // Implements the 'minigit clone' command (defined below Bundle).
+    bool clone(const std::vector<std::string>& args);
+
+    // Implements the 'minigit grep' command (defined below GrepPattern).
+    bool grep(const std::vector<std::string>& args);
+
+    // Implements the 'minigit grep-index' command (defined below GrepPattern).
+    bool grep_index(const std::vector<std::string>& args);
+
+    // Implements the 'minigit archive' command (defined below TarWriter).
+    bool archive(const std::vector<std::string>& args);
+
+    // Implements the 'minigit bundle' command (defined below Bundle).
+    bool bundle(const std::vector<std::string>& args);
+
+    // Implement 'minigit fetch' and 'minigit push', and the upload-pack and
+    // receive-pack services they run in the remote repository (defined below
+    // PktChannel).
+    bool fetch(const std::vector<std::string>& args);
+    bool push(const std::vector<std::string>& args);
+    bool upload_pack(const std::vector<std::string>& args);
+    bool receive_pack(const std::vector<std::string>& args);
+    bool fetch_objects(const std::string& remote, const std::vector<ObjectId>& oids);
+    std::vector<std::pair<std::string, ObjectId>> advertised_refs();
+    bool resolve_remote(const std::string& remote, std::string& url, std::string& name);
+
+    // Sets the bit of every object reachable from 'tips' in 'reached', pruning
+    // at objects already set there or in 'stop' (if given). 'visit' sees each
+    // newly reached object with its pack type and, for trees and blobs, the
+    // path it was first met at. Commits of 'stop' met as parents of reached
+    // commits are appended to 'boundary' (if given), each once. The parents of
+    // 'shallow' commits (if given) are not followed.
+    bool mark_reachable(const std::vector<ObjectId>& tips, ObjectNumbering& numbers, ObjectBitmap& reached,
+                        const ObjectBitmap* stop = nullptr,
+                        const std::function<void(std::uint32_t, int, const std::string&)>& visit = nullptr,
+                        std::vector<ObjectId>* boundary = nullptr, const OidSet* shallow = nullptr) {
+        struct Item {
+            ObjectId oid;
+            int type;
+            std::string path;
+        };
+        std::vector<Item> stack;
+        for (const ObjectId& tip : tips) stack.push_back({tip, kPackCommit, ""});
+        ObjectBitmap on_boundary;
+        while (!stack.empty()) {
+            Item item = std::move(stack.back());
+            stack.pop_back();
+            std::uint32_t n = numbers.number(item.oid);
+            if (reached.test(n)) {
+                continue;
+            }
+            if (stop != nullptr && stop->test(n)) {
+                if (boundary != nullptr && item.type == kPackCommit && !on_boundary.test(n)) {
+                    on_boundary.set(n);
+                    boundary->push_back(item.oid);
+                }
+                continue;
+            }
+            reached.set(n);
+            if (visit) visit(n, item.type, item.path);
+            if (item.type == kPackCommit) {
+                CommitInfo info;
+                if (!read_commit_info(item.oid, info)) {
+                    std::cerr << "Error: Could not read commit " << item.oid << std::endl;
+                    return false;
+                }
+                stack.push_back({info.tree, kPackTree, ""});
+                if (shallow != nullptr && shallow->contains(item.oid)) continue;
+                for (const ObjectId& parent : info.parents) stack.push_back({parent, kPackCommit, ""});
+            } else if (item.type == kPackTree) {
+                std::vector<TreeEntry> entries;
+                if (!read_tree(item.oid, entries)) {
+                    std::cerr << "Error: Could not read tree " << item.oid << std::endl;
+                    return false;
+                }
+                std::string prefix = item.path.empty() ? "" : item.path + "/";
+                for (const TreeEntry& entry : entries) {
+                    stack.push_back({entry.oid, entry.is_tree() ? kPackTree : kPackBlob, prefix + entry.name});
+                }
+            }
+        }
+        return true;
+    }
+
+    // What build_pack() puts in a pack: everything the 'wants' commits reach
+    // that the 'haves' commits do not, minus blobs with 'omit_blobs' (the
+    // blob:none filter of a partial clone), plus 'objects' as they are (the
+    // blobs a partial clone fetches on demand). Neither walk goes past the
+    // 'shallow' commits: the receiver's shallow boundary, old and new.
+    struct PackRequest {
+        std::vector<ObjectId> wants;
+        std::vector<ObjectId> haves;
+        std::vector<ObjectId> objects;
+        bool omit_blobs = false;
+        OidSet shallow;
+    };
+
+    // Builds a thin pack for 'request', selecting objects with reachability
+    // bitmaps. Trees and blobs are stored as deltas against the previous
+    // version at the same path, which may be an object of a boundary commit
+    // that only the receiver has. The boundary commits go to 'prerequisites'
+    // (if given).
+    bool build_pack(const PackRequest& request, std::string& out, std::vector<ObjectId>* prerequisites = nullptr,
+                    std::size_t* objects = nullptr, std::size_t* deltas = nullptr) {
+        // Everything the receiver has, then everything it lacks, as bitmaps.
+        ObjectNumbering numbers;
+        std::vector<ObjectId> boundary;
+        ObjectBitmap have_bits, want_bits;
+        struct Wanted {
+            std::uint32_t number;
+            int type;
+            std::string path;
+        };
+        std::vector<Wanted> wanted;
+        auto visit = [&](std::uint32_t n, int type, const std::string& path) {
+            if (type != kPackBlob || !request.omit_blobs) wanted.push_back({n, type, path});
+        };
+        const OidSet* shallow = request.shallow.empty() ? nullptr : &request.shallow;
+        if (!mark_reachable(request.haves, numbers, have_bits, nullptr, nullptr, nullptr, shallow) ||
+            !mark_reachable(request.wants, numbers, want_bits, &have_bits, visit, &boundary, shallow)) {
+            return false;
+        }
+        // Objects asked for by id are packed whole: their type is not known
+        // until they are read.
+        for (const ObjectId& oid : request.objects) {
+            std::uint32_t n = numbers.number(oid);
+            if (want_bits.test(n) || have_bits.test(n)) continue;
+            want_bits.set(n);
+            wanted.push_back({n, 0, ""});
+        }
+
+        // Delta candidates: the previous object met at the same path, or for the
+        // first one, the blob at that path in a prerequisite commit.
+        std::unordered_map<std::string, ObjectId> thin_bases;
+        for (std::size_t i = 0; i < boundary.size() && !request.omit_blobs; ++i) {
+            const ObjectId& prerequisite = boundary[i];
+            CommitInfo info;
+            std::vector<std::pair<std::string, ObjectId>> files;
+            if (!read_commit_info(prerequisite, info) || !list_tree_files(info.tree, "", files)) {
+                return false;
+            }
+            for (auto& f : files) thin_bases.emplace(std::move(f.first), f.second);
+        }
+        std::vector<ObjectId> bases(wanted.size());
+        std::unordered_map<std::string, std::size_t> last_at_path;
+        for (std::size_t i = 0; i < wanted.size(); ++i) {
+            const Wanted& w = wanted[i];
+            if (w.type == kPackCommit || w.type == 0) continue;
+            std::string key = std::to_string(w.type) + ":" + w.path;
+            auto last = last_at_path.find(key);
+            if (last != last_at_path.end()) {
+                bases[i] = numbers.oid(wanted[last->second].number);
+                last->second = i;
+            } else {
+                last_at_path.emplace(key, i);
+                auto thin = thin_bases.find(w.path);
+                if (w.type == kPackBlob && thin != thin_bases.end()) bases[i] = thin->second;
+            }
+        }
+
+        struct Packed {
+            std::string type;
+            std::string content;
+            std::string delta;
+        };
+        ThreadPool pool;
+        std::vector<std::future<Packed>> results;
+        for (std::size_t i = 0; i < wanted.size(); ++i) {
+            results.push_back(pool.submit([this, &numbers, &wanted, &bases, i] {
+                Packed packed;
+                std::string base_type, base;
+                if (read_object(numbers.oid(wanted[i].number), packed.type, packed.content) &&
+                    !bases[i].is_null() && packed.content.size() >= 64 && read_object(bases[i], base_type, base) &&
+                    base_type == packed.type && !create_delta(base, packed.content, packed.content.size() / 2, packed.delta)) {
+                    packed.delta.clear();
+                }
+                return packed;
+            }));
+        }
+
+        // Deltas form chains along each path; a chain is cut when it gets too deep.
+        const int kMaxDepth = 50;
+        OidMap<int> depth;
+        PackWriter pack;
+        std::size_t delta_count = 0;
+        for (std::size_t i = 0; i < wanted.size(); ++i) {
+            Packed packed = results[i].get();
+            const ObjectId& oid = numbers.oid(wanted[i].number);
+            if (packed.type.empty()) {
+                std::cerr << "Error: Could not read object " << oid << std::endl;
+                return false;
+            }
+            const int* base_depth = packed.delta.empty() ? nullptr : depth.find(bases[i]);
+            int d = packed.delta.empty() ? 0 : base_depth ? *base_depth + 1 : 1;
+            if (!packed.delta.empty() && d <= kMaxDepth) {
+                pack.add_delta(bases[i], packed.delta);
+                ++delta_count;
+            } else {
+                pack.add(packed.type, packed.content);
+                d = 0;
+            }
+            depth.insert(oid, d);
+        }
+        ObjectId checksum;
+        if (objects != nullptr) *objects = pack.count();
+        if (deltas != nullptr) *deltas = delta_count;
+        if (prerequisites != nullptr) *prerequisites = std::move(boundary);
+        out = pack.finish(checksum);
+        return true;
+    }
+
+    // Computes the trigrams of 'blobs' on a thread pool. Blobs that cannot be
+    // read or are not indexable are left out.
+    std::vector<TrigramIndex::Blob> blob_trigrams(const std::vector<ObjectId>& blobs) {
+        const std::size_t kChunk = 64;
+        ThreadPool pool;
+        std::vector<std::future<std::vector<TrigramIndex::Blob>>> results;
+        for (std::size_t begin = 0; begin < blobs.size(); begin += kChunk) {
+            std::size_t end = std::min(blobs.size(), begin + kChunk);
+            results.push_back(pool.submit([this, &blobs, begin, end] {
+                std::vector<TrigramIndex::Blob> chunk;
+                for (std::size_t i = begin; i < end; ++i) {
+                    std::string type, content;
+                    TrigramIndex::Blob blob{blobs[i], {}};
+                    if (read_object(blobs[i], type, content) && type == "blob" &&
+                        TrigramIndex::blob_trigrams(content, blob.second)) {
+                        chunk.push_back(std::move(blob));
+                    }
+                }
+                return chunk;
+            }));
+        }
+        std::vector<TrigramIndex::Blob> out;
+        for (auto& result : results) {
+            for (auto& blob : result.get()) out.push_back(std::move(blob));
+        }
+        return out;
+    }
+
+    // Adds the blobs that 'new_tree' introduces over 'old_tree' to the trigram
+    // index, if there is one. The delta file is folded into the base once it
+    // outgrows a quarter of it. Failures only cost grep some speed, so they are
+    // reported but not fatal.
+    void update_trigram_index(const ObjectId& old_tree, const ObjectId& new_tree) {
+        std::string path = minigit_dir_name_ + "/trigram-index";
+        std::error_code ec;
+        auto base_size = fs::file_size(path, ec);
+        if (ec) {
+            return;
+        }
+        std::vector<TreeChange> changes;
+        if (!diff_trees(old_tree, new_tree, changes)) {
+            return;
+        }
+        std::vector<ObjectId> added;
+        for (const TreeChange& change : changes) {
+            if (!change.new_oid.is_null()) added.push_back(change.new_oid);
+        }
+        if (!TrigramIndex::append_delta(path, blob_trigrams(added))) {
+            std::cerr << "warning: could not update " << path << std::endl;
+            return;
+        }
+        auto delta_size = fs::file_size(path + ".delta", ec);
+        if (!ec && delta_size > std::max<std::uintmax_t>(base_size / 4, 256 << 10)) {
+            TrigramIndex index;
+            if (index.load(path) && TrigramIndex::write(path, index.blobs())) {
+                fs::remove(path + ".delta", ec);
+            }
+        }
+    }
+
+    // Implements the 'minigit blame' command (defined below Blame).
+    bool blame(const std::vector<std::string>& args);
+
+    // Implements the 'minigit log' command (defined below RevWalk).
+    bool log(const std::vector<std::string>& args);
+
+    // Implements the 'minigit status' command (defined below Blame).
+    bool status(const std::vector<std::string>& args);
+
+    // Implements the 'minigit diff' command (defined below Blame).
+    // Compares the index with the working tree, a commit with the index
+    // (--cached) or the working tree, or two commits; --binary includes the
+    // data of binary changes so that 'apply' can replay them.
+    bool diff(const std::vector<std::string>& args);
+
+    // Implements the 'minigit apply' command (defined below Blame).
+    bool apply(const std::vector<std::string>& args);
+
+    // Implements the 'minigit fsck' command.
+    // Re-hashes every stored object, loose or packed, and reports those whose
+    // content no longer matches their name. Returns true if the object store is intact.
+    bool fsck() {
+        std::string objects_path = minigit_dir_name_ + "/objects";
+        if (!fs::is_directory(objects_path)) {
+            std::cerr << "Error: Not a MiniGit repository (missing " << objects_path << ")" << std::endl;
+            return false;
+        }
+
+        OidSet verified;
+        std::size_t corrupt = 0;
+        for (const auto& entry : fs::directory_iterator(objects_path)) {
+            if (!entry.is_regular_file()) {
+                continue;
+            }
+            std::string name = entry.path().filename().string();
+            ObjectId oid;
+            if (!ObjectId::from_hex(name, oid)) {
+                std::cerr << "warning: ignoring unexpected file objects/" << name << std::endl;
+                continue;
+            }
+            std::string data;
+            if (!read_file(entry.path().string(), data) || hash_raw(data) != oid) {
+                std::cout << "corrupt object " << oid << std::endl;
+                ++corrupt;
+                continue;
+            }
+            verified.insert(oid);
+        }
+        for (const auto& pack : packs()) {
+            std::string_view data = pack->pack_data();
+            std::size_t body = data.size() - ObjectId::kSha1RawSize;
+            if (std::memcmp(hash_raw(std::string(data.substr(0, body))).bytes.data(), data.data() + body,
+                            ObjectId::kSha1RawSize) != 0) {
+                std::cout << "corrupt pack " << pack->pack_path() << std::endl;
+                ++corrupt;
+            }
+            for (std::uint32_t i = 0; i < pack->size(); ++i) {
+                ObjectId oid = pack->oid_at(i);
+                std::string type, content;
+                if (!read_packed_object(oid, type, content) || hash_object(type, content) != oid) {
+                    std::cout << "corrupt object " << oid << std::endl;
+                    ++corrupt;
+                    continue;
+                }
+                verified.insert(oid);
+            }
+        }
+
+        std::cout << "Checked " << verified.size() + corrupt << " objects, " << corrupt << " corrupt." << std::endl;
+        return corrupt == 0;
+    }
+
+    // Lists the refs under 'prefix' (e.g. "refs/heads") as (name, id) pairs.
+    std::vector<std::pair<std::string, ObjectId>> list_refs(const std::string& prefix) {
+        std::vector<std::pair<std::string, ObjectId>> refs;
+        std::string root = minigit_dir_name_ + "/" + prefix;
+        std::error_code ec;
+        if (!fs::is_directory(root, ec)) {
+            return refs;
+        }
+        for (const auto& entry : fs::recursive_directory_iterator(root, ec)) {
+            if (!entry.is_regular_file()) continue;
+            std::string name = prefix + "/" + fs::relative(entry.path(), root).generic_string();
+            ObjectId oid = resolve_ref(name);
+            if (!oid.is_null()) refs.emplace_back(name, oid);
+        }
+        std::sort(refs.begin(), refs.end());
+        return refs;
+    }
+
+private:
+    std::string object_path(const ObjectId& oid) const {
+        return minigit_dir_name_ + "/objects/" + oid.to_hex();
+    }
+
+    static std::string trim(const std::string& s) {
+        std::size_t begin = s.find_first_not_of(" \t\r\n");
+        std::size_t end = s.find_last_not_of(" \t\r\n");
+        return begin == std::string::npos ? "" : s.substr(begin, end - begin + 1);
+    }
+
+    static std::string first_line(const std::string& s) { return s.substr(0, s.find('\n')); }
+
+    // Author/committer identity from MINIGIT_AUTHOR_NAME/MINIGIT_AUTHOR_EMAIL.
+    static std::string identity() {
+        const char* name = std::getenv("MINIGIT_AUTHOR_NAME");
+        const char* email = std::getenv("MINIGIT_AUTHOR_EMAIL");
+        return std::string(name ? name : "MiniGit User") + " <" + (email ? email : "user@minigit") + ">";
+    }
+
+    // Turns a command-line path into the repository-relative form used in the index.
+    static std::string normalize_path(const std::string& path) {
+        std::string normal = fs::path(path).lexically_normal().generic_string();
+        while (normal.compare(0, 2, "./") == 0) normal.erase(0, 2);
+        while (!normal.empty() && normal.back() == '/') normal.pop_back();
+        return normal == "." ? "" : normal;
+    }
+
+    // True if 'path' equals one of 'scopes' or lies below it ("" covers everything).
+    static bool in_scope(const std::string& path, const std::vector<std::string>& scopes) {
+        for (const std::string& r : scopes) {
+            if (r.empty() || path == r ||
+                (path.size() > r.size() && path.compare(0, r.size(), r) == 0 && path[r.size()] == '/')) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Recursively lists regular files under 'dir', skipping the .minigit directory.
+    void collect_files(const std::string& dir, std::vector<std::string>& files) {
+        std::error_code ec;
+        fs::recursive_directory_iterator it(dir.empty() ? "." : dir, ec), end;
+        for (; it != end; it.increment(ec)) {
+            if (it->path().filename() == minigit_dir_name_) {
+                it.disable_recursion_pending();
+                continue;
+            }
+            if (it->is_regular_file()) {
+                files.push_back(normalize_path(it->path().generic_string()));
+            }
+        }
+    }
+
+    // Saves working-tree files as blobs and fills in their index entries, in
+    // the order of 'paths'. This runs as a pipeline: reader threads read the
+    // files into object bytes, hasher threads hash them, and this thread
+    // writes the objects that are new. Readers hand their work to any hasher
+    // through one shared queue; each hasher has its own queue to the writer.
+    // All queues are bounded, so a stage that gets ahead waits for the next
+    // one and memory use stays flat however many files are added. Files the
+    // blob cache confirms still hold the blob staged for them in 'index' are
+    // not hashed again.
+    bool stage_files(const std::vector<std::string>& paths, const std::vector<IndexEntry>& index,
+                     std::vector<IndexEntry>& entries) {
+        struct Item {
+            std::size_t index = 0;
+            std::string data;  // "blob <size>\0<content>"
+            struct stat st;
+            bool confirmed = false;  // the staged blob, vouched for by the blob cache instead of hashed
+        };
+        // Spins briefly, then sleeps, while a neighbouring stage catches up.
+        struct Backoff {
+            unsigned spins = 0;
+            void pause() {
+                if (++spins < 64) {
+                    std::this_thread::yield();
+                } else {
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                }
+            }
+        };
+        entries.assign(paths.size(), IndexEntry{});
+        std::string cache_path = minigit_dir_name_ + "/blob-cache";
+        blob_cache_.load(cache_path);
+        auto hash = [&](Item& item) {
+            std::string_view content = std::string_view(item.data).substr(item.data.find('\0') + 1);
+            ObjectId& oid = entries[item.index].oid;
+            const std::string& path = paths[item.index];
+            auto staged = std::lower_bound(index.begin(), index.end(), path,
+                                           [](const IndexEntry& e, const std::string& p) { return e.path < p; });
+            item.confirmed = staged != index.end() && staged->path == path && staged->stage == 0 &&
+                             blob_cache_.confirms(item.st, content, staged->oid);
+            if (item.confirmed) {
+                oid = staged->oid;
+            } else {
+                oid = hash_raw(item.data);
+                blob_cache_.record(item.st, content, oid);
+            }
+        };
+        OidSet written;
+        // A confirmed blob is normally stored already; if it is not, the
+        // content is hashed after all rather than written under an unchecked id.
+        auto store = [&](Item& item) {
+            ObjectId& oid = entries[item.index].oid;
+            if (item.confirmed && !has_object(oid)) oid = hash_raw(item.data);
+            if (written.insert(oid) && !has_object(oid) && !write_file_atomic(object_path(oid), item.data)) {
+                std::cerr << "Error: Could not save object to " << object_path(oid) << std::endl;
+                return false;
+            }
+            return true;
+        };
+        // With one core, or a handful of files, the stages only get in each
+        // other's way and run one after another here.
+        unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+        if (cores == 1 || paths.size() < 64) {
+            Item item;
+            for (item.index = 0; item.index < paths.size(); ++item.index) {
+                if (!read_blob_file(paths[item.index], entries[item.index], item.data, item.st)) {
+                    std::cerr << "Error: Could not read " << paths[item.index] << std::endl;
+                    return false;
+                }
+                hash(item);
+                if (!store(item)) return false;
+            }
+            blob_cache_.save(cache_path);
+            return true;
+        }
+        unsigned readers = static_cast<unsigned>(std::min<std::size_t>(paths.size(), std::clamp(cores / 2, 1u, 4u)));
+        unsigned hashers = static_cast<unsigned>(std::min<std::size_t>(paths.size(), std::max(1u, cores - readers)));
+        MpmcQueue<Item> read_queue(64);
+        std::vector<std::unique_ptr<SpscQueue<Item>>> hash_queues;
+        for (unsigned h = 0; h < hashers; ++h) hash_queues.push_back(std::make_unique<SpscQueue<Item>>(16));
+        std::atomic<std::size_t> next{0};
+        std::atomic<unsigned> readers_left{readers};
+        std::atomic<bool> failed{false};
+
+        // Both return false once another stage has failed; pop() also
+        // returns false when the queue is closed and drained.
+        auto push = [&failed](auto& queue, Item& item) {
+            for (Backoff backoff; !queue.try_push(item); backoff.pause()) {
+                if (failed) return false;
+            }
+            return true;
+        };
+        auto pop = [&failed](auto& queue, Item& item) {
+            for (Backoff backoff;; backoff.pause()) {
+                bool closed = queue.closed();
+                if (queue.try_pop(item)) return true;
+                if (closed || failed) return false;
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned r = 0; r < readers; ++r) {
+            threads.emplace_back([&] {
+                for (std::size_t i; !failed && (i = next++) < paths.size();) {
+                    Item item;
+                    item.index = i;
+                    if (!read_blob_file(paths[i], entries[i], item.data, item.st)) {
+                        std::cerr << "Error: Could not read " << paths[i] << std::endl;
+                        failed = true;
+                    } else if (!push(read_queue, item)) {
+                        break;
+                    }
+                }
+                if (--readers_left == 0) read_queue.close();
+            });
+        }
+        for (unsigned h = 0; h < hashers; ++h) {
+            threads.emplace_back([&, h] {
+                Item item;
+                while (pop(read_queue, item)) {
+                    hash(item);
+                    if (!push(*hash_queues[h], item)) break;
+                }
+                hash_queues[h]->close();
+            });
+        }
+
+        Item item;
+        Backoff backoff;
+        for (unsigned open = hashers; open > 0 && !failed;) {
+            bool progress = false;
+            for (unsigned h = 0; h < hashers; ++h) {
+                SpscQueue<Item>* queue = hash_queues[h].get();
+                if (queue == nullptr) continue;
+                bool closed = queue->closed();
+                if (queue->try_pop(item)) {
+                    progress = true;
+                    if (!store(item)) failed = true;
+                } else if (closed) {
+                    hash_queues[h].reset();
+                    --open;
+                }
+            }
+            if (progress) {
+                backoff.spins = 0;
+            } else {
+                backoff.pause();
+            }
+        }
+        for (std::thread& thread : threads) thread.join();
+        if (!failed) blob_cache_.save(cache_path);
+        return !failed;
+    }
+
+    // Reads a working-tree file as blob object bytes and fills in the path
+    // and stat data of its index entry.
+    static bool read_blob_file(const std::string& path, IndexEntry& entry, std::string& data, struct stat& st) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || ::fstat(fd, &st) != 0) {
+            if (fd >= 0) ::close(fd);
+            return false;
+        }
+        std::size_t size = static_cast<std::size_t>(st.st_size);
+        std::string header = "blob " + std::to_string(size);
+        header.push_back('\0');
+        data.resize(header.size() + size);
+        std::memcpy(&data[0], header.data(), header.size());
+        std::size_t got = 0;
+        while (got < size) {
+            ssize_t n = ::read(fd, &data[header.size() + got], size - got);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            got += static_cast<std::size_t>(n);
+        }
+        ::close(fd);
+        entry.path = path;
+        entry.mode = (st.st_mode & S_IXUSR) ? kModeExecutable : kModeFile;
+        entry.mtime_ns = std::int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        entry.size = size;
+        return got == size;  // a file that shrank while being read is reported
+    }
+
+    // Writes the tree for index entries [begin, end) that share a directory prefix
+    // of 'prefix_len' characters, recursing into subdirectories.
+    ObjectId write_index_tree(const std::vector<IndexEntry>& index, std::size_t begin, std::size_t end,
+                              std::size_t prefix_len) {
+        std::vector<TreeEntry> entries;
+        std::size_t i = begin;
+        while (i < end) {
+            const std::string& path = index[i].path;
+            std::size_t slash = path.find('/', prefix_len);
+            TreeEntry entry;
+            if (slash == std::string::npos) {
+                entry.mode = index[i].mode;
+                entry.oid = index[i].oid;
+                entry.name = path.substr(prefix_len);
+                ++i;
+            } else {
+                std::string dir = path.substr(0, slash + 1);
+                std::size_t j = i + 1;
+                while (j < end && index[j].path.compare(0, dir.size(), dir) == 0) ++j;
+                entry.mode = kModeTree;
+                entry.oid = write_index_tree(index, i, j, slash + 1);
+                entry.name = path.substr(prefix_len, slash - prefix_len);
+                if (entry.oid.is_null()) return ObjectId{};
+                i = j;
+            }
+            entries.push_back(std::move(entry));
+        }
+        std::sort(entries.begin(), entries.end(),
+                  [](const TreeEntry& a, const TreeEntry& b) { return a.name < b.name; });
+        return write_tree(entries);
+    }
+
+    // Resolves a unique abbreviated object id by scanning the object directory
+    // and the pack indexes.
+    bool resolve_abbreviated(const std::string& prefix, ObjectId& out) {
+        if (prefix.size() < 4 || prefix.size() >= 2 * ObjectId::kSha1RawSize) {
+            return false;
+        }
+        for (char c : prefix) {
+            if (hex_digit_value(c) < 0) return false;
+        }
+        std::string lower = prefix;
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        bool found = false;
+        std::error_code ec;
+        std::vector<std::string> dirs{minigit_dir_name_ + "/objects"};
+        dirs.insert(dirs.end(), alternates().begin(), alternates().end());
+        for (const std::string& dir : dirs) {
+            for (const auto& entry : fs::directory_iterator(dir, ec)) {
+                std::string name = entry.path().filename().string();
+                ObjectId oid;
+                if (name.compare(0, lower.size(), lower) != 0 || !ObjectId::from_hex(name, oid)) continue;
+                if (found && oid != out) {
+                    std::cerr << "Error: Ambiguous object name " << prefix << std::endl;
+                    return false;
+                }
+                found = true;
+                out = oid;
+            }
+        }
+        ObjectId low;
+        std::string padded = lower + std::string(2 * ObjectId::kSha1RawSize - lower.size(), '0');
+        ObjectId::from_hex(padded, low);
+        for (const auto& pack : packs()) {
+            for (std::uint32_t i = pack->lower_bound(low); i < pack->size(); ++i) {
+                ObjectId oid = pack->oid_at(i);
+                if (oid.to_hex().compare(0, lower.size(), lower) != 0) break;
+                if (found && oid != out) {
+                    std::cerr << "Error: Ambiguous object name " << prefix << std::endl;
+                    return false;
+                }
+                found = true;
+                out = oid;
+            }
+        }
+        return found;
+    }
+
+    // Loads the alternates and opens the packs; packs_mutex_ must be held.
+    void load_object_stores() const {
+        if (packs_loaded_) {
+            return;
+        }
+        alternates_.clear();
+        packs_.clear();
+        std::string objects = minigit_dir_name_ + "/objects";
+        std::ifstream list(objects + "/info/alternates");
+        std::string line;
+        while (std::getline(list, line)) {
+            line = trim(line);
+            if (line.empty() || line[0] == '#') continue;
+            alternates_.push_back(fs::path(line).is_absolute() ? line : objects + "/" + line);
+        }
+        std::vector<std::string> names;
+        std::error_code ec;
+        std::vector<std::string> dirs{objects};
+        dirs.insert(dirs.end(), alternates_.begin(), alternates_.end());
+        for (const std::string& dir : dirs) {
+            for (const auto& entry : fs::directory_iterator(dir + "/pack", ec)) {
+                if (entry.path().extension() == ".pack") names.push_back(entry.path().string());
+            }
+        }
+        for (const std::string& name : names) {
+            auto pack = std::make_shared<PackFile>();
+            if (pack->open(name.substr(0, name.size() - 5))) {
+                packs_.push_back(std::move(pack));
+            } else {
+                std::cerr << "warning: ignoring unreadable pack " << name << std::endl;
+            }
+        }
+        packs_loaded_ = true;
+    }
+
+    // Longest delta chain read_packed_object() follows before giving up.
+    static constexpr std::size_t kMaxDeltaChain = 10000;
+
+    std::string minigit_dir_name_;
+    CommitGraph commit_graph_;
+    bool commit_graph_loaded_ = false;
+    mutable std::mutex packs_mutex_;
+    // Only ever appended to once loaded, so that views into pack mappings
+    // handed out earlier stay valid.
+    mutable std::vector<std::shared_ptr<PackFile>> packs_;
+    mutable std::vector<std::string> alternates_;
+    mutable bool packs_loaded_ = false;
+    std::mutex shallow_mutex_;
+    std::atomic<bool> shallow_loaded_{false};
+    OidSet shallow_;
+    std::mutex promisor_mutex_;
+    std::condition_variable promisor_done_;
+    std::string promisor_;
+    bool promisor_loaded_ = false;
+    bool promisor_busy_ = false;
+    std::vector<ObjectId> promisor_queue_;
+    OidSet promisor_missing_;
+    // Loaded by read_index() and saved by write_index().
+    std::unordered_map<std::string, UntrackedDir> untracked_cache_;
+    std::vector<IndexEntry> split_base_;
+    std::string split_base_id_;
+    BlobCache blob_cache_;
+    OidTranslation oid_translation_;
+    bool translations_loaded_ = false;
+    std::unordered_map<ObjectId, ObjectId> loose_translations_;
+    std::unique_ptr<MergeCache> merge_cache_;
+};
+
+// Buffers command output and writes it to stdout in large chunks. When stdout is
+// a terminal each record is flushed as soon as it is complete. Once a write fails
+// (for example because the reader of a pipe exited) the buffer stops writing and
+// failed() tells the producer to stop generating output.
+class OutputBuffer {
+public:
+    explicit OutputBuffer(std::size_t capacity = 64 * 1024)
+        : capacity_(capacity), interactive_(::isatty(STDOUT_FILENO) != 0) {
+        buffer_.reserve(capacity_);
+    }
+    ~OutputBuffer() { flush(); }
+
+    OutputBuffer& operator<<(const std::string& s) {
+        buffer_ += s;
+        if (buffer_.size() >= capacity_) flush();
+        return *this;
+    }
+    OutputBuffer& operator<<(const char* s) { return *this << std::string(s); }
+    OutputBuffer& operator<<(char c) {
+        buffer_.push_back(c);
+        return *this;
+    }
+
+    // Marks the end of one logical record (a commit, a match, ...).
+    void end_record() {
+        if (interactive_ || buffer_.size() >= capacity_) flush();
+    }
+
+    void flush() {
+        std::size_t written = 0;
+        while (!failed_ && written < buffer_.size()) {
+            ssize_t n = ::write(STDOUT_FILENO, buffer_.data() + written, buffer_.size() - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                failed_ = true;
+                break;
+            }
+            written += static_cast<std::size_t>(n);
+        }
+        buffer_.clear();
+    }
+
+    bool failed() const { return failed_; }
+
+private:
+    std::string buffer_;
+    std::size_t capacity_;
+    bool interactive_;
+    bool failed_ = false;
+};
+
+// Lazily walks commit history newest-first (by commit date). Commits are produced
+// one at a time by next(), so a caller that stops early (log -n, a closed pipe)
+// never pays for the rest of history. Parents and dates come from the
+// commit-graph when the commit is in it, and from the commit object otherwise.
+class RevWalk {
+public:
+    explicit RevWalk(MiniGit& repo) : repo_(repo) {}
+
+    // Adds a starting commit. Returns false if 'oid' is not a readable commit.
+    bool push(const ObjectId& oid) {
+        if (!seen_.insert(oid)) {
+            return true;
+        }
+        Item item;
+        if (!load(oid, item)) {
+            return false;
+        }
+        queue_.push(std::move(item));
+        return true;
+    }
+
+    // Ends the walk once every remaining commit is older than 'time'. Since the
+    // queue is ordered by date this stops traversal instead of filtering it.
+    void stop_before(std::int64_t time) {
+        since_ = time;
+        has_since_ = true;
+    }
+
+    // Produces the next commit, or returns false when history is exhausted.
+    bool next(ObjectId& oid) {
+        if (queue_.empty() || (has_since_ && queue_.top().time < since_)) {
+            return false;
+        }
+        Item item = queue_.top();
+        queue_.pop();
+        for (const ObjectId& parent : item.parents) {
+            if (!seen_.insert(parent)) continue;
+            Item parent_item;
+            if (!load(parent, parent_item)) {
+                std::cerr << "Error: Could not read commit " << parent << std::endl;
+                continue;
+            }
+            queue_.push(std::move(parent_item));
+        }
+        oid = item.oid;
+        last_time_ = item.time;
+        return true;
+    }
+
+    // Commit time of the commit last returned by next().
+    std::int64_t last_commit_time() const { return last_time_; }
+
+private:
+    struct Item {
+        ObjectId oid;
+        std::int64_t time = 0;
+        std::uint64_t order = 0;
+        std::vector<ObjectId> parents;
+    };
+
+    // Newest first; among equal dates, the commit queued first wins.
+    struct OlderThan {
+        bool operator()(const Item& a, const Item& b) const {
+            return a.time != b.time ? a.time < b.time : a.order > b.order;
+        }
+    };
+
+    bool load(const ObjectId& oid, Item& item) {
+        CommitInfo info;
+        if (!repo_.read_commit_info(oid, info)) {
+            return false;
+        }
+        item.oid = oid;
+        item.order = counter_++;
+        item.time = info.commit_time;
+        item.parents = std::move(info.parents);
+        return true;
+    }
+
+    MiniGit& repo_;
+    std::priority_queue<Item, std::vector<Item>, OlderThan> queue_;
+    OidSet seen_;
+    std::uint64_t counter_ = 0;
+    std::int64_t since_ = 0;
+    bool has_since_ = false;
+    std::int64_t last_time_ = 0;
+};
+
+// Walks history in topological order: every commit comes before its parents, and
+// the commits of a side branch are kept together. This is the incremental form
+// of Kahn's algorithm used by Git. An indegree walk counts, for each commit, how
+// many of its children have been seen, but it is only advanced down to the
+// generation number of the parent being released next: a commit's children all
+// have higher generation numbers, so once the indegree walk has covered that
+// generation the commit's count is final. The first screen of output therefore
+// needs only the top of the DAG. Commits missing from the commit-graph have
+// infinite generation and are all counted up front.
+class TopoWalk {
+public:
+    explicit TopoWalk(MiniGit& repo) : repo_(repo) {}
+
+    // Adds a starting commit; must be called before the first next().
+    bool push(const ObjectId& oid) {
+        State* start = state(oid);
+        if (start == nullptr) {
+            return false;
+        }
+        if (start->indegree == 0) {
+            start->indegree = 1;
+            indegree_queue_.push({oid, start->info.generation, counter_++});
+            starts_.push_back(oid);
+        }
+        return true;
+    }
+
+    // Commits older than 'time' are neither shown nor walked past.
+    void stop_before(std::int64_t time) {
+        since_ = time;
+        has_since_ = true;
+    }
+
+    bool next(ObjectId& oid) {
+        if (!started_) {
+            start();
+        }
+        while (!topo_stack_.empty()) {
+            ObjectId current = topo_stack_.back();
+            topo_stack_.pop_back();
+            const State* st = state(current);
+            if (has_since_ && st->info.commit_time < since_) {
+                continue;
+            }
+            last_time_ = st->info.commit_time;
+            expand(current);
+            oid = current;
+            return true;
+        }
+        return false;
+    }
+
+    std::int64_t last_commit_time() const { return last_time_; }
+
+private:
+    // Indegree is stored off by one, as in Git: 0 means "not reached by the
+    // indegree walk yet" and 1 means "no unshown children left".
+    struct State {
+        CommitInfo info;
+        std::uint32_t indegree = 0;
+    };
+
+    struct QueueEntry {
+        ObjectId oid;
+        std::uint32_t generation;
+        std::uint64_t order;
+    };
+
+    // Highest generation first; ties in insertion order.
+    struct LowerGeneration {
+        bool operator()(const QueueEntry& a, const QueueEntry& b) const {
+            return a.generation != b.generation ? a.generation < b.generation : a.order > b.order;
+        }
+    };
+
+    // Returns the state for 'oid', loading its commit info on first use. The
+    // pointer is only valid until the next call (the map may rehash).
+    State* state(const ObjectId& oid) {
+        if (State* st = states_.find(oid)) {
+            return st;
+        }
+        State loaded;
+        if (!repo_.read_commit_info(oid, loaded.info)) {
+            std::cerr << "Error: Could not read commit " << oid << std::endl;
+            return nullptr;
+        }
+        return states_.insert(oid, std::move(loaded)).first;
+    }
+
+    void start() {
+        started_ = true;
+        std::uint32_t min_generation = kGenerationInfinity;
+        for (const ObjectId& oid : starts_) {
+            min_generation = std::min(min_generation, state(oid)->info.generation);
+        }
+        depth_ = min_generation;
+        compute_indegrees_to_depth(depth_);
+        // The stack pops last-in first, so push the starts in reverse.
+        for (auto it = starts_.rbegin(); it != starts_.rend(); ++it) {
+            if (state(*it)->indegree == 1) topo_stack_.push_back(*it);
+        }
+    }
+
+    // Advances the indegree walk over every queued commit with a generation of at
+    // least 'generation'.
+    void compute_indegrees_to_depth(std::uint32_t generation) {
+        while (!indegree_queue_.empty() && indegree_queue_.top().generation >= generation) {
+            ObjectId oid = indegree_queue_.top().oid;
+            indegree_queue_.pop();
+            const State* st = state(oid);
+            if (has_since_ && st->info.commit_time < since_) {
+                continue;
+            }
+            std::vector<ObjectId> parents = st->info.parents;
+            for (const ObjectId& parent : parents) {
+                State* parent_state = state(parent);
+                if (parent_state == nullptr) continue;
+                if (parent_state->indegree > 0) {
+                    ++parent_state->indegree;
+                } else {
+                    parent_state->indegree = 2;
+                    indegree_queue_.push({parent, parent_state->info.generation, counter_++});
+                }
+            }
+        }
+    }
+
+    // Releases the parents of a commit that was just shown.
+    void expand(const ObjectId& oid) {
+        std::vector<ObjectId> parents = state(oid)->info.parents;
+        for (const ObjectId& parent : parents) {
+            State* parent_state = state(parent);
+            if (parent_state == nullptr) continue;
+            if (parent_state->info.generation < depth_) {
+                depth_ = parent_state->info.generation;
+                compute_indegrees_to_depth(depth_);
+                parent_state = state(parent);
+            }
+            if (parent_state->indegree > 1 && --parent_state->indegree == 1) {
+                topo_stack_.push_back(parent);
+            }
+        }
+    }
+
+    MiniGit& repo_;
+    OidMap<State> states_;
+    std::priority_queue<QueueEntry, std::vector<QueueEntry>, LowerGeneration> indegree_queue_;
+    std::vector<ObjectId> topo_stack_;
+    std::vector<ObjectId> starts_;
+    std::uint32_t depth_ = kGenerationInfinity;
+    std::uint64_t counter_ = 0;
+    bool started_ = false;
+    std::int64_t since_ = 0;
+    bool has_since_ = false;
+    std::int64_t last_time_ = 0;
+};
+
+// Draws the ASCII commit graph for 'log --graph'. Each lane (column) tracks the
+// commit expected next on it; commits must arrive in topological order.
+class GraphRenderer {
+public:
+    // Returns the graph prefix for the line of 'oid' and updates the lanes for
+    // its parents. Connector lines needed before the next commit are queued and
+    // returned by take_connectors().
+    std::string commit_line(const ObjectId& oid, const std::vector<ObjectId>& parents) {
+        std::size_t lane = std::find(lanes_.begin(), lanes_.end(), oid) - lanes_.begin();
+        if (lane == lanes_.size()) {
+            lanes_.push_back(oid);
+        }
+        std::string line = draw_lanes(lanes_.size());
+        line[2 * lane] = '*';
+
+        std::vector<ObjectId> next = lanes_;
+        next.erase(next.begin() + lane);
+        std::size_t inserted = 0;
+        for (const ObjectId& parent : parents) {
+            if (std::find(next.begin(), next.end(), parent) == next.end() || parent == parents[0]) {
+                next.insert(next.begin() + lane + inserted, parent);
+                ++inserted;
+            }
+        }
+
+        connectors_.clear();
+        if (inserted > 1) {
+            // A merge opens lanes right of the commit; the lanes after it move right.
+            std::string connector(2 * (lanes_.size() + inserted), ' ');
+            for (std::size_t j = 0; j <= lane; ++j) connector[2 * j] = '|';
+            for (std::size_t m = 1; m < inserted; ++m) connector[2 * (lane + m) - 1] = '\\';
+            for (std::size_t k = lane + 1; k < lanes_.size(); ++k) connector[2 * (k + inserted - 1) - 1] = '\\';
+            connectors_.push_back(connector);
+        }
+        // A parent already on an earlier lane closes the later one.
+        for (std::size_t j = 1; j < next.size(); ++j) {
+            if (std::find(next.begin(), next.begin() + j, next[j]) == next.begin() + j) continue;
+            connectors_.push_back(shift_left(next.size(), j, true));
+            next.erase(next.begin() + j);
+            --j;
+        }
+        if (inserted == 0 && lane < next.size()) {
+            // A root commit ends its lane; the lanes after it move left.
+            connectors_.push_back(shift_left(lanes_.size(), lane, false));
+        }
+        for (std::string& connector : connectors_) {
+            connector.erase(connector.find_last_not_of(' ') + 1);
+        }
+        lanes_ = std::move(next);
+        return line;
+    }
+
+    std::vector<std::string> take_connectors() { return std::move(connectors_); }
+
+    // Prefix for the lines between commits (the commit's message body).
+    std::string padding() const { return lanes_.empty() ? std::string() : draw_lanes(lanes_.size()); }
+
+private:
+    // Connector for lane 'removed' going away: lanes before it continue straight,
+    // lanes after it move one column left ('removed' itself is drawn merging left
+    // when 'merging' is set).
+    static std::string shift_left(std::size_t width, std::size_t removed, bool merging) {
+        std::string connector(2 * width, ' ');
+        for (std::size_t j = 0; j < removed; ++j) connector[2 * j] = '|';
+        for (std::size_t k = merging ? removed : removed + 1; k < width; ++k) connector[2 * k - 1] = '/';
+        return connector;
+    }
+
+    static std::string draw_lanes(std::size_t count) {
+        std::string line;
+        for (std::size_t i = 0; i < count; ++i) line += i ? " |" : "|";
+        return line;
+    }
+
+    std::vector<ObjectId> lanes_;
+    std::vector<std::string> connectors_;
+};
+
+// Formats a commit time the way 'git log' does, always in UTC.
+std::string format_date(std::int64_t time) {
+    std::time_t t = static_cast<std::time_t>(time);
+    std::tm tm{};
+    gmtime_r(&t, &tm);
+    char buf[64];
+    std::strftime(buf, sizeof(buf), "%a %b %e %H:%M:%S %Y +0000", &tm);
+    return buf;
+}
+
+// Options of the 'minigit log' command.
+struct LogOptions {
+    long long max_count = -1;
+    bool oneline = false;
+    bool graph = false;
+    bool has_until = false;
+    std::int64_t until = 0;
+};
+
+// Formats commits as 'walk' produces them. Output starts immediately and the walk
+// ends as soon as enough commits were shown or stdout is closed.
+template <typename Walk>
+bool print_log(MiniGit& repo, Walk& walk, const LogOptions& options) {
+    // A closed pipe should end the walk, not the process.
+    std::signal(SIGPIPE, SIG_IGN);
+    OutputBuffer out;
+    GraphRenderer graph;
+    ObjectId oid;
+    long long shown = 0;
+    while ((options.max_count < 0 || shown < options.max_count) && !out.failed() && walk.next(oid)) {
+        if (options.has_until && walk.last_commit_time() > options.until) {
+            continue;
+        }
+        Commit commit;
+        if (!repo.read_commit(oid, commit)) {
+            std::cerr << "Error: Could not read commit " << oid << std::endl;
+            return false;
+        }
+        if (shown && !options.oneline) {
+            out << graph.padding() << '\n';
+        }
+        std::string prefix = options.graph ? graph.commit_line(oid, commit.parents) + " " : "";
+        std::string message_first = commit.message.substr(0, commit.message.find('\n'));
+        if (options.oneline) {
+            out << prefix << oid.to_hex().substr(0, 7) << ' ' << message_first << '\n';
+        } else {
+            std::string pad = graph.padding();
+            if (!pad.empty()) pad += ' ';
+            out << prefix << "commit " << oid.to_hex() << '\n';
+            if (commit.parents.size() > 1) {
+                out << pad << "Merge:";
+                for (const ObjectId& parent : commit.parents) out << ' ' << parent.to_hex().substr(0, 7);
+                out << '\n';
+            }
+            out << pad << "Author: " << commit.author << '\n';
+            out << pad << "Date:   " << format_date(commit.author_time) << '\n' << pad << '\n';
+            std::istringstream lines(commit.message);
+            std::string line;
+            while (std::getline(lines, line)) {
+                out << pad << "    " << line << '\n';
+            }
+        }
+        if (options.graph) {
+            for (const std::string& connector : graph.take_connectors()) out << connector << '\n';
+        }
+        out.end_record();
+        ++shown;
+    }
+    return true;
+}
+
+// Resolves the revisions to start a walk from (HEAD if none) and pushes them.
+template <typename Walk>
+bool push_revisions(MiniGit& repo, Walk& walk, std::vector<std::string> revs) {
+    if (revs.empty()) {
+        revs.push_back("HEAD");
+    }
+    for (const std::string& rev : revs) {
+        ObjectId oid;
+        if (!repo.resolve_revision(rev, oid)) {
+            if (rev == "HEAD") {
+                std::cerr << "Error: Current branch does not have any commits yet" << std::endl;
+            } else {
+                std::cerr << "Error: Unknown revision: " << rev << std::endl;
+            }
+            return false;
+        }
+        if (!walk.push(oid)) {
+            std::cerr << "Error: Not a commit: " << rev << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Implements the 'minigit log' command:
+//   minigit log [-n <count>] [--oneline] [--topo-order] [--graph]
+//               [--since=<date>] [--until=<date>] [<rev>...]
+// The default order is newest first by commit date; --topo-order (implied by
+// --graph) shows children before parents and keeps branches together.
+bool MiniGit::log(const std::vector<std::string>& args) {
+    LogOptions options;
+    bool topo_order = false;
+    std::int64_t since = 0;
+    bool has_since = false;
+    std::vector<std::string> revs;
+    for (std::size_t i = 0; i < args.size(); ++i) {
+        const std::string& arg = args[i];
+        std::string value;
+        auto option = [&](const std::string& name) {
+            if (arg.compare(0, name.size() + 1, name + "=") == 0) {
+                value = arg.substr(name.size() + 1);
+                return true;
+            }
+            if (arg == name && i + 1 < args.size()) {
+                value = args[++i];
+                return true;
+            }
+            return false;
+        };
+        if (arg == "--oneline") {
+            options.oneline = true;
+        } else if (arg == "--topo-order") {
+            topo_order = true;
+        } else if (arg == "--graph") {
+            options.graph = topo_order = true;
+        } else if (option("-n") || option("--max-count")) {
+            options.max_count = std::atoll(value.c_str());
+        } else if (arg.size() > 1 && arg[0] == '-' && std::isdigit(static_cast<unsigned char>(arg[1]))) {
+            options.max_count = std::atoll(arg.c_str() + 1);
+        } else if (option("--since") || option("--after")) {
+            if (!parse_date(value, since)) {
+                std::cerr << "Error: Invalid date: " << value << std::endl;
+                return false;
+            }
+            has_since = true;
+        } else if (option("--until") || option("--before")) {
+            if (!parse_date(value, options.until)) {
+                std::cerr << "Error: Invalid date: " << value << std::endl;
+                return false;
+            }
+            options.has_until = true;
+        } else if (!arg.empty() && arg[0] == '-') {
+            std::cerr << "Error: Unknown option for log: " << arg << std::endl;
+            return false;
+        } else {
+            revs.push_back(arg);
+        }
+    }
+
+    if (topo_order) {
+        TopoWalk walk(*this);
+        if (has_since) walk.stop_before(since);
+        return push_revisions(*this, walk, revs) && print_log(*this, walk, options);
+    }
+    RevWalk walk(*this);
+    if (has_since) walk.stop_before(since);
+    return push_revisions(*this, walk, revs) && print_log(*this, walk, options);
+}
+
+// Attributes every line of a file to the commit that last changed it.
+//
+// Only lines that are still unattributed are tracked, as ranges held by the
+// "suspect" commit currently responsible for them. Suspects are processed newest
+// first: a commit whose changed-path Bloom filter rules out the file passes all
+// of its ranges to its first parent untouched; otherwise the file is diffed
+// against each parent, unchanged lines move on to that parent (renumbered) and
+// the lines no parent has are blamed on the commit. The diffs do not depend on
+// the ranges, so a prefetcher walks ahead of the suspects and computes them on a
+// thread pool while earlier commits are still being processed.
+class Blame {
+public:
+    // Lines of the final file blamed on 'commit'; 'source_line' is the line
+    // number in that commit's version of the file.
+    struct Line {
+        ObjectId commit;
+        std::size_t source_line = 0;
+    };
+
+    Blame(MiniGit& repo, ThreadPool& pool, std::string path)
+        : repo_(repo), pool_(pool), path_(std::move(path)), prefetch_walk_(repo) {
+        // Load the commit-graph before any worker can ask for it.
+        repo_.commit_graph();
+        window_ = 4 * pool_.size();
+    }
+
+    // Blames 'path' as of commit 'start'; 'line_count' is the number of lines of
+    // the file in that commit.
+    bool run(const ObjectId& start, std::size_t line_count, std::vector<Line>& result) {
+        result.assign(line_count, Line{});
+        if (line_count == 0) {
+            return true;
+        }
+        prefetch_walk_.push(start);
+        suspects_[start].push_back({0, line_count, 0});
+        CommitInfo info;
+        if (!repo_.read_commit_info(start, info)) {
+            return false;
+        }
+        queue_.push({start, info.commit_time, counter_++});
+
+        while (!queue_.empty()) {
+            QueueItem item = queue_.top();
+            queue_.pop();
+            std::vector<Range> ranges = std::move(suspects_[item.oid]);
+            suspects_.erase(item.oid);
+            if (ranges.empty()) {
+                continue;
+            }
+            if (!repo_.read_commit_info(item.oid, info)) {
+                std::cerr << "Error: Could not read commit " << item.oid << std::endl;
+                return false;
+            }
+            prefetch(item.time);
+
+            if (!info.parents.empty() && !maybe_changed(item.oid)) {
+                if (!pass_to_parent(info.parents[0], std::move(ranges))) return false;
+                continue;
+            }
+            CommitDiff diff = take_diff(item.oid, item.time);
+            if (!diff.ok) {
+                std::cerr << "Error: Could not read " << path_ << " in commit " << item.oid << std::endl;
+                return false;
+            }
+            bool passed = false;
+            for (std::size_t i = 0; i < diff.parents.size() && !passed; ++i) {
+                if (diff.parents[i].identical) {
+                    if (!pass_to_parent(info.parents[i], std::move(ranges))) return false;
+                    passed = true;
+                }
+            }
+            if (passed) {
+                continue;
+            }
+            for (std::size_t i = 0; i < diff.parents.size() && !ranges.empty(); ++i) {
+                if (!diff.parents[i].has_path) continue;
+                std::vector<Range> to_parent, kept;
+                split_ranges(ranges, diff.parents[i].hunks, to_parent, kept);
+                if (!to_parent.empty() && !pass_to_parent(info.parents[i], std::move(to_parent))) return false;
+                ranges = std::move(kept);
+            }
+            for (const Range& range : ranges) {
+                for (std::size_t k = 0; k < range.count; ++k) {
+                    result[range.final_start + k] = {item.oid, range.start + k};
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    // 'count' lines starting at 'start' in the suspect's version of the file,
+    // which are lines 'final_start'... of the blamed file.
+    struct Range {
+        std::size_t start;
+        std::size_t count;
+        std::size_t final_start;
+    };
+
+    struct QueueItem {
+        ObjectId oid;
+        std::int64_t time;
+        std::uint64_t order;
+    };
+
+    struct OlderThan {
+        bool operator()(const QueueItem& a, const QueueItem& b) const {
+            return a.time != b.time ? a.time < b.time : a.order > b.order;
+        }
+    };
+
+    struct ParentDiff {
+        bool has_path = false;   // the parent has the file at all
+        bool identical = false;  // ... with the same content
+        std::vector<DiffHunk> hunks;
+    };
+
+    struct CommitDiff {
+        bool ok = true;
+        std::vector<ParentDiff> parents;
+    };
+
+    struct Pending {
+        ObjectId oid;
+        std::int64_t time;
+        std::shared_future<CommitDiff> diff;
+    };
+
+    bool maybe_changed(const ObjectId& oid) {
+        const CommitGraph& graph = repo_.commit_graph();
+        std::uint32_t pos;
+        return !graph.find(oid, pos) || graph.maybe_changed(pos, path_);
+    }
+
+    // Reads one version of the file; false if it is missing or not a blob.
+    bool read_version(const ObjectId& oid, std::string& content) {
+        std::string type;
+        return repo_.read_object(oid, type, content) && type == "blob";
+    }
+
+    // Diffs the file in 'oid' against the file in each parent. Runs on workers.
+    // A version that cannot be read fails the diff instead of being diffed as
+    // an empty file, which would blame its lines on the wrong commit.
+    CommitDiff compute_diff(const ObjectId& oid) {
+        CommitDiff diff;
+        CommitInfo info;
+        TreeEntry entry;
+        if (!repo_.read_commit_info(oid, info) || !repo_.lookup_path(info.tree, path_, entry)) {
+            // Reported by the consumer: prefetched commits may never be needed.
+            diff.ok = false;
+            return diff;
+        }
+        std::string content, parent_content;
+        bool have_content = false;
+        for (const ObjectId& parent : info.parents) {
+            ParentDiff parent_diff;
+            CommitInfo parent_info;
+            TreeEntry parent_entry;
+            if (!repo_.read_commit_info(parent, parent_info)) {
+                diff.ok = false;  // not "the parent lacks the file": its lines would be blamed here
+                return diff;
+            }
+            if (repo_.lookup_path(parent_info.tree, path_, parent_entry) && !parent_entry.is_tree()) {
+                parent_diff.has_path = true;
+                parent_diff.identical = parent_entry.oid == entry.oid;
+                if (!parent_diff.identical) {
+                    if ((!have_content && !read_version(entry.oid, content)) ||
+                        !read_version(parent_entry.oid, parent_content)) {
+                        diff.ok = false;
+                        return diff;
+                    }
+                    have_content = true;
+                    parent_diff.hunks = diff_text(parent_content, content);
+                }
+            }
+            diff.parents.push_back(std::move(parent_diff));
+        }
+        return diff;
+    }
+
+    // Keeps up to 'window_' diffs in flight for commits the walk will reach soon.
+    void prefetch(std::int64_t current_time) {
+        while (!pending_.empty() && pending_.front().time > current_time) {
+            pending_.pop_front();  // a commit the suspects never reached
+        }
+        ObjectId oid;
+        while (pending_.size() < window_ && prefetch_walk_.next(oid)) {
+            CommitInfo info;
+            if (!repo_.read_commit_info(oid, info) || (!info.parents.empty() && !maybe_changed(oid))) {
+                continue;
+            }
+            pending_.push_back({oid, info.commit_time, pool_.submit([this, oid] { return compute_diff(oid); }).share()});
+        }
+    }
+
+    CommitDiff take_diff(const ObjectId& oid, std::int64_t time) {
+        for (auto it = pending_.begin(); it != pending_.end() && it->time >= time; ++it) {
+            if (it->oid == oid) {
+                CommitDiff diff = it->diff.get();
+                pending_.erase(it);
+                return diff;
+            }
+        }
+        return compute_diff(oid);
+    }
+
+    // Makes 'parent' a suspect for 'ranges'. False if it cannot be read, in
+    // which case those lines would have no owner.
+    bool pass_to_parent(const ObjectId& parent, std::vector<Range> ranges) {
+        std::vector<Range>& held = suspects_[parent];
+        if (held.empty()) {
+            CommitInfo info;
+            if (!repo_.read_commit_info(parent, info)) {
+                std::cerr << "Error: Could not read commit " << parent << std::endl;
+                return false;
+            }
+            queue_.push({parent, info.commit_time, counter_++});
+        }
+        held.insert(held.end(), ranges.begin(), ranges.end());
+        return true;
+    }
+
+    // Splits 'ranges' (line numbers in the new file) against the hunks of a
+    // parent -> commit diff. Lines outside the hunks go to 'to_parent' renumbered
+    // to the parent's file; lines inside them stay in 'kept'.
+    static void split_ranges(std::vector<Range> ranges, const std::vector<DiffHunk>& hunks,
+                             std::vector<Range>& to_parent, std::vector<Range>& kept) {
+        std::sort(ranges.begin(), ranges.end(), [](const Range& a, const Range& b) { return a.start < b.start; });
+        struct Segment {
+            std::size_t begin, end;
+            bool changed;
+            long delta;  // parent line = new line + delta
+        };
+        std::vector<Segment> segments;
+        std::size_t new_pos = 0, old_pos = 0;
+        for (const DiffHunk& hunk : hunks) {
+            segments.push_back({new_pos, hunk.new_start, false, long(old_pos) - long(new_pos)});
+            segments.push_back({hunk.new_start, hunk.new_start + hunk.new_count, true, 0});
+            new_pos = hunk.new_start + hunk.new_count;
+            old_pos = hunk.old_start + hunk.old_count;
+        }
+        segments.push_back({new_pos, static_cast<std::size_t>(-1), false, long(old_pos) - long(new_pos)});
+
+        std::size_t s = 0;
+        for (const Range& range : ranges) {
+            std::size_t begin = range.start, end = range.start + range.count;
+            while (segments[s].end <= begin) ++s;
+            for (std::size_t t = s; begin < end; ++t) {
+                std::size_t piece_end = std::min(end, segments[t].end);
+                if (piece_end <= begin) continue;
+                Range piece{begin, piece_end - begin, range.final_start + (begin - range.start)};
+                if (segments[t].changed) {
+                    kept.push_back(piece);
+                } else {
+                    piece.start = static_cast<std::size_t>(long(begin) + segments[t].delta);
+                    to_parent.push_back(piece);
+                }
+                begin = piece_end;
+            }
+        }
+    }
+
+    MiniGit& repo_;
+    ThreadPool& pool_;
+    std::string path_;
+    OidMap<std::vector<Range>> suspects_;
+    std::priority_queue<QueueItem, std::vector<QueueItem>, OlderThan> queue_;
+    std::uint64_t counter_ = 0;
+    RevWalk prefetch_walk_;
+    std::deque<Pending> pending_;
+    std::size_t window_ = 4;
+};
+
+// Implements the 'minigit blame [<rev>] [--] <file>' command.
+bool MiniGit::blame(const std::vector<std::string>& args) {
+    std::vector<std::string> positional;
+    bool after_dashes = false;
+    for (const std::string& arg : args) {
+        if (arg == "--" && !after_dashes) {
+            after_dashes = true;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.empty() || positional.size() > 2) {
+        std::cerr << "Usage: minigit blame [<rev>] [--] <file>" << std::endl;
+        return false;
+    }
+    std::string rev = positional.size() == 2 ? positional[0] : "HEAD";
+    std::string path = normalize_path(positional.back());
+
+    ObjectId start;
+    Commit commit;
+    TreeEntry entry;
+    if (!resolve_revision(rev, start) || !read_commit(start, commit)) {
+        std::cerr << "Error: Unknown revision: " << rev << std::endl;
+        return false;
+    }
+    if (!lookup_path(commit.tree, path, entry) || entry.is_tree()) {
+        std::cerr << "Error: No such file " << path << " in " << rev << std::endl;
+        return false;
+    }
+    // A partial clone fetches every version of the file in one request
+    // rather than one at a time as blame reaches them.
+    if (!promisor_remote().empty()) {
+        RevWalk walk(*this);
+        OidSet versions;
+        std::vector<ObjectId> missing;
+        ObjectId oid;
+        TreeEntry version;
+        walk.push(start);
+        while (walk.next(oid)) {
+            CommitInfo info;
+            if (read_commit_info(oid, info) && lookup_path(info.tree, path, version) && !version.is_tree() &&
+                versions.insert(version.oid) && !has_object(version.oid)) {
+                missing.push_back(version.oid);
+            }
+        }
+        fetch_promised(missing);
+    }
+    std::string type, content;
+    if (!read_object(entry.oid, type, content) || type != "blob") {
+        std::cerr << "Error: Could not read blob " << entry.oid << std::endl;
+        return false;
+    }
+    std::vector<std::string_view> lines = split_lines(content);
+
+    ThreadPool pool;
+    Blame blame(*this, pool, path);
+    std::vector<Blame::Line> result;
+    if (!blame.run(start, lines.size(), result)) {
+        return false;
+    }
+
+    std::signal(SIGPIPE, SIG_IGN);
+    OutputBuffer out;
+    OidMap<std::string> labels;
+    std::size_t width = std::to_string(lines.size()).size();
+    for (std::size_t i = 0; i < lines.size() && !out.failed(); ++i) {
+        const ObjectId& oid = result[i].commit;
+        std::string* label = labels.find(oid);
+        if (label == nullptr) {
+            Commit owner;
+            if (!read_commit(oid, owner)) {
+                out.flush();
+                std::cerr << "Error: Could not read commit " << oid << std::endl;
+                return false;
+            }
+            std::string name = owner.author.substr(0, owner.author.find(" <"));
+            char date[32];
+            std::time_t t = static_cast<std::time_t>(owner.author_time);
+            std::tm tm{};
+            gmtime_r(&t, &tm);
+            std::strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+            label = labels.insert(oid, oid.to_hex().substr(0, 8) + " (" + name + " " + date + " ").first;
+        }
+        std::string number = std::to_string(i + 1);
+        std::string_view line = lines[i];
+        out << *label << std::string(width - number.size(), ' ') << number << ") "
+            << std::string(line.substr(0, line.size() - (line.back() == '\n' ? 1 : 0))) << '\n';
+        out.end_record();
+    }
+    return true;
+}
+
+// Implements the 'minigit status [-s | --short]' command.
+// Compares HEAD with the index (staged changes), the index with the working
+// tree (unstaged changes) and lists untracked files. Index entries are checked
+// in parallel chunks; a file is only re-hashed when its stat data no longer
+// matches, and entries found unchanged get their stat data refreshed. The
+// working tree is walked one directory level at a time on the thread pool,
+// re-reading only the directories the untracked cache cannot vouch for.
+bool MiniGit::status(const std::vector<std::string>& args) {
+    bool short_format = false;
+    for (const std::string& arg : args) {
+        if (arg == "-s" || arg == "--short") {
+            short_format = true;
+        } else {
+            std::cerr << "Usage: minigit status [-s | --short]" << std::endl;
+            return false;
+        }
+    }
+    std::string symref;
+    ObjectId head;
+    std::vector<IndexEntry> index, head_entries;
+    if (!read_head(symref, head) || !read_index(index)) {
+        return false;
+    }
+    Commit commit;
+    if (!head.is_null() && (!read_commit(head, commit) || !list_tree_entries(commit.tree, "", head_entries))) {
+        return false;
+    }
+    // Paths left unmerged by a conflicted merge are reported on their own and
+    // set aside, so that the comparisons below see one entry per path. Each
+    // gets a mask of the stages present (1 base, 2 ours, 4 theirs).
+    auto first_unmerged =
+        std::stable_partition(index.begin(), index.end(), [](const IndexEntry& e) { return e.stage == 0; });
+    std::vector<IndexEntry> unmerged_entries(std::make_move_iterator(first_unmerged),
+                                             std::make_move_iterator(index.end()));
+    index.erase(first_unmerged, index.end());
+    std::vector<std::pair<std::string, unsigned>> unmerged;
+    for (const IndexEntry& entry : unmerged_entries) {
+        if (unmerged.empty() || unmerged.back().first != entry.path) unmerged.emplace_back(entry.path, 0);
+        unmerged.back().second |= 1u << (entry.stage - 1);
+    }
+    auto is_unmerged = [&unmerged](const std::string& path) {
+        auto it = std::lower_bound(unmerged.begin(), unmerged.end(), path,
+                                   [](const auto& u, const std::string& p) { return u.first < p; });
+        return it != unmerged.end() && it->first == path;
+    };
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    const std::int64_t start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+    // Files modified in the same timestamp tick as the index was written
+    // may have changed after it without a visible stat difference.
+    std::int64_t index_mtime_ns = start_ns;
+    struct stat index_st;
+    if (::stat((minigit_dir_name_ + "/index").c_str(), &index_st) == 0) {
+        index_mtime_ns = std::int64_t(index_st.st_mtim.tv_sec) * 1000000000 + index_st.st_mtim.tv_nsec;
+    }
+
+    // Staged: HEAD against the index, both sorted by path.
+    std::vector<std::pair<std::string, char>> staged;
+    for (std::size_t i = 0, j = 0; i < head_entries.size() || j < index.size();) {
+        if (j == index.size() || (i < head_entries.size() && head_entries[i].path < index[j].path)) {
+            if (!is_unmerged(head_entries[i].path)) staged.emplace_back(head_entries[i].path, 'D');
+            ++i;
+        } else if (i == head_entries.size() || index[j].path < head_entries[i].path) {
+            staged.emplace_back(index[j++].path, 'A');
+        } else {
+            if (head_entries[i].oid != index[j].oid || head_entries[i].mode != index[j].mode) {
+                staged.emplace_back(index[j].path, 'M');
+            }
+            ++i, ++j;
+        }
+    }
+
+    // Unstaged: the index against the working tree.
+    std::string cache_path = minigit_dir_name_ + "/blob-cache";
+    blob_cache_.load(cache_path);
+    ThreadPool pool;
+    const std::size_t kChunk = 256;
+    std::vector<char> unstaged(index.size(), 0);
+    std::atomic<bool> refreshed{false};
+    std::vector<std::future<void>> checks;
+    for (std::size_t begin = 0; begin < index.size(); begin += kChunk) {
+        std::size_t end = std::min(index.size(), begin + kChunk);
+        checks.push_back(pool.submit([&, begin, end] {
+            for (std::size_t i = begin; i < end; ++i) {
+                IndexEntry& entry = index[i];
+                struct stat st;
+                std::string content;
+                if (::lstat(entry.path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+                    unstaged[i] = 'D';
+                    continue;
+                }
+                std::int64_t mtime_ns = std::int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+                unsigned mode = (st.st_mode & S_IXUSR) ? kModeExecutable : kModeFile;
+                if (mode != entry.mode) {
+                    unstaged[i] = 'M';
+                    continue;
+                }
+                if (mtime_ns == entry.mtime_ns && std::uint64_t(st.st_size) == entry.size && mtime_ns < index_mtime_ns) {
+                    continue;
+                }
+                // The blob cache can prove a change from the edges of the file
+                // alone, or confirm that it still holds the staged blob
+                // without SHA-1.
+                const BlobCache::Entry* cached = blob_cache_.find(st);
+                std::uint64_t partial = 0;
+                ObjectId oid;
+                if (cached != nullptr && cached->oid == entry.oid &&
+                    BlobCache::read_partial_hash(entry.path, cached->size, partial) && partial != cached->partial) {
+                    unstaged[i] = 'M';
+                    continue;
+                }
+                if (!read_file(entry.path, content)) {
+                    unstaged[i] = 'D';
+                    continue;
+                }
+                if (blob_cache_.confirms(st, content, entry.oid)) {
+                    oid = entry.oid;
+                } else {
+                    oid = hash_object("blob", content);
+                    blob_cache_.record(st, content, oid);
+                }
+                if (oid != entry.oid) {
+                    unstaged[i] = 'M';
+                } else if (mtime_ns != entry.mtime_ns || std::uint64_t(st.st_size) != entry.size) {
+                    entry.mtime_ns = mtime_ns;
+                    entry.size = static_cast<std::uint64_t>(st.st_size);
+                    refreshed = true;
+                }
+            }
+        }));
+    }
+    for (auto& check : checks) check.get();
+    blob_cache_.save(cache_path);
+
+    // Untracked: the tracked names of each directory, hashed so that the
+    // cache notices when files are added to or removed from the index.
+    std::unordered_set<std::string> tracked, tracked_dirs{""};
+    std::unordered_map<std::string, std::uint64_t> tracked_hashes;
+    std::vector<std::string> tracked_paths;
+    for (const IndexEntry& entry : index) tracked_paths.push_back(entry.path);
+    for (const auto& [path, stages] : unmerged) tracked_paths.push_back(path);
+    for (const std::string& path : tracked_paths) {
+        tracked.insert(path);
+        std::size_t slash = path.rfind('/');
+        std::string dir = slash == std::string::npos ? "" : path.substr(0, slash);
+        std::uint64_t& hash = tracked_hashes.emplace(dir, 14695981039346656037ull).first->second;
+        for (char c : path.substr(dir.empty() ? 0 : slash + 1) + '\0') {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+        }
+        for (; slash != std::string::npos; slash = path.rfind('/', slash - 1)) {
+            if (!tracked_dirs.insert(path.substr(0, slash)).second || slash == 0) break;
+        }
+    }
+    std::unordered_map<std::string, UntrackedDir> cache;
+    std::size_t reread = 0;
+    std::vector<std::string> level{""};
+    while (!level.empty()) {
+        std::vector<std::future<UntrackedDir>> scans;
+        for (const std::string& dir : level) {
+            scans.push_back(pool.submit([&, dir] {
+                UntrackedDir result;
+                auto hash = tracked_hashes.find(dir);
+                result.tracked_hash = hash == tracked_hashes.end() ? 0 : hash->second;
+                std::string fs_dir = dir.empty() ? "." : dir;
+                struct stat st;
+                if (::stat(fs_dir.c_str(), &st) != 0) {
+                    return result;
+                }
+                std::int64_t mtime_ns = std::int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+                auto cached = untracked_cache_.find(dir);
+                if (cached != untracked_cache_.end() && cached->second.mtime_ns == mtime_ns &&
+                    cached->second.tracked_hash == result.tracked_hash) {
+                    return cached->second;
+                }
+                result.mtime_ns = mtime_ns > start_ns - 1000000000 ? -1 : mtime_ns;
+                DIR* handle = ::opendir(fs_dir.c_str());
+                if (handle == nullptr) {
+                    result.mtime_ns = -1;
+                    return result;
+                }
+                std::string prefix = dir.empty() ? "" : dir + "/";
+                while (struct dirent* ent = ::readdir(handle)) {
+                    std::string name = ent->d_name;
+                    if (name == "." || name == ".." || name == minigit_dir_name_) {
+                        continue;
+                    }
+                    bool is_dir = ent->d_type == DT_DIR;
+                    if (ent->d_type == DT_UNKNOWN) {
+                        struct stat child;
+                        is_dir = ::lstat((prefix + name).c_str(), &child) == 0 && S_ISDIR(child.st_mode);
+                    }
+                    if (is_dir) {
+                        result.subdirs.push_back(std::move(name));
+                    } else if (!tracked.count(prefix + name)) {
+                        result.untracked.push_back(std::move(name));
+                    }
+                }
+                ::closedir(handle);
+                std::sort(result.subdirs.begin(), result.subdirs.end());
+                std::sort(result.untracked.begin(), result.untracked.end());
+                return result;
+            }));
+        }
+        std::vector<std::string> next;
+        for (std::size_t i = 0; i < level.size(); ++i) {
+            UntrackedDir result = scans[i].get();
+            auto cached = untracked_cache_.find(level[i]);
+            if (cached == untracked_cache_.end() || cached->second.mtime_ns != result.mtime_ns ||
+                cached->second.mtime_ns < 0 || cached->second.tracked_hash != result.tracked_hash) {
+                ++reread;
+            }
+            for (const std::string& sub : result.subdirs) {
+                next.push_back(level[i].empty() ? sub : level[i] + "/" + sub);
+            }
+            cache[level[i]] = std::move(result);
+        }
+        level = std::move(next);
+    }
+
+    // Untracked files under a directory with no tracked files are shown as
+    // that directory, as in git.
+    std::vector<std::string> untracked;
+    for (const auto& [dir, entry] : cache) {
+        if (entry.untracked.empty()) continue;
+        // The outermost directory on the path without tracked files, if any.
+        std::string shown;
+        for (std::size_t end = dir.find('/'); !dir.empty(); end = dir.find('/', end + 1)) {
+            if (!tracked_dirs.count(dir.substr(0, end))) {
+                shown = dir.substr(0, end) + "/";
+                break;
+            }
+            if (end == std::string::npos) break;
+        }
+        if (!shown.empty()) {
+            untracked.push_back(shown);
+        } else {
+            for (const std::string& name : entry.untracked) untracked.push_back(dir.empty() ? name : dir + "/" + name);
+        }
+    }
+    std::sort(untracked.begin(), untracked.end());
+    untracked.erase(std::unique(untracked.begin(), untracked.end()), untracked.end());
+
+    bool cache_changed = reread > 0 || cache.size() != untracked_cache_.size();
+    untracked_cache_ = std::move(cache);
+    if (refreshed || cache_changed) {
+        std::vector<IndexEntry> all = index;
+        all.insert(all.end(), unmerged_entries.begin(), unmerged_entries.end());
+        std::stable_sort(all.begin(), all.end(), [](const IndexEntry& a, const IndexEntry& b) { return a.path < b.path; });
+        if (!write_index(all)) {
+            std::cerr << "warning: could not refresh the index" << std::endl;
+        }
+    }
+    // Git's names for the stages an unmerged path has.
+    auto unmerged_code = [](unsigned stages) {
+        return stages == 7 ? "UU" : stages == 6 ? "AA" : stages == 3 ? "UD" : stages == 5 ? "DU" : stages == 2 ? "AU" : "UA";
+    };
+    auto unmerged_label = [](unsigned stages) {
+        return stages == 7   ? "both modified:   "
+               : stages == 6 ? "both added:      "
+               : stages == 3 ? "deleted by them: "
+               : stages == 5 ? "deleted by us:   "
+               : stages == 2 ? "added by us:     "
+                             : "added by them:   ";
+    };
+
+    std::signal(SIGPIPE, SIG_IGN);
+    OutputBuffer out;
+    if (short_format) {
+        std::vector<std::pair<std::string, std::string>> lines;
+        for (const auto& [path, code] : staged) lines.emplace_back(path, std::string(1, code) + ' ');
+        for (const auto& [path, stages] : unmerged) lines.emplace_back(path, unmerged_code(stages));
+        for (std::size_t i = 0; i < index.size(); ++i) {
+            if (unstaged[i] != 0) lines.emplace_back(index[i].path, std::string(" ") + unstaged[i]);
+        }
+        std::stable_sort(lines.begin(), lines.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        for (std::size_t i = 0; i < lines.size() && !out.failed(); ++i) {
+            std::string code = lines[i].second;
+            if (i + 1 < lines.size() && lines[i + 1].first == lines[i].first) {
+                code[1] = lines[++i].second[1];
+            }
+            out << code << ' ' << lines[i].first << '\n';
+            out.end_record();
+        }
+        for (const std::string& path : untracked) {
+            if (out.failed()) break;
+            out << "?? " << path << '\n';
+            out.end_record();
+        }
+        return true;
+    }
+
+    if (symref.compare(0, 11, "refs/heads/") == 0) {
+        out << "On branch " << symref.substr(11) << '\n';
+    } else {
+        out << "HEAD detached at " << head.to_hex().substr(0, 8) << '\n';
+    }
+    if (head.is_null()) {
+        out << "\nNo commits yet\n";
+    }
+    static const char* const kLabels[] = {"new file:   ", "modified:   ", "deleted:    "};
+    auto label = [](char code) { return kLabels[code == 'A' ? 0 : code == 'M' ? 1 : 2]; };
+    if (!staged.empty()) {
+        out << "\nChanges to be committed:\n";
+        for (const auto& [path, code] : staged) out << '\t' << label(code) << path << '\n';
+    }
+    if (!unmerged.empty()) {
+        out << "\nUnmerged paths:\n";
+        for (const auto& [path, stages] : unmerged) out << '\t' << unmerged_label(stages) << path << '\n';
+    }
+    bool dirty = !unmerged.empty(), dirty_unstaged = false;
+    for (std::size_t i = 0; i < index.size(); ++i) {
+        if (unstaged[i] == 0) continue;
+        if (!dirty_unstaged) out << "\nChanges not staged for commit:\n";
+        dirty = dirty_unstaged = true;
+        out << '\t' << label(unstaged[i]) << index[i].path << '\n';
+    }
+    if (!untracked.empty()) {
+        out << "\nUntracked files:\n";
+        for (const std::string& path : untracked) out << '\t' << path << '\n';
+    }
+    if (staged.empty() && !dirty) {
+        out << '\n'
+            << (untracked.empty() ? "nothing to commit, working tree clean"
+                                  : "nothing added to commit but untracked files present")
+            << '\n';
+    }
+    out.end_record();
+    return true;
+}
+
+// Git's base85 alphabet, used for the data of binary patches.
+constexpr char kBase85Chars[] =
+    "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz!#$%&()*+-;<=>?@^_`{|}~";
+
+// Appends 'data' as binary patch lines: a length character ('A'-'Z' for 1-26
+// bytes, 'a'-'z' for 27-52), then every 4 bytes (the last group zero-padded)
+// as 5 base85 digits, most significant first.
+void append_base85_lines(std::string& out, std::string_view data) {
+    for (std::size_t pos = 0; pos < data.size(); pos += 52) {
+        std::size_t n = std::min<std::size_t>(52, data.size() - pos);
+        out.push_back(static_cast<char>(n <= 26 ? 'A' + n - 1 : 'a' + n - 27));
+        for (std::size_t i = 0; i < n; i += 4) {
+            std::uint32_t group = 0;
+            for (std::size_t k = 0; k < 4; ++k) {
+                group = (group << 8) | (i + k < n ? static_cast<unsigned char>(data[pos + i + k]) : 0);
+            }
+            char digits[5];
+            for (int k = 4; k >= 0; --k) {
+                digits[k] = kBase85Chars[group % 85];
+                group /= 85;
+            }
+            out.append(digits, 5);
+        }
+        out.push_back('\n');
+    }
+}
+
+// Decodes one line written by append_base85_lines() onto 'out'. Returns false
+// if the line is malformed.
+bool decode_base85_line(std::string_view line, std::string& out) {
+    static const std::array<int, 256> values = [] {
+        std::array<int, 256> table;
+        table.fill(-1);
+        for (int i = 0; i < 85; ++i) table[static_cast<unsigned char>(kBase85Chars[i])] = i;
+        return table;
+    }();
+    if (line.empty()) return false;
+    char c = line[0];
+    std::size_t n = c >= 'A' && c <= 'Z' ? std::size_t(c - 'A' + 1) : c >= 'a' && c <= 'z' ? std::size_t(c - 'a' + 27) : 0;
+    if (n == 0 || line.size() != 1 + (n + 3) / 4 * 5) return false;
+    for (std::size_t i = 0; i < n; i += 4) {
+        std::uint64_t group = 0;
+        for (std::size_t k = 0; k < 5; ++k) {
+            int v = values[static_cast<unsigned char>(line[1 + i / 4 * 5 + k])];
+            if (v < 0) return false;
+            group = group * 85 + static_cast<std::uint64_t>(v);
+        }
+        if (group > 0xffffffffu) return false;
+        for (std::size_t k = 0; k < 4 && i + k < n; ++k) out.push_back(static_cast<char>(group >> (24 - 8 * k)));
+    }
+    return true;
+}
+
+// Appends the change from 'old_content' to 'new_content' as a binary patch.
+// The layout follows Git's "GIT binary patch": a "delta <n>" or "literal <n>"
+// header with the payload size, the payload in base85 lines and a blank line.
+// Unlike Git the payload is not zlib-compressed, matching the uncompressed
+// object store. A delta is sent only when it is smaller than the new content.
+void append_binary_patch(std::string& out, std::string_view old_content, std::string_view new_content,
+                         DeltaSearch search) {
+    std::string delta;
+    bool use_delta = !old_content.empty() && !new_content.empty() &&
+                     create_delta(old_content, new_content, new_content.size() - 1, delta, search);
+    std::string_view payload = use_delta ? std::string_view(delta) : new_content;
+    out += "MINIGIT binary patch\n";
+    out += (use_delta ? "delta " : "literal ") + std::to_string(payload.size()) + "\n";
+    append_base85_lines(out, payload);
+    out += "\n";
+}
+
+// Appends the hunks of a unified diff between two texts, with 'context'
+// unchanged lines around every change; changes closer than twice that share
+// a hunk.
+void append_unified_hunks(std::string& out, std::string_view old_text, std::string_view new_text,
+                          std::size_t context = 3) {
+    std::vector<std::string_view> a = split_lines(old_text);
+    std::vector<std::string_view> b = split_lines(new_text);
+    std::vector<DiffHunk> hunks = diff_text(old_text, new_text);
+    auto append_line = [&](char prefix, std::string_view line) {
+        out.push_back(prefix);
+        out.append(line.data(), line.size());
+        if (line.empty() || line.back() != '\n') out += "\n\\ No newline at end of file\n";
+    };
+    auto range = [](std::size_t start, std::size_t count) {
+        std::string text = std::to_string(count == 0 ? start : start + 1);
+        return count == 1 ? text : text + "," + std::to_string(count);
+    };
+    for (std::size_t first = 0; first < hunks.size();) {
+        std::size_t last = first;
+        while (last + 1 < hunks.size() &&
+               hunks[last + 1].old_start - (hunks[last].old_start + hunks[last].old_count) <= 2 * context) {
+            ++last;
+        }
+        std::size_t old_begin = hunks[first].old_start - std::min(context, hunks[first].old_start);
+        std::size_t new_begin = old_begin + hunks[first].new_start - hunks[first].old_start;
+        std::size_t old_tail = hunks[last].old_start + hunks[last].old_count;
+        std::size_t old_end = std::min(a.size(), old_tail + context);
+        std::size_t new_end = old_end - old_tail + hunks[last].new_start + hunks[last].new_count;
+        out += "@@ -" + range(old_begin, old_end - old_begin) + " +" + range(new_begin, new_end - new_begin) + " @@\n";
+        std::size_t pos = old_begin;
+        for (std::size_t h = first; h <= last; ++h) {
+            for (; pos < hunks[h].old_start; ++pos) append_line(' ', a[pos]);
+            for (std::size_t k = 0; k < hunks[h].old_count; ++k) append_line('-', a[hunks[h].old_start + k]);
+            for (std::size_t k = 0; k < hunks[h].new_count; ++k) append_line('+', b[hunks[h].new_start + k]);
+            pos = hunks[h].old_start + hunks[h].old_count;
+        }
+        for (; pos < old_end; ++pos) append_line(' ', a[pos]);
+        first = last + 1;
+    }
+}
+
+bool MiniGit::diff(const std::vector<std::string>& args) {
+    bool binary = false, cached = false;
+    DeltaSearch search = DeltaSearch::Fast;
+    std::vector<std::string> revs, scopes;
+    for (std::size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "--") {
+            for (++i; i < args.size(); ++i) scopes.push_back(normalize_path(args[i]));
+        } else if (args[i] == "--binary") {
+            binary = true;
+        } else if (args[i] == "--best") {
+            binary = true;
+            search = DeltaSearch::Best;
+        } else if (args[i] == "--cached" || args[i] == "--staged") {
+            cached = true;
+        } else if (args[i][0] != '-' && revs.size() < 2) {
+            revs.push_back(args[i]);
+        } else {
+            std::cerr << "Usage: minigit diff [--binary | --best] [--cached] [<commit> [<commit>]] [-- <path>...]"
+                      << std::endl;
+            return false;
+        }
+    }
+    if (scopes.empty()) scopes.push_back("");
+    if (cached && revs.size() == 2) {
+        std::cerr << "Error: --cached compares a commit with the index; give at most one commit" << std::endl;
+        return false;
+    }
+
+    // The old side is a commit or the index; the new side another commit,
+    // the index or the working tree.
+    std::vector<ObjectId> trees;
+    for (const std::string& rev : revs) {
+        ObjectId oid;
+        Commit commit;
+        if (!resolve_revision(rev, oid) || !read_commit(oid, commit)) {
+            std::cerr << "Error: Not a valid commit: " << rev << std::endl;
+            return false;
+        }
+        trees.push_back(commit.tree);
+    }
+    std::vector<TreeChange> changes;
+    std::vector<std::string> unmerged;
+    bool worktree = !cached && revs.size() < 2;
+    if (revs.size() == 2) {
+        if (!diff_trees(trees[0], trees[1], changes)) {
+            return false;
+        }
+    } else {
+        std::vector<IndexEntry> index, old_entries;
+        if (!read_index(index)) {
+            return false;
+        }
+        // Unmerged paths have no single version to compare; they are only named.
+        for (const IndexEntry& entry : index) {
+            if (entry.stage != 0 && in_scope(entry.path, scopes) && (unmerged.empty() || unmerged.back() != entry.path)) {
+                unmerged.push_back(entry.path);
+            }
+        }
+        index.erase(std::remove_if(index.begin(), index.end(), [](const IndexEntry& e) { return e.stage != 0; }),
+                    index.end());
+        if (cached && revs.empty()) {
+            std::string symref;
+            ObjectId head;
+            Commit commit;
+            if (!read_head(symref, head)) {
+                return false;
+            }
+            if (!head.is_null()) {
+                if (!read_commit(head, commit)) return false;
+                trees.push_back(commit.tree);
+            }
+        }
+        if (!trees.empty() && !list_tree_entries(trees[0], "", old_entries)) {
+            return false;
+        }
+        if (!cached && revs.empty()) {
+            old_entries = index;
+        }
+        std::vector<IndexEntry> new_entries;
+        if (cached) {
+            new_entries = index;
+        } else {
+            // The working-tree files at the index's paths; the blob id of a file
+            // whose stat data matches its entry (and that was not modified in the
+            // same tick as the index was written) is taken from the index.
+            std::int64_t index_mtime_ns = 0;
+            struct stat index_st;
+            if (::stat((minigit_dir_name_ + "/index").c_str(), &index_st) == 0) {
+                index_mtime_ns = std::int64_t(index_st.st_mtim.tv_sec) * 1000000000 + index_st.st_mtim.tv_nsec;
+            }
+            for (const IndexEntry& entry : index) {
+                struct stat st;
+                if (!in_scope(entry.path, scopes) || ::lstat(entry.path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+                    continue;
+                }
+                IndexEntry file = entry;
+                file.mode = (st.st_mode & S_IXUSR) ? kModeExecutable : kModeFile;
+                std::int64_t mtime_ns = std::int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+                if (mtime_ns != entry.mtime_ns || std::uint64_t(st.st_size) != entry.size ||
+                    mtime_ns >= index_mtime_ns) {
+                    std::string content;
+                    if (!read_file(entry.path, content)) {
+                        std::cerr << "Error: Could not read " << entry.path << std::endl;
+                        return false;
+                    }
+                    file.oid = hash_object("blob", content);
+                }
+                new_entries.push_back(std::move(file));
+            }
+        }
+        for (std::size_t i = 0, j = 0; i < old_entries.size() || j < new_entries.size();) {
+            const IndexEntry* old_entry = nullptr;
+            const IndexEntry* new_entry = nullptr;
+            if (j == new_entries.size() || (i < old_entries.size() && old_entries[i].path < new_entries[j].path)) {
+                old_entry = &old_entries[i++];
+            } else if (i == old_entries.size() || new_entries[j].path < old_entries[i].path) {
+                new_entry = &new_entries[j++];
+            } else {
+                old_entry = &old_entries[i++];
+                new_entry = &new_entries[j++];
+            }
+            if (old_entry && new_entry && old_entry->oid == new_entry->oid && old_entry->mode == new_entry->mode) {
+                continue;
+            }
+            changes.push_back({old_entry ? old_entry->path : new_entry->path, old_entry ? old_entry->oid : ObjectId{},
+                               new_entry ? new_entry->oid : ObjectId{}, old_entry ? old_entry->mode : 0,
+                               new_entry ? new_entry->mode : 0});
+        }
+    }
+
+    // Binary patches carry full ids, so that 'apply' can check the preimage.
+    auto abbrev = [binary](const ObjectId& oid) {
+        std::string hex = oid.to_hex();
+        return binary ? hex : hex.substr(0, 7);
+    };
+    OutputBuffer out;
+    for (const std::string& path : unmerged) out << "* Unmerged path " << path << '\n';
+    std::string text;
+    for (const TreeChange& change : changes) {
+        if (!in_scope(change.path, scopes) ||
+            std::binary_search(unmerged.begin(), unmerged.end(), change.path)) {
+            continue;
+        }
+        text.clear();
+        text += "diff --git a/" + change.path + " b/" + change.path + "\n";
+        char mode[16];
+        if (change.old_mode == 0) {
+            std::snprintf(mode, sizeof(mode), "%06o", change.new_mode);
+            text += std::string("new file mode ") + mode + "\n";
+        } else if (change.new_mode == 0) {
+            std::snprintf(mode, sizeof(mode), "%06o", change.old_mode);
+            text += std::string("deleted file mode ") + mode + "\n";
+        } else if (change.old_mode != change.new_mode) {
+            std::snprintf(mode, sizeof(mode), "%06o", change.old_mode);
+            text += std::string("old mode ") + mode + "\n";
+            std::snprintf(mode, sizeof(mode), "%06o", change.new_mode);
+            text += std::string("new mode ") + mode + "\n";
+        }
+        if (change.old_oid != change.new_oid) {
+            text += "index " + abbrev(change.old_oid) + ".." + abbrev(change.new_oid);
+            if (change.old_mode == change.new_mode) {
+                std::snprintf(mode, sizeof(mode), " %06o", change.old_mode);
+                text += mode;
+            }
+            text += "\n";
+            std::string old_content, new_content;
+            if (!change.old_oid.is_null()) old_content = read_blob(change.old_oid);
+            if (!change.new_oid.is_null()) {
+                if (worktree) {
+                    if (!read_file(change.path, new_content)) {
+                        std::cerr << "Error: Could not read " << change.path << std::endl;
+                        return false;
+                    }
+                } else {
+                    new_content = read_blob(change.new_oid);
+                }
+            }
+            std::string old_name = change.old_oid.is_null() ? "/dev/null" : "a/" + change.path;
+            std::string new_name = change.new_oid.is_null() ? "/dev/null" : "b/" + change.path;
+            if (is_binary_content(old_content) || is_binary_content(new_content)) {
+                if (binary) {
+                    append_binary_patch(text, old_content, new_content, search);
+                } else {
+                    text += "Binary files " + old_name + " and " + new_name + " differ\n";
+                }
+            } else {
+                text += "--- " + old_name + "\n+++ " + new_name + "\n";
+                append_unified_hunks(text, old_content, new_content);
+            }
+        }
+        out << text;
+        out.end_record();
+    }
+    out.flush();
+    return !out.failed();
+}
+
+// One hunk of a unified diff. The lines are views into the patch text and
+// keep their '\n' unless the patch marks them "No newline at end of file".
+struct PatchHunk {
+    std::size_t old_start = 0;  // 1-based line number from the header; 0 before the first line
+    std::vector<std::string_view> old_lines;  // context and removed lines
+    std::vector<std::string_view> new_lines;  // context and added lines
+    std::size_t leading = 0;                  // context lines before the first change
+    std::size_t trailing = 0;                 // context lines after the last change
+};
+
+// One file's part of a patch, as written by 'minigit diff'. Ids in the index
+// line may be abbreviated, so they are kept as hex prefixes. The hunks point
+// into the patch text, which must outlive this.
+struct FilePatch {
+    std::string old_path;  // empty for a new file
+    std::string new_path;  // empty for a deleted file
+    unsigned old_mode = 0;
+    unsigned new_mode = 0;
+    std::string old_hex;
+    std::string new_hex;
+    bool binary = false;    // a binary change ...
+    bool has_data = false;  // ... with its "MINIGIT binary patch" payload
+    bool delta = false;     // the payload is a delta against the old content
+    std::string data;
+    std::vector<PatchHunk> hunks;
+};
+
+// Splits a patch into its files. Returns false with a message on malformed input.
+bool parse_patch(std::string_view patch, std::vector<FilePatch>& files) {
+    std::size_t pos = 0, line_number = 0;
+    auto next_line = [&](std::string_view& line) {
+        if (pos >= patch.size()) return false;
+        std::size_t eol = patch.find('\n', pos);
+        if (eol == std::string_view::npos) eol = patch.size();
+        line = patch.substr(pos, eol - pos);
+        pos = eol + 1;
+        ++line_number;
+        return true;
+    };
+    auto parse_mode = [](std::string_view text, unsigned& mode) {
+        auto result = std::from_chars(text.data(), text.data() + text.size(), mode, 8);
+        return result.ec == std::errc() && result.ptr == text.data() + text.size() && mode != 0;
+    };
+    // Parses "<start>[,<count>]" of a hunk header; the count defaults to 1.
+    auto parse_range = [](std::string_view text, std::size_t& start, std::size_t& count) {
+        const char* end = text.data() + text.size();
+        auto result = std::from_chars(text.data(), end, start);
+        count = 1;
+        if (result.ec == std::errc() && result.ptr != end && *result.ptr == ',') {
+            result = std::from_chars(result.ptr + 1, end, count);
+        }
+        return result.ec == std::errc() && result.ptr == end;
+    };
+    auto fail = [&](const std::string& message) {
+        std::cerr << "Error: corrupt patch at line " << line_number << ": " << message << std::endl;
+        return false;
+    };
+    auto starts_with = [](std::string_view s, std::string_view prefix) { return s.substr(0, prefix.size()) == prefix; };
+    std::string_view line;
+    FilePatch* file = nullptr;
+    while (next_line(line)) {
+        if (starts_with(line, "diff --git ")) {
+            std::string_view names = line.substr(11);
+            std::size_t split = names.find(" b/");
+            if (!starts_with(names, "a/") || split == std::string_view::npos) return fail("bad diff header");
+            files.emplace_back();
+            file = &files.back();
+            file->old_path = std::string(names.substr(2, split - 2));
+            file->new_path = std::string(names.substr(split + 3));
+            continue;
+        }
+        if (!file) {
+            continue;  // text before the first file, e.g. a commit message
+        }
+        if (starts_with(line, "new file mode ")) {
+            if (!parse_mode(line.substr(14), file->new_mode)) return fail("bad mode");
+            file->old_path.clear();
+        } else if (starts_with(line, "deleted file mode ")) {
+            if (!parse_mode(line.substr(18), file->old_mode)) return fail("bad mode");
+            file->new_path.clear();
+        } else if (starts_with(line, "old mode ")) {
+            if (!parse_mode(line.substr(9), file->old_mode)) return fail("bad mode");
+        } else if (starts_with(line, "new mode ")) {
+            if (!parse_mode(line.substr(9), file->new_mode)) return fail("bad mode");
+        } else if (starts_with(line, "index ")) {
+            std::string_view ids = line.substr(6);
+            std::size_t dots = ids.find("..");
+            std::size_t space = ids.find(' ');
+            if (dots == std::string_view::npos) return fail("bad index line");
+            file->old_hex = std::string(ids.substr(0, dots));
+            file->new_hex = std::string(ids.substr(dots + 2, space == std::string_view::npos ? space : space - dots - 2));
+            if (space != std::string_view::npos) {
+                unsigned mode = 0;
+                if (!parse_mode(ids.substr(space + 1), mode)) return fail("bad mode");
+                file->old_mode = file->new_mode = mode;
+            }
+        } else if (starts_with(line, "Binary files ")) {
+            file->binary = true;
+        } else if (line == "MINIGIT binary patch") {
+            file->binary = file->has_data = true;
+            std::size_t size = 0;
+            std::string_view header;
+            if (!next_line(header)) return fail("missing binary patch header");
+            if (starts_with(header, "delta ")) {
+                file->delta = true;
+                header.remove_prefix(6);
+            } else if (starts_with(header, "literal ")) {
+                header.remove_prefix(8);
+            } else {
+                return fail("bad binary patch header");
+            }
+            auto result = std::from_chars(header.data(), header.data() + header.size(), size);
+            if (result.ec != std::errc() || result.ptr != header.data() + header.size()) {
+                return fail("bad binary patch size");
+            }
+            std::string_view data_line;
+            while (next_line(data_line) && !data_line.empty()) {
+                if (!decode_base85_line(data_line, file->data)) return fail("bad base85 line");
+            }
+            if (file->data.size() != size) return fail("binary patch size mismatch");
+        } else if (starts_with(line, "@@ -")) {
+            std::size_t plus = line.find(" +", 4);
+            std::size_t close = plus == std::string_view::npos ? plus : line.find(" @@", plus + 2);
+            PatchHunk hunk;
+            std::size_t old_count = 0, new_start = 0, new_count = 0;
+            if (close == std::string_view::npos || !parse_range(line.substr(4, plus - 4), hunk.old_start, old_count) ||
+                !parse_range(line.substr(plus + 2, close - plus - 2), new_start, new_count)) {
+                return fail("bad hunk header");
+            }
+            char last_kind = 0;
+            std::size_t since_change = 0;
+            bool changed = false;
+            while ((hunk.old_lines.size() < old_count || hunk.new_lines.size() < new_count ||
+                    (pos < patch.size() && patch[pos] == '\\')) &&
+                   next_line(line)) {
+                // The line without its prefix, with the '\n' that ended it in the patch.
+                std::string_view text(line.data() + (line.empty() ? 0 : 1),
+                                      line.size() - (line.empty() ? 0 : 1) + (pos <= patch.size() ? 1 : 0));
+                char kind = line.empty() ? ' ' : line[0];  // editors may strip an empty context line to nothing
+                if (kind == '\\') {
+                    if (last_kind == 0) return fail("misplaced end-of-file marker");
+                    auto strip = [](std::string_view& l) {
+                        if (!l.empty() && l.back() == '\n') l.remove_suffix(1);
+                    };
+                    if (last_kind != '+') strip(hunk.old_lines.back());
+                    if (last_kind != '-') strip(hunk.new_lines.back());
+                    continue;
+                }
+                if (kind == ' ') {
+                    hunk.old_lines.push_back(text);
+                    hunk.new_lines.push_back(text);
+                    ++since_change;
+                } else if (kind == '-' || kind == '+') {
+                    (kind == '-' ? hunk.old_lines : hunk.new_lines).push_back(text);
+                    if (!changed) hunk.leading = since_change;
+                    changed = true;
+                    since_change = 0;
+                } else {
+                    return fail("unexpected line in hunk");
+                }
+                last_kind = kind;
+            }
+            if (hunk.old_lines.size() != old_count || hunk.new_lines.size() != new_count) {
+                return fail("hunk line counts do not match its header");
+            }
+            hunk.trailing = changed ? since_change : 0;
+            file->hunks.push_back(std::move(hunk));
+        }
+    }
+    return true;
+}
+
+// Applies the hunks of one file to 'content'. Lines are interned in a shared
+// LineTable, so looking for a hunk compares one integer per line. Each hunk is
+// looked for at the line its header names (shifted by the offset at which the
+// previous hunk applied), then at growing distances on either side. If that
+// fails, up to 'max_fuzz' lines of outer context are ignored, as patch(1) does.
+bool apply_hunks(const std::string& path, std::string_view content, const std::vector<PatchHunk>& hunks,
+                 std::size_t max_fuzz, std::string& out) {
+    std::vector<std::string_view> lines = split_lines(content);
+    LineTable table;
+    std::vector<std::uint32_t> ids = table.intern(lines);
+    out.clear();
+    out.reserve(content.size());
+    std::size_t copied = 0;  // lines before this are done
+    long offset = 0;
+    for (std::size_t h = 0; h < hunks.size(); ++h) {
+        const PatchHunk& hunk = hunks[h];
+        std::vector<std::uint32_t> pre = table.intern(hunk.old_lines);
+        long header_line = long(hunk.old_start) - (hunk.old_lines.empty() ? 0 : 1);
+        bool found = false;
+        std::size_t front = 0, back = 0, at = 0, fuzz = 0;
+        for (; !found && fuzz <= max_fuzz; ++fuzz) {
+            std::size_t next_front = std::min(fuzz, hunk.leading), next_back = std::min(fuzz, hunk.trailing);
+            if (fuzz > 0 && next_front == front && next_back == back) {
+                break;  // no context left to ignore
+            }
+            front = next_front;
+            back = next_back;
+            std::size_t n = pre.size() - front - back;
+            if (copied + n > ids.size()) continue;
+            long lo = long(copied), hi = long(ids.size() - n);
+            long expected = std::clamp(header_line + long(front) + offset, lo, hi);
+            auto match = [&](long p) { return std::equal(pre.begin() + front, pre.end() - back, ids.begin() + p); };
+            for (long d = 0; !found && (expected - d >= lo || expected + d <= hi); ++d) {
+                if (expected - d >= lo && match(expected - d)) {
+                    at = std::size_t(expected - d);
+                    found = true;
+                } else if (d > 0 && expected + d <= hi && match(expected + d)) {
+                    at = std::size_t(expected + d);
+                    found = true;
+                }
+            }
+        }
+        if (!found) {
+            std::cerr << "Error: " << path << ": patch failed at hunk #" << h + 1 << " (line " << hunk.old_start
+                      << ")" << std::endl;
+            return false;
+        }
+        --fuzz;
+        long shift = long(at) - long(front) - header_line;
+        if (fuzz > 0 || shift != 0) {
+            std::cerr << path << ": hunk #" << h + 1 << " succeeded at " << at - front + 1;
+            if (fuzz > 0) std::cerr << " with fuzz " << fuzz;
+            if (shift != 0) std::cerr << " (offset " << shift << (shift == 1 || shift == -1 ? " line)" : " lines)");
+            std::cerr << "." << std::endl;
+        }
+        offset = shift;
+        for (; copied < at; ++copied) out.append(lines[copied].data(), lines[copied].size());
+        for (std::size_t k = front; k < hunk.new_lines.size() - back; ++k) {
+            out.append(hunk.new_lines[k].data(), hunk.new_lines[k].size());
+        }
+        copied = at + pre.size() - front - back;
+    }
+    for (; copied < lines.size(); ++copied) out.append(lines[copied].data(), lines[copied].size());
+    return true;
+}
+
+bool MiniGit::apply(const std::vector<std::string>& args) {
+    bool check = false, update_index = false;
+    std::size_t max_fuzz = 2;
+    std::vector<std::string> patch_paths;
+    for (const std::string& arg : args) {
+        if (arg == "--check") {
+            check = true;
+        } else if (arg == "--index") {
+            update_index = true;
+        } else if (arg.compare(0, 7, "--fuzz=") == 0 && arg.size() > 7 &&
+                   arg.find_first_not_of("0123456789", 7) == std::string::npos) {
+            max_fuzz = std::stoul(arg.substr(7));
+        } else if (arg == "-" || arg[0] != '-') {
+            patch_paths.push_back(arg);
+        } else {
+            std::cerr << "Usage: minigit apply [--check] [--index] [--fuzz=<n>] [<patch>...]" << std::endl;
+            return false;
+        }
+    }
+    if (patch_paths.empty()) patch_paths.push_back("-");
+    std::vector<std::string> patches(patch_paths.size());
+    for (std::size_t i = 0; i < patch_paths.size(); ++i) {
+        if (patch_paths[i] == "-") {
+            patches[i].assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+        } else if (!read_file(patch_paths[i], patches[i])) {
+            std::cerr << "Error: Could not read " << patch_paths[i] << std::endl;
+            return false;
+        }
+    }
+
+    // The patches are applied in order to an in-memory image of the files they
+    // touch; nothing is written until all of them apply, so a series applies
+    // completely or not at all.
+    struct PatchedFile {
+        std::string path;
+        bool exists = false;
+        unsigned mode = kModeFile;
+        std::string content;
+    };
+    std::vector<PatchedFile> touched;
+    std::unordered_map<std::string, std::size_t> positions;
+    auto load = [&](const std::string& path) -> PatchedFile* {
+        auto inserted = positions.emplace(path, touched.size());
+        if (inserted.second) {
+            touched.emplace_back();
+            PatchedFile& file = touched.back();
+            file.path = path;
+            struct stat st;
+            if (::lstat(path.c_str(), &st) == 0) {
+                file.exists = true;
+                file.mode = (st.st_mode & S_IXUSR) ? kModeExecutable : kModeFile;
+                if (!S_ISREG(st.st_mode) || !read_file(path, file.content)) {
+                    std::cerr << "Error: Could not read " << path << std::endl;
+                    return nullptr;
+                }
+            }
+        }
+        return &touched[inserted.first->second];
+    };
+    auto matches = [](const std::string& hex, const ObjectId& oid) {
+        return hex.find_first_not_of('0') == std::string::npos ? oid.is_null()
+                                                                : oid.to_hex().compare(0, hex.size(), hex) == 0;
+    };
+    for (const std::string& patch : patches) {
+        std::vector<FilePatch> files;
+        if (!parse_patch(patch, files)) {
+            return false;
+        }
+        for (FilePatch& file : files) {
+            const std::string& path = file.new_path.empty() ? file.old_path : file.new_path;
+            std::string current;
+            if (file.old_path.empty()) {
+                PatchedFile* target = load(file.new_path);
+                if (!target) return false;
+                if (target->exists) {
+                    std::cerr << "Error: " << path << ": already exists in working directory" << std::endl;
+                    return false;
+                }
+            } else {
+                PatchedFile* source = load(file.old_path);
+                if (!source) return false;
+                if (!source->exists) {
+                    std::cerr << "Error: " << file.old_path << ": No such file in working directory" << std::endl;
+                    return false;
+                }
+                current = source->content;
+                if (!file.old_mode) file.old_mode = source->mode;
+            }
+            // Text hunks can apply with an offset or fuzz to other content than
+            // the index line names; binary patches need the exact preimage.
+            if (file.binary && !file.old_hex.empty() &&
+                !matches(file.old_hex, file.old_path.empty() ? ObjectId{} : hash_object("blob", current))) {
+                std::cerr << "Error: " << path << ": patch does not apply" << std::endl;
+                return false;
+            }
+            std::string result;
+            if (!file.hunks.empty()) {
+                if (!apply_hunks(path, current, file.hunks, max_fuzz, result)) return false;
+            } else if (file.has_data) {
+                if (!file.delta) {
+                    result = file.data;
+                } else if (!apply_delta(current, file.data, result)) {
+                    std::cerr << "Error: " << path << ": binary patch does not apply" << std::endl;
+                    return false;
+                }
+            } else if (file.binary && !file.new_path.empty()) {
+                // Without its data a binary change applies only if the new blob
+                // is already in the object store.
+                ObjectId new_oid;
+                std::string type;
+                if (!ObjectId::from_hex(file.new_hex, new_oid) || !read_object(new_oid, type, result) ||
+                    type != "blob") {
+                    std::cerr << "Error: cannot apply binary patch to '" << path << "' without full index line"
+                              << std::endl;
+                    return false;
+                }
+            } else {
+                result = current;  // a mode change, rename or deletion
+            }
+            if (file.binary && !file.new_path.empty() && !file.new_hex.empty() &&
+                !matches(file.new_hex, hash_object("blob", result))) {
+                std::cerr << "Error: " << path << ": patch result does not match its index line" << std::endl;
+                return false;
+            }
+            if (!file.old_path.empty() && file.old_path != file.new_path) {
+                if (file.new_path.empty() && !result.empty()) {
+                    std::cerr << "Error: " << path << ": removal patch leaves file contents" << std::endl;
+                    return false;
+                }
+                touched[positions[file.old_path]].exists = false;
+            }
+            if (!file.new_path.empty()) {
+                PatchedFile* target = load(file.new_path);
+                if (!target) return false;
+                target->exists = true;
+                target->content = std::move(result);
+                target->mode = file.new_mode ? file.new_mode : file.old_mode ? file.old_mode : kModeFile;
+            }
+        }
+    }
+    if (check) {
+        return true;
+    }
+
+    // Write the results in parallel, then stage them through the blob-writing
+    // pipeline and update the index once.
+    const std::size_t kChunk = 32;
+    ThreadPool pool;
+    std::vector<std::future<bool>> results;
+    for (std::size_t begin = 0; begin < touched.size(); begin += kChunk) {
+        std::size_t end = std::min(touched.size(), begin + kChunk);
+        results.push_back(pool.submit([&touched, begin, end] {
+            for (std::size_t i = begin; i < end; ++i) {
+                const PatchedFile& file = touched[i];
+                std::error_code ec;
+                if (!file.exists) {
+                    if (!fs::remove(file.path, ec) && ec) {
+                        std::cerr << "Error: Could not remove " << file.path << std::endl;
+                        return false;
+                    }
+                    continue;
+                }
+                fs::path parent = fs::path(file.path).parent_path();
+                if (!parent.empty()) fs::create_directories(parent, ec);
+                if (!write_file_atomic(file.path, file.content) ||
+                    ::chmod(file.path.c_str(), file.mode == kModeExecutable ? 0755 : 0644) != 0) {
+                    std::cerr << "Error: Could not write " << file.path << std::endl;
+                    return false;
+                }
+            }
+            return true;
+        }));
+    }
+    bool ok = true;
+    for (auto& result : results) ok = result.get() && ok;
+    if (!ok || !update_index) {
+        return ok;
+    }
+    std::vector<IndexEntry> index, updates;
+    std::vector<std::string> written;
+    std::unordered_set<std::string> removed;
+    for (const PatchedFile& file : touched) {
+        if (file.exists) {
+            written.push_back(file.path);
+        } else {
+            removed.insert(file.path);
+        }
+    }
+    if (!read_index(index) || !stage_files(written, index, updates)) {
+        return false;
+    }
+    return write_index(merge_index_updates(index, updates,
+                                           [&removed](const std::string& path) { return removed.count(path) != 0; }));
+}
+
+// Merges two commits in memory, as 'merge' would, without touching HEAD, the
+// index or the working tree, and prints
+//   clean <tree>
+// or
+//   conflicted <tree> <count>
+// followed by one "<reason>\t<path>" line per conflict. The result trees and
+// merged blobs (conflict markers and all) are written to the object store.
+// With --batch, "<commit1> <commit2>" pairs are read from stdin, one per line,
+// and a pair that does not name two commits is answered "invalid <line>".
+// Revisions are resolved afresh for every pair, but the merge cache is kept
+// for the whole run, so asking about many branches against the same main
+// reads main's trees, walks shared history and merges equal trees only once.
+// Standard input is read straight from its descriptor, and answers are
+// flushed only when every complete line read so far has been answered and
+// poll() finds no more input waiting.
+bool MiniGit::merge_tree(const std::vector<std::string>& args) {
+    bool batch = args.size() == 1 && args[0] == "--batch";
+    if (!batch && args.size() != 2) {
+        std::cerr << "Usage: minigit merge-tree (--batch | <commit1> <commit2>)" << std::endl;
+        return false;
+    }
+    merge_cache_ = std::make_unique<MergeCache>();
+    OutputBuffer out;
+    // Returns false if the pair could not be merged; 'clean' tells how it went.
+    auto answer = [&](const std::string& ours_rev, const std::string& theirs_rev, bool& clean) {
+        ObjectId ours, theirs, base_tree, tree;
+        CommitInfo ours_info, theirs_info;
+        std::vector<ObjectId> bases;
+        std::vector<MergeConflict> conflicts;
+        if (!resolve_revision(ours_rev, ours) || !resolve_revision(theirs_rev, theirs) ||
+            !read_commit_info(ours, ours_info) || !read_commit_info(theirs, theirs_info) ||
+            !merge_bases(ours, theirs, bases) || !merge_base_tree(bases, base_tree) ||
+            !merge_trees(base_tree, ours_info.tree, theirs_info.tree, ours_rev, theirs_rev, tree, conflicts)) {
+            return false;
+        }
+        if (tree.is_null()) tree = write_tree({});
+        clean = conflicts.empty();
+        if (clean) {
+            out << "clean " << tree.to_hex() << '\n';
+        } else {
+            out << "conflicted " << tree.to_hex() << ' ' << std::to_string(conflicts.size()) << '\n';
+            for (const MergeConflict& conflict : conflicts) out << conflict.reason << '\t' << conflict.path << '\n';
+        }
+        return true;
+    };
+
+    bool clean = false;
+    if (!batch) {
+        bool ok = answer(args[0], args[1], clean);
+        merge_cache_.reset();
+        if (!ok) std::cerr << "Error: Could not merge " << args[0] << " and " << args[1] << std::endl;
+        return ok && clean;
+    }
+    auto answer_line = [&](const std::string& line) {
+        std::istringstream fields(line);
+        std::string ours_rev, theirs_rev, extra;
+        if (!(fields >> ours_rev >> theirs_rev) || (fields >> extra) || !answer(ours_rev, theirs_rev, clean)) {
+            out << "invalid " << line << '\n';
+        }
+        out.end_record();
+    };
+    std::string input;
+    std::size_t start = 0;  // of the first unanswered line in 'input'
+    char chunk[64 * 1024];
+    bool read_error = false;
+    while (!out.failed()) {
+        for (std::size_t eol; !out.failed() && (eol = input.find('\n', start)) != std::string::npos; start = eol + 1) {
+            answer_line(input.substr(start, eol - start));
+        }
+        input.erase(0, start);
+        start = 0;
+        struct pollfd waiting = {STDIN_FILENO, POLLIN, 0};
+        if (::poll(&waiting, 1, 0) <= 0) out.flush();
+        ssize_t n = ::read(STDIN_FILENO, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            read_error = n < 0;
+            break;
+        }
+        input.append(chunk, static_cast<std::size_t>(n));
+    }
+    if (!out.failed() && !input.empty()) answer_line(input);  // a last line without '\n'
+    merge_cache_.reset();
+    if (read_error) std::cerr << "Error: Could not read standard input" << std::endl;
+    return !out.failed() && !read_error;
+}
+
+// Finds 'needle' in 'haystack' at or after 'from'; returns npos if absent. The
+// SSE2 loop compares the first and the last byte of the needle against 16
+// candidate positions at once and only verifies candidates where both match.
+std::size_t find_literal(std::string_view haystack, std::string_view needle, std::size_t from = 0) {
+    std::size_t n = needle.size();
+    if (from > haystack.size() || n > haystack.size() - from) {
+        return std::string_view::npos;
+    }
+    if (n == 0) {
+        return from;
+    }
+    std::size_t i = from;
+#if defined(__SSE2__)
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[n - 1]);
+    for (; i + n - 1 + 16 <= haystack.size(); i += 16) {
+        __m128i block_first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(haystack.data() + i));
+        __m128i block_last = _mm_loadu_si128(reinterpret_cast<const __m128i*>(haystack.data() + i + n - 1));
+        unsigned mask = static_cast<unsigned>(
+            _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first), _mm_cmpeq_epi8(last, block_last))));
+        while (mask != 0) {
+            unsigned bit = static_cast<unsigned>(__builtin_ctz(mask));
+            if (n <= 2 || std::memcmp(haystack.data() + i + bit + 1, needle.data() + 1, n - 2) == 0) {
+                return i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    return haystack.find(needle, i);
+}
+
+// A compiled 'minigit grep' pattern: an optional regular expression plus the
+// literals that every match must contain; the longest is searched for first.
+class GrepPattern {
+public:
+    enum class Syntax { Basic, Extended, Fixed };
+
+    bool compile(const std::string& pattern, Syntax syntax, bool ignore_case) {
+        ignore_case_ = ignore_case;
+        fixed_ = syntax == Syntax::Fixed;
+        literals_ = fixed_ ? std::vector<std::string>{pattern} : required_literals(pattern, syntax);
+        literal_.clear();
+        for (const std::string& literal : literals_) {
+            if (literal.size() > literal_.size()) literal_ = literal;
+        }
+        if (ignore_case_) {
+            literal_ = to_lower(literal_);
+        }
+        if (fixed_) {
+            return true;
+        }
+        try {
+            auto flags = syntax == Syntax::Basic ? std::regex::basic : std::regex::extended;
+            if (ignore_case_) flags |= std::regex::icase;
+            regex_ = std::regex(pattern, flags | std::regex::optimize);
+        } catch (const std::regex_error& e) {
+            std::cerr << "Error: Invalid pattern '" << pattern << "': " << e.what() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // The literals every matching line contains (possibly none).
+    const std::vector<std::string>& literals() const { return literals_; }
+
+    // Calls 'on_match(line_number, line)' for every matching line of 'text'
+    // (line numbers are 1-based); stops early when it returns false.
+    template <typename F>
+    void search(std::string_view text, F&& on_match) const {
+        std::string lowered;
+        std::string_view haystack = text;
+        if (ignore_case_ && !literal_.empty()) {
+            lowered = to_lower(std::string(text));
+            haystack = lowered;
+        }
+        std::size_t line_start = 0, line_number = 1, counted_to = 0;
+        while (line_start < text.size()) {
+            // Jump straight to the next line containing the required literal.
+            if (!literal_.empty()) {
+                std::size_t hit = find_literal(haystack, literal_, line_start);
+                if (hit == std::string_view::npos) {
+                    return;
+                }
+                std::size_t previous_newline = text.rfind('\n', hit);
+                line_start = previous_newline == std::string_view::npos || previous_newline < line_start
+                                 ? line_start
+                                 : previous_newline + 1;
+            }
+            std::size_t line_end = text.find('\n', line_start);
+            if (line_end == std::string_view::npos) {
+                line_end = text.size();
+            }
+            line_number += static_cast<std::size_t>(
+                std::count(text.begin() + counted_to, text.begin() + line_start, '\n'));
+            counted_to = line_start;
+            std::string_view line = text.substr(line_start, line_end - line_start);
+            bool matched = fixed_ ? true : std::regex_search(line.begin(), line.end(), regex_);
+            if (matched && !on_match(line_number, line)) {
+                return;
+            }
+            line_start = line_end + 1;
+        }
+    }
+
+private:
+    static std::string to_lower(std::string s) {
+        std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return std::tolower(c); });
+        return s;
+    }
+
+public:
+    // The runs of plain characters that any match must contain: those outside
+    // groups, bracket expressions and interval bounds, and not followed by a
+    // quantifier. Empty if the pattern has top-level alternation or nothing
+    // usable.
+    static std::vector<std::string> required_literals(const std::string& pattern, Syntax syntax) {
+        std::vector<std::string> runs;
+        std::string run;
+        int depth = 0;
+        auto flush = [&] {
+            if (depth == 0 && !run.empty()) runs.push_back(run);
+            run.clear();
+        };
+        for (std::size_t i = 0; i < pattern.size(); ++i) {
+            char c = pattern[i];
+            char next = i + 1 < pattern.size() ? pattern[i + 1] : '\0';
+            bool quantified = next == '*' || (syntax == Syntax::Extended && (next == '+' || next == '?' || next == '{')) ||
+                              (syntax == Syntax::Basic && next == '\\' && i + 2 < pattern.size() &&
+                               std::strchr("+?{", pattern[i + 2]));
+            if (c == '|' && syntax == Syntax::Extended && depth == 0) return {};
+            if (c == '\\') {
+                if (next == '|' && depth == 0) return {};
+                if (syntax == Syntax::Basic && (next == '(' || next == ')')) {
+                    flush();
+                    depth = next == '(' ? depth + 1 : std::max(0, depth - 1);
+                    ++i;
+                    continue;
+                }
+                // An escaped punctuation character is a literal, except for the
+                // escaped operators of basic syntax.
+                bool literal = next != '\0' && std::ispunct(static_cast<unsigned char>(next)) &&
+                               !(syntax == Syntax::Basic && std::strchr("{}+?|", next));
+                char after = i + 2 < pattern.size() ? pattern[i + 2] : '\0';
+                bool after_quantified =
+                    after == '*' || (after != '\0' && syntax == Syntax::Extended && std::strchr("+?{", after)) ||
+                    (after == '\\' && syntax == Syntax::Basic && i + 3 < pattern.size() &&
+                     std::strchr("+?{", pattern[i + 3]));
+                if (syntax == Syntax::Basic && next == '{') {
+                    // An interval: its bounds are not part of the text.
+                    std::size_t close = pattern.find("\\}", i + 2);
+                    if (close == std::string::npos) return runs;
+                    flush();
+                    i = close + 1;
+                    continue;
+                }
+                if (literal && !after_quantified) {
+                    run += next;
+                } else {
+                    flush();
+                }
+                ++i;
+                continue;
+            }
+            if (c == '[') {
+                // A bracket expression: a ']' right after the '[' or "[^" is
+                // a member, and so is any ']' inside "[:class:]", "[=x=]" or
+                // "[.x.]".
+                flush();
+                std::size_t j = i + 1;
+                if (j < pattern.size() && pattern[j] == '^') ++j;
+                if (j < pattern.size() && pattern[j] == ']') ++j;
+                while (j < pattern.size() && pattern[j] != ']') {
+                    if (pattern[j] == '[' && j + 1 < pattern.size() && std::strchr(":=.", pattern[j + 1])) {
+                        std::size_t close = pattern.find(std::string(1, pattern[j + 1]) + "]", j + 2);
+                        if (close == std::string::npos) return runs;
+                        j = close + 2;
+                    } else {
+                        ++j;
+                    }
+                }
+                if (j >= pattern.size()) return runs;
+                i = j;
+                continue;
+            }
+            if (c == '{' && syntax == Syntax::Extended) {
+                std::size_t close = pattern.find('}', i + 1);
+                if (close == std::string::npos) return runs;
+                flush();
+                i = close;
+                continue;
+            }
+            if (syntax == Syntax::Extended && (c == '(' || c == ')')) {
+                flush();
+                depth = c == '(' ? depth + 1 : std::max(0, depth - 1);
+                continue;
+            }
+            if (std::strchr(".*^$", c) || (syntax == Syntax::Extended && std::strchr("+?{}", c))) {
+                flush();
+                continue;
+            }
+            if (quantified) {
+                flush();
+                continue;
+            }
+            run += c;
+        }
+        flush();
+        return runs;
+    }
+
+private:
+    std::regex regex_;
+    std::vector<std::string> literals_;
+    std::string literal_;
+    bool fixed_ = false;
+    bool ignore_case_ = false;
+};
+
+// Implements the 'minigit grep' command:
+//   minigit grep [-i] [-n] [-l] [-F|-E] [--cached] [-e] <pattern> [<rev>...] [-- <path>...]
+// Without a revision the tracked files of the working tree are searched;
+// --cached searches the staged blobs and each <rev> the blobs of that commit,
+// both straight from the object store. When a trigram index exists, blobs it
+// proves cannot contain the pattern's required literals are skipped unread.
+// Files are searched on a thread pool and the results are printed in order as
+// soon as each file's turn comes.
+bool MiniGit::grep(const std::vector<std::string>& args) {
+    const char* usage = "Usage: minigit grep [-i] [-n] [-l] [-F|-E] [--cached] <pattern> [<rev>...] [-- <path>...]";
+    bool ignore_case = false, line_numbers = false, names_only = false, cached = false;
+    GrepPattern::Syntax syntax = GrepPattern::Syntax::Basic;
+    std::string pattern;
+    std::vector<std::string> revs;
+    bool have_pattern = false;
+    std::vector<std::string> pathspecs;
+    for (std::size_t i = 0; i < args.size(); ++i) {
+        const std::string& arg = args[i];
+        if (arg == "--") {
+            for (++i; i < args.size(); ++i) pathspecs.push_back(normalize_path(args[i]));
+        } else if (arg == "-i" || arg == "--ignore-case") {
+            ignore_case = true;
+        } else if (arg == "-n" || arg == "--line-number") {
+            line_numbers = true;
+        } else if (arg == "-l" || arg == "--files-with-matches") {
+            names_only = true;
+        } else if (arg == "-F" || arg == "--fixed-strings") {
+            syntax = GrepPattern::Syntax::Fixed;
+        } else if (arg == "-E" || arg == "--extended-regexp") {
+            syntax = GrepPattern::Syntax::Extended;
+        } else if (arg == "--cached") {
+            cached = true;
+        } else if (arg == "-e" && i + 1 < args.size()) {
+            pattern = args[++i];
+            have_pattern = true;
+        } else if (!have_pattern) {
+            pattern = arg;
+            have_pattern = true;
+        } else {
+            revs.push_back(arg);
+        }
+    }
+    if (!have_pattern || (cached && !revs.empty())) {
+        std::cerr << usage << std::endl;
+        return false;
+    }
+    GrepPattern compiled;
+    if (!compiled.compile(pattern, syntax, ignore_case)) {
+        return false;
+    }
+
+    // The files to search: (display name, blob id). A null id means "read the
+    // working tree". With several revisions the names are "<rev>:<path>".
+    std::vector<std::pair<std::string, ObjectId>> files;
+    auto select = [&](std::vector<std::pair<std::string, ObjectId>>& listed, const std::string& prefix) {
+        std::sort(listed.begin(), listed.end());
+        for (auto& file : listed) {
+            if (pathspecs.empty() || in_scope(file.first, pathspecs)) {
+                files.emplace_back(prefix + file.first, file.second);
+            }
+        }
+    };
+    for (const std::string& rev : revs) {
+        ObjectId commit_oid;
+        Commit commit;
+        if (!resolve_revision(rev, commit_oid) || !read_commit(commit_oid, commit)) {
+            std::cerr << "Error: Unknown revision: " << rev << std::endl;
+            return false;
+        }
+        std::vector<std::pair<std::string, ObjectId>> listed;
+        if (!list_tree_files(commit.tree, "", listed)) {
+            return false;
+        }
+        select(listed, rev + ":");
+    }
+    if (revs.empty()) {
+        std::vector<IndexEntry> index;
+        if (!read_index(index)) {
+            return false;
+        }
+        std::vector<std::pair<std::string, ObjectId>> listed;
+        for (const IndexEntry& entry : index) {
+            listed.emplace_back(entry.path, cached ? entry.oid : ObjectId{});
+        }
+        select(listed, "");
+    }
+
+    // Drop the blobs the trigram index rules out.
+    std::vector<std::uint32_t> trigrams;
+    for (const std::string& literal : compiled.literals()) {
+        TrigramIndex::append_trigrams(literal, trigrams);
+    }
+    TrigramIndex trigram_index;
+    if (!trigrams.empty() && (cached || !revs.empty()) && trigram_index.load(minigit_dir_name_ + "/trigram-index")) {
+        trigram_index.restrict(trigrams);
+        files.erase(std::remove_if(files.begin(), files.end(),
+                                   [&](const std::pair<std::string, ObjectId>& f) {
+                                       return !trigram_index.may_contain(f.second);
+                                   }),
+                    files.end());
+    }
+    // A partial clone fetches the blobs that are left in one request.
+    if (!promisor_remote().empty()) {
+        std::vector<ObjectId> missing;
+        for (const auto& file : files) {
+            if (!file.second.is_null() && !has_object(file.second)) missing.push_back(file.second);
+        }
+        fetch_promised(missing);
+    }
+
+    auto search_file = [&, this](std::size_t i) {
+        const std::string& name = files[i].first;
+        std::string content;
+        if (files[i].second.is_null()) {
+            if (!read_file(name, content)) return std::string();
+        } else {
+            content = read_blob(files[i].second);
+        }
+        std::string result;
+        bool binary = std::memchr(content.data(), '\0', std::min<std::size_t>(content.size(), 8000)) != nullptr;
+        compiled.search(content, [&](std::size_t number, std::string_view line) {
+            if (names_only || binary) {
+                result = names_only ? name + "\n" : "Binary file " + name + " matches\n";
+                return false;
+            }
+            result += name + ":";
+            if (line_numbers) result += std::to_string(number) + ":";
+            result.append(line.data(), line.size());
+            result += '\n';
+            return true;
+        });
+        return result;
+    };
+
+    // Keep a bounded window of files in flight; print them strictly in order.
+    std::signal(SIGPIPE, SIG_IGN);
+    ThreadPool pool;
+    OutputBuffer out;
+    const std::size_t window = 8 * pool.size();
+    std::deque<std::future<std::string>> in_flight;
+    std::size_t next = 0;
+    bool found = false;
+    while ((next < files.size() || !in_flight.empty()) && !out.failed()) {
+        while (next < files.size() && in_flight.size() < window) {
+            in_flight.push_back(pool.submit([&search_file, i = next] { return search_file(i); }));
+            ++next;
+        }
+        std::string result = in_flight.front().get();
+        in_flight.pop_front();
+        if (!result.empty()) {
+            found = true;
+            out << result;
+            out.end_record();
+        }
+    }
+    // Let queued searches finish before their captures go out of scope.
+    for (auto& pending : in_flight) pending.wait();
+    return found;
+}
+
+// Implements the 'minigit grep-index [<rev>...]' command.
+// (Re)builds the trigram index over every blob reachable from the given
+// revisions (default: all branches and HEAD). Blobs already in the old index
+// keep their trigrams; only new ones are read, in parallel.
+bool MiniGit::grep_index(const std::vector<std::string>& args) {
+    std::vector<ObjectId> tips;
+    for (const std::string& rev : args) {
+        ObjectId oid;
+        if (!resolve_revision(rev, oid)) {
+            std::cerr << "Error: Unknown revision: " << rev << std::endl;
+            return false;
+        }
+        tips.push_back(oid);
+    }
+    if (args.empty()) {
+        std::string symref;
+        ObjectId head;
+        if (read_head(symref, head) && !head.is_null()) {
+            tips.push_back(head);
+        }
+        for (const auto& ref : list_refs("refs/heads")) {
+            tips.push_back(ref.second);
+        }
+    }
+
+    // Collect the blobs of every reachable tree, visiting each tree once.
+    OidSet seen_commits, seen_trees, seen_blobs;
+    std::vector<ObjectId> commits, trees, blobs;
+    for (const ObjectId& tip : tips) {
+        if (seen_commits.insert(tip)) commits.push_back(tip);
+    }
+    while (!commits.empty()) {
+        CommitInfo info;
+        ObjectId oid = commits.back();
+        commits.pop_back();
+        if (!read_commit_info(oid, info)) {
+            std::cerr << "Error: Could not read commit " << oid << std::endl;
+            return false;
+        }
+        for (const ObjectId& parent : info.parents) {
+            if (seen_commits.insert(parent)) commits.push_back(parent);
+        }
+        if (seen_trees.insert(info.tree)) trees.push_back(info.tree);
+        while (!trees.empty()) {
+            ObjectId tree = trees.back();
+            trees.pop_back();
+            std::vector<TreeEntry> entries;
+            if (!read_tree(tree, entries)) {
+                std::cerr << "Error: Could not read tree " << tree << std::endl;
+                return false;
+            }
+            for (const TreeEntry& entry : entries) {
+                if (entry.is_tree()) {
+                    if (seen_trees.insert(entry.oid)) trees.push_back(entry.oid);
+                } else if (seen_blobs.insert(entry.oid)) {
+                    blobs.push_back(entry.oid);
+                }
+            }
+        }
+    }
+
+    std::string path = minigit_dir_name_ + "/trigram-index";
+    TrigramIndex old_index;
+    std::vector<TrigramIndex::Blob> indexed;
+    if (old_index.load(path)) {
+        for (TrigramIndex::Blob& blob : old_index.blobs()) {
+            if (seen_blobs.contains(blob.first)) indexed.push_back(std::move(blob));
+        }
+        blobs.erase(std::remove_if(blobs.begin(), blobs.end(),
+                                   [&](const ObjectId& oid) { return old_index.contains(oid); }),
+                    blobs.end());
+    }
+    for (TrigramIndex::Blob& blob : blob_trigrams(blobs)) {
+        indexed.push_back(std::move(blob));
+    }
+    std::size_t count = indexed.size();
+    if (!TrigramIndex::write(path, std::move(indexed))) {
+        std::cerr << "Error: Could not write " << path << std::endl;
+        return false;
+    }
+    std::error_code ec;
+    fs::remove(path + ".delta", ec);
+    std::cout << "Indexed " << count << " of " << seen_blobs.size() << " blobs." << std::endl;
+    return true;
+}
+
+// Destination of 'minigit archive': a file descriptor that receives several
+// pieces per writev() call, optionally through a zstd compression stream.
+class ArchiveSink {
+public:
+    ArchiveSink(int fd, bool compress) : fd_(fd) {
+#if defined(MINIGIT_WITH_ZSTD)
+        if (compress) {
+            zstd_ = ZSTD_createCCtx();
+            ZSTD_CCtx_setParameter(zstd_, ZSTD_c_compressionLevel, 3);
+            buffer_.resize(ZSTD_CStreamOutSize());
+        }
+#else
+        (void)compress;
+#endif
+    }
+    ArchiveSink(const ArchiveSink&) = delete;
+    ArchiveSink& operator=(const ArchiveSink&) = delete;
+    ~ArchiveSink() {
+#if defined(MINIGIT_WITH_ZSTD)
+        ZSTD_freeCCtx(zstd_);
+#endif
+    }
+
+    static bool compression_supported() {
+#if defined(MINIGIT_WITH_ZSTD)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    bool write(std::initializer_list<std::string_view> pieces) {
+#if defined(MINIGIT_WITH_ZSTD)
+        if (zstd_ != nullptr) {
+            for (std::string_view piece : pieces) {
+                if (!compress(piece, ZSTD_e_continue)) return false;
+            }
+            return true;
+        }
+#endif
+        iovec iov[8];
+        int count = 0;
+        for (std::string_view piece : pieces) {
+            if (piece.empty()) continue;
+            iov[count].iov_base = const_cast<char*>(piece.data());
+            iov[count].iov_len = piece.size();
+            ++count;
+        }
+        return write_all(iov, count);
+    }
+
+    // Flushes the compression stream, if any.
+    bool finish() {
+#if defined(MINIGIT_WITH_ZSTD)
+        if (zstd_ != nullptr) {
+            return compress(std::string_view(), ZSTD_e_end);
+        }
+#endif
+        return true;
+    }
+
+private:
+    bool write_all(iovec* iov, int count) {
+        while (count > 0) {
+            ssize_t n = ::writev(fd_, iov, count);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            auto done = static_cast<std::size_t>(n);
+            while (count > 0 && done >= iov->iov_len) {
+                done -= iov->iov_len;
+                ++iov;
+                --count;
+            }
+            if (count > 0) {
+                iov->iov_base = static_cast<char*>(iov->iov_base) + done;
+                iov->iov_len -= done;
+            }
+        }
+        return true;
+    }
+
+#if defined(MINIGIT_WITH_ZSTD)
+    bool compress(std::string_view piece, ZSTD_EndDirective mode) {
+        ZSTD_inBuffer in{piece.data(), piece.size(), 0};
+        for (;;) {
+            ZSTD_outBuffer out{&buffer_[0], buffer_.size(), 0};
+            std::size_t remaining = ZSTD_compressStream2(zstd_, &out, &in, mode);
+            if (ZSTD_isError(remaining)) {
+                std::cerr << "Error: zstd: " << ZSTD_getErrorName(remaining) << std::endl;
+                return false;
+            }
+            iovec iov{&buffer_[0], out.pos};
+            if (out.pos > 0 && !write_all(&iov, 1)) return false;
+            if (mode == ZSTD_e_end ? remaining == 0 : in.pos == in.size) return true;
+        }
+    }
+
+    ZSTD_CCtx* zstd_ = nullptr;
+    std::string buffer_;
+#endif
+    int fd_;
+};
+
+// Writes a POSIX tar stream laid out the way 'git archive' does it: a pax
+// global header holding the commit id, ustar entries owned by root with umask
+// 002 applied, long paths split into the ustar prefix field or carried in a
+// pax 'path' record, and the stream padded to whole 10 KiB records.
+class TarWriter {
+public:
+    TarWriter(ArchiveSink& sink, std::int64_t mtime) : sink_(sink), mtime_(mtime) {}
+
+    bool add_commit_id(const ObjectId& commit) {
+        std::string records = pax_record("comment", commit.to_hex());
+        Block header = make_header("pax_global_header", 0100666, records.size(), 'g');
+        return emit(header, records);
+    }
+
+    // 'path' is the directory path without a trailing slash.
+    bool add_directory(const std::string& path, const ObjectId& oid) {
+        return add_entry(path + "/", kModeTree, std::string_view(), oid);
+    }
+
+    bool add_file(const std::string& path, unsigned mode, std::string_view content, const ObjectId& oid) {
+        return add_entry(path, mode, content, oid);
+    }
+
+    // Writes the end-of-archive marker and the record padding.
+    bool finish() {
+        std::size_t padding = 2 * kBlockSize;
+        std::size_t total = written_ + padding;
+        padding += (kRecordSize - total % kRecordSize) % kRecordSize;
+        static const std::string zeros(kRecordSize + 2 * kBlockSize, '\0');
+        written_ += padding;
+        return sink_.write({std::string_view(zeros.data(), padding)}) && sink_.finish();
+    }
+
+private:
+    static constexpr std::size_t kBlockSize = 512;
+    static constexpr std::size_t kRecordSize = 20 * kBlockSize;
+    static constexpr unsigned kUmask = 002;
+    using Block = std::array<char, kBlockSize>;
+
+    bool add_entry(const std::string& path, unsigned mode, std::string_view content, const ObjectId& oid) {
+        std::string name = path, prefix, records;
+        if (path.size() > 100) {
+            std::size_t split = path_prefix(path, 155);
+            std::size_t rest = split > 0 ? path.size() - split - 1 : 0;
+            if (split > 0 && rest <= 100) {
+                prefix = path.substr(0, split);
+                name = path.substr(split + 1);
+            } else {
+                name = oid.to_hex() + ".data";
+                records = pax_record("path", path);
+            }
+        }
+        unsigned tar_mode = mode == kModeTree ? (mode | 0777) & ~kUmask
+                                              : (mode | ((mode & 0100) ? 0777 : 0666)) & ~kUmask;
+        Block header = make_header(name, tar_mode, content.size(), mode == kModeTree ? '5' : '0', prefix);
+        if (!records.empty()) {
+            Block pax = make_header(oid.to_hex() + ".paxheader", 0100666, records.size(), 'x');
+            if (!emit(pax, records)) return false;
+        }
+        return emit(header, content);
+    }
+
+    // Writes a header block and its data in one go, straight from where the
+    // data lives, followed by the padding to the next block.
+    bool emit(const Block& header, std::string_view data) {
+        static const char zeros[kBlockSize] = {};
+        std::size_t padding = (kBlockSize - data.size() % kBlockSize) % kBlockSize;
+        written_ += kBlockSize + data.size() + padding;
+        return sink_.write({std::string_view(header.data(), kBlockSize), data, std::string_view(zeros, padding)});
+    }
+
+    Block make_header(const std::string& name, unsigned mode, std::size_t size, char type,
+                      const std::string& prefix = "") const {
+        Block block{};
+        char* h = block.data();
+        std::memcpy(h, name.data(), std::min<std::size_t>(name.size(), 100));
+        std::snprintf(h + 100, 8, "%07o", mode & 07777);
+        std::snprintf(h + 108, 8, "%07o", 0);
+        std::snprintf(h + 116, 8, "%07o", 0);
+        std::snprintf(h + 124, 12, "%011llo", static_cast<unsigned long long>(size));
+        std::snprintf(h + 136, 12, "%011llo", static_cast<unsigned long long>(mtime_));
+        h[156] = type;
+        std::memcpy(h + 257, "ustar", 6);
+        std::memcpy(h + 263, "00", 2);
+        std::memcpy(h + 265, "root", 4);
+        std::memcpy(h + 297, "root", 4);
+        std::snprintf(h + 329, 8, "%07o", 0);
+        std::snprintf(h + 337, 8, "%07o", 0);
+        std::memcpy(h + 345, prefix.data(), std::min<std::size_t>(prefix.size(), 155));
+        std::memset(h + 148, ' ', 8);
+        unsigned checksum = 0;
+        for (char c : block) checksum += static_cast<unsigned char>(c);
+        std::snprintf(h + 148, 8, "%07o", checksum);
+        return block;
+    }
+
+    // The longest leading directory part of 'path' that fits in 'max' bytes,
+    // as a length; 0 if there is none.
+    static std::size_t path_prefix(const std::string& path, std::size_t max) {
+        std::size_t i = path.size();
+        if (i > 1 && path[i - 1] == '/') --i;
+        if (i > max) i = max;
+        do {
+            --i;
+        } while (i > 0 && path[i] != '/');
+        return i;
+    }
+
+    // "<length> <key>=<value>\n", where the length counts its own digits.
+    static std::string pax_record(const std::string& key, const std::string& value) {
+        std::size_t body = 1 + key.size() + 1 + value.size() + 1;
+        std::size_t length = body + std::to_string(body).size();
+        if (std::to_string(length).size() != std::to_string(body).size()) ++length;
+        return std::to_string(length) + " " + key + "=" + value + "\n";
+    }
+
+    ArchiveSink& sink_;
+    std::int64_t mtime_;
+    std::uint64_t written_ = 0;
+};
+
+// Implements the 'minigit archive' command:
+//   minigit archive [--format=tar|tar.zst] [--prefix=<dir>/] [-o <file>] <tree-ish>
+// Streams the files of a commit or tree as a tar archive without checking
+// them out. Blobs are mapped and paged in on a thread pool ahead of the
+// writer, which hands each one to writev() straight from the loose object or
+// pack mapping.
+bool MiniGit::archive(const std::vector<std::string>& args) {
+    const char* usage = "Usage: minigit archive [--format=tar|tar.zst] [--prefix=<dir>/] [-o <file>] <tree-ish>";
+    std::string format, prefix, output, rev;
+    for (std::size_t i = 0; i < args.size(); ++i) {
+        const std::string& arg = args[i];
+        if (arg.compare(0, 9, "--format=") == 0) {
+            format = arg.substr(9);
+        } else if (arg.compare(0, 9, "--prefix=") == 0) {
+            prefix = arg.substr(9);
+        } else if ((arg == "-o" || arg == "--output") && i + 1 < args.size()) {
+            output = args[++i];
+        } else if (arg.compare(0, 9, "--output=") == 0) {
+            output = arg.substr(9);
+        } else if (rev.empty() && arg[0] != '-') {
+            rev = arg;
+        } else {
+            std::cerr << usage << std::endl;
+            return false;
+        }
+    }
+    if (rev.empty()) {
+        std::cerr << usage << std::endl;
+        return false;
+    }
+    if (format.empty()) {
+        auto ends_with = [&](const char* suffix) {
+            std::size_t n = std::strlen(suffix);
+            return output.size() >= n && output.compare(output.size() - n, n, suffix) == 0;
+        };
+        format = ends_with(".tar.zst") || ends_with(".tzst") ? "tar.zst" : "tar";
+    }
+    if (format != "tar" && format != "tar.zst") {
+        std::cerr << "Error: Unknown archive format '" << format << "'" << std::endl;
+        return false;
+    }
+    if (format == "tar.zst" && !ArchiveSink::compression_supported()) {
+        std::cerr << "Error: This build of minigit has no zstd support" << std::endl;
+        return false;
+    }
+
+    // A commit archives its tree with its commit time; a bare tree gets the current time.
+    ObjectId oid, tree, commit_id;
+    std::string type, content;
+    std::int64_t mtime = current_time();
+    if (!resolve_revision(rev, oid) || !read_object(oid, type, content)) {
+        std::cerr << "Error: Unknown revision: " << rev << std::endl;
+        return false;
+    }
+    if (type == "commit") {
+        Commit commit;
+        if (!parse_commit(content, commit)) {
+            std::cerr << "Error: Could not read commit " << oid << std::endl;
+            return false;
+        }
+        tree = commit.tree;
+        commit_id = oid;
+        mtime = commit.commit_time;
+    } else if (type == "tree") {
+        tree = oid;
+    } else {
+        std::cerr << "Error: " << rev << " is not a tree-ish" << std::endl;
+        return false;
+    }
+
+    // Flatten the tree, each directory ahead of its contents.
+    struct Entry {
+        std::string path;
+        unsigned mode;
+        ObjectId oid;
+    };
+    std::vector<Entry> entries;
+    std::function<bool(const ObjectId&, const std::string&)> walk = [&](const ObjectId& id, const std::string& dir) {
+        std::vector<TreeEntry> children;
+        if (!read_tree(id, children)) {
+            std::cerr << "Error: Could not read tree " << id << std::endl;
+            return false;
+        }
+        for (const TreeEntry& child : children) {
+            entries.push_back({dir + child.name, child.mode, child.oid});
+            if (child.is_tree() && !walk(child.oid, dir + child.name + "/")) return false;
+        }
+        return true;
+    };
+    if (!prefix.empty() && prefix.back() == '/') {
+        entries.push_back({prefix.substr(0, prefix.size() - 1), kModeTree, tree});
+    }
+    if (!walk(tree, prefix)) {
+        return false;
+    }
+    // A partial clone fetches the blobs it lacks in one request.
+    if (!promisor_remote().empty()) {
+        std::vector<ObjectId> missing;
+        for (const Entry& entry : entries) {
+            if (entry.mode != kModeTree && !has_object(entry.oid)) missing.push_back(entry.oid);
+        }
+        if (!fetch_promised(missing)) {
+            return false;
+        }
+    }
+
+    int fd = 1;
+    if (!output.empty()) {
+        fd = ::open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            std::cerr << "Error: Could not create " << output << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+    }
+    std::signal(SIGPIPE, SIG_IGN);
+    ArchiveSink sink(fd, format == "tar.zst");
+    TarWriter tar(sink, mtime);
+    bool ok = commit_id.is_null() || tar.add_commit_id(commit_id);
+
+    // A blob is served from its mapped loose file, from its mapped pack when
+    // stored whole there, or else (a delta) from a buffer.
+    struct Loaded {
+        MappedFile file;
+        std::string buffer;
+        std::string_view content;
+        bool ok = false;
+    };
+    auto load = [this, &entries](std::size_t i) {
+        Loaded loaded;
+        std::string blob_type;
+        const ObjectId& oid = entries[i].oid;
+        if (map_object(oid, loaded.file, blob_type, loaded.content, true) ||
+            packed_view(oid, blob_type, loaded.content)) {
+            // Fault the pages in here rather than in the writer.
+            volatile char sink = 0;
+            for (std::size_t at = 0; at < loaded.content.size(); at += 4096) sink = sink + loaded.content[at];
+        } else if (read_object(oid, blob_type, loaded.buffer)) {
+            loaded.content = loaded.buffer;
+        }
+        loaded.ok = blob_type == "blob";
+        return loaded;
+    };
+    ThreadPool pool;
+    const std::size_t window = 8 * pool.size();
+    std::deque<std::future<Loaded>> in_flight;
+    std::size_t next = 0, done = 0;
+    while (ok && done < entries.size()) {
+        for (; next < entries.size() && in_flight.size() < window; ++next) {
+            if (entries[next].mode == kModeTree) continue;
+            in_flight.push_back(pool.submit([&load, i = next] { return load(i); }));
+        }
+        const Entry& entry = entries[done++];
+        if (entry.mode == kModeTree) {
+            ok = tar.add_directory(entry.path, entry.oid);
+            continue;
+        }
+        Loaded loaded = in_flight.front().get();
+        in_flight.pop_front();
+        if (!loaded.ok) {
+            std::cerr << "Error: Could not read blob " << entry.oid << " (" << entry.path << ")" << std::endl;
+            ok = false;
+            break;
+        }
+        ok = tar.add_file(entry.path, entry.mode, loaded.content, entry.oid);
+    }
+    for (auto& pending : in_flight) pending.wait();
+    ok = ok && tar.finish();
+    if (fd != 1 && ::close(fd) != 0) {
+        ok = false;
+    }
+    if (!ok && errno != EPIPE) {
+        std::cerr << "Error: Could not write archive" << std::endl;
+    }
+    return ok;
+}
+
+// A bundle file: a text header naming the commits the receiver must already
+// have and the refs the bundle carries, then a blank line and a thin pack:
+//   # v2 minigit bundle
+//   -<prerequisite id> <subject>
+//   <id> <refname>
+//
+//   <pack>
+struct Bundle {
+    std::vector<std::pair<ObjectId, std::string>> prerequisites;
+    std::vector<std::pair<ObjectId, std::string>> refs;
+    std::string pack;
+};
+
+static const char kBundleSignature[] = "# v2 minigit bundle\n";
+
+bool read_bundle(const std::string& path, Bundle& bundle) {
+    std::string data;
+    if (!read_file(path, data)) {
+        std::cerr << "Error: Could not open bundle " << path << std::endl;
+        return false;
+    }
+    if (data.compare(0, sizeof(kBundleSignature) - 1, kBundleSignature) != 0) {
+        std::cerr << "Error: " << path << " is not a MiniGit bundle" << std::endl;
+        return false;
+    }
+    std::size_t pos = sizeof(kBundleSignature) - 1;
+    for (;;) {
+        std::size_t end = data.find('\n', pos);
+        if (end == std::string::npos) {
+            std::cerr << "Error: Truncated bundle header in " << path << std::endl;
+            return false;
+        }
+        std::string line = data.substr(pos, end - pos);
+        pos = end + 1;
+        if (line.empty()) {
+            break;
+        }
+        bool prerequisite = line[0] == '-';
+        std::size_t start = prerequisite ? 1 : 0;
+        std::size_t space = line.find(' ', start);
+        ObjectId oid;
+        if (!ObjectId::from_hex(line.substr(start, space == std::string::npos ? std::string::npos : space - start),
+                                oid)) {
+            std::cerr << "Error: Bad bundle header line: " << line << std::endl;
+            return false;
+        }
+        std::string rest = space == std::string::npos ? "" : line.substr(space + 1);
+        (prerequisite ? bundle.prerequisites : bundle.refs).emplace_back(oid, rest);
+    }
+    bundle.pack = data.substr(pos);
+    return true;
+}
+
+// Implements the 'minigit bundle' command:
+//   minigit bundle create <file> (<rev> | ^<rev> | <rev>..<rev> | --all)...
+//   minigit bundle unbundle <file> [--update-refs]
+//   minigit bundle verify <file>
+//   minigit bundle list-heads <file>
+// 'create' selects the objects reachable from the positive revisions but not
+// from the negative ones with reachability bitmaps, and packs trees and blobs
+// as deltas against the previous version at the same path, which may be an
+// object only the receiver has. 'unbundle' checks the prerequisites, indexes
+// the pack in parallel and prints the refs (setting them with --update-refs).
+bool MiniGit::bundle(const std::vector<std::string>& args) {
+    const char* usage =
+        "Usage: minigit bundle create <file> <rev>... | unbundle <file> [--update-refs] | verify <file> | "
+        "list-heads <file>";
+    if (args.size() < 2) {
+        std::cerr << usage << std::endl;
+        return false;
+    }
+    const std::string& action = args[0];
+    const std::string& file = args[1];
+
+    if (action == "create") {
+        std::vector<ObjectId> wants, haves;
+        std::vector<std::pair<ObjectId, std::string>> refs;
+        // The full ref name a positive revision argument stands for, if any.
+        auto ref_name = [this](const std::string& rev) -> std::string {
+            if (rev == "HEAD") return rev;
+            for (const std::string& name : {rev, "refs/heads/" + rev, "refs/tags/" + rev}) {
+                if (name.compare(0, 5, "refs/") == 0 && !resolve_ref(name).is_null()) return name;
+            }
+            return "";
+        };
+        auto add_want = [&](const std::string& rev) {
+            ObjectId oid;
+            if (!resolve_revision(rev, oid)) {
+                std::cerr << "Error: Unknown revision: " << rev << std::endl;
+                return false;
+            }
+            wants.push_back(oid);
+            std::string name = ref_name(rev);
+            if (!name.empty()) refs.emplace_back(oid, name);
+            return true;
+        };
+        for (std::size_t i = 2; i < args.size(); ++i) {
+            const std::string& arg = args[i];
+            std::size_t dots = arg.find("..");
+            ObjectId oid;
+            if (arg == "--all") {
+                for (const char* prefix : {"refs/heads", "refs/tags"}) {
+                    for (const auto& ref : list_refs(prefix)) {
+                        wants.push_back(ref.second);
+                        refs.emplace_back(ref.second, ref.first);
+                    }
+                }
+            } else if (arg[0] == '^') {
+                if (!resolve_revision(arg.substr(1), oid)) {
+                    std::cerr << "Error: Unknown revision: " << arg.substr(1) << std::endl;
+                    return false;
+                }
+                haves.push_back(oid);
+            } else if (dots != std::string::npos) {
+                std::string from = arg.substr(0, dots), to = arg.substr(dots + 2);
+                if (!resolve_revision(from.empty() ? "HEAD" : from, oid)) {
+                    std::cerr << "Error: Unknown revision: " << from << std::endl;
+                    return false;
+                }
+                haves.push_back(oid);
+                if (!add_want(to.empty() ? "HEAD" : to)) return false;
+            } else if (!add_want(arg)) {
+                return false;
+            }
+        }
+        std::sort(refs.begin(), refs.end(), [](const auto& a, const auto& b) { return a.second < b.second; });
+        refs.erase(std::unique(refs.begin(), refs.end(), [](const auto& a, const auto& b) { return a.second == b.second; }),
+                   refs.end());
+        if (refs.empty()) {
+            std::cerr << "Error: Refusing to create empty bundle (no refs given)" << std::endl;
+            return false;
+        }
+
+        std::vector<ObjectId> prerequisites;
+        std::string pack;
+        std::size_t objects = 0, deltas = 0;
+        if (!build_pack({wants, haves, {}, false, {}}, pack, &prerequisites, &objects, &deltas)) {
+            return false;
+        }
+        std::string out = kBundleSignature;
+        for (const ObjectId& prerequisite : prerequisites) {
+            Commit commit;
+            out += "-" + prerequisite.to_hex() + " " +
+                   (read_commit(prerequisite, commit) ? first_line(commit.message) : std::string()) + "\n";
+        }
+        for (const auto& ref : refs) out += ref.first.to_hex() + " " + ref.second + "\n";
+        out += "\n";
+        out += pack;
+        if (!write_file_atomic(file, out)) {
+            std::cerr << "Error: Could not write " << file << std::endl;
+            return false;
+        }
+        std::cout << "Wrote bundle " << file << " with " << objects << " objects (" << deltas << " deltas, "
+                  << prerequisites.size() << " prerequisites)." << std::endl;
+        return true;
+    }
+
+    if (action != "unbundle" && action != "verify" && action != "list-heads") {
+        std::cerr << usage << std::endl;
+        return false;
+    }
+    Bundle bundle;
+    if (!read_bundle(file, bundle)) {
+        return false;
+    }
+    if (action == "list-heads") {
+        for (const auto& ref : bundle.refs) std::cout << ref.first << " " << ref.second << std::endl;
+        return true;
+    }
+    std::vector<std::pair<ObjectId, std::string>> missing;
+    for (const auto& prerequisite : bundle.prerequisites) {
+        if (!has_object(prerequisite.first)) missing.push_back(prerequisite);
+    }
+    if (!missing.empty()) {
+        std::cerr << "Error: Repository lacks these prerequisite commits:" << std::endl;
+        for (const auto& m : missing) std::cerr << "error: " << m.first << " " << m.second << std::endl;
+        return false;
+    }
+    if (action == "verify") {
+        std::cout << "The bundle contains " << bundle.refs.size() << " ref(s) and requires "
+                  << bundle.prerequisites.size() << " commit(s)." << std::endl;
+        std::cout << file << " is okay" << std::endl;
+        return true;
+    }
+
+    bool update_refs = args.size() > 2 && args[2] == "--update-refs";
+    if (!store_pack(bundle.pack)) {
+        return false;
+    }
+    for (const auto& ref : bundle.refs) {
+        std::cout << ref.first << " " << ref.second << std::endl;
+        if (update_refs && ref.second.compare(0, 5, "refs/") == 0 && !update_ref(ref.second, ref.first)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Implements the 'minigit clone' command:
+//   minigit clone [--shared | [--filter=blob:none] [--depth=<n>]] <source> [<directory>]
+// Clones a local repository. Loose objects, packs and the commit-graph are
+// hardlinked on a thread pool (copied when the source is on another file
+// system); with --shared nothing is linked and the new repository borrows the
+// source's objects through objects/info/alternates. Refs and HEAD are copied,
+// the source is recorded as remote.origin.url with its branches mirrored
+// under refs/remotes/origin/, and HEAD is checked out in parallel.
+// --filter=blob:none makes a partial clone instead: commits and trees are
+// fetched through upload-pack, and blobs are fetched from the source (the
+// promisor remote) when first needed, starting with those HEAD checks out.
+// --depth=<n> fetches only the last <n> commits of each branch, recording
+// where history was cut in .minigit/shallow.
+bool MiniGit::clone(const std::vector<std::string>& args) {
+    bool shared = false, partial = false;
+    std::string depth;
+    std::vector<std::string> paths;
+    for (const std::string& arg : args) {
+        if (arg.compare(0, 8, "--depth=") == 0) {
+            depth = arg.substr(8);
+            if (std::atoi(depth.c_str()) <= 0) {
+                std::cerr << "Error: Depth " << depth << " is not a positive number" << std::endl;
+                return false;
+            }
+        } else if (arg == "--shared" || arg == "-s") {
+            shared = true;
+        } else if (arg.compare(0, 9, "--filter=") == 0) {
+            if (arg != "--filter=blob:none") {
+                std::cerr << "Error: Unsupported filter " << arg.substr(9) << " (only blob:none)" << std::endl;
+                return false;
+            }
+            partial = true;
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    bool fetched = partial || !depth.empty();
+    if (paths.empty() || paths.size() > 2 || (shared && fetched)) {
+        std::cerr << "Usage: minigit clone [--shared | [--filter=blob:none] [--depth=<n>]] <source> [<directory>]"
+                  << std::endl;
+        return false;
+    }
+    fs::path source = fs::absolute(paths[0]).lexically_normal();
+    if (source.filename().empty()) source = source.parent_path();
+    fs::path source_dir = source / minigit_dir_name_;
+    if (!fs::is_directory(source_dir / "objects")) {
+        std::cerr << "Error: '" << paths[0] << "' is not a MiniGit repository" << std::endl;
+        return false;
+    }
+    fs::path target = fs::absolute(paths.size() == 2 ? fs::path(paths[1]) : source.filename());
+    std::error_code ec;
+    if (fs::exists(target, ec) && !fs::is_empty(target, ec)) {
+        std::cerr << "Error: Destination path '" << target.string() << "' already exists and is not an empty directory"
+                  << std::endl;
+        return false;
+    }
+    std::cout << "Cloning into '" << (paths.size() == 2 ? paths[1] : source.filename().string()) << "'..." << std::endl;
+    fs::create_directories(target, ec);
+    fs::current_path(target, ec);
+    if (ec) {
+        std::cerr << "Error: Could not enter " << target.string() << ": " << ec.message() << std::endl;
+        return false;
+    }
+    for (const char* dir : {"/objects/pack", "/objects/info", "/refs/heads", "/refs/tags"}) {
+        fs::create_directories(minigit_dir_name_ + dir, ec);
+        if (ec) {
+            std::cerr << "Error: Could not create " << minigit_dir_name_ << dir << std::endl;
+            return false;
+        }
+    }
+
+    // Objects: fetched (without blobs or old history), borrowed, or
+    // hardlinked file by file.
+    std::string alternates_path = minigit_dir_name_ + "/objects/info/alternates";
+    std::string source_alternates;
+    read_file((source_dir / "objects/info/alternates").string(), source_alternates);
+    std::size_t linked = 0;
+    if (fetched) {
+        if (!config_set("remote.origin.url", source.string()) ||
+            (partial && (!config_set("remote.origin.promisor", "true") ||
+                         !config_set("remote.origin.partialclonefilter", "blob:none") ||
+                         !config_set("extensions.partialclone", "origin"))) ||
+            !fetch(depth.empty() ? std::vector<std::string>{"origin"}
+                                 : std::vector<std::string>{"--depth=" + depth, "origin"})) {
+            return false;
+        }
+    } else if (shared) {
+        if (!write_file_atomic(alternates_path, (source_dir / "objects").string() + "\n" + source_alternates)) {
+            std::cerr << "Error: Could not write " << alternates_path << std::endl;
+            return false;
+        }
+    } else {
+        if (!source_alternates.empty() && !write_file_atomic(alternates_path, source_alternates)) {
+            std::cerr << "Error: Could not write " << alternates_path << std::endl;
+            return false;
+        }
+        std::vector<std::pair<fs::path, std::string>> links;
+        for (const auto& entry : fs::directory_iterator(source_dir / "objects", ec)) {
+            ObjectId oid;
+            if (entry.is_regular_file() && ObjectId::from_hex(entry.path().filename().string(), oid)) {
+                links.emplace_back(entry.path(), minigit_dir_name_ + "/objects/" + entry.path().filename().string());
+            }
+        }
+        for (const auto& entry : fs::directory_iterator(source_dir / "objects/pack", ec)) {
+            std::string ext = entry.path().extension().string();
+            if (ext == ".pack" || ext == ".idx") {
+                links.emplace_back(entry.path(), minigit_dir_name_ + "/objects/pack/" + entry.path().filename().string());
+            }
+        }
+        if (fs::exists(source_dir / "commit-graph")) {
+            links.emplace_back(source_dir / "commit-graph", minigit_dir_name_ + "/commit-graph");
+        }
+        // Objects are never modified in place (writers rename new files over
+        // old ones), so sharing inodes with the source is safe.
+        const std::size_t kChunk = 256;
+        ThreadPool pool;
+        std::vector<std::future<bool>> results;
+        for (std::size_t begin = 0; begin < links.size(); begin += kChunk) {
+            std::size_t end = std::min(links.size(), begin + kChunk);
+            results.push_back(pool.submit([&links, begin, end] {
+                for (std::size_t i = begin; i < end; ++i) {
+                    std::error_code link_error;
+                    fs::create_hard_link(links[i].first, links[i].second, link_error);
+                    if (link_error && !fs::copy_file(links[i].first, links[i].second, link_error)) {
+                        std::cerr << "Error: Could not link " << links[i].first.string() << ": " << link_error.message()
+                                  << std::endl;
+                        return false;
+                    }
+                }
+                return true;
+            }));
+        }
+        bool ok = true;
+        for (auto& result : results) ok = result.get() && ok;
+        if (!ok) {
+            return false;
+        }
+        linked = links.size();
+    }
+
+    // Refs and HEAD. The fetch already set the remote branches and tags.
+    for (const auto& ref : fetched ? list_refs("refs/remotes/origin") : std::vector<std::pair<std::string, ObjectId>>{}) {
+        if (!update_ref("refs/heads/" + ref.first.substr(20), ref.second)) {
+            return false;
+        }
+    }
+    for (const auto& entry : fs::recursive_directory_iterator(source_dir / "refs", ec)) {
+        if (fetched || !entry.is_regular_file()) continue;
+        std::string name = "refs/" + fs::relative(entry.path(), source_dir / "refs").generic_string();
+        std::string content;
+        ObjectId oid;
+        if (name.compare(0, 13, "refs/remotes/") == 0 || !read_file(entry.path().string(), content) ||
+            !ObjectId::from_hex(trim(content), oid)) {
+            continue;
+        }
+        if (!update_ref(name, oid) ||
+            (name.compare(0, 11, "refs/heads/") == 0 && !update_ref("refs/remotes/origin/" + name.substr(11), oid))) {
+            return false;
+        }
+    }
+    std::string head;
+    if (!read_file((source_dir / "HEAD").string(), head) || !write_file_atomic(minigit_dir_name_ + "/HEAD", head)) {
+        std::cerr << "Error: Could not copy HEAD" << std::endl;
+        return false;
+    }
+    if (!config_set("remote.origin.url", source.string())) {
+        return false;
+    }
 
-    std::stringstream ss;
-    ss << std::hex << std::setw(32) << std::setfill('0') << content_hash; // Use 32 hex chars for a hash-like appearance
-    return ss.str();
+    std::string symref;
+    ObjectId commit_oid;
+    Commit commit;
+    if (!read_head(symref, commit_oid)) {
+        return false;
+    }
+    if (commit_oid.is_null()) {
+        std::cout << "warning: You appear to have cloned an empty repository." << std::endl;
+        return write_index({});
+    }
+    std::vector<IndexEntry> index;
+    if (!read_commit(commit_oid, commit) || !list_tree_entries(commit.tree, "", index) ||
+        !checkout_entries(index) || !write_index(index)) {
+        return false;
+    }
+    std::cout << "done. ";
+    if (fetched) {
+        std::cout << (partial ? "Blobs are fetched from " + source.string() + " on demand"
+                              : "History cut at depth " + depth);
+    } else if (shared) {
+        std::cout << "Objects are borrowed from " << (source_dir / "objects").string();
+    } else {
+        std::cout << "Linked " << linked << " object files";
+    }
+    std::cout << ", checked out " << index.size() << " files." << std::endl;
+    return true;
 }
 
-class MiniGit {
+// pkt-line framing over a pair of file descriptors, as in Git's wire protocol:
+// each line is prefixed with its length in 4 hex digits (counting the prefix),
+// and "0000" is a flush packet that ends a section. Output is buffered until
+// a flush; raw data (a pack) may follow a line that announces its size.
+class PktChannel {
 public:
-    // Constructor initializes the base directory name
-    MiniGit() : minigit_dir_name_(".minigit") {}
+    PktChannel(int in, int out) : in_(in), out_(out) {}
 
-    // Implements the 'minigit init' command
-    void init() {
-        std::cout << "Initializing MiniGit repository..." << std::endl;
+    void write_line(const std::string& line) {
+        char prefix[5];
+        std::snprintf(prefix, sizeof(prefix), "%04zx", line.size() + 5);
+        out_buf_.append(prefix, 4);
+        out_buf_ += line;
+        out_buf_ += '\n';
+    }
 
-        // Check if .minigit directory already exists
-        if (fs::exists(minigit_dir_name_) && fs::is_directory(minigit_dir_name_)) {
-            std::cout << "Reinitializing existing MiniGit repository in " << fs::current_path() << std::endl;
-            // In a real Git, re-init might reset HEAD or just confirm.
-            // For simplicity, we'll just confirm existence here.
-        } else {
-            // Create the .minigit directory
-            if (!fs::create_directory(minigit_dir_name_)) {
-                std::cerr << "Error: Could not create directory " << minigit_dir_name_ << std::endl;
-                return;
+    bool write_flush() {
+        out_buf_ += "0000";
+        return send();
+    }
+
+    bool write_raw(const std::string& data) {
+        out_buf_ += data;
+        return send();
+    }
+
+    // Reads the next packet into 'line' (without its newline); 'flush' tells
+    // whether it was a flush packet. Fails at end of input or on bad framing.
+    bool read_line(std::string& line, bool& flush) {
+        if (!fill(4)) {
+            return false;
+        }
+        std::size_t size = 0;
+        for (int i = 0; i < 4; ++i) {
+            int digit = hex_digit_value(in_buf_[in_pos_ + i]);
+            if (digit < 0) {
+                return false;
             }
-            std::cout << "Created directory: " << minigit_dir_name_ << std::endl;
+            size = size * 16 + static_cast<std::size_t>(digit);
+        }
+        flush = size == 0;
+        if (flush) {
+            in_pos_ += 4;
+            line.clear();
+            return true;
         }
+        if (size < 4 || !fill(size)) {
+            return false;
+        }
+        line.assign(in_buf_, in_pos_ + 4, size - 4);
+        in_pos_ += size;
+        if (!line.empty() && line.back() == '\n') line.pop_back();
+        return true;
+    }
 
-        // Create .minigit/objects directory for storing blob contents
-        std::string objects_path = minigit_dir_name_ + "/objects";
-        if (!fs::exists(objects_path)) {
-            if (!fs::create_directory(objects_path)) {
-                std::cerr << "Error: Could not create directory " << objects_path << std::endl;
-                return;
+    bool read_raw(std::size_t size, std::string& out) {
+        if (!fill(size)) {
+            return false;
+        }
+        out.assign(in_buf_, in_pos_, size);
+        in_pos_ += size;
+        return true;
+    }
+
+private:
+    static int hex_digit_value(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        return -1;
+    }
+
+    // Makes at least 'size' unread bytes available.
+    bool fill(std::size_t size) {
+        if (in_pos_ > 0 && in_buf_.size() - in_pos_ < size) {
+            in_buf_.erase(0, in_pos_);
+            in_pos_ = 0;
+        }
+        char buffer[65536];
+        while (in_buf_.size() - in_pos_ < size) {
+            ssize_t n = ::read(in_, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                return false;
             }
-            std::cout << "Created directory: " << objects_path << std::endl;
+            in_buf_.append(buffer, static_cast<std::size_t>(n));
         }
+        return true;
+    }
 
-        // Create .minigit/refs directory for storing references (branches, tags)
-        std::string refs_path = minigit_dir_name_ + "/refs";
-        if (!fs::exists(refs_path)) {
-            if (!fs::create_directory(refs_path)) {
-                std::cerr << "Error: Could not create directory " << refs_path << std::endl;
-                return;
+    bool send() {
+        std::size_t done = 0;
+        while (done < out_buf_.size()) {
+            ssize_t n = ::write(out_, out_buf_.data() + done, out_buf_.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                out_buf_.clear();
+                return false;
             }
-            std::cout << "Created directory: " << refs_path << std::endl;
+            done += static_cast<std::size_t>(n);
         }
+        out_buf_.clear();
+        return true;
+    }
 
-        // Create .minigit/refs/heads directory for storing branch pointers
-        std::string heads_path = refs_path + "/heads";
-        if (!fs::exists(heads_path)) {
-            if (!fs::create_directory(heads_path)) {
-                std::cerr << "Error: Could not create directory " << heads_path << std::endl;
-                return;
+    int in_;
+    int out_;
+    std::string in_buf_;
+    std::size_t in_pos_ = 0;
+    std::string out_buf_;
+};
+
+// A 'minigit <service> <directory>' child process (this same executable)
+// talking to us through a pair of pipes. Its stderr is ours.
+class ServiceProcess {
+public:
+    ServiceProcess() = default;
+    ServiceProcess(const ServiceProcess&) = delete;
+    ServiceProcess& operator=(const ServiceProcess&) = delete;
+    ~ServiceProcess() { finish(); }
+
+    bool start(const std::string& service, const std::string& directory) {
+        char exe[4096];
+        ssize_t length = ::readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+        int to_child[2], from_child[2];
+        if (length <= 0 || ::pipe(to_child) != 0) {
+            std::cerr << "Error: Could not start " << service << std::endl;
+            return false;
+        }
+        exe[length] = '\0';
+        if (::pipe(from_child) != 0) {
+            ::close(to_child[0]);
+            ::close(to_child[1]);
+            std::cerr << "Error: Could not start " << service << std::endl;
+            return false;
+        }
+        std::cout.flush();
+        pid_ = ::fork();
+        if (pid_ == 0) {
+            ::dup2(to_child[0], 0);
+            ::dup2(from_child[1], 1);
+            ::close(to_child[0]);
+            ::close(to_child[1]);
+            ::close(from_child[0]);
+            ::close(from_child[1]);
+            ::execl(exe, "minigit", service.c_str(), directory.c_str(), static_cast<char*>(nullptr));
+            _exit(127);
+        }
+        ::close(to_child[0]);
+        ::close(from_child[1]);
+        if (pid_ < 0) {
+            ::close(to_child[1]);
+            ::close(from_child[0]);
+            std::cerr << "Error: Could not start " << service << std::endl;
+            return false;
+        }
+        in_ = from_child[0];
+        out_ = to_child[1];
+        return true;
+    }
+
+    int in() const { return in_; }
+    int out() const { return out_; }
+
+    // Closes the pipes and waits for the child; true if it exited with 0.
+    bool finish() {
+        if (in_ >= 0) ::close(in_);
+        if (out_ >= 0) ::close(out_);
+        in_ = out_ = -1;
+        if (pid_ <= 0) {
+            return false;
+        }
+        int status = 0;
+        while (::waitpid(pid_, &status, 0) < 0 && errno == EINTR) {
+        }
+        pid_ = -1;
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+
+private:
+    pid_t pid_ = -1;
+    int in_ = -1;
+    int out_ = -1;
+};
+
+// Picks the "have" commits a fetch offers, like Git's skipping negotiator.
+// Local history is walked newest first. Along each line of history the
+// commits offered are spaced further and further apart (1, 2, 4, 7, 11...
+// commits, growing by half each time), so a long history that the other side
+// has most of costs O(log n) haves rather than O(n). An acknowledged commit
+// makes every ancestor met so far common: those are neither offered nor
+// walked.
+class SkipNegotiator {
+public:
+    using Reader = std::function<bool(const ObjectId&, CommitInfo&)>;
+
+    explicit SkipNegotiator(Reader reader) : reader_(std::move(reader)) {}
+
+    void add_tip(const ObjectId& oid) { push(oid, 0, 0); }
+
+    // The next commit to offer, or a null id once history is exhausted.
+    ObjectId next() {
+        while (!queue_.empty()) {
+            Entry entry = queue_.top();
+            queue_.pop();
+            unsigned& flags = *flags_.find(entry.oid);
+            if (flags & kCommon) continue;
+            flags |= kPopped;
+            CommitInfo info;
+            if (!reader_(entry.oid, info)) continue;
+            // Parents skip one fewer commit, or after an offered commit start a
+            // gap half as long again as the previous one.
+            std::uint32_t stride = entry.skip > 0 ? entry.stride : entry.stride * 3 / 2 + 1;
+            std::uint32_t skip = entry.skip > 0 ? entry.skip - 1 : stride;
+            bool pushed = false;
+            for (const ObjectId& parent : info.parents) pushed = push(parent, skip, stride) || pushed;
+            // A root (or a commit whose parents were all walked already) is
+            // always offered, so no line of history ends unoffered.
+            if (entry.skip == 0 || !pushed) {
+                return entry.oid;
             }
-            std::cout << "Created directory: " << heads_path << std::endl;
         }
+        return ObjectId{};
+    }
 
-        // Initialize HEAD file to point to the 'main' branch
-        // In real Git, HEAD initially points to 'ref: refs/heads/master' or 'ref: refs/heads/main'
-        std::string head_path = minigit_dir_name_ + "/HEAD";
-        std::ofstream head_file(head_path);
-        if (head_file.is_open()) {
-            head_file << "ref: refs/heads/main" << std::endl;
-            head_file.close();
-            std::cout << "Initialized HEAD to point to refs/heads/main" << std::endl;
-        } else {
-            std::cerr << "Error: Could not create HEAD file." << std::endl;
+    // Records that the other side has 'oid', and so all of its ancestors.
+    void ack(const ObjectId& oid) {
+        std::vector<ObjectId> stack{oid};
+        while (!stack.empty()) {
+            ObjectId current = stack.back();
+            stack.pop_back();
+            unsigned* flags = flags_.find(current);
+            if (flags == nullptr) {
+                flags = flags_.insert(current, 0).first;
+            }
+            if (*flags & kCommon) continue;
+            *flags |= kCommon;
+            // Parents of a walked commit are known; further ones are never
+            // queued because their children are common.
+            CommitInfo info;
+            if ((*flags & kPopped) && reader_(current, info)) {
+                for (const ObjectId& parent : info.parents) {
+                    if (flags_.contains(parent)) stack.push_back(parent);
+                }
+            }
+        }
+    }
+
+private:
+    enum : unsigned { kQueued = 1, kPopped = 2, kCommon = 4 };
+    struct Entry {
+        ObjectId oid;
+        std::int64_t time;
+        std::uint32_t skip;
+        std::uint32_t stride;
+    };
+    struct Older {
+        bool operator()(const Entry& a, const Entry& b) const { return a.time < b.time; }
+    };
+
+    bool push(const ObjectId& oid, std::uint32_t skip, std::uint32_t stride) {
+        auto inserted = flags_.insert(oid, kQueued);
+        if (!inserted.second) {
+            return false;
         }
+        CommitInfo info;
+        if (!reader_(oid, info)) {
+            return false;
+        }
+        queue_.push({oid, info.commit_time, skip, stride});
+        return true;
+    }
 
-        // Create the initial 'main' branch file (it will be empty until the first commit)
-        std::string main_branch_path = heads_path + "/main";
-        std::ofstream main_branch_file(main_branch_path);
-        if (main_branch_file.is_open()) {
-            main_branch_file.close(); // File is created but empty, will hold commit hash later
-            std::cout << "Created initial 'main' branch reference file." << std::endl;
-        } else {
-            std::cerr << "Error: Could not create main branch file." << std::endl;
+    Reader reader_;
+    OidMap<unsigned> flags_;
+    std::priority_queue<Entry, std::vector<Entry>, Older> queue_;
+};
+
+// Reads a ref advertisement: "<id> <refname>" lines up to a flush.
+static bool read_ref_advertisement(PktChannel& channel, std::vector<std::pair<std::string, ObjectId>>& refs) {
+    std::string line;
+    bool flush = false;
+    while (channel.read_line(line, flush) && !flush) {
+        ObjectId oid;
+        std::size_t space = line.find(' ');
+        if (space == std::string::npos || !ObjectId::from_hex(line.substr(0, space), oid)) {
+            std::cerr << "Error: Bad ref advertisement line: " << line << std::endl;
+            return false;
         }
+        refs.emplace_back(line.substr(space + 1), oid);
+    }
+    if (!flush) {
+        std::cerr << "Error: The remote end hung up unexpectedly" << std::endl;
+        return false;
+    }
+    return true;
+}
 
+// Sends "packfile <size>" and the pack, or "packfile 0" for no pack.
+static bool send_pack(PktChannel& channel, const std::string& pack) {
+    channel.write_line("packfile " + std::to_string(pack.size()));
+    return channel.write_raw(pack);
+}
 
-        std::cout << "MiniGit repository initialized successfully!" << std::endl;
+static bool receive_pack_data(PktChannel& channel, std::string& pack) {
+    std::string line;
+    bool flush = false;
+    if (!channel.read_line(line, flush) || flush || line.compare(0, 9, "packfile ") != 0) {
+        std::cerr << "Error: Expected a pack from the remote end" << std::endl;
+        return false;
+    }
+    std::size_t size = std::strtoull(line.c_str() + 9, nullptr, 10);
+    if (!channel.read_raw(size, pack)) {
+        std::cerr << "Error: The remote end hung up before sending the whole pack" << std::endl;
+        return false;
     }
+    return true;
+}
 
-    // Stores file content as a 'blob' in the .minigit/objects directory.
-    // Returns the hash of the blob.
-    std::string save_blob(const std::string& file_content) {
-        std::string hash = generate_simple_hash(file_content);
-        std::string blob_path = minigit_dir_name_ + "/objects/" + hash;
-
-        std::ofstream outfile(blob_path);
-        if (outfile.is_open()) {
-            outfile << file_content;
-            outfile.close();
-            // std::cout << "Saved blob with hash: " << hash << std::endl; // For debugging
-            return hash;
-        } else {
-            std::cerr << "Error: Could not save blob to " << blob_path << std::endl;
-            return ""; // Return empty string on error
+// The refs a server advertises: HEAD, then branches and tags by name.
+std::vector<std::pair<std::string, ObjectId>> MiniGit::advertised_refs() {
+    std::vector<std::pair<std::string, ObjectId>> refs;
+    std::string symref;
+    ObjectId head;
+    if (read_head(symref, head) && !head.is_null()) refs.emplace_back("HEAD", head);
+    for (const char* prefix : {"refs/heads", "refs/tags"}) {
+        for (auto& ref : list_refs(prefix)) refs.push_back(std::move(ref));
+    }
+    return refs;
+}
+
+// The repository directory a remote name (from remote.<name>.url) or path
+// stands for, and the name to keep remote-tracking refs under (empty for a
+// bare path).
+bool MiniGit::resolve_remote(const std::string& remote, std::string& url, std::string& name) {
+    url = config_get("remote." + remote + ".url");
+    name = remote;
+    if (url.empty()) {
+        name.clear();
+        url = remote;
+    }
+    if (!fs::is_directory(fs::path(url) / minigit_dir_name_)) {
+        std::cerr << "Error: '" << remote << "' does not appear to be a MiniGit repository" << std::endl;
+        return false;
+    }
+    url = fs::absolute(url).lexically_normal().string();
+    return true;
+}
+
+// Implements 'minigit upload-pack <directory>', the server side of fetch,
+// on stdin/stdout:
+//   S: ref advertisement, flush
+//   C: "want <commit id>" and "want-object <id>" lines, optionally
+//      "filter blob:none", the client's "shallow <id>" boundary and
+//      "deepen <depth>", flush (no wants: the exchange ends here)
+//   S: with deepen, the new boundary as "shallow <id>" lines and the client's
+//      boundary commits it now gets the parents of as "unshallow <id>", flush
+//   C: rounds of "have <id>" lines, each ended by a flush
+//   S: per round, "ACK <id>" for each have it has, flush
+//   C: "done", flush
+//   S: "packfile <size>" and a thin pack of wants minus the acknowledged haves
+// "want-object" asks for one object as it is; partial clones fetch their
+// missing blobs that way.
+bool MiniGit::upload_pack(const std::vector<std::string>& args) {
+    std::error_code ec;
+    if (args.size() != 1 || (fs::current_path(args[0], ec), ec)) {
+        std::cerr << "Usage: minigit upload-pack <directory>" << std::endl;
+        return false;
+    }
+    std::signal(SIGPIPE, SIG_IGN);
+    PktChannel channel(0, 1);
+    for (const auto& ref : advertised_refs()) channel.write_line(ref.second.to_hex() + " " + ref.first);
+    if (!channel.write_flush()) {
+        return false;
+    }
+
+    PackRequest request;
+    int depth = 0;
+    std::string line;
+    bool flush = false;
+    while (channel.read_line(line, flush) && !flush) {
+        ObjectId oid;
+        if (line == "filter blob:none") {
+            request.omit_blobs = true;
+        } else if (line.compare(0, 7, "deepen ") == 0) {
+            depth = std::atoi(line.c_str() + 7);
+            if (depth <= 0) {
+                std::cerr << "Error: upload-pack: invalid depth " << line.substr(7) << std::endl;
+                return false;
+            }
+        } else if (line.compare(0, 8, "shallow ") == 0 && ObjectId::from_hex(line.substr(8), oid)) {
+            request.shallow.insert(oid);
+        } else if (line.compare(0, 5, "want ") == 0 && ObjectId::from_hex(line.substr(5), oid) && has_object(oid)) {
+            request.wants.push_back(oid);
+        } else if (line.compare(0, 12, "want-object ") == 0 && ObjectId::from_hex(line.substr(12), oid) &&
+                   has_object(oid)) {
+            request.objects.push_back(oid);
+        } else {
+            std::cerr << "Error: upload-pack: not our ref " << line << std::endl;
+            return false;
+        }
+    }
+    if (!flush) {
+        return false;
+    }
+    if (request.wants.empty() && request.objects.empty()) {
+        return true;
+    }
+    if (depth > 0) {
+        // Breadth first, so each commit is met at its smallest depth. Commits
+        // at the requested depth that have parents form the new boundary.
+        OidMap<int> seen;
+        std::deque<std::pair<ObjectId, int>> queue;
+        for (const ObjectId& want : request.wants) {
+            if (seen.insert(want, 1).second) queue.emplace_back(want, 1);
+        }
+        std::vector<ObjectId> deepened;
+        while (!queue.empty()) {
+            auto [oid, d] = queue.front();
+            queue.pop_front();
+            CommitInfo info;
+            if (!read_commit_info(oid, info)) {
+                std::cerr << "Error: upload-pack: could not read commit " << oid << std::endl;
+                return false;
+            }
+            if (info.parents.empty()) continue;
+            if (d >= depth) {
+                channel.write_line("shallow " + oid.to_hex());
+                request.shallow.insert(oid);
+                continue;
+            }
+            if (request.shallow.contains(oid)) {
+                channel.write_line("unshallow " + oid.to_hex());
+                deepened.push_back(oid);
+            }
+            for (const ObjectId& parent : info.parents) {
+                if (seen.insert(parent, d + 1).second) queue.emplace_back(parent, d + 1);
+            }
+        }
+        // The client has the deepened commits but not their parents, so those
+        // are wanted in their own right; the walk from the client's haves
+        // still stops at the deepened commits.
+        for (const ObjectId& oid : deepened) {
+            CommitInfo info;
+            if (read_commit_info(oid, info)) {
+                request.wants.insert(request.wants.end(), info.parents.begin(), info.parents.end());
+            }
+        }
+        if (!channel.write_flush()) {
+            return false;
+        }
+    }
+    for (;;) {
+        bool done = false;
+        while (channel.read_line(line, flush) && !flush) {
+            ObjectId oid;
+            CommitInfo info;
+            if (line == "done") {
+                done = true;
+            } else if (line.compare(0, 5, "have ") == 0 && ObjectId::from_hex(line.substr(5), oid)) {
+                if (has_object(oid) && read_commit_info(oid, info)) {
+                    request.haves.push_back(oid);
+                    channel.write_line("ACK " + oid.to_hex());
+                }
+            } else {
+                std::cerr << "Error: upload-pack: unexpected line " << line << std::endl;
+                return false;
+            }
+        }
+        if (!flush) {
+            return false;
+        }
+        if (done) {
+            break;
+        }
+        if (!channel.write_flush()) {
+            return false;
         }
     }
+    std::string pack;
+    return build_pack(request, pack) && send_pack(channel, pack);
+}
 
-    // Reads the content of a blob given its hash.
-    // Returns the content as a string.
-    std::string read_blob(const std::string& hash) {
-        std::string blob_path = minigit_dir_name_ + "/objects/" + hash;
-        std::ifstream infile(blob_path);
-        std::string content;
+// Implements the 'minigit fetch' command:
+//   minigit fetch [<remote> | <path>]
+// Runs upload-pack in the remote repository (remote.origin.url by default)
+// and fetches its branches and tags. Only objects we lack cross the pipe:
+// "have" commits are offered in rounds of 32 as picked by SkipNegotiator,
+// and the remote packs just what the acknowledged ones do not reach, with
+// deltas against objects we already have. Branches land in
+// refs/remotes/<remote>/, tags in refs/tags/, and all tips in FETCH_HEAD.
+bool MiniGit::fetch(const std::vector<std::string>& args) {
+    int depth = 0;
+    std::vector<std::string> positional;
+    for (std::size_t i = 0; i < args.size(); ++i) {
+        if (args[i].compare(0, 8, "--depth=") == 0) {
+            depth = std::atoi(args[i].c_str() + 8);
+        } else if (args[i] == "--depth" && i + 1 < args.size()) {
+            depth = std::atoi(args[++i].c_str());
+        } else {
+            positional.push_back(args[i]);
+        }
+    }
+    if (positional.size() > 1 || depth < 0) {
+        std::cerr << "Usage: minigit fetch [--depth=<n>] [<remote>]" << std::endl;
+        return false;
+    }
+    std::string remote = positional.empty() ? "origin" : positional[0];
+    std::string url, name;
+    if (!resolve_remote(remote, url, name)) {
+        return false;
+    }
+    std::signal(SIGPIPE, SIG_IGN);
+    ServiceProcess process;
+    if (!process.start("upload-pack", url)) {
+        return false;
+    }
+    PktChannel channel(process.in(), process.out());
+    std::vector<std::pair<std::string, ObjectId>> refs;
+    if (!read_ref_advertisement(channel, refs)) {
+        return false;
+    }
+
+    // Deepening wants the tips we have too: the history below them is what
+    // is missing.
+    OidSet wanted;
+    std::vector<ObjectId> wants;
+    for (const auto& ref : refs) {
+        if (ref.first != "HEAD" && (depth > 0 || !has_object(ref.second)) && wanted.insert(ref.second)) {
+            wants.push_back(ref.second);
+            channel.write_line("want " + ref.second.to_hex());
+        }
+    }
+    if (!wants.empty()) {
+        // A partial clone keeps fetching without blobs.
+        if (!name.empty() && config_get("remote." + name + ".partialclonefilter") == "blob:none") {
+            channel.write_line("filter blob:none");
+        }
+        for (const ObjectId& oid : read_shallow_file()) channel.write_line("shallow " + oid.to_hex());
+        if (depth > 0) channel.write_line("deepen " + std::to_string(depth));
+    }
+    if (!channel.write_flush()) {
+        std::cerr << "Error: The remote end hung up unexpectedly" << std::endl;
+        return false;
+    }
+    std::vector<ObjectId> shallow, unshallow;
+    if (!wants.empty() && depth > 0) {
+        std::string line;
+        bool flush = false;
+        while (channel.read_line(line, flush) && !flush) {
+            ObjectId oid;
+            if (line.compare(0, 8, "shallow ") == 0 && ObjectId::from_hex(line.substr(8), oid)) {
+                shallow.push_back(oid);
+            } else if (line.compare(0, 10, "unshallow ") == 0 && ObjectId::from_hex(line.substr(10), oid)) {
+                unshallow.push_back(oid);
+            }
+        }
+        if (!flush) {
+            std::cerr << "Error: The remote end hung up unexpectedly" << std::endl;
+            return false;
+        }
+    }
+
+    std::size_t offered = 0, acknowledged = 0, objects = 0;
+    if (!wants.empty()) {
+        SkipNegotiator negotiator([this](const ObjectId& oid, CommitInfo& info) { return read_commit_info(oid, info); });
+        for (const char* prefix : {"refs/heads", "refs/remotes", "refs/tags"}) {
+            for (const auto& ref : list_refs(prefix)) negotiator.add_tip(ref.second);
+        }
+        std::string symref;
+        ObjectId head;
+        if (fs::exists(minigit_dir_name_ + "/HEAD") && read_head(symref, head) && !head.is_null()) {
+            negotiator.add_tip(head);
+        }
 
-        if (infile.is_open()) {
+        // Give up on finding more common commits after this many unanswered
+        // haves in a row, as Git does.
+        const std::size_t kRoundSize = 32, kMaxInVain = 256;
+        std::size_t in_vain = 0;
+        while (in_vain < kMaxInVain) {
+            std::size_t sent = 0;
+            for (ObjectId have; sent < kRoundSize && !(have = negotiator.next()).is_null(); ++sent) {
+                channel.write_line("have " + have.to_hex());
+            }
+            if (sent == 0) {
+                break;
+            }
+            offered += sent;
+            if (!channel.write_flush()) {
+                std::cerr << "Error: The remote end hung up unexpectedly" << std::endl;
+                return false;
+            }
             std::string line;
-            while (std::getline(infile, line)) {
-                content += line + "\n";
+            bool flush = false;
+            std::size_t acks = 0;
+            while (channel.read_line(line, flush) && !flush) {
+                ObjectId oid;
+                if (line.compare(0, 4, "ACK ") == 0 && ObjectId::from_hex(line.substr(4), oid)) {
+                    negotiator.ack(oid);
+                    ++acks;
+                }
             }
-            infile.close();
-            if (!content.empty()) {
-                content.pop_back(); // Remove the last newline character if present
+            if (!flush) {
+                std::cerr << "Error: The remote end hung up unexpectedly" << std::endl;
+                return false;
             }
-            // std::cout << "Read blob with hash: " << hash << std::endl; // For debugging
-            return content;
+            acknowledged += acks;
+            in_vain = acks > 0 ? 0 : in_vain + sent;
+        }
+        channel.write_line("done");
+        std::string pack;
+        if (!channel.write_flush() || !receive_pack_data(channel, pack)) {
+            return false;
+        }
+        objects = pack.size() >= 12 ? get_u32(pack.data() + 8) : 0;
+        if (objects > 0 && !store_pack(pack)) {
+            return false;
+        }
+    }
+    // A boundary commit whose parents we already have stays complete.
+    std::vector<ObjectId> cut;
+    for (const ObjectId& oid : shallow) {
+        std::string type, content;
+        Commit commit;
+        if (read_object(oid, type, content) && parse_commit(content, commit) &&
+            !std::all_of(commit.parents.begin(), commit.parents.end(),
+                         [this](const ObjectId& parent) { return has_object(parent); })) {
+            cut.push_back(oid);
+        }
+    }
+    if ((!cut.empty() || !unshallow.empty()) && !update_shallow(cut, unshallow)) {
+        return false;
+    }
+    if (!process.finish()) {
+        std::cerr << "Error: upload-pack failed" << std::endl;
+        return false;
+    }
+
+    std::string fetch_head;
+    bool changed = false;
+    for (const auto& ref : refs) {
+        const std::string& refname = ref.first;
+        std::string local, short_name;
+        if (refname.compare(0, 11, "refs/heads/") == 0) {
+            short_name = refname.substr(11);
+            if (!name.empty()) local = "refs/remotes/" + name + "/" + short_name;
+        } else if (refname.compare(0, 10, "refs/tags/") == 0) {
+            short_name = refname.substr(10);
+            local = refname;
         } else {
-            std::cerr << "Error: Could not read blob from " << blob_path << std::endl;
-            return ""; // Return empty string on error
+            continue;
+        }
+        fetch_head += ref.second.to_hex() + "\t" + refname + " of " + url + "\n";
+        if (local.empty()) continue;
+        ObjectId old = resolve_ref(local);
+        if (old == ref.second) continue;
+        if (!update_ref(local, ref.second)) {
+            return false;
+        }
+        std::string display = local.compare(0, 13, "refs/remotes/") == 0 ? local.substr(13) : short_name;
+        if (!changed) std::cout << "From " << url << std::endl;
+        changed = true;
+        if (old.is_null()) {
+            std::cout << " * [new " << (local == refname ? "tag" : "branch") << "]  " << short_name << " -> "
+                      << display << std::endl;
+        } else {
+            std::cout << "   " << old.to_hex().substr(0, 7) << ".." << ref.second.to_hex().substr(0, 7) << "  "
+                      << short_name << " -> " << display << std::endl;
+        }
+    }
+    if (!write_file_atomic(minigit_dir_name_ + "/FETCH_HEAD", fetch_head)) {
+        std::cerr << "Error: Could not write FETCH_HEAD" << std::endl;
+        return false;
+    }
+    if (!wants.empty()) {
+        std::cout << "Received " << objects << " objects; offered " << offered << " haves, " << acknowledged
+                  << " in common." << std::endl;
+    } else if (!changed) {
+        std::cout << "Already up to date." << std::endl;
+    }
+    return true;
+}
+
+// Fetches 'oids' as they are from 'remote', the promisor remote of a partial
+// clone, in one request without negotiation.
+bool MiniGit::fetch_objects(const std::string& remote, const std::vector<ObjectId>& oids) {
+    std::string url, name;
+    if (oids.empty()) {
+        return true;
+    }
+    if (!resolve_remote(remote, url, name)) {
+        return false;
+    }
+    std::signal(SIGPIPE, SIG_IGN);
+    ServiceProcess process;
+    if (!process.start("upload-pack", url)) {
+        return false;
+    }
+    PktChannel channel(process.in(), process.out());
+    std::vector<std::pair<std::string, ObjectId>> refs;
+    if (!read_ref_advertisement(channel, refs)) {
+        return false;
+    }
+    for (const ObjectId& oid : oids) channel.write_line("want-object " + oid.to_hex());
+    if (!channel.write_flush()) {
+        std::cerr << "Error: The remote end hung up unexpectedly" << std::endl;
+        return false;
+    }
+    channel.write_line("done");
+    std::string pack;
+    if (!channel.write_flush() || !receive_pack_data(channel, pack) || !store_pack(pack)) {
+        std::cerr << "Error: Could not fetch " << oids.size() << " missing objects from " << remote << std::endl;
+        return false;
+    }
+    return process.finish();
+}
+
+// Implements 'minigit receive-pack <directory>', the server side of push,
+// on stdin/stdout:
+//   S: ref advertisement, flush
+//   C: "update <old id> <new id> <refname>" lines, flush
+//   C: "packfile <size>" and a thin pack of the new objects
+//   S: "ok <refname>" or "ng <refname> <reason>" per update, flush
+// A ref is only moved if it still points at <old id>. The checked-out branch
+// is left alone unless receive.denyCurrentBranch is "ignore".
+bool MiniGit::receive_pack(const std::vector<std::string>& args) {
+    std::error_code ec;
+    if (args.size() != 1 || (fs::current_path(args[0], ec), ec)) {
+        std::cerr << "Usage: minigit receive-pack <directory>" << std::endl;
+        return false;
+    }
+    std::signal(SIGPIPE, SIG_IGN);
+    PktChannel channel(0, 1);
+    for (const auto& ref : advertised_refs()) {
+        if (ref.first != "HEAD") channel.write_line(ref.second.to_hex() + " " + ref.first);
+    }
+    if (!channel.write_flush()) {
+        return false;
+    }
+
+    struct Update {
+        ObjectId old_oid;
+        ObjectId new_oid;
+        std::string refname;
+    };
+    std::vector<Update> updates;
+    std::string line;
+    bool flush = false;
+    while (channel.read_line(line, flush) && !flush) {
+        Update update;
+        if (line.size() <= 7 + 2 * 41 || line.compare(0, 7, "update ") != 0 ||
+            !ObjectId::from_hex(line.substr(7, 40), update.old_oid) ||
+            !ObjectId::from_hex(line.substr(48, 40), update.new_oid)) {
+            std::cerr << "Error: receive-pack: bad update line " << line << std::endl;
+            return false;
         }
+        update.refname = line.substr(89);
+        updates.push_back(std::move(update));
     }
+    std::string pack;
+    if (!flush || updates.empty() || !receive_pack_data(channel, pack)) {
+        return flush && updates.empty();
+    }
+    bool unpacked = pack.empty() || store_pack(pack);
 
-private:
-    std::string minigit_dir_name_;
-};
+    std::string head_symref;
+    ObjectId head;
+    read_head(head_symref, head);
+    bool deny_current = config_get("receive.denyCurrentBranch", "refuse") != "ignore";
+    for (const Update& update : updates) {
+        std::string reason;
+        CommitInfo info;
+        if (update.refname.compare(0, 5, "refs/") != 0 || update.refname.find("..") != std::string::npos) {
+            reason = "funny refname";
+        } else if (!unpacked) {
+            reason = "unpacker error";
+        } else if (deny_current && update.refname == head_symref) {
+            reason = "branch is currently checked out";
+        } else if (resolve_ref(update.refname) != update.old_oid) {
+            reason = "stale info";
+        } else if (!update.new_oid.is_null() && !read_commit_info(update.new_oid, info)) {
+            reason = "missing necessary objects";
+        } else if (update.new_oid.is_null()) {
+            if (!fs::remove(minigit_dir_name_ + "/" + update.refname, ec)) reason = "failed to delete";
+        } else if (!update_ref(update.refname, update.new_oid)) {
+            reason = "failed to update ref";
+        }
+        channel.write_line((reason.empty() ? "ok " : "ng ") + update.refname + (reason.empty() ? "" : " " + reason));
+    }
+    return channel.write_flush();
+}
+
+// Implements the 'minigit push' command:
+//   minigit push [--force] [<remote> | <path>] [[+]<src>[:<dst>]...]
+// Runs receive-pack in the remote repository (remote.origin.url and the
+// current branch by default). No negotiation is needed: the refs the remote
+// advertises that we have are the haves, and the pack holds what the pushed
+// commits reach beyond them. Updates that are not fast-forwards are refused
+// unless forced; an empty <src> deletes <dst>.
+bool MiniGit::push(const std::vector<std::string>& args) {
+    bool force_all = false;
+    std::vector<std::string> positional;
+    for (const std::string& arg : args) {
+        if (arg == "--force" || arg == "-f") {
+            force_all = true;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    std::string remote = positional.empty() ? "origin" : positional[0];
+    std::vector<std::string> refspecs(positional.size() > 1 ? positional.begin() + 1 : positional.end(),
+                                      positional.end());
+    std::string symref;
+    ObjectId head;
+    if (!read_head(symref, head)) {
+        return false;
+    }
+    if (refspecs.empty()) {
+        if (symref.compare(0, 11, "refs/heads/") != 0) {
+            std::cerr << "Error: You are not currently on a branch" << std::endl;
+            return false;
+        }
+        refspecs.push_back(symref.substr(11));
+    }
+    std::string url, name;
+    if (!resolve_remote(remote, url, name)) {
+        return false;
+    }
+
+    struct Update {
+        std::string src;
+        std::string refname;
+        ObjectId old_oid;
+        ObjectId new_oid;
+        bool force;
+        bool forced = false;
+    };
+    std::vector<Update> updates;
+    for (const std::string& spec : refspecs) {
+        Update update;
+        update.force = force_all || (!spec.empty() && spec[0] == '+');
+        std::string body = spec.substr(spec.empty() || spec[0] != '+' ? 0 : 1);
+        std::size_t colon = body.find(':');
+        update.src = body.substr(0, colon);
+        std::string dst = colon == std::string::npos ? update.src : body.substr(colon + 1);
+        if (!update.src.empty() && !resolve_revision(update.src, update.new_oid)) {
+            std::cerr << "Error: src refspec " << update.src << " does not match any" << std::endl;
+            return false;
+        }
+        if (dst.empty() || dst == "HEAD") {
+            std::cerr << "Error: Bad refspec " << spec << std::endl;
+            return false;
+        }
+        if (dst.compare(0, 5, "refs/") != 0) {
+            dst = (!resolve_ref("refs/tags/" + dst).is_null() ? "refs/tags/" : "refs/heads/") + dst;
+        }
+        update.refname = dst;
+        updates.push_back(std::move(update));
+    }
+
+    std::signal(SIGPIPE, SIG_IGN);
+    ServiceProcess process;
+    if (!process.start("receive-pack", url)) {
+        return false;
+    }
+    PktChannel channel(process.in(), process.out());
+    std::vector<std::pair<std::string, ObjectId>> refs;
+    if (!read_ref_advertisement(channel, refs)) {
+        return false;
+    }
+    std::vector<ObjectId> haves, wants;
+    OidSet known;
+    for (const auto& ref : refs) {
+        CommitInfo info;
+        if (has_object(ref.second) && read_commit_info(ref.second, info) && known.insert(ref.second)) {
+            haves.push_back(ref.second);
+        }
+    }
+
+    std::cout << "To " << url << std::endl;
+    bool ok = true;
+    std::vector<const Update*> sent;
+    for (Update& update : updates) {
+        for (const auto& ref : refs) {
+            if (ref.first == update.refname) update.old_oid = ref.second;
+        }
+        std::string display = update.src + " -> " + update.refname.substr(update.refname.rfind('/') + 1);
+        if (update.old_oid == update.new_oid) {
+            std::cout << " = [up to date]      " << display << std::endl;
+            continue;
+        }
+        update.forced = !update.old_oid.is_null() && !update.new_oid.is_null() &&
+                        (!known.contains(update.old_oid) || !is_ancestor(update.old_oid, update.new_oid));
+        if (update.forced && !update.force) {
+            std::cout << " ! [rejected]        " << display
+                      << (known.contains(update.old_oid) ? " (non-fast-forward)" : " (fetch first)") << std::endl;
+            ok = false;
+            continue;
+        }
+        channel.write_line("update " + update.old_oid.to_hex() + " " + update.new_oid.to_hex() + " " +
+                           update.refname);
+        if (!update.new_oid.is_null()) wants.push_back(update.new_oid);
+        sent.push_back(&update);
+    }
+    if (!channel.write_flush()) {
+        std::cerr << "Error: The remote end hung up unexpectedly" << std::endl;
+        return false;
+    }
+    if (sent.empty()) {
+        if (ok) std::cout << "Everything up-to-date" << std::endl;
+        return process.finish() && ok;
+    }
+    std::string pack;
+    std::size_t objects = 0, deltas = 0;
+    if (!wants.empty() && !build_pack({wants, haves, {}, false, {}}, pack, nullptr, &objects, &deltas)) {
+        return false;
+    }
+    if (!send_pack(channel, pack)) {
+        std::cerr << "Error: The remote end hung up unexpectedly" << std::endl;
+        return false;
+    }
+
+    std::unordered_map<std::string, std::string> status;
+    std::string line;
+    bool flush = false;
+    while (channel.read_line(line, flush) && !flush) {
+        std::size_t space = line.find(' ', 3);
+        status[line.substr(3, space == std::string::npos ? std::string::npos : space - 3)] = line;
+    }
+    if (!process.finish() || !flush) {
+        std::cerr << "Error: receive-pack failed" << std::endl;
+        return false;
+    }
+    for (const Update* update : sent) {
+        std::string display = update->src + " -> " + update->refname.substr(update->refname.rfind('/') + 1);
+        const std::string& result = status[update->refname];
+        if (result.compare(0, 3, "ok ") != 0) {
+            std::string reason = result.size() > 4 + update->refname.size() ? result.substr(4 + update->refname.size())
+                                                                          : "no report";
+            std::cout << " ! [remote rejected] " << display << " (" << reason << ")" << std::endl;
+            ok = false;
+            continue;
+        }
+        if (update->new_oid.is_null()) {
+            std::cout << " - [deleted]         " << update->refname.substr(update->refname.rfind('/') + 1)
+                      << std::endl;
+        } else if (update->old_oid.is_null()) {
+            std::cout << " * [new " << (update->refname.compare(0, 10, "refs/tags/") == 0 ? "tag" : "branch")
+                      << "]      " << display << std::endl;
+        } else {
+            std::cout << (update->forced ? " + " : "   ") << update->old_oid.to_hex().substr(0, 7)
+                      << (update->forced ? "..." : "..") << update->new_oid.to_hex().substr(0, 7) << "  " << display
+                      << std::endl;
+        }
+        // Keep our remote-tracking ref in step, as a fetch would.
+        if (!name.empty() && update->refname.compare(0, 11, "refs/heads/") == 0) {
+            std::string tracking = "refs/remotes/" + name + "/" + update->refname.substr(11);
+            std::error_code ec;
+            if (update->new_oid.is_null()) {
+                fs::remove(minigit_dir_name_ + "/" + tracking, ec);
+            } else if (!update_ref(tracking, update->new_oid)) {
+                return false;
+            }
+        }
+    }
+    if (objects > 0) {
+        std::cout << "Sent " << objects << " objects (" << deltas << " deltas)." << std::endl;
+    }
+    return ok;
+}
 
 // Main function to simulate command line interaction
 int main(int argc, char* argv[]) {
@@ -158,19 +10835,74 @@ int main(int argc, char* argv[]) {
 
     if (argc < 2) {
         std::cout << "Usage: minigit <command> [arguments]" << std::endl;
-        std::cout << "Available commands: init, test_blob" << std::endl;
+        std::cout << "Available commands: init, clone, fetch, push, add, commit, status, diff, apply, merge, merge-tree, ahead-behind, cherry-pick, rebase, log, blame, grep, grep-index, archive, bundle, config, oid-map, commit-graph, fsck, test_blob, test_grep" << std::endl;
         return 1;
     }
 
     std::string command = argv[1];
+    std::vector<std::string> args(argv + 2, argv + argc);
 
     if (command == "init") {
-        minigit.init();
+        return minigit.init(args) ? 0 : 1;
+    } else if (command == "add") {
+        return minigit.add(args) ? 0 : 1;
+    } else if (command == "commit") {
+        return minigit.commit(args) ? 0 : 1;
+    } else if (command == "status") {
+        return minigit.status(args) ? 0 : 1;
+    } else if (command == "diff") {
+        return minigit.diff(args) ? 0 : 1;
+    } else if (command == "apply") {
+        return minigit.apply(args) ? 0 : 1;
+    } else if (command == "merge") {
+        return minigit.merge(args) ? 0 : 1;
+    } else if (command == "merge-tree") {
+        return minigit.merge_tree(args) ? 0 : 1;
+    } else if (command == "ahead-behind") {
+        return minigit.ahead_behind(args) ? 0 : 1;
+    } else if (command == "cherry-pick") {
+        return minigit.cherry_pick(args) ? 0 : 1;
+    } else if (command == "rebase") {
+        return minigit.rebase(args) ? 0 : 1;
+    } else if (command == "log") {
+        return minigit.log(args) ? 0 : 1;
+    } else if (command == "grep") {
+        return minigit.grep(args) ? 0 : 1;
+    } else if (command == "grep-index") {
+        return minigit.grep_index(args) ? 0 : 1;
+    } else if (command == "archive") {
+        return minigit.archive(args) ? 0 : 1;
+    } else if (command == "bundle") {
+        return minigit.bundle(args) ? 0 : 1;
+    } else if (command == "clone") {
+        return minigit.clone(args) ? 0 : 1;
+    } else if (command == "fetch") {
+        return minigit.fetch(args) ? 0 : 1;
+    } else if (command == "push") {
+        return minigit.push(args) ? 0 : 1;
+    } else if (command == "upload-pack") {
+        return minigit.upload_pack(args) ? 0 : 1;
+    } else if (command == "receive-pack") {
+        return minigit.receive_pack(args) ? 0 : 1;
+    } else if (command == "oid-map") {
+        return minigit.oid_map(args) ? 0 : 1;
+    } else if (command == "config") {
+        return minigit.config(args) ? 0 : 1;
+    } else if (command == "blame") {
+        return minigit.blame(args) ? 0 : 1;
+    } else if (command == "commit-graph") {
+        if (args.empty() || args[0] != "write") {
+            std::cerr << "Usage: minigit commit-graph write" << std::endl;
+            return 1;
+        }
+        return minigit.commit_graph_write() ? 0 : 1;
+    } else if (command == "fsck") {
+        return minigit.fsck() ? 0 : 1;
     } else if (command == "test_blob") {
         // This is a test command to demonstrate blob saving/reading
         std::cout << "--- Testing Blob Storage ---" << std::endl;
         std::string test_content1 = "Hello, MiniGit!";
-        std::string hash1 = minigit.save_blob(test_content1);
+        ObjectId hash1 = minigit.save_blob(test_content1);
         std::cout << "Content: \"" << test_content1 << "\", Saved as hash: " << hash1 << std::endl;
         std::string read_content1 = minigit.read_blob(hash1);
         std::cout << "Read content for hash " << hash1 << ": \"" << read_content1 << "\"" << std::endl;
@@ -179,7 +10911,7 @@ int main(int argc, char* argv[]) {
         std::cout << "\n";
 
         std::string test_content2 = "This is some different content for a second blob.";
-        std::string hash2 = minigit.save_blob(test_content2);
+        ObjectId hash2 = minigit.save_blob(test_content2);
         std::cout << "Content: \"" << test_content2 << "\", Saved as hash: " << hash2 << std::endl;
         std::string read_content2 = minigit.read_blob(hash2);
         std::cout << "Read content for hash " << hash2 << ": \"" << read_content2 << "\"" << std::endl;
@@ -188,14 +10920,49 @@ int main(int argc, char* argv[]) {
         std::cout << "\n";
 
         std::string test_content3 = "Hello, MiniGit!"; // Same content as test_content1
-        std::string hash3 = minigit.save_blob(test_content3);
+        ObjectId hash3 = minigit.save_blob(test_content3);
         std::cout << "Content: \"" << test_content3 << "\", Saved as hash: " << hash3 << std::endl;
         std::string read_content3 = minigit.read_blob(hash3);
         std::cout << "Read content for hash " << hash3 << ": \"" << read_content3 << "\"" << std::endl;
         std::cout << "Content matches: " << (test_content3 == read_content3 ? "true" : "false") << std::endl;
-        std::cout << "Hash of identical content (with timestamp influence): " << hash1 << " vs " << hash3 << std::endl;
+        std::cout << "Identical content shares one object: " << hash1 << " vs " << hash3
+                  << (hash1 == hash3 ? " (same)" : " (different)") << std::endl;
 
 
+    } else if (command == "test_grep") {
+        // Checks the literals grep requires of a match (they also decide which
+        // blobs the trigram index skips) and that patterns still find their lines.
+        struct Case {
+            const char* pattern;
+            GrepPattern::Syntax syntax;
+            const char* text;
+            std::vector<std::string> literals;
+        };
+        const GrepPattern::Syntax basic = GrepPattern::Syntax::Basic, extended = GrepPattern::Syntax::Extended;
+        const std::vector<Case> cases = {
+            {"foo", basic, "foo", {"foo"}},
+            {"o{2}", extended, "foo", {}},
+            {"fo{2}d", extended, "food", {"f", "d"}},
+            {"o\\{2\\}", basic, "foo", {}},
+            {"x\\.\\{0,1\\}y", basic, "xy", {"x", "y"}},
+            {"[^]x]ar", basic, "bar", {"ar"}},
+            {"[]x]ar", basic, "]ar", {"ar"}},
+            {"a[[:digit:]]b", extended, "a1b", {"a", "b"}},
+            {"ab|cd", extended, "cd", {}},
+        };
+        bool all_passed = true;
+        for (const Case& c : cases) {
+            GrepPattern pattern;
+            bool matched = false;
+            std::vector<std::string> literals = GrepPattern::required_literals(c.pattern, c.syntax);
+            if (pattern.compile(c.pattern, c.syntax, false)) {
+                pattern.search(c.text, [&matched](std::size_t, std::string_view) { return !(matched = true); });
+            }
+            bool passed = matched && literals == c.literals;
+            all_passed = all_passed && passed;
+            std::cout << (passed ? "ok   " : "FAIL ") << c.pattern << " on \"" << c.text << "\"" << std::endl;
+        }
+        return all_passed ? 0 : 1;
     } else {
         std::cout << "Unknown command: " << command << std::endl;
     }